@@ -33,6 +33,9 @@ unsigned get_chain_count(const Array<ClusterChain>& cluster_chains, unsigned fir
 
 void defragment(const UnicodeString& file_name) {
   UnicodeString real_path = add_trailing_slash(get_real_path(extract_file_path(file_name))) + extract_file_name(file_name);
+  // Clusters are only queried and moved through file system (FSCTL_GET_VOLUME_BITMAP, FSCTL_MOVE_FILE),
+  // raw volume data is never read, so this volume has no block cache (unlike ntfsfile NtfsVolume).
+  // USN close record written after clusters are moved makes ntfsfile panels drop cached blocks.
   NtfsVolume volume;
   volume.open(extract_path_root(real_path));
   // file fragments
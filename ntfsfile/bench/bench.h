@@ -0,0 +1,57 @@
+#pragma once
+
+// Common code of Linux test and benchmark programs.
+// Programs verify results with CHECK (failure is reported by run_bench) and print timings.
+
+inline double time_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+inline std::string narrow(const UnicodeString& str) {
+  std::string res;
+  for (unsigned i = 0; i < str.size(); i++) res += str[i] < 0x80 ? static_cast<char>(str[i]) : '?';
+  return res;
+}
+
+inline UnicodeString widen(const char* str) {
+  UnicodeString res;
+  for (; *str; str++) res += static_cast<wchar_t>(static_cast<u8>(*str));
+  return res;
+}
+
+// deterministic pseudo-random numbers (xorshift64*)
+class Random {
+private:
+  u64 state;
+public:
+  Random(u64 seed): state(seed | 1) {
+  }
+  u64 next() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+  }
+  unsigned next(unsigned range) {
+    return static_cast<unsigned>(next() % range);
+  }
+  void fill(u8* data, unsigned size) {
+    for (unsigned i = 0; i < size; i++) data[i] = static_cast<u8>(next() >> 56);
+  }
+};
+
+inline int run_bench(void (*proc)(int argc, char* argv[]), int argc, char* argv[]) {
+  try {
+    proc(argc, argv);
+    return 0;
+  }
+  catch (Error& e) {
+    fprintf(stderr, "%s:%u: %s\n", e.file, e.line, narrow(e.message()).c_str());
+  }
+  catch (std::exception& e) {
+    fprintf(stderr, "%s\n", e.what());
+  }
+  return 1;
+}
@@ -0,0 +1,243 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include <unistd.h>
+
+#include "utils.h"
+#include "crc.h"
+#include "lzo_chunks.h"
+#include "mft_index.h"
+#include "mft_cache.h"
+#include "bench.h"
+
+// Cache file store and load: version 3 (columns and lookup tables split into chunks compressed on
+// all processors) against version 0 (records serialized into single LZO block on calling thread,
+// lookup tables rebuilt on load). Loaded index must match stored one section by section.
+// Damaged chunk of column must mark exactly the records stored in it.
+
+const u64 c_root_rec = 5;
+const u64 c_usn_journal_id = 0x01D0123456789ABCULL;
+const USN c_next_usn = 0x123456780;
+
+// Random tree: every 16th file is directory, every 32nd file has second name (hard link),
+// parents are directories created before.
+static void generate_index(MftIndex& mft_index, unsigned rec_cnt, u64 seed) {
+  Random rnd(seed);
+  std::vector<u64> dirs(1, c_root_rec);
+  mft_index.clear();
+  mft_index.reserve(rec_cnt);
+  FileRecord rec;
+  for (u64 file_ref = c_root_rec; mft_index.size() < rec_cnt; file_ref++) {
+    bool root = file_ref == c_root_rec;
+    bool dir = root || (rnd.next(16) == 0);
+    unsigned name_cnt = !dir && (rnd.next(32) == 0) ? 2 : 1;
+    u64 data_size = dir ? 0 : (rnd.next(4) ? rnd.next(64 * 1024) : rnd.next(64 * 1024 * 1024));
+    bool resident = !dir && (data_size <= 256);
+    u64 time = 0x01D0000000000000ULL + (file_ref << 20) + rnd.next(1 << 20);
+    for (unsigned i = 0; i < name_cnt; i++) {
+      rec.file_ref_num = file_ref;
+      rec.parent_ref_num = root ? c_root_rec : dirs[rnd.next(static_cast<unsigned>(dirs.size()))];
+      if (root) rec.file_name = L".";
+      else rec.file_name = UnicodeString::format(dir ? L"Folder %x" : L"file_%x_%x.dat", static_cast<unsigned>(file_ref), rnd.next(0x10000));
+      rec.file_attr = dir ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_ARCHIVE;
+      rec.creation_time.dwLowDateTime = static_cast<DWORD>(time);
+      rec.creation_time.dwHighDateTime = static_cast<DWORD>(time >> 32);
+      rec.last_access_time = rec.creation_time;
+      rec.last_write_time = rec.creation_time;
+      rec.data_size = data_size;
+      rec.disk_size = resident ? 0 : (data_size + 4095) & ~4095ULL;
+      rec.valid_size = data_size;
+      rec.fragment_cnt = resident ? 0 : 1 + rnd.next(3);
+      rec.mft_rec_cnt = 1;
+      rec.stream_cnt = 1;
+      rec.hard_link_cnt = static_cast<u16>(name_cnt);
+      rec.set_flags(false, resident);
+      mft_index.add(rec);
+    }
+    if (dir && !root) dirs.push_back(file_ref);
+  }
+  mft_index.sort();
+}
+
+static void get_record(const MftIndex& mft_index, unsigned idx, FileRecord& rec) {
+  rec.file_ref_num = mft_index.file_ref_num(idx);
+  rec.parent_ref_num = mft_index.parent_ref_num(idx);
+  rec.file_name.copy(mft_index.file_name_data(idx), mft_index.file_name_size(idx));
+  rec.file_attr = mft_index.file_attr(idx);
+  rec.creation_time = mft_index.creation_time(idx);
+  rec.last_access_time = mft_index.last_access_time(idx);
+  rec.last_write_time = mft_index.last_write_time(idx);
+  rec.data_size = mft_index.data_size(idx);
+  rec.disk_size = mft_index.disk_size(idx);
+  rec.valid_size = mft_index.valid_size(idx);
+  rec.fragment_cnt = mft_index.fragment_cnt(idx);
+  rec.mft_rec_cnt = mft_index.mft_rec_cnt(idx);
+  rec.stream_cnt = mft_index.stream_cnt(idx);
+  rec.hard_link_cnt = mft_index.hard_link_cnt(idx);
+  rec.flags = mft_index.flags(idx);
+}
+
+static void write_file(const char* file_path, const void* data, size_t size) {
+  FILE* file = fopen(file_path, "wb");
+  CHECK(file != NULL);
+  bool ok = fwrite(data, 1, size, file) == size;
+  CHECK((fclose(file) == 0) && ok);
+}
+
+static u64 file_size(const char* file_path) {
+  FILE* file = fopen(file_path, "rb");
+  CHECK(file != NULL);
+  fseek(file, 0, SEEK_END);
+  u64 size = ftell(file);
+  fclose(file);
+  return size;
+}
+
+// Version 0 cache (see load_mft_index_v0() of mft_cache.cpp): header checksum, version, sizes and
+// checksum of compressed block, then block of USN journal position and encoded records.
+static void write_cache_v0(const char* file_path, const MftIndex& mft_index, DWORDLONG usn_journal_id, USN next_usn) {
+  Array<u8> buffer;
+  buffer.add(reinterpret_cast<const u8*>(&usn_journal_id), sizeof(usn_journal_id));
+  buffer.add(reinterpret_cast<const u8*>(&next_usn), sizeof(next_usn));
+  u32 count = mft_index.size();
+  buffer.add(reinterpret_cast<const u8*>(&count), sizeof(count));
+  FileRecord rec;
+  for (unsigned i = 0; i < mft_index.size(); i++) {
+    get_record(mft_index, i, rec);
+    encode_file_record(buffer, rec);
+  }
+
+  const unsigned c_header_size = 4 + 1 + 4 + 4 + 4;
+  Array<u8> file_data;
+  u8* data = file_data.buf(c_header_size + lzo_chunk_buffer_size(buffer.size()));
+  Array<u8> work_buf;
+  lzo_uint comp_size;
+  CHECK(lzo1x_1_compress(buffer.data(), buffer.size(), data + c_header_size, &comp_size, work_buf.buf(LZO1X_1_MEM_COMPRESS)) == LZO_E_OK);
+  u8 version = 0;
+  u32 buffer_size = buffer.size();
+  u32 comp_buffer_size = static_cast<u32>(comp_size);
+  memcpy(data + 4, &version, 1);
+  memcpy(data + 5, &buffer_size, 4);
+  memcpy(data + 9, &comp_buffer_size, 4);
+  u32 header_checksum = crc32_update(0, data + 4, 9);
+  u32 comp_checksum = crc32_update(0, data + c_header_size, comp_buffer_size);
+  memcpy(data, &header_checksum, 4);
+  memcpy(data + 13, &comp_checksum, 4);
+  write_file(file_path, data, c_header_size + comp_buffer_size);
+}
+
+static void compare_sections(const MftIndex& index, const MftIndex& expected) {
+  Array<MftIndexSection> sections, expected_sections;
+  index.get_sections(sections);
+  expected.get_sections(expected_sections);
+  CHECK(sections.size() == expected_sections.size());
+  for (unsigned i = 0; i < sections.size(); i++) {
+    if ((sections[i].size != expected_sections[i].size) || memcmp(sections[i].data, expected_sections[i].data, static_cast<size_t>(sections[i].size))) {
+      printf("section %u differs\n", i);
+      CHECK(false);
+    }
+  }
+}
+
+static void load_cache(const char* file_path, MftIndex& mft_index, MftCacheInfo& info, const char* name, u64 rec_cnt) {
+  double t_start = time_now();
+  load_mft_cache(widen(file_path), mft_index, info, NULL);
+  double time = time_now() - t_start;
+  printf("%-10s load  %7.0f ms, %6.1f M records/s (lookup tables %s)\n", name, time * 1000, rec_cnt / time / 1e6, info.lookup_loaded ? "loaded" : "rebuilt");
+  CHECK(info.usn_journal_id == c_usn_journal_id);
+  CHECK(info.next_usn == c_next_usn);
+}
+
+// Damages chunk in the middle of data_sizes column (section 8, see MftIndex::get_sections()).
+// Returns range of records stored in it.
+static void damage_chunk(const char* file_path, unsigned& first_rec, unsigned& end_rec) {
+  const unsigned c_section_idx = 8;
+  FILE* file = fopen(file_path, "r+b");
+  CHECK(file != NULL);
+  MftCacheHeader header;
+  CHECK(fread(&header, sizeof(header), 1, file) == 1);
+  Array<MftCacheSection> section_table;
+  CHECK(fread(section_table.buf(header.section_cnt), sizeof(MftCacheSection), header.section_cnt, file) == header.section_cnt);
+  section_table.set_size(header.section_cnt);
+  Array<MftCacheChunk> chunk_table;
+  CHECK(fread(chunk_table.buf(header.chunk_cnt), sizeof(MftCacheChunk), header.chunk_cnt, file) == header.chunk_cnt);
+  chunk_table.set_size(header.chunk_cnt);
+  const MftCacheSection& section = section_table[c_section_idx];
+  unsigned chunk_idx = section.first_chunk + section.chunk_cnt / 2;
+  u64 pos = 0;
+  for (unsigned i = section.first_chunk; i < chunk_idx; i++) pos += chunk_table[i].data_size;
+  first_rec = static_cast<unsigned>(pos / sizeof(u64));
+  end_rec = static_cast<unsigned>((pos + chunk_table[chunk_idx].data_size) / sizeof(u64));
+  const MftCacheChunk& chunk = chunk_table[chunk_idx];
+  CHECK(fseek(file, static_cast<long>(chunk.offset + chunk.size / 2), SEEK_SET) == 0);
+  int c = fgetc(file);
+  CHECK(c != EOF);
+  CHECK(fseek(file, -1, SEEK_CUR) == 0);
+  fputc(c ^ 0x5A, file);
+  CHECK(fclose(file) == 0);
+}
+
+static void cache_store(int argc, char* argv[]) {
+  unsigned rec_cnt = argc > 1 ? atoi(argv[1]) : 1000000;
+  char file_path[] = "/tmp/cache_store_XXXXXX";
+  int fd = mkstemp(file_path);
+  CHECK(fd != -1);
+  close(fd);
+  std::string v0_path = std::string(file_path) + ".v0";
+  try {
+    MftIndex mft_index;
+    generate_index(mft_index, rec_cnt, 1);
+    printf("%u records, %.1f MB index\n", mft_index.size(), mft_index.mem_size() / 1e6);
+
+    double t_start = time_now();
+    write_mft_cache(widen(file_path), mft_index, c_usn_journal_id, c_next_usn, NULL);
+    double time = time_now() - t_start;
+    printf("%-10s store %7.0f ms, %6.1f MB file\n", "version 3", time * 1000, file_size(file_path) / 1e6);
+    t_start = time_now();
+    write_cache_v0(v0_path.c_str(), mft_index, c_usn_journal_id, c_next_usn);
+    time = time_now() - t_start;
+    printf("%-10s store %7.0f ms, %6.1f MB file\n", "version 0", time * 1000, file_size(v0_path.c_str()) / 1e6);
+
+    MftCacheInfo info;
+    {
+      MftIndex loaded_index;
+      load_cache(file_path, loaded_index, info, "version 3", mft_index.size());
+      CHECK(info.version == c_cache_version);
+      CHECK(info.lookup_loaded);
+      CHECK(info.damaged_file_refs.size() == 0);
+      compare_sections(loaded_index, mft_index);
+    }
+    {
+      MftIndex loaded_index;
+      load_cache(v0_path.c_str(), loaded_index, info, "version 0", mft_index.size());
+      CHECK(info.version == 0);
+      CHECK(!info.lookup_loaded);
+      compare_sections(loaded_index, mft_index);
+    }
+
+    // damaged records are loaded with zeroed fields, lookup tables are rebuilt
+    unsigned first_rec, end_rec;
+    damage_chunk(file_path, first_rec, end_rec);
+    MftIndex loaded_index;
+    load_cache(file_path, loaded_index, info, "damaged", mft_index.size());
+    CHECK(!info.lookup_loaded);
+    std::set<u64> damaged_file_refs;
+    for (unsigned i = first_rec; i < end_rec; i++) damaged_file_refs.insert(mft_index.file_ref_num(i));
+    CHECK(info.damaged_file_refs == damaged_file_refs);
+    for (unsigned i = 0; i < mft_index.size(); i++) {
+      CHECK(loaded_index.data_size(i) == ((i >= first_rec) && (i < end_rec) ? 0 : mft_index.data_size(i)));
+    }
+    printf("%u of %u records damaged\n", end_rec - first_rec, mft_index.size());
+  }
+  catch (...) {
+    unlink(file_path);
+    unlink(v0_path.c_str());
+    throw;
+  }
+  unlink(file_path);
+  unlink(v0_path.c_str());
+}
+
+int main(int argc, char* argv[]) {
+  return run_bench(cache_store, argc, argv);
+}
@@ -0,0 +1,112 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include <zlib.h>
+
+#include "utils.h"
+#include "crc.h"
+#include "bench.h"
+
+// CRC kernels: crc32_update() must match zlib crc32(), crc16_update() must match the byte-at-a-time
+// table loop it replaced (removed crc16.cpp). Random sizes, buffer offsets and split points cover
+// both kernels: blocks shorter than 128 bytes go through tables.
+// Throughput is printed for memory-bound (64 MB) and cache-resident (256 KB) buffers.
+
+// CRC16::update() of removed crc16.cpp
+class Crc16Table {
+private:
+  u16 table[256];
+public:
+  Crc16Table() {
+    for (unsigned i = 0; i < 256; i++) {
+      u16 crc = static_cast<u16>(i);
+      for (unsigned j = 0; j < 8; j++) crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+      table[i] = crc;
+    }
+  }
+  // first and last entries of crc16.cpp table
+  bool valid() const {
+    return (table[1] == 0xC0C1) && (table[255] == 0x4040);
+  }
+  u16 update(u16 crc, const u8* data, size_t size) const {
+    for (size_t i = 0; i < size; i++) crc = (crc >> 8) ^ table[(crc & 0xFF) ^ data[i]];
+    return crc;
+  }
+};
+
+static const Crc16Table g_crc16_table;
+
+static u32 zlib_crc32(u32 crc, const u8* data, size_t size) {
+  return static_cast<u32>(crc32(crc, data, static_cast<uInt>(size)));
+}
+
+static void check_crc(const u8* data, unsigned max_size, unsigned check_cnt, Random& rnd) {
+  for (unsigned i = 0; i < check_cnt; i++) {
+    // mostly short blocks around kernel thresholds, sometimes long ones
+    unsigned size = rnd.next(4) ? rnd.next(600) : rnd.next(max_size);
+    unsigned offset = rnd.next(64);
+    const u8* p = data + offset;
+    CHECK(crc32_update(0, p, size) == zlib_crc32(0, p, size));
+    CHECK(crc16_update(c_crc16_init, p, size) == g_crc16_table.update(c_crc16_init, p, size));
+    // result of first block is passed to next one
+    unsigned split = size ? rnd.next(size) : 0;
+    CHECK(crc32_update(crc32_update(0, p, split), p + split, size - split) == zlib_crc32(0, p, size));
+    CHECK(crc16_update(crc16_update(c_crc16_init, p, split), p + split, size - split) == g_crc16_table.update(c_crc16_init, p, size));
+  }
+  // known value ("123456789")
+  const u8 c_check[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+  CHECK(crc32_update(0, c_check, sizeof(c_check)) == 0xCBF43926);
+}
+
+// best of several passes over the same buffer
+static void time_crc(const char* name, u32 (*proc)(const u8* data, size_t size), const u8* data, size_t size, unsigned pass_cnt) {
+  double best_time = 0;
+  u32 result = 0;
+  for (unsigned pass = 0; pass < pass_cnt; pass++) {
+    double t_start = time_now();
+    result = proc(data, size);
+    double time = time_now() - t_start;
+    if ((pass == 0) || (time < best_time)) best_time = time;
+  }
+  printf("%-12s %6u KB: %6.2f GB/s (%08x)\n", name, static_cast<unsigned>(size / 1024), size / best_time / 1e9, result);
+}
+
+static u32 crc32_new(const u8* data, size_t size) {
+  return crc32_update(0, data, size);
+}
+
+static u32 crc32_zlib(const u8* data, size_t size) {
+  return zlib_crc32(0, data, size);
+}
+
+static u32 crc16_new(const u8* data, size_t size) {
+  return crc16_update(c_crc16_init, data, size);
+}
+
+static u32 crc16_old(const u8* data, size_t size) {
+  return g_crc16_table.update(c_crc16_init, data, size);
+}
+
+static void crc(int argc, char* argv[]) {
+  const unsigned c_data_size = 64 * 1024 * 1024;
+  Array<u8> buffer;
+  u8* data = buffer.buf(c_data_size);
+  Random rnd(1);
+  rnd.fill(data, c_data_size);
+  CHECK(g_crc16_table.valid());
+  check_crc(data, 64 * 1024, 20000, rnd);
+  check_crc(data, c_data_size - 64, 40, rnd);
+
+  const size_t c_sizes[] = { c_data_size, 256 * 1024 };
+  for (unsigned i = 0; i < ARRAYSIZE(c_sizes); i++) {
+    unsigned pass_cnt = c_sizes[i] == c_data_size ? 3 : 100;
+    time_crc("crc32", crc32_new, data, c_sizes[i], pass_cnt);
+    time_crc("zlib crc32", crc32_zlib, data, c_sizes[i], pass_cnt);
+    time_crc("crc16", crc16_new, data, c_sizes[i], pass_cnt);
+    time_crc("old crc16", crc16_old, data, c_sizes[i], pass_cnt);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  return run_bench(crc, argc, argv);
+}
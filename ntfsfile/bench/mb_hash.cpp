@@ -0,0 +1,166 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include "utils.h"
+#include "mb_hash.h"
+#include "bench.h"
+
+// MultiBufferHash: digests of every message must be equal to OpenSSL digests (message sizes around
+// block and padding boundaries, lanes finishing at different times, empty messages).
+// Throughput of many small messages is compared with per-message OpenSSL calls (content analysis
+// before multi-buffer engine). OpenSSL may use SHA extensions; OPENSSL_ia32cap environment
+// variable masks them to match bundled OpenSSL.
+
+static const char* const c_type_names[] = { "MD5", "SHA-1", "SHA-256" };
+
+static void hash_openssl(MbHashType type, const u8* data, size_t size, u8* digest) {
+  if (type == mbh_md5) {
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, data, size);
+    MD5_Final(digest, &ctx);
+  }
+  else if (type == mbh_sha1) {
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+    SHA1_Update(&ctx, data, size);
+    SHA1_Final(digest, &ctx);
+  }
+  else {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, data, size);
+    SHA256_Final(digest, &ctx);
+  }
+}
+
+// messages are random slices of common data buffer
+struct Message {
+  size_t offset;
+  size_t size;
+};
+
+static void make_messages(Array<Message>& messages, size_t data_size, unsigned min_size, unsigned max_size, size_t total_size, Random& rnd) {
+  messages.clear();
+  size_t size_sum = 0;
+  while (size_sum < total_size) {
+    Message msg;
+    msg.size = min_size + rnd.next(max_size - min_size + 1);
+    msg.offset = rnd.next(static_cast<unsigned>(data_size - msg.size + 1));
+    messages += msg;
+    size_sum += msg.size;
+  }
+}
+
+static void hash_messages(MbHashType type, const u8* data, const Array<Message>& messages, Array<u8>& digests) {
+  unsigned digest_size = MultiBufferHash::digest_size(type);
+  u8* digest = digests.buf(messages.size() * digest_size);
+  MultiBufferHash mb_hash(type);
+  for (unsigned i = 0; i < messages.size(); i++) {
+    mb_hash.submit(data + messages[i].offset, messages[i].size, digest + i * digest_size);
+  }
+  mb_hash.flush();
+  digests.set_size(messages.size() * digest_size);
+}
+
+static void check_digests(MbHashType type, const u8* data, const Array<Message>& messages, const Array<u8>& digests) {
+  unsigned digest_size = MultiBufferHash::digest_size(type);
+  CHECK(digests.size() == messages.size() * digest_size);
+  u8 digest[SHA256_DIGEST_LENGTH];
+  for (unsigned i = 0; i < messages.size(); i++) {
+    hash_openssl(type, data + messages[i].offset, messages[i].size, digest);
+    CHECK(memcmp(digests.data() + i * digest_size, digest, digest_size) == 0);
+  }
+}
+
+static void check_hash(MbHashType type, const u8* data, size_t data_size, Random& rnd) {
+  Array<Message> messages;
+  Array<u8> digests;
+  // every size up to 3 blocks, in order and shuffled (lanes start and finish at different blocks)
+  for (unsigned size = 0; size <= 192; size++) {
+    Message msg;
+    msg.offset = rnd.next(64);
+    msg.size = size;
+    messages += msg;
+  }
+  hash_messages(type, data, messages, digests);
+  check_digests(type, data, messages, digests);
+  for (unsigned i = messages.size() - 1; i > 0; i--) {
+    unsigned j = rnd.next(i + 1);
+    Message msg = messages[i];
+    messages.item(i) = messages[j];
+    messages.item(j) = msg;
+  }
+  hash_messages(type, data, messages, digests);
+  check_digests(type, data, messages, digests);
+
+  // fewer messages than lanes
+  for (unsigned cnt = 0; cnt <= 9; cnt++) {
+    messages.clear();
+    for (unsigned i = 0; i < cnt; i++) {
+      Message msg;
+      msg.size = rnd.next(300);
+      msg.offset = rnd.next(static_cast<unsigned>(data_size - msg.size));
+      messages += msg;
+    }
+    hash_messages(type, data, messages, digests);
+    check_digests(type, data, messages, digests);
+  }
+
+  // mixed small and large messages
+  make_messages(messages, data_size, 0, 64 * 1024, 4 * 1024 * 1024, rnd);
+  hash_messages(type, data, messages, digests);
+  check_digests(type, data, messages, digests);
+}
+
+static void time_hash(MbHashType type, const u8* data, const Array<Message>& messages, size_t total_size) {
+  unsigned digest_size = MultiBufferHash::digest_size(type);
+  Array<u8> digests;
+  u8* digest = digests.buf(messages.size() * digest_size);
+  double t_start = time_now();
+  for (unsigned i = 0; i < messages.size(); i++) {
+    hash_openssl(type, data + messages[i].offset, messages[i].size, digest + i * digest_size);
+  }
+  double t_openssl = time_now() - t_start;
+  t_start = time_now();
+  hash_messages(type, data, messages, digests);
+  double t_mb = time_now() - t_start;
+  check_digests(type, data, messages, digests);
+  printf("%-8s OpenSSL %6.2f GB/s, multi-buffer %6.2f GB/s\n", c_type_names[type], total_size / t_openssl / 1e9, total_size / t_mb / 1e9);
+}
+
+static void mb_hash(int argc, char* argv[]) {
+  const unsigned c_data_size = 64 * 1024 * 1024;
+  Array<u8> buffer;
+  u8* data = buffer.buf(c_data_size);
+  Random rnd(1);
+  rnd.fill(data, c_data_size);
+  for (unsigned type = mbh_md5; type <= mbh_sha256; type++) {
+    check_hash(static_cast<MbHashType>(type), data, c_data_size, rnd);
+  }
+  // known value (MD5 of "abc")
+  const u8 c_abc[] = { 'a', 'b', 'c' };
+  const u8 c_abc_md5[] = { 0x90, 0x01, 0x50, 0x98, 0x3c, 0xd2, 0x4f, 0xb0, 0xd6, 0x96, 0x3f, 0x7d, 0x28, 0xe1, 0x7f, 0x72 };
+  u8 digest[MD5_DIGEST_LENGTH];
+  MultiBufferHash abc_hash(mbh_md5);
+  abc_hash.submit(c_abc, sizeof(c_abc), digest);
+  abc_hash.flush();
+  CHECK(memcmp(digest, c_abc_md5, sizeof(digest)) == 0);
+
+  // message size ranges: small files, medium files
+  const unsigned c_ranges[][2] = { { 512, 4 * 1024 }, { 4 * 1024, 64 * 1024 } };
+  for (unsigned r = 0; r < ARRAYSIZE(c_ranges); r++) {
+    Array<Message> messages;
+    make_messages(messages, c_data_size, c_ranges[r][0], c_ranges[r][1], c_data_size, rnd);
+    size_t total_size = 0;
+    for (unsigned i = 0; i < messages.size(); i++) total_size += messages[i].size;
+    printf("%u messages of %.1f-%.1f KB\n", messages.size(), c_ranges[r][0] / 1024.0, c_ranges[r][1] / 1024.0);
+    for (unsigned type = mbh_md5; type <= mbh_sha256; type++) {
+      time_hash(static_cast<MbHashType>(type), data, messages, total_size);
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  return run_bench(mb_hash, argc, argv);
+}
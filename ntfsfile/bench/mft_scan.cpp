@@ -0,0 +1,175 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include <unistd.h>
+
+#include "utils.h"
+#include "ntfs.h"
+#include "volume.h"
+#include "ntfs_file.h"
+#include "mft_reader.h"
+#include "mft_index.h"
+#include "mft_scan.h"
+#include "bench.h"
+#include "ntfs_image.h"
+
+// MFT scan throughput on synthetic image opened through image file path (NtfsVolume::open_image()):
+// - per record: load_base_file_rec() for every allocated record (one positional read per record,
+//   same as ioctl path does on live volume);
+// - chunked: MftReader chunks decoded on calling thread;
+// - pool: MftReader chunks decoded by MftScanPool (as create_mft_index() does) with 1..N threads;
+// - record decoding from memory through views into chunk buffer and through per-record copies
+//   (FSCTL_GET_NTFS_FILE_RECORD output buffer with header removed).
+// All scans must produce the same records. Image file is in page cache, so I/O cost is mostly
+// system call overhead, not device speed.
+
+#define NTFS_FILE_REC_HEADER_SIZE offsetof(NTFS_FILE_RECORD_OUTPUT_BUFFER, FileRecordBuffer)
+
+static void compare_lists(const std::list<FileRecord>& list1, const std::list<FileRecord>& list2) {
+  CHECK(list1.size() == list2.size());
+  std::list<FileRecord>::const_iterator rec1 = list1.begin();
+  std::list<FileRecord>::const_iterator rec2 = list2.begin();
+  for (; rec1 != list1.end(); rec1++, rec2++) {
+    CHECK(rec1->file_ref_num == rec2->file_ref_num);
+    CHECK(rec1->parent_ref_num == rec2->parent_ref_num);
+    CHECK(rec1->file_name == rec2->file_name);
+    CHECK(rec1->file_attr == rec2->file_attr);
+    CHECK(rec1->data_size == rec2->data_size);
+    CHECK(rec1->disk_size == rec2->disk_size);
+    CHECK(rec1->fragment_cnt == rec2->fragment_cnt);
+    CHECK(rec1->stream_cnt == rec2->stream_cnt);
+    CHECK(rec1->hard_link_cnt == rec2->hard_link_cnt);
+    CHECK(rec1->flags == rec2->flags);
+  }
+}
+
+static void print_rate(const char* name, u64 rec_cnt, double time) {
+  printf("%-24s %8.1f ms %10.0f records/s\n", name, time * 1000, rec_cnt / time);
+}
+
+static void scan_per_record(NtfsVolume& volume, std::list<FileRecord>& file_list) {
+  MftReader mft_reader(volume, 0);
+  FileInfo file_info;
+  file_info.volume = &volume;
+  file_info.mft_reader = &mft_reader;
+  const MftBitmap& mft_bitmap = mft_reader.bitmap();
+  for (u64 file_index = mft_bitmap.next_set(0); file_index < mft_reader.record_count(); file_index = mft_bitmap.next_set(file_index + 1)) {
+    file_info.load_base_file_rec(file_index);
+    const MFT_RECORD* mft_rec = file_info.base_mft_rec();
+    if ((mft_rec->flags & MFT_RECORD_IN_USE) && (mft_rec->base_mft_record == 0)) {
+      file_info.process_base_file_rec();
+      add_file_records(file_list, file_info, false, false);
+    }
+  }
+}
+
+static void scan_pool(NtfsVolume& volume, unsigned num_th, std::list<FileRecord>& file_list) {
+  MftReader mft_reader(volume, 4 * 1024 * 1024, 2);
+  MftScanPool pool(volume, num_th, &mft_reader, false, false);
+  bool more = mft_reader.read_chunk();
+  while (more) {
+    pool.start(mft_reader.chunk());
+    more = mft_reader.read_chunk();
+    pool.wait(INFINITE);
+    pool.collect(file_list);
+  }
+}
+
+// Records already read into memory are decoded with or without copying every record first,
+// only decoding is timed (best of several passes).
+static void decode_records(NtfsVolume& volume, bool copy, std::list<FileRecord>& file_list) {
+  MftReader mft_reader(volume);
+  FileInfo file_info;
+  file_info.volume = &volume;
+  file_info.mft_reader = &mft_reader;
+  Array<u8> rec_buf;
+  std::list<FileRecord> chunk_list;
+  double time = 0;
+  while (mft_reader.read_chunk()) {
+    double best_time = 0;
+    for (unsigned pass = 0; pass < 3; pass++) {
+      chunk_list.clear();
+      double pass_time = 0;
+      for (unsigned i = 0; i < mft_reader.record_cnt(); i++) {
+        const u8* file_rec = mft_reader.record(i);
+        if (!file_rec || (reinterpret_cast<const MFT_RECORD*>(file_rec)->base_mft_record != 0)) continue;
+        double t_start = time_now();
+        if (copy) {
+          rec_buf.clear();
+          rec_buf.add(file_rec, NTFS_FILE_REC_HEADER_SIZE);
+          rec_buf.add(file_rec, volume.file_rec_size);
+          rec_buf.remove(0, NTFS_FILE_REC_HEADER_SIZE);
+          file_info.set_base_file_rec(mft_reader.first_record() + i, rec_buf.data(), rec_buf.size());
+        }
+        else file_info.set_base_file_rec(mft_reader.first_record() + i, file_rec, volume.file_rec_size);
+        file_info.process_base_file_rec();
+        pass_time += time_now() - t_start;
+        add_file_records(chunk_list, file_info, false, false);
+      }
+      if ((pass == 0) || (pass_time < best_time)) best_time = pass_time;
+    }
+    time += best_time;
+    file_list.splice(file_list.end(), chunk_list);
+  }
+  print_rate(copy ? "decode (record copies)" : "decode (record views)", mft_reader.record_count(), time);
+}
+
+static void mft_scan(int argc, char* argv[]) {
+  // arguments: number of files, maximum number of threads
+  unsigned file_cnt = argc > 1 ? atoi(argv[1]) : 20000;
+  char file_path[] = "/tmp/mft_scan_XXXXXX";
+  int fd = mkstemp(file_path);
+  CHECK(fd != -1);
+  close(fd);
+  try {
+    NtfsImage image(file_cnt + file_cnt / 8);
+    generate_tree(image, file_cnt, 1);
+    image.write(file_path);
+
+    NtfsVolume volume;
+    volume.open_image(widen(file_path));
+    u64 rec_cnt = MftReader(volume, 0).record_count();
+    printf("%Lu MFT records, %u files\n", rec_cnt, file_cnt);
+
+    std::list<FileRecord> expected;
+    double t_start = time_now();
+    scan_per_record(volume, expected);
+    print_rate("per record", rec_cnt, time_now() - t_start);
+
+    std::list<FileRecord> file_list;
+    t_start = time_now();
+    scan_volume(volume, file_list, false);
+    print_rate("chunked", rec_cnt, time_now() - t_start);
+    compare_lists(file_list, expected);
+
+    // several threads are used even on single processor to check merge of worker results
+    SYSTEM_INFO sys_info;
+    GetSystemInfo(&sys_info);
+    unsigned max_th = argc > 2 ? atoi(argv[2]) : max(sys_info.dwNumberOfProcessors, 4u);
+    for (unsigned num_th = 1; ; num_th = min(num_th * 2, max_th)) {
+      file_list.clear();
+      t_start = time_now();
+      scan_pool(volume, num_th, file_list);
+      char name[32];
+      sprintf(name, "pool, %u threads", num_th);
+      print_rate(name, rec_cnt, time_now() - t_start);
+      compare_lists(file_list, expected);
+      if (num_th >= max_th) break;
+    }
+
+    for (unsigned copy = 0; copy < 2; copy++) {
+      file_list.clear();
+      decode_records(volume, copy != 0, file_list);
+      compare_lists(file_list, expected);
+    }
+  }
+  catch (...) {
+    unlink(file_path);
+    throw;
+  }
+  unlink(file_path);
+}
+
+int main(int argc, char* argv[]) {
+  return run_bench(mft_scan, argc, argv);
+}
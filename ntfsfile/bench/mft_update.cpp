@@ -0,0 +1,368 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include "utils.h"
+#include "mft_index.h"
+#include "bench.h"
+
+// MftIndex::update(): batches of 1k, 100k and 1M changed files are merged into 10M record index and
+// result is compared with index rebuilt from scratch (add() and sort()) for changed file set.
+// Small batches patch lookup tables (patch_lookup()), large ones rebuild them (update_lookup()),
+// remaining records are moved as runs in both cases.
+// Files are kept in compact table (volume image of this size does not fit in memory). Indexes are
+// compared through digests of columns, lookup results and totals, so only one index exists at a time.
+
+const u32 c_root_rec = 5;
+const u32 c_first_user_rec = 16;
+const u32 c_no_name = 0xFFFFFFFF;
+const u64 c_max_resident_size = 256;
+// c_patch_ratio of mft_index.cpp (only used to report which path was taken)
+const unsigned c_patch_ratio = 16;
+
+struct FileState {
+  u32 parents[2]; // record numbers of parent directories
+  u32 names[2]; // unique name numbers, c_no_name if unused
+  u64 data_size;
+  bool in_use;
+  bool dir;
+  unsigned name_cnt() const {
+    return names[1] == c_no_name ? 1 : 2;
+  }
+};
+
+class FileSet {
+public:
+  std::vector<FileState> files; // by record number
+  std::vector<u32> child_cnts; // names inside directory
+  std::vector<u32> dirs;
+  std::vector<u32> dir_pos; // position of directory in dirs
+  std::vector<u32> free_recs;
+  u32 next_name;
+  unsigned rec_cnt; // index records (names of all files)
+private:
+  void link(u32 rec, unsigned name_idx, u32 parent) {
+    files[rec].parents[name_idx] = parent;
+    files[rec].names[name_idx] = next_name++;
+    child_cnts[parent]++;
+    rec_cnt++;
+  }
+  void unlink(u32 rec, unsigned name_idx) {
+    child_cnts[files[rec].parents[name_idx]]--;
+    rec_cnt--;
+  }
+public:
+  FileSet(): next_name(0), rec_cnt(0) {
+    files.resize(c_first_user_rec);
+    child_cnts.resize(c_first_user_rec);
+    dir_pos.resize(c_first_user_rec);
+    for (unsigned i = 0; i < files.size(); i++) files[i].in_use = false;
+    FileState& root = files[c_root_rec];
+    root.in_use = true;
+    root.dir = true;
+    root.data_size = 0;
+    root.names[1] = c_no_name;
+    link(c_root_rec, 0, c_root_rec);
+    dir_pos[c_root_rec] = 0;
+    dirs.push_back(c_root_rec);
+  }
+  u32 add_file(u32 parent, bool dir, u64 data_size) {
+    u32 rec;
+    if (free_recs.size()) {
+      rec = free_recs.back();
+      free_recs.pop_back();
+    }
+    else {
+      rec = static_cast<u32>(files.size());
+      files.push_back(FileState());
+      child_cnts.push_back(0);
+      dir_pos.push_back(0);
+    }
+    FileState& file = files[rec];
+    file.in_use = true;
+    file.dir = dir;
+    file.data_size = data_size;
+    file.names[1] = c_no_name;
+    child_cnts[rec] = 0;
+    link(rec, 0, parent);
+    if (dir) {
+      dir_pos[rec] = static_cast<u32>(dirs.size());
+      dirs.push_back(rec);
+    }
+    return rec;
+  }
+  void add_name(u32 rec, u32 parent) {
+    link(rec, 1, parent);
+  }
+  void remove_name(u32 rec, unsigned name_idx) {
+    FileState& file = files[rec];
+    unlink(rec, name_idx);
+    if (name_idx == 0) {
+      file.parents[0] = file.parents[1];
+      file.names[0] = file.names[1];
+    }
+    file.names[1] = c_no_name;
+  }
+  // new name and parent
+  void rename(u32 rec, unsigned name_idx, u32 parent) {
+    unlink(rec, name_idx);
+    link(rec, name_idx, parent);
+  }
+  void remove(u32 rec) {
+    FileState& file = files[rec];
+    for (unsigned i = 0; i < file.name_cnt(); i++) unlink(rec, i);
+    if (file.dir) {
+      u32 last = dirs.back();
+      dirs[dir_pos[rec]] = last;
+      dir_pos[last] = dir_pos[rec];
+      dirs.pop_back();
+    }
+    file.in_use = false;
+    free_recs.push_back(rec);
+  }
+  // rec is directory dir or is inside it
+  bool inside(u32 rec, u32 dir) const {
+    while (true) {
+      if (rec == dir) return true;
+      if (rec == c_root_rec) return false;
+      rec = files[rec].parents[0];
+    }
+  }
+  u32 random_dir(Random& rnd) const {
+    return dirs[rnd.next(static_cast<unsigned>(dirs.size()))];
+  }
+  u32 random_rec(Random& rnd) const {
+    u32 rec;
+    do {
+      rec = c_first_user_rec + rnd.next(static_cast<unsigned>(files.size()) - c_first_user_rec);
+    }
+    while (!files[rec].in_use);
+    return rec;
+  }
+  void get_record(u32 rec, unsigned name_idx, FileRecord& file_rec) const {
+    const FileState& file = files[rec];
+    file_rec.file_ref_num = rec;
+    file_rec.parent_ref_num = file.parents[name_idx];
+    if (rec == c_root_rec) file_rec.file_name = L".";
+    else file_rec.file_name = UnicodeString::format(file.dir ? L"d%x" : L"f%x", file.names[name_idx]);
+    file_rec.file_attr = file.dir ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_ARCHIVE;
+    u64 time = (static_cast<u64>(rec) << 24) + file.names[0];
+    file_rec.creation_time.dwLowDateTime = static_cast<DWORD>(time);
+    file_rec.creation_time.dwHighDateTime = static_cast<DWORD>(time >> 32);
+    file_rec.last_access_time = file_rec.creation_time;
+    file_rec.last_write_time.dwLowDateTime = static_cast<DWORD>(file.data_size);
+    file_rec.last_write_time.dwHighDateTime = static_cast<DWORD>(time >> 32);
+    bool resident = file.data_size <= c_max_resident_size;
+    file_rec.data_size = file.data_size;
+    file_rec.disk_size = resident ? 0 : (file.data_size + 4095) & ~4095ULL;
+    file_rec.valid_size = file.data_size;
+    file_rec.fragment_cnt = resident ? 0 : 1 + rec % 3;
+    file_rec.mft_rec_cnt = 1;
+    file_rec.stream_cnt = 1;
+    file_rec.hard_link_cnt = static_cast<u16>(file.name_cnt());
+    file_rec.set_flags(false, resident);
+  }
+  void get_records(u32 rec, std::list<FileRecord>& file_list) const {
+    if (!files[rec].in_use) return;
+    for (unsigned i = 0; i < files[rec].name_cnt(); i++) {
+      file_list.push_back(FileRecord());
+      get_record(rec, i, file_list.back());
+    }
+  }
+};
+
+static u64 random_size(Random& rnd) {
+  return rnd.next(4) ? rnd.next(64 * 1024) : rnd.next(64 * 1024 * 1024);
+}
+
+// directory tree with hard links
+static void generate_files(FileSet& file_set, unsigned rec_cnt, u64 seed) {
+  Random rnd(seed);
+  while (file_set.rec_cnt < rec_cnt) {
+    u32 dir = file_set.random_dir(rnd);
+    unsigned op = rnd.next(100);
+    if (op < 5) file_set.add_file(dir, true, 0);
+    else if ((op < 8) && (file_set.files.size() > c_first_user_rec)) {
+      u32 rec = file_set.random_rec(rnd);
+      if (!file_set.files[rec].dir && (file_set.files[rec].name_cnt() == 1)) file_set.add_name(rec, dir);
+    }
+    else file_set.add_file(dir, false, random_size(rnd));
+  }
+}
+
+// random changes (same operations as change_tree() of ntfs_image.cpp), changed records are
+// collected the way read_usn_changes() does
+static void change_files(FileSet& file_set, unsigned change_cnt, u64 seed, std::set<u64>& file_refs) {
+  Random rnd(seed);
+  for (unsigned i = 0; i < change_cnt; i++) {
+    unsigned op = rnd.next(100);
+    u32 dir = file_set.random_dir(rnd);
+    if (op < 20) {
+      file_refs.insert(file_set.add_file(dir, false, random_size(rnd)));
+      continue;
+    }
+    if (op < 25) {
+      file_refs.insert(file_set.add_file(dir, true, 0));
+      continue;
+    }
+    u32 rec = file_set.random_rec(rnd);
+    file_refs.insert(rec);
+    const FileState& file = file_set.files[rec];
+    if (file.dir) {
+      // rename or move (not into own subtree); empty directory is removed
+      if ((file_set.child_cnts[rec] == 0) && (op < 50)) file_set.remove(rec);
+      else if (!file_set.inside(dir, rec)) file_set.rename(rec, 0, dir);
+      else file_set.rename(rec, 0, file.parents[0]);
+    }
+    else if (op < 40) file_set.remove(rec);
+    else if (op < 50) file_set.rename(rec, rnd.next(file.name_cnt()), file.parents[0]);
+    else if (op < 60) file_set.rename(rec, rnd.next(file.name_cnt()), dir);
+    else if ((op < 68) && (file.name_cnt() == 1)) file_set.add_name(rec, dir);
+    else if ((op < 75) && (file.name_cnt() == 2)) file_set.remove_name(rec, rnd.next(2));
+    else file_set.files[rec].data_size = random_size(rnd);
+  }
+}
+
+// full rebuild: records of every file are added and sorted
+static void build_index(MftIndex& mft_index, const FileSet& file_set) {
+  mft_index.clear();
+  mft_index.reserve(file_set.rec_cnt);
+  FileRecord file_rec;
+  for (u32 rec = 0; rec < file_set.files.size(); rec++) {
+    if (!file_set.files[rec].in_use) continue;
+    for (unsigned i = 0; i < file_set.files[rec].name_cnt(); i++) {
+      file_set.get_record(rec, i, file_rec);
+      mft_index.add(file_rec);
+    }
+  }
+  mft_index.sort();
+}
+
+static u64 mix(u64 hash, u64 value) {
+  hash = (hash ^ value) * 0x100000001B3ULL;
+  return hash ^ (hash >> 29);
+}
+
+static u64 mix_totals(u64 hash, const MftTotals& totals) {
+  hash = mix(hash, totals.data_size);
+  hash = mix(hash, totals.disk_size);
+  hash = mix(hash, totals.fragment_cnt);
+  hash = mix(hash, totals.file_cnt);
+  hash = mix(hash, totals.dir_cnt);
+  hash = mix(hash, totals.hl_cnt);
+  hash = mix(hash, totals.file_rp_cnt);
+  return mix(hash, totals.dir_rp_cnt);
+}
+
+// Digest of every record (columns and lookup results for its file reference) followed by totals
+// of root contents and of random selections. Both indexes are sorted by (parent, name), so equal
+// indexes have equal digests at every position.
+static void index_digest(const MftIndex& index, u64 seed, Array<u64>& digest) {
+  const unsigned c_selection_cnt = 100;
+  digest.clear();
+  digest.extend(index.size() + c_selection_cnt + 2);
+  for (unsigned i = 0; i < index.size(); i++) {
+    u64 hash = mix(0xCBF29CE484222325ULL, index.file_ref_num(i));
+    hash = mix(hash, index.parent_ref_num(i));
+    const wchar_t* name = index.file_name_data(i);
+    for (unsigned j = 0; j < index.file_name_size(i); j++) hash = mix(hash, name[j]);
+    hash = mix(hash, index.file_attr(i));
+    hash = mix(hash, *reinterpret_cast<const u64*>(&index.creation_time(i)));
+    hash = mix(hash, *reinterpret_cast<const u64*>(&index.last_access_time(i)));
+    hash = mix(hash, *reinterpret_cast<const u64*>(&index.last_write_time(i)));
+    hash = mix(hash, index.data_size(i));
+    hash = mix(hash, index.disk_size(i));
+    hash = mix(hash, index.valid_size(i));
+    hash = mix(hash, index.fragment_cnt(i));
+    hash = mix(hash, index.mft_rec_cnt(i));
+    hash = mix(hash, index.stream_cnt(i));
+    hash = mix(hash, index.hard_link_cnt(i));
+    hash = mix(hash, index.flags(i));
+
+    // lookup tables (names are unique, so name lookup must find the record itself)
+    CHECK(index.find(index.parent_ref_num(i), index.file_name(i)) == i);
+    u64 ref = index.file_ref_num(i);
+    hash = mix(hash, index.find_dir(ref));
+    unsigned first_idx, end_idx;
+    index.get_children(ref, first_idx, end_idx);
+    hash = mix(hash, first_idx);
+    hash = mix(hash, end_idx);
+    const u32* rec_idxs;
+    unsigned rec_cnt;
+    index.get_file_records(ref, rec_idxs, rec_cnt);
+    u64 rec_idx_sum = 0; // order of records of file is not defined
+    for (unsigned j = 0; j < rec_cnt; j++) rec_idx_sum += rec_idxs[j];
+    hash = mix(hash, rec_cnt);
+    digest += mix(hash, rec_idx_sum);
+  }
+  digest += mix(index.find_root(), index.end_file_ref());
+
+  u64 root = index.find_root();
+  unsigned first_idx, end_idx;
+  index.get_children(root, first_idx, end_idx);
+  Array<unsigned> rec_idxs;
+  for (unsigned i = first_idx; i < end_idx; i++) {
+    if (index.file_ref_num(i) != root) rec_idxs.add(i);
+  }
+  digest += mix_totals(0, index.get_totals(rec_idxs));
+  Random rnd(seed);
+  for (unsigned i = 0; i < c_selection_cnt; i++) {
+    rec_idxs.clear();
+    unsigned cnt = rnd.next(8) + 1;
+    for (unsigned j = 0; j < cnt; j++) rec_idxs.add(rnd.next(index.size()));
+    digest += mix_totals(0, index.get_totals(rec_idxs));
+  }
+}
+
+static void compare_digests(const Array<u64>& digest, const Array<u64>& expected) {
+  CHECK(digest.size() == expected.size());
+  for (unsigned i = 0; i < expected.size(); i++) {
+    if (digest[i] != expected[i]) {
+      printf("digest %u of %u differs\n", i, expected.size());
+      CHECK(digest[i] == expected[i]);
+    }
+  }
+}
+
+static void mft_update(int argc, char* argv[]) {
+  unsigned rec_cnt = argc > 1 ? atoi(argv[1]) : 10000000;
+  FileSet file_set;
+  generate_files(file_set, rec_cnt, 1);
+  MftIndex mft_index;
+  double t_start = time_now();
+  build_index(mft_index, file_set);
+  printf("%u records (%u files, %u directories): build %.0f ms, %.1f MB\n", mft_index.size(), static_cast<unsigned>(file_set.files.size() - file_set.free_recs.size()), static_cast<unsigned>(file_set.dirs.size()), (time_now() - t_start) * 1000, mft_index.mem_size() / 1e6);
+
+  Array<u64> digest, expected;
+  const unsigned c_change_cnts[] = { rec_cnt / 10000, rec_cnt / 100, rec_cnt / 10 };
+  for (unsigned i = 0; i < ARRAYSIZE(c_change_cnts); i++) {
+    std::set<u64> file_refs;
+    change_files(file_set, c_change_cnts[i], 100 + i, file_refs);
+    std::list<FileRecord> file_list;
+    unsigned removed_cnt = 0;
+    for (std::set<u64>::const_iterator file_ref = file_refs.begin(); file_ref != file_refs.end(); file_ref++) {
+      file_set.get_records(static_cast<u32>(*file_ref), file_list);
+      const u32* rec_idxs;
+      unsigned cnt;
+      mft_index.get_file_records(*file_ref, rec_idxs, cnt);
+      removed_cnt += cnt;
+    }
+    bool patch = static_cast<u64>(removed_cnt + file_list.size()) * c_patch_ratio <= mft_index.size();
+
+    t_start = time_now();
+    mft_index.update(file_refs, file_list);
+    double t_update = time_now() - t_start;
+    index_digest(mft_index, i, digest);
+
+    t_start = time_now();
+    build_index(mft_index, file_set);
+    double t_build = time_now() - t_start;
+    index_digest(mft_index, i, expected);
+
+    compare_digests(digest, expected);
+    printf("%u changes (%u files, %u records replaced, %u new): update %.1f ms (lookup tables %s), rebuild %.0f ms\n", c_change_cnts[i], static_cast<unsigned>(file_refs.size()), removed_cnt, static_cast<unsigned>(file_list.size()), t_update * 1000, patch ? "patched" : "rebuilt", t_build * 1000);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  return run_bench(mft_update, argc, argv);
+}
@@ -0,0 +1,448 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include "utils.h"
+#include "ntfs.h"
+#include "volume.h"
+#include "ntfs_file.h"
+#include "mft_reader.h"
+#include "mft_index.h"
+#include "mft_scan.h"
+#include "bench.h"
+#include "ntfs_image.h"
+
+// attributes are appended to MFT record buffer
+class RecordWriter {
+private:
+  u8* rec_buf;
+  unsigned pos;
+  u16 instance;
+  ATTR_HEADER* add_attr(u32 type, const UnicodeString& name, unsigned info_size, unsigned value_size, unsigned& value_off) {
+    unsigned name_off = sizeof(ATTR_HEADER) + info_size;
+    value_off = (name_off + name.size() * sizeof(wchar_t) + 7) & ~7;
+    unsigned length = (value_off + value_size + 7) & ~7;
+    CHECK(pos + length + 8 <= NtfsImage::c_file_rec_size);
+    ATTR_HEADER* header = reinterpret_cast<ATTR_HEADER*>(rec_buf + pos);
+    header->type = type;
+    header->length = length;
+    header->name_length = static_cast<u8>(name.size());
+    header->name_offset = static_cast<u16>(name_off);
+    header->instance = instance++;
+    memcpy(rec_buf + pos + name_off, name.data(), name.size() * sizeof(wchar_t));
+    value_off += pos;
+    pos += length;
+    return header;
+  }
+public:
+  RecordWriter(u8* rec_buf, unsigned pos): rec_buf(rec_buf), pos(pos), instance(0) {
+  }
+  // returns value buffer
+  u8* add_resident(u32 type, const UnicodeString& name, unsigned value_size) {
+    unsigned value_off;
+    ATTR_HEADER* header = add_attr(type, name, sizeof(ATTR_RESIDENT), value_size, value_off);
+    ATTR_RESIDENT* info = reinterpret_cast<ATTR_RESIDENT*>(header + 1);
+    info->value_length = value_size;
+    info->value_offset = static_cast<u16>(value_off - (reinterpret_cast<u8*>(header) - rec_buf));
+    return rec_buf + value_off;
+  }
+  // runs: lcn, cluster count
+  void add_nonresident(u32 type, const UnicodeString& name, const std::vector<std::pair<u64, u64> >& runs, u64 data_size) {
+    // mapping pairs: header byte (offset size << 4 | length size), length, signed lcn delta
+    std::vector<u8> pairs;
+    u64 prev_lcn = 0;
+    u64 clusters = 0;
+    for (unsigned i = 0; i < runs.size(); i++) {
+      s64 delta = static_cast<s64>(runs[i].first - prev_lcn);
+      unsigned off_l = 1;
+      while ((off_l < 8) && ((delta < -(1LL << (off_l * 8 - 1))) || (delta >= (1LL << (off_l * 8 - 1))))) off_l++;
+      unsigned len_l = 1;
+      while ((len_l < 8) && (runs[i].second >> (len_l * 8))) len_l++;
+      pairs.push_back(static_cast<u8>(off_l << 4 | len_l));
+      for (unsigned j = 0; j < len_l; j++) pairs.push_back(static_cast<u8>(runs[i].second >> (j * 8)));
+      for (unsigned j = 0; j < off_l; j++) pairs.push_back(static_cast<u8>(static_cast<u64>(delta) >> (j * 8)));
+      prev_lcn = runs[i].first;
+      clusters += runs[i].second;
+    }
+    pairs.push_back(0);
+    unsigned value_off;
+    ATTR_HEADER* header = add_attr(type, name, sizeof(ATTR_NONRESIDENT), static_cast<unsigned>(pairs.size()), value_off);
+    header->non_resident = 1;
+    ATTR_NONRESIDENT* info = reinterpret_cast<ATTR_NONRESIDENT*>(header + 1);
+    info->highest_vcn = clusters - 1;
+    info->mapping_pairs_offset = static_cast<u16>(value_off - (reinterpret_cast<u8*>(header) - rec_buf));
+    info->allocated_size = clusters * NtfsImage::c_cluster_size;
+    info->data_size = data_size;
+    info->initialized_size = data_size;
+    memcpy(rec_buf + value_off, pairs.data(), pairs.size());
+  }
+  // end marker and record header fields, update sequence array is applied
+  void finish(u16 seq, u16 flags, u16 link_cnt) {
+    *reinterpret_cast<u32*>(rec_buf + pos) = AT_END;
+    pos += 8;
+    MFT_RECORD* rec = reinterpret_cast<MFT_RECORD*>(rec_buf);
+    rec->magic = magic_FILE;
+    rec->usa_ofs = 0x30;
+    rec->usa_count = NtfsImage::c_file_rec_size / NTFS_BLOCK_SIZE + 1;
+    rec->sequence_number = seq;
+    rec->link_count = link_cnt;
+    rec->attrs_offset = 0x38;
+    rec->flags = flags;
+    rec->bytes_in_use = pos;
+    rec->bytes_allocated = NtfsImage::c_file_rec_size;
+    rec->next_attr_instance = instance;
+    u16* usa = reinterpret_cast<u16*>(rec_buf + rec->usa_ofs);
+    usa[0] = seq | 1;
+    for (unsigned i = 1; i < rec->usa_count; i++) {
+      u16* sector_end = reinterpret_cast<u16*>(rec_buf + i * NTFS_BLOCK_SIZE - sizeof(u16));
+      usa[i] = *sector_end;
+      *sector_end = usa[0];
+    }
+  }
+};
+
+NtfsImage::NtfsImage(unsigned rec_cnt): journal_id(0x1D2C3B4A5968778ULL), next_usn(0x10000), clock(130000000000000000ULL), first_free(c_first_user_rec) {
+  const unsigned c_recs_per_cluster = c_cluster_size / c_file_rec_size;
+  rec_cnt = max((rec_cnt + 2 * c_recs_per_cluster - 1) / (2 * c_recs_per_cluster) * (2 * c_recs_per_cluster), static_cast<unsigned>(c_first_user_rec));
+  files.resize(rec_cnt);
+  for (unsigned i = 0; i < rec_cnt; i++) {
+    files[i].in_use = false;
+    files[i].dir = false;
+    files[i].seq = 1;
+  }
+  // $MFT is split into two extents
+  u64 mft_clusters = rec_cnt / c_recs_per_cluster;
+  mft_runs[0][0] = 16;
+  mft_runs[0][1] = mft_clusters / 2;
+  mft_runs[1][0] = mft_runs[0][0] + mft_runs[0][1] + 16;
+  mft_runs[1][1] = mft_clusters - mft_runs[0][1];
+  bitmap_lcn = mft_runs[1][0] + mft_runs[1][1];
+  end_lcn = bitmap_lcn + (rec_cnt / 8 + c_cluster_size - 1) / c_cluster_size;
+
+  File& mft = files[0];
+  mft.in_use = true;
+  Name name;
+  name.parent = c_root_rec;
+  name.name = L"$MFT";
+  mft.names.push_back(name);
+  mft.data_size = static_cast<u64>(rec_cnt) * c_file_rec_size;
+  mft.fragments = 2;
+  mft.stream_size = 0;
+  mft.time = clock;
+
+  File& root = files[c_root_rec];
+  root.in_use = true;
+  root.dir = true;
+  root.seq = c_root_rec;
+  name.name = L".";
+  root.names.push_back(name);
+  root.data_size = 0;
+  root.fragments = 0;
+  root.stream_size = 0;
+  root.time = clock;
+}
+
+void NtfsImage::record_change(u64 rec, DWORD reason) {
+  const File& file = files[static_cast<unsigned>(rec)];
+  UnicodeString name = file.names.size() ? file.names[0].name : UnicodeString();
+  unsigned name_off = offsetof(USN_RECORD, FileName);
+  unsigned rec_len = max(static_cast<unsigned>((name_off + name.size() * sizeof(wchar_t) + 7) & ~7), static_cast<unsigned>(sizeof(USN_RECORD)));
+  std::vector<u8> data(rec_len);
+  USN_RECORD* usn_rec = reinterpret_cast<USN_RECORD*>(data.data());
+  usn_rec->RecordLength = rec_len;
+  usn_rec->MajorVersion = 2;
+  usn_rec->FileReferenceNumber = file_ref(rec);
+  usn_rec->ParentFileReferenceNumber = file.names.size() ? file_ref(file.names[0].parent) : 0;
+  usn_rec->Usn = next_usn;
+  usn_rec->Reason = reason | USN_REASON_CLOSE;
+  usn_rec->FileNameLength = static_cast<WORD>(name.size() * sizeof(wchar_t));
+  usn_rec->FileNameOffset = static_cast<WORD>(name_off);
+  memcpy(data.data() + name_off, name.data(), name.size() * sizeof(wchar_t));
+  usn_records.add(data.data(), rec_len);
+  next_usn += rec_len;
+}
+
+u64 NtfsImage::add_file(u64 parent, const UnicodeString& name, bool dir, u64 data_size, unsigned fragments) {
+  unsigned rec = first_free;
+  while ((rec < files.size()) && files[rec].in_use) rec++;
+  CHECK(rec < files.size());
+  first_free = rec + 1;
+  File& file = files[rec];
+  file.in_use = true;
+  file.dir = dir;
+  file.names.clear();
+  Name file_name;
+  file_name.parent = parent;
+  file_name.name = name;
+  file.names.push_back(file_name);
+  file.data_size = dir ? 0 : data_size;
+  file.fragments = dir ? 0 : fragments;
+  file.stream_name.clear();
+  file.stream_size = 0;
+  file.time = clock++;
+  record_change(rec, USN_REASON_FILE_CREATE);
+  return rec;
+}
+
+void NtfsImage::add_name(u64 rec, u64 parent, const UnicodeString& name) {
+  File& file = files[static_cast<unsigned>(rec)];
+  Name file_name;
+  file_name.parent = parent;
+  file_name.name = name;
+  file.names.push_back(file_name);
+  record_change(rec, USN_REASON_HARD_LINK_CHANGE);
+}
+
+void NtfsImage::remove_name(u64 rec, unsigned name_idx) {
+  File& file = files[static_cast<unsigned>(rec)];
+  record_change(rec, USN_REASON_HARD_LINK_CHANGE);
+  file.names.erase(file.names.begin() + name_idx);
+}
+
+void NtfsImage::rename(u64 rec, unsigned name_idx, u64 parent, const UnicodeString& name) {
+  File& file = files[static_cast<unsigned>(rec)];
+  record_change(rec, USN_REASON_RENAME_OLD_NAME);
+  file.names[name_idx].parent = parent;
+  file.names[name_idx].name = name;
+  record_change(rec, USN_REASON_RENAME_NEW_NAME);
+}
+
+void NtfsImage::set_size(u64 rec, u64 data_size, unsigned fragments) {
+  File& file = files[static_cast<unsigned>(rec)];
+  file.data_size = data_size;
+  file.fragments = fragments;
+  file.time = clock++;
+  record_change(rec, USN_REASON_DATA_EXTEND);
+}
+
+void NtfsImage::set_stream(u64 rec, const UnicodeString& stream_name, unsigned stream_size) {
+  File& file = files[static_cast<unsigned>(rec)];
+  file.stream_name = stream_name;
+  file.stream_size = stream_size;
+  record_change(rec, USN_REASON_DATA_EXTEND);
+}
+
+// record can be reused with next sequence number
+void NtfsImage::remove(u64 rec) {
+  File& file = files[static_cast<unsigned>(rec)];
+  record_change(rec, USN_REASON_FILE_DELETE);
+  file.in_use = false;
+  file.seq++;
+  first_free = min(first_free, static_cast<unsigned>(rec));
+}
+
+static void encode_std_info(RecordWriter& writer, u64 time, u32 file_attributes) {
+  u8* value = writer.add_resident(AT_STANDARD_INFORMATION, UnicodeString(), 72);
+  STANDARD_INFORMATION_ATTR* std_info = reinterpret_cast<STANDARD_INFORMATION_ATTR*>(value);
+  std_info->creation_time = time;
+  std_info->last_data_change_time = time + 1;
+  std_info->last_mft_change_time = time + 2;
+  std_info->last_access_time = time + 3;
+  std_info->file_attributes = file_attributes;
+}
+
+static void encode_file_name(RecordWriter& writer, u64 parent_ref, const UnicodeString& name, u8 name_type, u32 file_attributes, u64 time) {
+  u8* value = writer.add_resident(AT_FILE_NAME, UnicodeString(), sizeof(FILE_NAME_ATTR) + name.size() * sizeof(wchar_t));
+  FILE_NAME_ATTR* fn_attr = reinterpret_cast<FILE_NAME_ATTR*>(value);
+  fn_attr->parent_directory = parent_ref;
+  fn_attr->creation_time = time;
+  fn_attr->last_data_change_time = time;
+  fn_attr->last_mft_change_time = time;
+  fn_attr->last_access_time = time;
+  fn_attr->file_attributes = file_attributes;
+  fn_attr->file_name_length = static_cast<u8>(name.size());
+  fn_attr->file_name_type = name_type;
+  memcpy(value + sizeof(FILE_NAME_ATTR), name.data(), name.size() * sizeof(wchar_t));
+}
+
+void NtfsImage::encode_record(u64 rec, u8* rec_buf) const {
+  const File& file = files[static_cast<unsigned>(rec)];
+  memset(rec_buf, 0, c_file_rec_size);
+  RecordWriter writer(rec_buf, 0x38);
+  if (!file.in_use) {
+    writer.finish(file.seq, 0, 0);
+    return;
+  }
+  encode_std_info(writer, file.time, file.dir ? 0 : FILE_ATTR_ARCHIVE);
+  u32 fn_attributes = file.dir ? FILE_ATTR_I30_INDEX_PRESENT : FILE_ATTR_ARCHIVE;
+  for (unsigned i = 0; i < file.names.size(); i++) {
+    const UnicodeString& name = file.names[i].name;
+    u64 parent_ref = file_ref(file.names[i].parent);
+    // long name of first link gets short (DOS) name, which is not indexed
+    if ((i == 0) && (name.size() > 12)) {
+      encode_file_name(writer, parent_ref, name, FILE_NAME_WIN32, fn_attributes, file.time);
+      encode_file_name(writer, parent_ref, name.left(6) + L"~1", FILE_NAME_DOS, fn_attributes, file.time);
+    }
+    else encode_file_name(writer, parent_ref, name, i % 2 ? FILE_NAME_POSIX : FILE_NAME_WIN32_AND_DOS, fn_attributes, file.time);
+  }
+  if (rec == 0) {
+    std::vector<std::pair<u64, u64> > runs;
+    runs.push_back(std::make_pair(mft_runs[0][0], mft_runs[0][1]));
+    runs.push_back(std::make_pair(mft_runs[1][0], mft_runs[1][1]));
+    writer.add_nonresident(AT_DATA, UnicodeString(), runs, file.data_size);
+    runs.clear();
+    runs.push_back(std::make_pair(bitmap_lcn, end_lcn - bitmap_lcn));
+    writer.add_nonresident(AT_BITMAP, UnicodeString(), runs, (files.size() / 8 + 7) & ~7);
+  }
+  else if (!file.dir) {
+    if (file.fragments == 0) writer.add_resident(AT_DATA, UnicodeString(), static_cast<unsigned>(file.data_size));
+    else {
+      // discontiguous extents far past the end of volume
+      u64 clusters = max((file.data_size + c_cluster_size - 1) / c_cluster_size, static_cast<u64>(file.fragments));
+      u64 lcn = 0x1000000 + rec * 0x10000;
+      std::vector<std::pair<u64, u64> > runs;
+      for (unsigned i = 0; i < file.fragments; i++) {
+        u64 len = clusters / file.fragments + (i < clusters % file.fragments ? 1 : 0);
+        runs.push_back(std::make_pair(lcn, len));
+        lcn += len + 1 + i;
+      }
+      writer.add_nonresident(AT_DATA, UnicodeString(), runs, file.data_size);
+    }
+    if (file.stream_name.size()) writer.add_resident(AT_DATA, file.stream_name, file.stream_size);
+  }
+  writer.finish(file.seq, MFT_RECORD_IN_USE | (file.dir ? MFT_RECORD_IS_DIRECTORY : 0), static_cast<u16>(file.names.size()));
+}
+
+void NtfsImage::write(Array<u8>& image) const {
+  unsigned size = static_cast<unsigned>(end_lcn * c_cluster_size);
+  u8* data = image.buf(size);
+  memset(data, 0, size);
+  image.set_size(size);
+
+  NTFS_BOOT_SECTOR* boot_sector = reinterpret_cast<NTFS_BOOT_SECTOR*>(data);
+  boot_sector->oem_id = NTFS_OEM_ID;
+  boot_sector->bytes_per_sector = NTFS_BLOCK_SIZE;
+  boot_sector->sectors_per_cluster = c_cluster_size / NTFS_BLOCK_SIZE;
+  boot_sector->number_of_sectors = size / NTFS_BLOCK_SIZE;
+  boot_sector->mft_lcn = mft_runs[0][0];
+  boot_sector->clusters_per_mft_record = -10; // 1 << 10 bytes
+  boot_sector->volume_serial_number = journal_id;
+
+  unsigned rec_idx = 0;
+  for (unsigned run = 0; run < 2; run++) {
+    u8* run_data = data + mft_runs[run][0] * c_cluster_size;
+    unsigned run_rec_cnt = static_cast<unsigned>(mft_runs[run][1] * c_cluster_size / c_file_rec_size);
+    for (unsigned i = 0; i < run_rec_cnt; i++, rec_idx++) encode_record(rec_idx, run_data + i * c_file_rec_size);
+  }
+  u8* bitmap = data + bitmap_lcn * c_cluster_size;
+  for (unsigned i = 0; i < files.size(); i++) {
+    if (files[i].in_use) bitmap[i / 8] |= 1 << (i % 8);
+  }
+}
+
+void NtfsImage::write(const char* file_path) const {
+  Array<u8> image;
+  write(image);
+  FILE* file = fopen(file_path, "wb");
+  CHECK(file != NULL);
+  bool ok = fwrite(image.data(), 1, image.size(), file) == image.size();
+  CHECK((fclose(file) == 0) && ok);
+}
+
+static bool is_ancestor(const NtfsImage& image, u64 rec, u64 dir) {
+  while (true) {
+    if (dir == rec) return true;
+    if (dir == NtfsImage::c_root_rec) return false;
+    dir = image.files[static_cast<unsigned>(dir)].names[0].parent;
+  }
+}
+
+void generate_tree(NtfsImage& image, unsigned file_cnt, u64 seed) {
+  Random rnd(seed);
+  std::vector<u64> dirs;
+  dirs.push_back(NtfsImage::c_root_rec);
+  for (unsigned i = 0; i < file_cnt; i++) {
+    u64 parent = dirs[rnd.next(static_cast<unsigned>(dirs.size()))];
+    if (rnd.next(100) < 10) {
+      dirs.push_back(image.add_file(parent, UnicodeString::format(L"Dir%u", i), true, 0));
+      continue;
+    }
+    u64 data_size = rnd.next(4) == 0 ? rnd.next(NtfsImage::c_max_resident_size) : rnd.next(16 * 1024 * 1024) + NtfsImage::c_max_resident_size;
+    unsigned fragments = data_size > NtfsImage::c_max_resident_size ? rnd.next(4) + 1 : 0;
+    UnicodeString name = rnd.next(3) == 0 ? UnicodeString::format(L"Long file name %u.txt", i) : UnicodeString::format(L"f%u.dat", i);
+    u64 rec = image.add_file(parent, name, false, data_size, fragments);
+    if (rnd.next(20) == 0) image.add_name(rec, dirs[rnd.next(static_cast<unsigned>(dirs.size()))], UnicodeString::format(L"link%u", i));
+    if (rnd.next(25) == 0) image.set_stream(rec, L"Zone.Identifier", 26);
+  }
+}
+
+void change_tree(NtfsImage& image, unsigned change_cnt, u64 seed) {
+  Random rnd(seed);
+  std::vector<u64> dirs;
+  for (unsigned i = 0; i < image.record_count(); i++) {
+    if (image.files[i].in_use && image.files[i].dir) dirs.push_back(i);
+  }
+  for (unsigned i = 0; i < change_cnt; i++) {
+    unsigned op = rnd.next(100);
+    u64 dir = dirs[rnd.next(static_cast<unsigned>(dirs.size()))];
+    UnicodeString name = UnicodeString::format(L"new%Lu_%u", seed, i);
+    if (op < 20) {
+      u64 data_size = rnd.next(1024 * 1024);
+      image.add_file(dir, name, false, data_size, data_size > NtfsImage::c_max_resident_size ? rnd.next(3) + 1 : 0);
+      continue;
+    }
+    if (op < 25) {
+      dirs.push_back(image.add_file(dir, name, true, 0));
+      continue;
+    }
+    // change existing user file
+    u64 rec;
+    do {
+      rec = NtfsImage::c_first_user_rec + rnd.next(image.record_count() - NtfsImage::c_first_user_rec);
+    }
+    while (!image.files[static_cast<unsigned>(rec)].in_use);
+    const NtfsImage::File& file = image.files[static_cast<unsigned>(rec)];
+    if (file.dir) {
+      // rename or move (not into own subtree); empty directory is removed
+      bool empty = true;
+      for (unsigned j = 0; empty && (j < image.record_count()); j++) {
+        const NtfsImage::File& child = image.files[j];
+        for (unsigned k = 0; child.in_use && (k < child.names.size()); k++) {
+          if ((child.names[k].parent == rec) && (j != rec)) empty = false;
+        }
+      }
+      if (empty && (op < 50)) {
+        image.remove(rec);
+        dirs.erase(std::find(dirs.begin(), dirs.end(), rec));
+      }
+      else if (!is_ancestor(image, rec, dir)) image.rename(rec, 0, dir, name);
+      else image.rename(rec, 0, file.names[0].parent, name);
+    }
+    else if (op < 40) image.remove(rec);
+    else if (op < 50) image.rename(rec, rnd.next(static_cast<unsigned>(file.names.size())), file.names[0].parent, name);
+    else if (op < 60) image.rename(rec, rnd.next(static_cast<unsigned>(file.names.size())), dir, name);
+    else if ((op < 68) && (file.names.size() < 3)) image.add_name(rec, dir, name);
+    else if ((op < 75) && (file.names.size() > 1)) image.remove_name(rec, rnd.next(static_cast<unsigned>(file.names.size())));
+    else if (op < 80) image.set_stream(rec, file.stream_name.size() ? UnicodeString() : UnicodeString(L"Zone.Identifier"), file.stream_name.size() ? 0 : 26);
+    else {
+      u64 data_size = rnd.next(64 * 1024 * 1024);
+      image.set_size(rec, data_size, data_size > NtfsImage::c_max_resident_size ? rnd.next(5) + 1 : 0);
+    }
+  }
+}
+
+void scan_volume(NtfsVolume& volume, std::list<FileRecord>& file_list, bool show_streams) {
+  MftReader mft_reader(volume);
+  FileInfo file_info;
+  file_info.volume = &volume;
+  file_info.mft_reader = &mft_reader;
+  while (mft_reader.read_chunk()) {
+    for (unsigned i = 0; i < mft_reader.record_cnt(); i++) {
+      const u8* file_rec = mft_reader.record(i);
+      if (file_rec && (reinterpret_cast<const MFT_RECORD*>(file_rec)->base_mft_record == 0)) {
+        file_info.set_base_file_rec(mft_reader.first_record() + i, file_rec, volume.file_rec_size);
+        file_info.process_base_file_rec();
+        add_file_records(file_list, file_info, show_streams, false);
+      }
+    }
+  }
+}
+
+void build_index(MftIndex& mft_index, std::list<FileRecord>& file_list) {
+  mft_index.clear();
+  mft_index.reserve(static_cast<unsigned>(file_list.size()));
+  while (file_list.size()) {
+    mft_index.add(file_list.front());
+    file_list.pop_front();
+  }
+  mft_index.sort();
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+// Synthetic NTFS volume image: boot sector, $MFT (two extents) with non-resident $BITMAP,
+// root directory and generated files. Files can be changed after image is written, every
+// change is recorded as USN_RECORD (FSCTL_READ_USN_JOURNAL layout), so index updates can be
+// replayed and compared with a fresh scan of changed image.
+// File data is not stored: non-resident streams point to clusters past the end of image.
+class NtfsImage {
+public:
+  enum {
+    c_cluster_size = 4096,
+    c_file_rec_size = 1024,
+    c_root_rec = 5,
+    c_first_user_rec = 16,
+    c_max_resident_size = 256
+  };
+  struct Name {
+    u64 parent; // record number
+    UnicodeString name;
+  };
+  struct File {
+    bool in_use;
+    bool dir;
+    u16 seq;
+    std::vector<Name> names;
+    u64 data_size;
+    unsigned fragments; // extents of unnamed stream, 0 - resident
+    UnicodeString stream_name; // named stream (resident), empty if none
+    unsigned stream_size;
+    u64 time;
+  };
+  std::vector<File> files; // by record number
+  DWORDLONG journal_id;
+  USN next_usn;
+  Array<u8> usn_records; // changes since clear_usn_records()
+private:
+  u64 clock;
+  unsigned first_free; // no free records below
+  u64 mft_runs[2][2]; // lcn, cluster count
+  u64 bitmap_lcn;
+  u64 end_lcn;
+  void record_change(u64 rec, DWORD reason);
+  void encode_record(u64 rec, u8* rec_buf) const;
+public:
+  // MFT has place for rec_cnt records
+  NtfsImage(unsigned rec_cnt);
+  unsigned record_count() const {
+    return static_cast<unsigned>(files.size());
+  }
+  u64 file_ref(u64 rec) const {
+    return rec | (static_cast<u64>(files[static_cast<unsigned>(rec)].seq) << 48);
+  }
+  // returns record number of new file (first free record is reused)
+  u64 add_file(u64 parent, const UnicodeString& name, bool dir, u64 data_size, unsigned fragments = 0);
+  void add_name(u64 rec, u64 parent, const UnicodeString& name);
+  void remove_name(u64 rec, unsigned name_idx);
+  void rename(u64 rec, unsigned name_idx, u64 parent, const UnicodeString& name);
+  void set_size(u64 rec, u64 data_size, unsigned fragments);
+  void set_stream(u64 rec, const UnicodeString& stream_name, unsigned stream_size);
+  void remove(u64 rec);
+  void clear_usn_records() {
+    usn_records.clear();
+  }
+  // whole volume image
+  void write(Array<u8>& image) const;
+  void write(const char* file_path) const;
+};
+
+// random directory tree with files, hard links and streams
+void generate_tree(NtfsImage& image, unsigned file_cnt, u64 seed);
+
+// random changes of existing tree (recorded as USN records)
+void change_tree(NtfsImage& image, unsigned change_cnt, u64 seed);
+
+// Index records of every file on volume: sequential MFT scan on calling thread.
+void scan_volume(NtfsVolume& volume, std::list<FileRecord>& file_list, bool show_streams);
+
+// sorted index with lookup tables
+void build_index(MftIndex& mft_index, std::list<FileRecord>& file_list);
@@ -0,0 +1,415 @@
+#pragma once
+
+// Replacement of precompiled headers.hpp for Linux builds of plugin sources (g++ -fshort-wchar).
+// Declares the subset of Win32 API used by volume, MFT and hashing code; functions
+// which need a live Windows volume fail with ERROR_NOT_SUPPORTED (see win32.cpp).
+// Files, events and threads are emulated with POSIX calls, so image and cache files can be
+// read and written and worker pools run unchanged.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <assert.h>
+#include <pthread.h>
+#include <strings.h>
+
+#include <string>
+#include <vector>
+#include <list>
+#include <set>
+#include <map>
+#include <unordered_set>
+#include <unordered_map>
+#include <algorithm>
+#include <memory>
+#include <new>
+using namespace std;
+
+#define __int8 char
+#define __int16 short
+#define __int32 int
+#define __int64 long long
+#define __cdecl
+#define __stdcall
+#define __A_IDXSZ_TYPE__ unsigned
+#define _strnicmp strncasecmp
+
+// wide character functions of C library expect 4-byte wchar_t
+size_t port_wcslen(const wchar_t* str);
+int port_wcsicmp(const wchar_t* str1, const wchar_t* str2);
+int port_wcsnicmp(const wchar_t* str1, const wchar_t* str2, size_t size);
+const wchar_t* port_wcserror(int code);
+#define wcslen port_wcslen
+#define _wcsicmp port_wcsicmp
+#define _wcsnicmp port_wcsnicmp
+#define _wcserror port_wcserror
+
+// utils.h declares int round(double)
+#define round plugin_round
+
+#if defined(__x86_64__) || defined(__i386__)
+#  ifdef __x86_64__
+#    define _M_X64 100
+#    define _WIN64
+#  else
+#    define _M_IX86 600
+#  endif
+#  define _MSC_VER 1700
+#endif
+
+typedef int BOOL;
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef uint64_t DWORDLONG;
+typedef LONGLONG USN;
+typedef size_t SIZE_T;
+typedef int32_t HRESULT;
+typedef wchar_t WCHAR;
+typedef wchar_t* LPWSTR;
+typedef const wchar_t* LPCWSTR;
+typedef void* LPVOID;
+typedef void* HANDLE;
+typedef HANDLE HINSTANCE;
+typedef HANDLE HLOCAL;
+
+#define TRUE 1
+#define FALSE 0
+#define MAX_PATH 260
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define INVALID_HANDLE_VALUE (reinterpret_cast<HANDLE>(static_cast<intptr_t>(-1)))
+#define INFINITE 0xFFFFFFFF
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT 258
+#define WAIT_FAILED 0xFFFFFFFF
+#define MAXIMUM_WAIT_OBJECTS 64
+
+#define ERROR_SUCCESS 0
+#define ERROR_FILE_NOT_FOUND 2
+#define ERROR_ACCESS_DENIED 5
+#define ERROR_INVALID_HANDLE 6
+#define ERROR_NOT_ENOUGH_MEMORY 8
+#define ERROR_INVALID_DATA 13
+#define ERROR_HANDLE_EOF 38
+#define ERROR_NOT_SUPPORTED 50
+#define ERROR_INVALID_PARAMETER 87
+#define ERROR_INSUFFICIENT_BUFFER 122
+#define ERROR_IO_INCOMPLETE 996
+#define ERROR_IO_PENDING 997
+#define ERROR_JOURNAL_NOT_ACTIVE 1179
+#define ERROR_JOURNAL_ENTRY_DELETED 1181
+
+#define FILE_ATTRIBUTE_READONLY 0x1
+#define FILE_ATTRIBUTE_HIDDEN 0x2
+#define FILE_ATTRIBUTE_SYSTEM 0x4
+#define FILE_ATTRIBUTE_DIRECTORY 0x10
+#define FILE_ATTRIBUTE_ARCHIVE 0x20
+#define FILE_ATTRIBUTE_NORMAL 0x80
+#define FILE_ATTRIBUTE_SPARSE_FILE 0x200
+#define FILE_ATTRIBUTE_REPARSE_POINT 0x400
+#define FILE_ATTRIBUTE_COMPRESSED 0x800
+#define FILE_ATTRIBUTE_ENCRYPTED 0x4000
+
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define FILE_READ_DATA 0x1
+#define FILE_SHARE_READ 0x1
+#define FILE_SHARE_WRITE 0x2
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define FILE_BEGIN 0
+#define FILE_CURRENT 1
+#define FILE_END 2
+#define MOVEFILE_REPLACE_EXISTING 0x1
+#define FILE_FLAG_RANDOM_ACCESS 0x10000000
+#define FILE_FLAG_SEQUENTIAL_SCAN 0x08000000
+#define FILE_FLAG_NO_BUFFERING 0x20000000
+#define FILE_FLAG_OVERLAPPED 0x40000000
+
+#define MEM_COMMIT 0x1000
+#define MEM_RELEASE 0x8000
+#define PAGE_READONLY 0x02
+#define PAGE_READWRITE 0x04
+#define FILE_MAP_READ 0x4
+
+#define FORMAT_MESSAGE_ALLOCATE_BUFFER 0x100
+#define FORMAT_MESSAGE_IGNORE_INSERTS 0x200
+#define FORMAT_MESSAGE_FROM_SYSTEM 0x1000
+
+#define HRESULT_FACILITY(hr) (((hr) >> 16) & 0x1FFF)
+#define HRESULT_CODE(hr) ((hr) & 0xFFFF)
+#define FAILED(hr) ((hr) < 0)
+#define FACILITY_NULL 0
+#define FACILITY_RPC 1
+#define FACILITY_DISPATCH 2
+#define FACILITY_STORAGE 3
+#define FACILITY_ITF 4
+#define FACILITY_WIN32 7
+#define FACILITY_WINDOWS 8
+
+#define FSCTL_GET_NTFS_VOLUME_DATA 0x00090064
+#define FSCTL_GET_NTFS_FILE_RECORD 0x00090068
+#define FSCTL_READ_USN_JOURNAL 0x000900BB
+#define FSCTL_QUERY_USN_JOURNAL 0x000900F4
+
+#define IO_REPARSE_TAG_MOUNT_POINT 0xA0000003
+
+struct FILETIME {
+  DWORD dwLowDateTime;
+  DWORD dwHighDateTime;
+};
+
+union LARGE_INTEGER {
+  struct {
+    DWORD LowPart;
+    LONG HighPart;
+  };
+  LONGLONG QuadPart;
+};
+
+struct OVERLAPPED {
+  uintptr_t Internal;
+  uintptr_t InternalHigh;
+  DWORD Offset;
+  DWORD OffsetHigh;
+  HANDLE hEvent;
+};
+
+struct SYSTEM_INFO {
+  DWORD dwNumberOfProcessors;
+};
+
+struct WIN32_FIND_DATAW {
+  DWORD dwFileAttributes;
+  FILETIME ftCreationTime;
+  FILETIME ftLastAccessTime;
+  FILETIME ftLastWriteTime;
+  DWORD nFileSizeHigh;
+  DWORD nFileSizeLow;
+  DWORD dwReserved0;
+  DWORD dwReserved1;
+  WCHAR cFileName[MAX_PATH];
+  WCHAR cAlternateFileName[14];
+};
+
+struct NTFS_VOLUME_DATA_BUFFER {
+  LARGE_INTEGER VolumeSerialNumber;
+  LARGE_INTEGER NumberSectors;
+  LARGE_INTEGER TotalClusters;
+  LARGE_INTEGER FreeClusters;
+  LARGE_INTEGER TotalReserved;
+  DWORD BytesPerSector;
+  DWORD BytesPerCluster;
+  DWORD BytesPerFileRecordSegment;
+  DWORD ClustersPerFileRecordSegment;
+  LARGE_INTEGER MftValidDataLength;
+  LARGE_INTEGER MftStartLcn;
+  LARGE_INTEGER Mft2StartLcn;
+  LARGE_INTEGER MftZoneStart;
+  LARGE_INTEGER MftZoneEnd;
+};
+
+struct NTFS_FILE_RECORD_INPUT_BUFFER {
+  LARGE_INTEGER FileReferenceNumber;
+};
+
+struct NTFS_FILE_RECORD_OUTPUT_BUFFER {
+  LARGE_INTEGER FileReferenceNumber;
+  DWORD FileRecordLength;
+  BYTE FileRecordBuffer[1];
+};
+
+struct USN_JOURNAL_DATA {
+  DWORDLONG UsnJournalID;
+  USN FirstUsn;
+  USN NextUsn;
+  USN LowestValidUsn;
+  USN MaxUsn;
+  DWORDLONG MaximumSize;
+  DWORDLONG AllocationDelta;
+};
+
+struct READ_USN_JOURNAL_DATA {
+  USN StartUsn;
+  DWORD ReasonMask;
+  DWORD ReturnOnlyOnClose;
+  DWORDLONG Timeout;
+  DWORDLONG BytesToWaitFor;
+  DWORDLONG UsnJournalID;
+};
+
+struct USN_RECORD {
+  DWORD RecordLength;
+  WORD MajorVersion;
+  WORD MinorVersion;
+  DWORDLONG FileReferenceNumber;
+  DWORDLONG ParentFileReferenceNumber;
+  USN Usn;
+  LARGE_INTEGER TimeStamp;
+  DWORD Reason;
+  DWORD SourceInfo;
+  DWORD SecurityId;
+  DWORD FileAttributes;
+  WORD FileNameLength;
+  WORD FileNameOffset;
+  WCHAR FileName[1];
+};
+
+#define USN_REASON_DATA_OVERWRITE 0x00000001
+#define USN_REASON_DATA_EXTEND 0x00000002
+#define USN_REASON_DATA_TRUNCATION 0x00000004
+#define USN_REASON_FILE_CREATE 0x00000100
+#define USN_REASON_FILE_DELETE 0x00000200
+#define USN_REASON_RENAME_OLD_NAME 0x00001000
+#define USN_REASON_RENAME_NEW_NAME 0x00002000
+#define USN_REASON_HARD_LINK_CHANGE 0x00010000
+#define USN_REASON_CLOSE 0x80000000
+
+// recursive like Win32 critical section
+struct CRITICAL_SECTION {
+  pthread_mutex_t mutex;
+};
+
+inline void InitializeCriticalSection(CRITICAL_SECTION* cs) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&cs->mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+inline void DeleteCriticalSection(CRITICAL_SECTION* cs) {
+  pthread_mutex_destroy(&cs->mutex);
+}
+
+inline void EnterCriticalSection(CRITICAL_SECTION* cs) {
+  pthread_mutex_lock(&cs->mutex);
+}
+
+inline void LeaveCriticalSection(CRITICAL_SECTION* cs) {
+  pthread_mutex_unlock(&cs->mutex);
+}
+
+// not recursive like Win32 slim reader/writer lock
+struct SRWLOCK {
+  pthread_rwlock_t rwlock;
+};
+
+inline void InitializeSRWLock(SRWLOCK* lock) {
+  pthread_rwlock_init(&lock->rwlock, NULL);
+}
+
+inline void AcquireSRWLockShared(SRWLOCK* lock) {
+  pthread_rwlock_rdlock(&lock->rwlock);
+}
+
+inline void ReleaseSRWLockShared(SRWLOCK* lock) {
+  pthread_rwlock_unlock(&lock->rwlock);
+}
+
+inline void AcquireSRWLockExclusive(SRWLOCK* lock) {
+  pthread_rwlock_wrlock(&lock->rwlock);
+}
+
+inline void ReleaseSRWLockExclusive(SRWLOCK* lock) {
+  pthread_rwlock_unlock(&lock->rwlock);
+}
+
+inline LONG InterlockedIncrement(volatile LONG* value) {
+  return __sync_add_and_fetch(value, 1);
+}
+
+inline LONG InterlockedExchange(volatile LONG* target, LONG value) {
+  return __sync_lock_test_and_set(target, value);
+}
+
+DWORD GetLastError();
+void SetLastError(DWORD code);
+DWORD FormatMessageW(DWORD flags, const void* source, DWORD code, DWORD lang_id, LPWSTR buffer, DWORD size, va_list* args);
+HLOCAL LocalFree(HLOCAL mem);
+LPVOID VirtualAlloc(LPVOID address, SIZE_T size, DWORD alloc_type, DWORD protect);
+BOOL VirtualFree(LPVOID address, SIZE_T size, DWORD free_type);
+BOOL QueryPerformanceCounter(LARGE_INTEGER* counter);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* freq);
+DWORD CharUpperBuffW(LPWSTR str, DWORD size);
+HANDLE CreateFileW(LPCWSTR file_name, DWORD access, DWORD share_mode, void* security, DWORD disposition, DWORD flags, HANDLE templ);
+BOOL CloseHandle(HANDLE handle);
+BOOL ReadFile(HANDLE handle, LPVOID buffer, DWORD size, DWORD* bytes_read, OVERLAPPED* ov);
+BOOL WriteFile(HANDLE handle, const void* buffer, DWORD size, DWORD* bytes_written, OVERLAPPED* ov);
+BOOL SetFilePointerEx(HANDLE handle, LARGE_INTEGER distance, LARGE_INTEGER* new_pos, DWORD method);
+BOOL GetFileSizeEx(HANDLE handle, LARGE_INTEGER* size);
+BOOL MoveFileExW(LPCWSTR src_name, LPCWSTR dst_name, DWORD flags);
+BOOL DeleteFileW(LPCWSTR file_name);
+HANDLE CreateFileMappingW(HANDLE h_file, void* security, DWORD protect, DWORD size_high, DWORD size_low, LPCWSTR name);
+LPVOID MapViewOfFile(HANDLE h_mapping, DWORD access, DWORD offset_high, DWORD offset_low, SIZE_T size);
+BOOL UnmapViewOfFile(const void* address);
+BOOL GetOverlappedResult(HANDLE handle, OVERLAPPED* ov, DWORD* size, BOOL wait);
+BOOL CancelIo(HANDLE handle);
+BOOL FlushFileBuffers(HANDLE handle);
+BOOL DeviceIoControl(HANDLE handle, DWORD code, LPVOID in_buf, DWORD in_size, LPVOID out_buf, DWORD out_size, DWORD* bytes_ret, OVERLAPPED* ov);
+// test hook: port implements no control codes, calls are passed to hook if it is set
+extern BOOL (*g_device_io_control)(HANDLE handle, DWORD code, LPVOID in_buf, DWORD in_size, LPVOID out_buf, DWORD out_size, DWORD* bytes_ret);
+BOOL GetVolumeInformationW(LPCWSTR root, LPWSTR label, DWORD label_size, DWORD* serial, DWORD* max_comp_len, DWORD* flags, LPWSTR fs_name, DWORD fs_name_size);
+BOOL GetDiskFreeSpaceW(LPCWSTR root, DWORD* sectors_per_cluster, DWORD* bytes_per_sector, DWORD* free_clusters, DWORD* total_clusters);
+BOOL GetVolumeNameForVolumeMountPointW(LPCWSTR mount_point, LPWSTR volume_name, DWORD size);
+HANDLE CreateEventW(void* security, BOOL manual_reset, BOOL initial_state, LPCWSTR name);
+#define CreateEvent CreateEventW
+BOOL SetEvent(HANDLE h_event);
+BOOL ResetEvent(HANDLE h_event);
+DWORD WaitForSingleObject(HANDLE handle, DWORD timeout);
+DWORD WaitForMultipleObjects(DWORD count, const HANDLE* handles, BOOL wait_all, DWORD timeout);
+uintptr_t _beginthreadex(void* security, unsigned stack_size, unsigned (*proc)(void*), void* arg, unsigned flags, unsigned* th_id);
+void GetSystemInfo(SYSTEM_INFO* sys_info);
+DWORD GetTickCount();
+
+// Far API subset referenced by shared code
+typedef int FILE_CONTROL_COMMANDS;
+typedef int TBPFLAG;
+struct PluginPanelItem;
+enum {
+  CPM_FULL,
+  CPM_REAL,
+  CPM_NATIVE
+};
+struct FarStandardFunctions {
+  size_t (*ConvertPath)(int mode, const wchar_t* src, wchar_t* dest, size_t dest_size);
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include "intrin.h"
+#endif
+
+// system OpenSSL instead of bundled one, with API of bundled version (1.0)
+#if __has_include(<openssl/sha.h>)
+#define OPENSSL_API_COMPAT 0x10000000L
+#include <openssl/md4.h>
+#include <openssl/md5.h>
+#include <openssl/sha.h>
+#endif
+
+// system LZO library (cache file code)
+#if __has_include(<lzo/lzo1x.h>)
+#include <lzo/lzo1x.h>
+#endif
+
+#include "col/AnsiString.h"
+#include "col/UnicodeString.h"
+#include "col/PlainArray.h"
+#include "col/ObjectArray.h"
+using namespace col;
+
+// windows.h min/max macros (plugin sources mix argument types), defined after C++ library headers
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#define max(a, b) (((a) > (b)) ? (a) : (b))
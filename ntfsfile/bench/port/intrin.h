@@ -0,0 +1,40 @@
+#pragma once
+
+// MSVC intrinsics used by plugin sources, mapped to GCC builtins
+#include <x86intrin.h>
+#include <cpuid.h>
+#undef __cpuid
+
+inline void __cpuid(int cpu_info[4], int leaf) {
+  __cpuid_count(leaf, 0, cpu_info[0], cpu_info[1], cpu_info[2], cpu_info[3]);
+}
+
+// __cpuidex is provided by cpuid.h
+
+inline unsigned long _byteswap_ulong(unsigned long value) {
+  return __builtin_bswap32(static_cast<unsigned>(value));
+}
+
+inline unsigned char _BitScanForward(unsigned long* idx, unsigned value) {
+  if (value == 0) return 0;
+  *idx = __builtin_ctz(value);
+  return 1;
+}
+
+inline unsigned char _BitScanReverse(unsigned long* idx, unsigned value) {
+  if (value == 0) return 0;
+  *idx = 31 - __builtin_clz(value);
+  return 1;
+}
+
+inline unsigned char _BitScanForward64(unsigned long* idx, unsigned long long value) {
+  if (value == 0) return 0;
+  *idx = __builtin_ctzll(value);
+  return 1;
+}
+
+inline unsigned char _BitScanReverse64(unsigned long* idx, unsigned long long value) {
+  if (value == 0) return 0;
+  *idx = 63 - __builtin_clzll(value);
+  return 1;
+}
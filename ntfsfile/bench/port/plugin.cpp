@@ -0,0 +1,89 @@
+#include "error.h"
+#include "utils.h"
+
+// Plugin globals, path functions and progress monitor of utils.cpp used by volume, file record
+// and cache code (utils.cpp itself depends on Far headers). Paths are not converted, progress is
+// not interrupted by user (there is no console).
+
+static size_t convert_path(int mode, const wchar_t* src, wchar_t* dest, size_t dest_size) {
+  size_t size = port_wcslen(src) + 1;
+  if (size <= dest_size) memcpy(dest, src, size * sizeof(wchar_t));
+  return size;
+}
+
+struct FarStandardFunctions g_fsf = { convert_path };
+
+static void locate_path_root(const UnicodeString& path, unsigned& path_root_len, bool& is_unc_path) {
+  unsigned prefix_len = 0;
+  is_unc_path = false;
+  if (path.equal(0, L"\\\\?\\UNC\\")) {
+    prefix_len = 8;
+    is_unc_path = true;
+  }
+  else if (path.equal(0, L"\\\\?\\") || path.equal(0, L"\\??\\") || path.equal(0, L"\\\\.\\")) {
+    prefix_len = 4;
+  }
+  else if (path.equal(0, L"\\\\")) {
+    prefix_len = 2;
+    is_unc_path = true;
+  }
+  if ((prefix_len == 0) && !path.equal(1, L':')) {
+    path_root_len = 0;
+  }
+  else {
+    unsigned p = path.search(prefix_len, L'\\');
+    if (p == -1) p = path.size();
+    if (is_unc_path) {
+      p = path.search(p + 1, L'\\');
+      if (p == -1) p = path.size();
+    }
+    path_root_len = p;
+  }
+}
+
+UnicodeString extract_path_root(const UnicodeString& path) {
+  unsigned path_root_len;
+  bool is_unc_path;
+  locate_path_root(path, path_root_len, is_unc_path);
+  return path.left(path_root_len);
+}
+
+bool is_unc_path(const UnicodeString& path) {
+  unsigned path_root_len;
+  bool is_unc_path;
+  locate_path_root(path, path_root_len, is_unc_path);
+  return is_unc_path;
+}
+
+UnicodeString long_path(const UnicodeString& path) {
+  return path;
+}
+
+UnicodeString add_trailing_slash(const UnicodeString& file_path) {
+  if ((file_path.size() == 0) || (file_path.last() == L'\\')) return file_path;
+  else return file_path + L'\\';
+}
+
+UnicodeString del_trailing_slash(const UnicodeString& file_path) {
+  if ((file_path.size() < 2) || (file_path.last() != L'\\')) return file_path;
+  else return file_path.left(file_path.size() - 1);
+}
+
+ProgressMonitor::ProgressMonitor(bool lazy): h_scr(NULL) {
+  QueryPerformanceCounter(reinterpret_cast<LARGE_INTEGER*>(&t_curr));
+  t_start = t_curr;
+  QueryPerformanceFrequency(reinterpret_cast<LARGE_INTEGER*>(&t_freq));
+  if (lazy) t_next = t_curr + t_freq / 2;
+  else t_next = t_curr;
+}
+
+ProgressMonitor::~ProgressMonitor() {
+}
+
+void ProgressMonitor::update_ui(bool force) {
+  QueryPerformanceCounter(reinterpret_cast<LARGE_INTEGER*>(&t_curr));
+  if ((t_curr >= t_next) || force) {
+    t_next = t_curr + t_freq / 2;
+    do_update_ui();
+  }
+}
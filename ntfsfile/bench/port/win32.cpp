@@ -0,0 +1,625 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "utils.h"
+
+// Win32 API subset for Linux builds of plugin sources (see headers.hpp).
+// Volume and device functions are not available and fail with ERROR_NOT_SUPPORTED.
+
+static __thread DWORD g_last_error;
+
+DWORD GetLastError() {
+  return g_last_error;
+}
+
+void SetLastError(DWORD code) {
+  g_last_error = code;
+}
+
+size_t port_wcslen(const wchar_t* str) {
+  const wchar_t* end = str;
+  while (*end) end++;
+  return end - str;
+}
+
+int port_wcsnicmp(const wchar_t* str1, const wchar_t* str2, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    wint_t c1 = towupper(static_cast<u16>(str1[i]));
+    wint_t c2 = towupper(static_cast<u16>(str2[i]));
+    if (c1 != c2) return c1 < c2 ? -1 : 1;
+    if (c1 == 0) break;
+  }
+  return 0;
+}
+
+int port_wcsicmp(const wchar_t* str1, const wchar_t* str2) {
+  return port_wcsnicmp(str1, str2, static_cast<size_t>(-1));
+}
+
+const wchar_t* port_wcserror(int code) {
+  static __thread wchar_t msg[256];
+  const char* str = strerror(code);
+  unsigned i = 0;
+  for (; (i + 1 < ARRAYSIZE(msg)) && str[i]; i++) msg[i] = static_cast<u8>(str[i]);
+  msg[i] = 0;
+  return msg;
+}
+
+DWORD FormatMessageW(DWORD flags, const void* source, DWORD code, DWORD lang_id, LPWSTR buffer, DWORD size, va_list* args) {
+  SetLastError(ERROR_NOT_SUPPORTED);
+  return 0;
+}
+
+HLOCAL LocalFree(HLOCAL mem) {
+  free(mem);
+  return NULL;
+}
+
+// size of mapping is kept in the page in front of returned address
+const size_t c_page_size = 0x1000;
+
+LPVOID VirtualAlloc(LPVOID address, SIZE_T size, DWORD alloc_type, DWORD protect) {
+  size_t map_size = size + c_page_size;
+  void* mem = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return NULL;
+  }
+  *static_cast<size_t*>(mem) = map_size;
+  return static_cast<u8*>(mem) + c_page_size;
+}
+
+BOOL VirtualFree(LPVOID address, SIZE_T size, DWORD free_type) {
+  u8* mem = static_cast<u8*>(address) - c_page_size;
+  return munmap(mem, *reinterpret_cast<size_t*>(mem)) == 0;
+}
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER* counter) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  counter->QuadPart = static_cast<LONGLONG>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* freq) {
+  freq->QuadPart = 1000000000;
+  return TRUE;
+}
+
+DWORD CharUpperBuffW(LPWSTR str, DWORD size) {
+  for (DWORD i = 0; i < size; i++) str[i] = static_cast<wchar_t>(towupper(static_cast<u16>(str[i])));
+  return size;
+}
+
+// Events, threads, files and file mappings share one handle type. Waiters are woken through a single
+// condition variable on every state change (few objects, simplicity over throughput).
+struct PortHandle {
+  enum Kind {
+    event,
+    thread,
+    file,
+    mapping // read-only mapping of whole file (fd is duplicate of file descriptor)
+  };
+  Kind kind;
+  bool manual_reset;
+  bool signaled;
+  unsigned ref_cnt; // handle and running thread
+  int fd;
+  bool overlapped;
+  unsigned (*proc)(void*);
+  void* arg;
+  PortHandle(Kind kind): kind(kind), manual_reset(true), signaled(false), ref_cnt(1), fd(-1), overlapped(false), proc(NULL), arg(NULL) {
+  }
+};
+
+static pthread_mutex_t g_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct WaitCond {
+  pthread_cond_t cond;
+  WaitCond() {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond, &attr);
+    pthread_condattr_destroy(&attr);
+  }
+} g_wait;
+
+static PortHandle* port_handle(HANDLE handle) {
+  if ((handle == NULL) || (handle == INVALID_HANDLE_VALUE)) return NULL;
+  return static_cast<PortHandle*>(handle);
+}
+
+// called with g_wait_mutex held
+static void release(PortHandle* h) {
+  if (--h->ref_cnt == 0) delete h;
+}
+
+static void set_signaled(PortHandle* h, bool signaled) {
+  pthread_mutex_lock(&g_wait_mutex);
+  h->signaled = signaled;
+  if (signaled) pthread_cond_broadcast(&g_wait.cond);
+  pthread_mutex_unlock(&g_wait_mutex);
+}
+
+HANDLE CreateEventW(void* security, BOOL manual_reset, BOOL initial_state, LPCWSTR name) {
+  PortHandle* h = new PortHandle(PortHandle::event);
+  h->manual_reset = manual_reset != 0;
+  h->signaled = initial_state != 0;
+  return h;
+}
+
+BOOL SetEvent(HANDLE h_event) {
+  PortHandle* h = port_handle(h_event);
+  if ((h == NULL) || (h->kind != PortHandle::event)) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  set_signaled(h, true);
+  return TRUE;
+}
+
+BOOL ResetEvent(HANDLE h_event) {
+  PortHandle* h = port_handle(h_event);
+  if ((h == NULL) || (h->kind != PortHandle::event)) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  set_signaled(h, false);
+  return TRUE;
+}
+
+// called with g_wait_mutex held; auto-reset events are reset by successful wait
+static bool try_wait(PortHandle* const* hs, DWORD count, BOOL wait_all, DWORD& idx) {
+  if (wait_all) {
+    for (DWORD i = 0; i < count; i++) {
+      if (!hs[i]->signaled) return false;
+    }
+    for (DWORD i = 0; i < count; i++) {
+      if ((hs[i]->kind == PortHandle::event) && !hs[i]->manual_reset) hs[i]->signaled = false;
+    }
+    idx = 0;
+    return true;
+  }
+  for (DWORD i = 0; i < count; i++) {
+    if (hs[i]->signaled) {
+      if ((hs[i]->kind == PortHandle::event) && !hs[i]->manual_reset) hs[i]->signaled = false;
+      idx = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+DWORD WaitForMultipleObjects(DWORD count, const HANDLE* handles, BOOL wait_all, DWORD timeout) {
+  PortHandle* hs[MAXIMUM_WAIT_OBJECTS];
+  if ((count == 0) || (count > MAXIMUM_WAIT_OBJECTS)) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return WAIT_FAILED;
+  }
+  for (DWORD i = 0; i < count; i++) {
+    hs[i] = port_handle(handles[i]);
+    if ((hs[i] == NULL) || ((hs[i]->kind != PortHandle::event) && (hs[i]->kind != PortHandle::thread))) {
+      SetLastError(ERROR_INVALID_HANDLE);
+      return WAIT_FAILED;
+    }
+  }
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  if (timeout != INFINITE) {
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+  DWORD idx;
+  DWORD result = WAIT_TIMEOUT;
+  pthread_mutex_lock(&g_wait_mutex);
+  while (true) {
+    if (try_wait(hs, count, wait_all, idx)) {
+      result = WAIT_OBJECT_0 + idx;
+      break;
+    }
+    if (timeout == INFINITE) pthread_cond_wait(&g_wait.cond, &g_wait_mutex);
+    else if ((timeout == 0) || (pthread_cond_timedwait(&g_wait.cond, &g_wait_mutex, &deadline) == ETIMEDOUT)) {
+      if (try_wait(hs, count, wait_all, idx)) result = WAIT_OBJECT_0 + idx;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_wait_mutex);
+  return result;
+}
+
+DWORD WaitForSingleObject(HANDLE handle, DWORD timeout) {
+  return WaitForMultipleObjects(1, &handle, TRUE, timeout);
+}
+
+static void* thread_proc(void* param) {
+  PortHandle* h = static_cast<PortHandle*>(param);
+  h->proc(h->arg);
+  pthread_mutex_lock(&g_wait_mutex);
+  h->signaled = true;
+  pthread_cond_broadcast(&g_wait.cond);
+  release(h);
+  pthread_mutex_unlock(&g_wait_mutex);
+  return NULL;
+}
+
+// thread handle is signaled when thread exits
+uintptr_t _beginthreadex(void* security, unsigned stack_size, unsigned (*proc)(void*), void* arg, unsigned flags, unsigned* th_id) {
+  static volatile LONG s_th_id = 0;
+  PortHandle* h = new PortHandle(PortHandle::thread);
+  h->ref_cnt = 2;
+  h->proc = proc;
+  h->arg = arg;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t thread;
+  int res = pthread_create(&thread, &attr, thread_proc, h);
+  pthread_attr_destroy(&attr);
+  if (res != 0) {
+    delete h;
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return 0;
+  }
+  if (th_id) *th_id = InterlockedIncrement(&s_th_id);
+  return reinterpret_cast<uintptr_t>(h);
+}
+
+void GetSystemInfo(SYSTEM_INFO* sys_info) {
+  long cpu_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+  sys_info->dwNumberOfProcessors = cpu_cnt > 0 ? static_cast<DWORD>(cpu_cnt) : 1;
+}
+
+DWORD GetTickCount() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<DWORD>(static_cast<u64>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000);
+}
+
+static DWORD errno_to_error(int code) {
+  switch (code) {
+  case ENOENT:
+    return ERROR_FILE_NOT_FOUND;
+  case EACCES:
+  case EPERM:
+    return ERROR_ACCESS_DENIED;
+  case ENOMEM:
+    return ERROR_NOT_ENOUGH_MEMORY;
+  case EBADF:
+    return ERROR_INVALID_HANDLE;
+  default:
+    return ERROR_INVALID_PARAMETER;
+  }
+}
+
+// UTF-8 path, "\\?\" prefix of long paths is removed
+static std::string port_path(LPCWSTR file_name) {
+  if ((file_name[0] == L'\\') && (file_name[1] == L'\\') && (file_name[2] == L'?') && (file_name[3] == L'\\')) file_name += 4;
+  std::string path;
+  for (; *file_name; file_name++) {
+    wchar_t c = *file_name;
+    if (c < 0x80) path += static_cast<char>(c);
+    else if (c < 0x800) {
+      path += static_cast<char>(0xC0 | (c >> 6));
+      path += static_cast<char>(0x80 | (c & 0x3F));
+    }
+    else {
+      path += static_cast<char>(0xE0 | (c >> 12));
+      path += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+      path += static_cast<char>(0x80 | (c & 0x3F));
+    }
+  }
+  return path;
+}
+
+// existing files are opened for reading, new files are created for writing (CREATE_ALWAYS)
+HANDLE CreateFileW(LPCWSTR file_name, DWORD access, DWORD share_mode, void* security, DWORD disposition, DWORD flags, HANDLE templ) {
+  int open_flags;
+  if ((disposition == OPEN_EXISTING) && !(access & GENERIC_WRITE)) open_flags = O_RDONLY;
+  else if (disposition == CREATE_ALWAYS) open_flags = (access & GENERIC_READ ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+  else {
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return INVALID_HANDLE_VALUE;
+  }
+  int fd = open(port_path(file_name).c_str(), open_flags, 0644);
+  if (fd == -1) {
+    SetLastError(errno_to_error(errno));
+    return INVALID_HANDLE_VALUE;
+  }
+  PortHandle* h = new PortHandle(PortHandle::file);
+  h->fd = fd;
+  h->overlapped = (flags & FILE_FLAG_OVERLAPPED) != 0;
+  return h;
+}
+
+BOOL CloseHandle(HANDLE handle) {
+  PortHandle* h = port_handle(handle);
+  if (h == NULL) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  if ((h->kind == PortHandle::file) || (h->kind == PortHandle::mapping)) close(h->fd);
+  pthread_mutex_lock(&g_wait_mutex);
+  release(h);
+  pthread_mutex_unlock(&g_wait_mutex);
+  return TRUE;
+}
+
+// returns number of bytes read, -1 on error (errno is set)
+static ssize_t read_at(int fd, void* buffer, DWORD size, u64 pos) {
+  DWORD bytes_read = 0;
+  while (bytes_read < size) {
+    ssize_t res = pread(fd, static_cast<u8*>(buffer) + bytes_read, size - bytes_read, pos + bytes_read);
+    if ((res == -1) && (errno == EINTR)) continue;
+    if (res == -1) return -1;
+    if (res == 0) break; // end of file
+    bytes_read += static_cast<DWORD>(res);
+  }
+  return bytes_read;
+}
+
+// Overlapped reads are completed by a fixed set of I/O threads in submission order,
+// up to c_io_thread_cnt reads are in progress at once.
+const unsigned c_io_thread_cnt = 16;
+const uintptr_t c_status_pending = 0x103;
+
+struct IoRequest {
+  int fd;
+  void* buffer;
+  DWORD size;
+  u64 pos;
+  OVERLAPPED* ov;
+};
+
+static pthread_mutex_t g_io_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_io_cond = PTHREAD_COND_INITIALIZER;
+static std::list<IoRequest> g_io_queue;
+static bool g_io_started = false;
+
+static void* io_thread_proc(void* param) {
+  while (true) {
+    pthread_mutex_lock(&g_io_mutex);
+    while (g_io_queue.empty()) pthread_cond_wait(&g_io_cond, &g_io_mutex);
+    IoRequest rq = g_io_queue.front();
+    g_io_queue.pop_front();
+    pthread_mutex_unlock(&g_io_mutex);
+    ssize_t res = read_at(rq.fd, rq.buffer, rq.size, rq.pos);
+    DWORD error = res == -1 ? errno_to_error(errno) : ((res == 0) && (rq.size != 0) ? ERROR_HANDLE_EOF : ERROR_SUCCESS);
+    rq.ov->InternalHigh = res == -1 ? 0 : res;
+    __atomic_store_n(&rq.ov->Internal, static_cast<uintptr_t>(error), __ATOMIC_RELEASE);
+    if (rq.ov->hEvent) SetEvent(rq.ov->hEvent);
+  }
+  return NULL;
+}
+
+static bool start_io_threads() {
+  pthread_mutex_lock(&g_io_mutex);
+  bool ok = true;
+  for (unsigned i = 0; !g_io_started && ok && (i < c_io_thread_cnt); i++) {
+    pthread_t thread;
+    ok = pthread_create(&thread, NULL, io_thread_proc, NULL) == 0;
+    if (ok) pthread_detach(thread);
+  }
+  if (ok) g_io_started = true;
+  pthread_mutex_unlock(&g_io_mutex);
+  return ok;
+}
+
+// Reads at OVERLAPPED offset; handles opened with FILE_FLAG_OVERLAPPED complete asynchronously.
+// Read past end of file fails with ERROR_HANDLE_EOF.
+BOOL ReadFile(HANDLE handle, LPVOID buffer, DWORD size, DWORD* bytes_read, OVERLAPPED* ov) {
+  PortHandle* h = port_handle(handle);
+  if ((h == NULL) || (h->kind != PortHandle::file) || (ov == NULL)) {
+    SetLastError(h == NULL ? ERROR_INVALID_HANDLE : ERROR_NOT_SUPPORTED);
+    return FALSE;
+  }
+  u64 pos = ov->Offset | (static_cast<u64>(ov->OffsetHigh) << 32);
+  if (!h->overlapped) {
+    ssize_t res = read_at(h->fd, buffer, size, pos);
+    if (res == -1) {
+      SetLastError(errno_to_error(errno));
+      return FALSE;
+    }
+    if ((res == 0) && (size != 0)) {
+      SetLastError(ERROR_HANDLE_EOF);
+      return FALSE;
+    }
+    if (bytes_read) *bytes_read = static_cast<DWORD>(res);
+    return TRUE;
+  }
+  if (!start_io_threads()) {
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return FALSE;
+  }
+  if (ov->hEvent) ResetEvent(ov->hEvent);
+  ov->Internal = c_status_pending;
+  ov->InternalHigh = 0;
+  IoRequest rq = { h->fd, buffer, size, pos, ov };
+  pthread_mutex_lock(&g_io_mutex);
+  g_io_queue.push_back(rq);
+  pthread_cond_signal(&g_io_cond);
+  pthread_mutex_unlock(&g_io_mutex);
+  SetLastError(ERROR_IO_PENDING);
+  return FALSE;
+}
+
+BOOL GetOverlappedResult(HANDLE handle, OVERLAPPED* ov, DWORD* size, BOOL wait) {
+  if (wait && ov->hEvent && (WaitForSingleObject(ov->hEvent, INFINITE) != WAIT_OBJECT_0)) return FALSE;
+  uintptr_t status = __atomic_load_n(&ov->Internal, __ATOMIC_ACQUIRE);
+  if (status == c_status_pending) {
+    SetLastError(ERROR_IO_INCOMPLETE);
+    return FALSE;
+  }
+  *size = static_cast<DWORD>(ov->InternalHigh);
+  if (status != ERROR_SUCCESS) {
+    SetLastError(static_cast<DWORD>(status));
+    return FALSE;
+  }
+  return TRUE;
+}
+
+// Writes at current file position, overlapped writes are not supported.
+BOOL WriteFile(HANDLE handle, const void* buffer, DWORD size, DWORD* bytes_written, OVERLAPPED* ov) {
+  PortHandle* h = port_handle(handle);
+  if ((h == NULL) || (h->kind != PortHandle::file) || (ov != NULL)) {
+    SetLastError(h == NULL ? ERROR_INVALID_HANDLE : ERROR_NOT_SUPPORTED);
+    return FALSE;
+  }
+  DWORD size_written = 0;
+  while (size_written < size) {
+    ssize_t res = write(h->fd, static_cast<const u8*>(buffer) + size_written, size - size_written);
+    if ((res == -1) && (errno == EINTR)) continue;
+    if (res == -1) {
+      SetLastError(errno_to_error(errno));
+      return FALSE;
+    }
+    size_written += static_cast<DWORD>(res);
+  }
+  if (bytes_written) *bytes_written = size_written;
+  return TRUE;
+}
+
+BOOL SetFilePointerEx(HANDLE handle, LARGE_INTEGER distance, LARGE_INTEGER* new_pos, DWORD method) {
+  PortHandle* h = port_handle(handle);
+  if ((h == NULL) || (h->kind != PortHandle::file)) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  int whence = method == FILE_BEGIN ? SEEK_SET : (method == FILE_CURRENT ? SEEK_CUR : SEEK_END);
+  off_t pos = lseek(h->fd, distance.QuadPart, whence);
+  if (pos == -1) {
+    SetLastError(errno_to_error(errno));
+    return FALSE;
+  }
+  if (new_pos) new_pos->QuadPart = pos;
+  return TRUE;
+}
+
+BOOL GetFileSizeEx(HANDLE handle, LARGE_INTEGER* size) {
+  PortHandle* h = port_handle(handle);
+  struct stat st;
+  if ((h == NULL) || (h->kind != PortHandle::file) || (fstat(h->fd, &st) == -1)) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return FALSE;
+  }
+  size->QuadPart = st.st_size;
+  return TRUE;
+}
+
+// existing file is always replaced
+BOOL MoveFileExW(LPCWSTR src_name, LPCWSTR dst_name, DWORD flags) {
+  if (rename(port_path(src_name).c_str(), port_path(dst_name).c_str()) == -1) {
+    SetLastError(errno_to_error(errno));
+    return FALSE;
+  }
+  return TRUE;
+}
+
+BOOL DeleteFileW(LPCWSTR file_name) {
+  if (unlink(port_path(file_name).c_str()) == -1) {
+    SetLastError(errno_to_error(errno));
+    return FALSE;
+  }
+  return TRUE;
+}
+
+// Only read-only mappings of whole file are supported. Views are private file mmaps, their
+// sizes are kept for UnmapViewOfFile.
+static pthread_mutex_t g_view_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<const void*, size_t> g_view_sizes;
+
+HANDLE CreateFileMappingW(HANDLE h_file, void* security, DWORD protect, DWORD size_high, DWORD size_low, LPCWSTR name) {
+  PortHandle* h = port_handle(h_file);
+  if ((h == NULL) || (h->kind != PortHandle::file)) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return NULL;
+  }
+  if ((protect != PAGE_READONLY) || size_high || size_low) {
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return NULL;
+  }
+  int fd = dup(h->fd);
+  if (fd == -1) {
+    SetLastError(errno_to_error(errno));
+    return NULL;
+  }
+  PortHandle* h_mapping = new PortHandle(PortHandle::mapping);
+  h_mapping->fd = fd;
+  return h_mapping;
+}
+
+LPVOID MapViewOfFile(HANDLE h_mapping, DWORD access, DWORD offset_high, DWORD offset_low, SIZE_T size) {
+  PortHandle* h = port_handle(h_mapping);
+  struct stat st;
+  if ((h == NULL) || (h->kind != PortHandle::mapping) || (fstat(h->fd, &st) == -1)) {
+    SetLastError(ERROR_INVALID_HANDLE);
+    return NULL;
+  }
+  if ((access != FILE_MAP_READ) || offset_high || offset_low || size || (st.st_size == 0)) {
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return NULL;
+  }
+  void* view = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, h->fd, 0);
+  if (view == MAP_FAILED) {
+    SetLastError(errno_to_error(errno));
+    return NULL;
+  }
+  pthread_mutex_lock(&g_view_mutex);
+  g_view_sizes[view] = st.st_size;
+  pthread_mutex_unlock(&g_view_mutex);
+  return view;
+}
+
+BOOL UnmapViewOfFile(const void* address) {
+  pthread_mutex_lock(&g_view_mutex);
+  std::map<const void*, size_t>::iterator view = g_view_sizes.find(address);
+  bool found = view != g_view_sizes.end();
+  size_t size = found ? view->second : 0;
+  if (found) g_view_sizes.erase(view);
+  pthread_mutex_unlock(&g_view_mutex);
+  if (!found || (munmap(const_cast<void*>(address), size) == -1)) {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+// queued reads are not cancelled, they complete normally
+BOOL CancelIo(HANDLE handle) {
+  return TRUE;
+}
+
+BOOL FlushFileBuffers(HANDLE handle) {
+  SetLastError(ERROR_INVALID_HANDLE);
+  return FALSE;
+}
+
+BOOL (*g_device_io_control)(HANDLE handle, DWORD code, LPVOID in_buf, DWORD in_size, LPVOID out_buf, DWORD out_size, DWORD* bytes_ret) = NULL;
+
+BOOL DeviceIoControl(HANDLE handle, DWORD code, LPVOID in_buf, DWORD in_size, LPVOID out_buf, DWORD out_size, DWORD* bytes_ret, OVERLAPPED* ov) {
+  if (g_device_io_control) return g_device_io_control(handle, code, in_buf, in_size, out_buf, out_size, bytes_ret);
+  SetLastError(ERROR_NOT_SUPPORTED);
+  return FALSE;
+}
+
+BOOL GetVolumeInformationW(LPCWSTR root, LPWSTR label, DWORD label_size, DWORD* serial, DWORD* max_comp_len, DWORD* flags, LPWSTR fs_name, DWORD fs_name_size) {
+  SetLastError(ERROR_NOT_SUPPORTED);
+  return FALSE;
+}
+
+BOOL GetDiskFreeSpaceW(LPCWSTR root, DWORD* sectors_per_cluster, DWORD* bytes_per_sector, DWORD* free_clusters, DWORD* total_clusters) {
+  SetLastError(ERROR_NOT_SUPPORTED);
+  return FALSE;
+}
+
+BOOL GetVolumeNameForVolumeMountPointW(LPCWSTR mount_point, LPWSTR volume_name, DWORD size) {
+  SetLastError(ERROR_NOT_SUPPORTED);
+  return FALSE;
+}
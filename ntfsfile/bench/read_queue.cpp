@@ -0,0 +1,126 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include <unistd.h>
+
+#include "utils.h"
+#include "read_queue.h"
+#include "bench.h"
+
+// ReadQueue throughput and data order with different queue depths and block sizes.
+// Overlapped reads are completed by POSIX threads of the port (see port/win32.cpp), so only
+// scheduling is measured; file is read through page cache unless it is larger than memory.
+// A file to read may be given as argument, otherwise a temporary file is generated.
+
+// position dependent hash of data stream (blocks except the last one must be multiples of 8 bytes)
+class StreamHash {
+private:
+  u64 hash;
+public:
+  StreamHash(): hash(0) {
+  }
+  void update(const u8* data, unsigned size) {
+    unsigned i = 0;
+    for (; i + sizeof(u64) <= size; i += sizeof(u64)) {
+      u64 word;
+      memcpy(&word, data + i, sizeof(word));
+      hash = (hash + word + 1) * 0x100000001B3ULL;
+    }
+    for (; i < size; i++) hash = (hash + data[i] + 1) * 0x100000001B3ULL;
+  }
+  u64 value() const {
+    return hash;
+  }
+};
+
+static u64 hash_file(const char* file_path, u64& file_size) {
+  FILE* file = fopen(file_path, "rb");
+  CHECK(file != NULL);
+  Array<u8> buffer;
+  u8* buf = buffer.buf(1024 * 1024);
+  StreamHash hash;
+  file_size = 0;
+  size_t size;
+  while ((size = fread(buf, 1, 1024 * 1024, file)) != 0) {
+    hash.update(buf, static_cast<unsigned>(size));
+    file_size += size;
+  }
+  fclose(file);
+  return hash.value();
+}
+
+static void read_file(const char* file_path, u64 file_size, unsigned depth, unsigned max_block_size, u64 expected_hash) {
+  HANDLE h_file = CreateFileW(widen(file_path).data(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING, NULL);
+  CHECK_SYS(h_file != INVALID_HANDLE_VALUE);
+  Array<u8> buffer_data;
+  u8* buffers = buffer_data.buf(depth * max_block_size);
+  Array<unsigned> free_bufs;
+  for (unsigned i = 0; i < depth; i++) free_bufs += i;
+  StreamHash hash;
+  u64 total_size = 0;
+  unsigned block_size;
+  double t_start = time_now();
+  {
+    ReadQueue queue(h_file, file_size, depth, max_block_size);
+    while (queue.active()) {
+      while (queue.can_submit()) {
+        unsigned buf_idx = free_bufs.last();
+        free_bufs.remove(free_bufs.size() - 1);
+        queue.submit(buffers + buf_idx * max_block_size, buf_idx);
+      }
+      unsigned size;
+      unsigned buf_idx = queue.complete(size);
+      hash.update(buffers + buf_idx * max_block_size, size);
+      total_size += size;
+      free_bufs += buf_idx;
+    }
+    block_size = queue.get_block_size();
+  }
+  double time = time_now() - t_start;
+  CloseHandle(h_file);
+  CHECK(total_size == file_size);
+  CHECK(hash.value() == expected_hash);
+  printf("depth %2u, max. block %5u KB: %8.1f MB/s, last block %5u KB\n", depth, max_block_size / 1024, file_size / time / 1e6, block_size / 1024);
+}
+
+static void read_queue(int argc, char* argv[]) {
+  char file_path[] = "/tmp/read_queue_XXXXXX";
+  const char* read_path = file_path;
+  if (argc > 1) read_path = argv[1];
+  else {
+    // size is not a multiple of block size: last read is short
+    int fd = mkstemp(file_path);
+    CHECK(fd != -1);
+    close(fd);
+    FILE* file = fopen(file_path, "wb");
+    CHECK(file != NULL);
+    Random rnd(1);
+    Array<u8> data;
+    u8* buf = data.buf(1024 * 1024);
+    for (unsigned i = 0; i < 64; i++) {
+      rnd.fill(buf, 1024 * 1024);
+      CHECK(fwrite(buf, 1, 1024 * 1024, file) == 1024 * 1024);
+    }
+    CHECK(fwrite(buf, 1, 12345, file) == 12345);
+    CHECK(fclose(file) == 0);
+  }
+  try {
+    u64 file_size;
+    u64 expected_hash = hash_file(read_path, file_size);
+    // single 64 KB read in flight (old content analysis behavior), then deeper queues with adaptive blocks
+    read_file(read_path, file_size, 1, ReadQueue::c_min_block_size, expected_hash);
+    read_file(read_path, file_size, 1, ReadQueue::c_max_block_size, expected_hash);
+    read_file(read_path, file_size, ReadQueue::c_depth, ReadQueue::c_min_block_size, expected_hash);
+    read_file(read_path, file_size, ReadQueue::c_depth, ReadQueue::get_max_block_size(ReadQueue::c_depth), expected_hash);
+    read_file(read_path, file_size, 16, ReadQueue::get_max_block_size(16), expected_hash);
+  }
+  catch (...) {
+    if (read_path == file_path) unlink(file_path);
+    throw;
+  }
+  if (read_path == file_path) unlink(file_path);
+}
+
+int main(int argc, char* argv[]) {
+  return run_bench(read_queue, argc, argv);
+}
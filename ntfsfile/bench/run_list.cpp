@@ -0,0 +1,224 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include "utils.h"
+#include "ntfs.h"
+#include "volume.h"
+#include "ntfs_file.h"
+#include "bench.h"
+
+// FileInfo::decode_data_runs(): runs and fragment counts must match the byte-at-a-time decoder it
+// replaced. Random mapping pairs use every field width (including wider than needed), sparse runs
+// and negative LCN deltas. Some lists end exactly at the end of record, so the last fields are
+// decoded without wide loads.
+// Decode time per run is printed for old decoder (new array per call), new one (runs appended to
+// reused array) and fragment counting alone (process_attribute() does not store runs).
+
+typedef FileInfo::DataRun DataRun;
+
+const unsigned c_pairs_off = sizeof(ATTR_HEADER) + sizeof(ATTR_NONRESIDENT);
+
+// decode_data_runs() before wide loads
+static Array<DataRun> old_decode_data_runs(const MftRecView& file_rec, unsigned attr_off) {
+  Array<DataRun> data_run_list;
+  const ATTR_NONRESIDENT* attr_info = file_rec.attr_info<ATTR_NONRESIDENT>(attr_off);
+  const u8* data_runs = file_rec.data();
+  unsigned size = file_rec.size();
+  unsigned idx = attr_off + attr_info->mapping_pairs_offset;
+  data_run_list.extend((size - idx) / 3);
+  u64 lcn = 0;
+  while (true) {
+    CHECK(idx < size);
+    if (data_runs[idx] == 0) break; // end marker
+    unsigned len_l = data_runs[idx] & 0x0F;
+    unsigned off_l = (data_runs[idx] & 0xF0) >> 4;
+    idx++;
+    CHECK(idx + len_l + off_l <= size);
+    u64 len = 0;
+    unsigned i;
+    for (i = 0; i < len_l; i++) {
+      len += static_cast<u64>(data_runs[idx++]) << (i * 8);
+    }
+    if (off_l == 0) {
+      data_run_list += DataRun(-1, len); // sparse
+      continue;
+    }
+    s64 off = 0;
+    for (i = 0; i + 1 < off_l; i++) {
+      off |= static_cast<u64>(data_runs[idx++]) << (i * 8);
+    }
+    off |= static_cast<s64>(static_cast<s8>(data_runs[idx++])) << (i * 8);
+    lcn = lcn + off;
+    data_run_list += DataRun(lcn, len);
+  }
+  return data_run_list;
+}
+
+// fragment count of process_attribute() before RunStats
+static u64 count_fragments(const Array<DataRun>& data_runs, u64& prev_lcn, u64& prev_len) {
+  u64 fragments = 0;
+  for (unsigned i = 0; i < data_runs.size(); i++) {
+    if (data_runs[i].lcn == -1) continue;
+    if (prev_lcn + prev_len != data_runs[i].lcn) fragments++;
+    prev_lcn = data_runs[i].lcn;
+    prev_len = data_runs[i].len;
+  }
+  return fragments;
+}
+
+static unsigned field_width(u64 value, bool is_signed) {
+  unsigned width = 1;
+  if (is_signed) {
+    s64 v = static_cast<s64>(value);
+    while ((width < 8) && ((v < -(1LL << (width * 8 - 1))) || (v >= (1LL << (width * 8 - 1))))) width++;
+  }
+  else {
+    while ((width < 8) && (value >> (width * 8))) width++;
+  }
+  return width;
+}
+
+// random value of 1..8 significant bytes, small values are more frequent
+static u64 random_value(Random& rnd) {
+  unsigned bits = rnd.next(4) ? rnd.next(16) + 1 : rnd.next(64) + 1;
+  return rnd.next() & (bits == 64 ? -1 : (1ULL << bits) - 1);
+}
+
+// Attribute at offset 0 of record, mapping pairs of run_cnt random runs follow attribute header.
+// If tail is set, end marker is the last byte of record.
+static void make_attr(Array<u8>& rec, unsigned run_cnt, bool tail, Random& rnd) {
+  Array<u8> pairs;
+  u64 lcn = 0;
+  for (unsigned i = 0; i < run_cnt; i++) {
+    u64 len = random_value(rnd) + 1;
+    unsigned len_l = field_width(len, false);
+    if (rnd.next(8) == 0) len_l += rnd.next(9 - len_l);
+    unsigned off_l = 0;
+    u64 off = 0;
+    if (rnd.next(8) != 0) { // not sparse
+      off = random_value(rnd);
+      if (rnd.next(2)) off = -static_cast<s64>(off);
+      if (lcn + off == -1) off++; // LCN -1 marks sparse run in decoded list
+      lcn += off;
+      off_l = field_width(off, true);
+      if (rnd.next(8) == 0) off_l += rnd.next(9 - off_l);
+    }
+    pairs += static_cast<u8>(off_l << 4 | len_l);
+    for (unsigned j = 0; j < len_l; j++) pairs += static_cast<u8>(len >> (j * 8));
+    for (unsigned j = 0; j < off_l; j++) pairs += static_cast<u8>(off >> (j * 8));
+  }
+  pairs += static_cast<u8>(0);
+  unsigned rec_size = c_pairs_off + pairs.size() + (tail ? 0 : rnd.next(64) + 8);
+  memset(rec.buf(rec_size), 0, rec_size);
+  rec.set_size(rec_size);
+  ATTR_HEADER* header = reinterpret_cast<ATTR_HEADER*>(rec.buf());
+  header->type = AT_DATA;
+  header->length = rec_size;
+  header->non_resident = 1;
+  ATTR_NONRESIDENT* info = reinterpret_cast<ATTR_NONRESIDENT*>(header + 1);
+  info->mapping_pairs_offset = c_pairs_off;
+  memcpy(rec.buf() + c_pairs_off, pairs.data(), pairs.size());
+}
+
+static bool same_runs(const DataRun* runs1, const DataRun* runs2, unsigned cnt) {
+  for (unsigned i = 0; i < cnt; i++) {
+    if ((runs1[i].lcn != runs2[i].lcn) || (runs1[i].len != runs2[i].len)) return false;
+  }
+  return true;
+}
+
+static bool decode_fails(const Array<u8>& rec) {
+  Array<DataRun> runs;
+  try {
+    FileInfo::decode_data_runs(MftRecView(rec), 0, &runs);
+  }
+  catch (Error&) {
+    return true;
+  }
+  return false;
+}
+
+static void check_decoder(Random& rnd) {
+  Array<u8> rec1, rec2;
+  Array<DataRun> arena;
+  for (unsigned i = 0; i < 100000; i++) {
+    // two extents of one attribute, decoded into the same array
+    make_attr(rec1, rnd.next(48), rnd.next(4) == 0, rnd);
+    make_attr(rec2, rnd.next(48), rnd.next(4) == 0, rnd);
+    Array<DataRun> expected1 = old_decode_data_runs(MftRecView(rec1), 0);
+    Array<DataRun> expected2 = old_decode_data_runs(MftRecView(rec2), 0);
+    arena.clear();
+    FileInfo::RunStats stats;
+    FileInfo::decode_data_runs(MftRecView(rec1), 0, &arena, &stats);
+    FileInfo::decode_data_runs(MftRecView(rec2), 0, &arena, &stats);
+    CHECK(arena.size() == expected1.size() + expected2.size());
+    CHECK(same_runs(arena.data(), expected1.data(), expected1.size()));
+    CHECK(same_runs(arena.data() + expected1.size(), expected2.data(), expected2.size()));
+    u64 prev_lcn = 0, prev_len = 0;
+    u64 fragments = count_fragments(expected1, prev_lcn, prev_len);
+    fragments += count_fragments(expected2, prev_lcn, prev_len);
+    CHECK(stats.fragments == fragments);
+  }
+
+  // field wider than 8 bytes, pairs running past the end of record, missing end marker
+  make_attr(rec1, 1, true, rnd);
+  rec1.item(c_pairs_off) = 0x19;
+  CHECK(decode_fails(rec1));
+  make_attr(rec1, 4, true, rnd);
+  rec1.set_size(rec1.size() - 2);
+  CHECK(decode_fails(rec1));
+  make_attr(rec1, 4, true, rnd);
+  rec1.set_size(rec1.size() - 1);
+  CHECK(decode_fails(rec1));
+}
+
+static void run_list(int argc, char* argv[]) {
+  Random rnd(1);
+  check_decoder(rnd);
+
+  // fragmented files: 16 runs per extent, records with free space after attribute
+  const unsigned c_attr_cnt = 10000;
+  const unsigned c_pass_cnt = 50;
+  ObjectArray<Array<u8> > attrs;
+  u64 run_cnt = 0;
+  for (unsigned i = 0; i < c_attr_cnt; i++) {
+    Array<u8> rec;
+    make_attr(rec, 16, false, rnd);
+    run_cnt += old_decode_data_runs(MftRecView(rec), 0).size();
+    attrs += rec;
+  }
+  run_cnt *= c_pass_cnt;
+  u64 check_sum[2] = {};
+  double t0 = time_now();
+  for (unsigned pass = 0; pass < c_pass_cnt; pass++) {
+    for (unsigned i = 0; i < attrs.size(); i++) {
+      Array<DataRun> runs = old_decode_data_runs(MftRecView(attrs[i]), 0);
+      check_sum[0] += runs.last().lcn;
+    }
+  }
+  double t1 = time_now();
+  Array<DataRun> arena;
+  for (unsigned pass = 0; pass < c_pass_cnt; pass++) {
+    for (unsigned i = 0; i < attrs.size(); i++) {
+      arena.clear();
+      FileInfo::decode_data_runs(MftRecView(attrs[i]), 0, &arena);
+      check_sum[1] += arena.last().lcn;
+    }
+  }
+  double t2 = time_now();
+  u64 fragments = 0;
+  for (unsigned pass = 0; pass < c_pass_cnt; pass++) {
+    for (unsigned i = 0; i < attrs.size(); i++) {
+      FileInfo::RunStats stats;
+      FileInfo::decode_data_runs(MftRecView(attrs[i]), 0, NULL, &stats);
+      fragments += stats.fragments;
+    }
+  }
+  double t3 = time_now();
+  CHECK(check_sum[0] == check_sum[1]);
+  printf("decode per run: old %.1f ns, new %.1f ns, fragment count only %.1f ns (%llu fragments)\n", (t1 - t0) * 1e9 / run_cnt, (t2 - t1) * 1e9 / run_cnt, (t3 - t2) * 1e9 / run_cnt, static_cast<unsigned long long>(fragments));
+}
+
+int main(int argc, char* argv[]) {
+  return run_bench(run_list, argc, argv);
+}
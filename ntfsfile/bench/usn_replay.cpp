@@ -0,0 +1,202 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include <unistd.h>
+
+#include "utils.h"
+#include "ntfs.h"
+#include "volume.h"
+#include "volume_io.h"
+#include "ntfs_file.h"
+#include "mft_reader.h"
+#include "mft_index.h"
+#include "mft_scan.h"
+#include "usn_journal.h"
+#include "bench.h"
+#include "ntfs_image.h"
+
+// USN replay: changes of volume image are recorded as USN stream, replayed with RecordedUsnJournal
+// and merged into index the same way as live update does (FilePanel::load_file_records() and
+// MftIndex::update()). Updated index must be equal to index built by a fresh scan of changed image.
+
+static void open_image(NtfsVolume& volume, const NtfsImage& image, const char* file_path) {
+  image.write(file_path);
+  volume.open_image(new PosixFileBackend(file_path), L"image");
+}
+
+// records of changed files loaded through MftReader (deleted records are still readable and are skipped)
+static void load_file_records(NtfsVolume& volume, const std::set<u64>& file_refs, std::list<FileRecord>& file_list, bool show_streams) {
+  MftReader mft_reader(volume, 0);
+  FileInfo file_info;
+  file_info.volume = &volume;
+  file_info.mft_reader = &mft_reader;
+  for (std::set<u64>::const_iterator file_ref = file_refs.begin(); file_ref != file_refs.end(); file_ref++) {
+    if (*file_ref >= mft_reader.record_count()) continue;
+    file_info.load_base_file_rec(*file_ref);
+    const MFT_RECORD* mft_rec = file_info.base_mft_rec();
+    if ((mft_rec->flags & MFT_RECORD_IN_USE) && (mft_rec->base_mft_record == 0)) {
+      file_info.process_base_file_rec();
+      add_file_records(file_list, file_info, show_streams, false);
+    }
+  }
+}
+
+static void compare_totals(const MftTotals& totals1, const MftTotals& totals2) {
+  CHECK(totals1.data_size == totals2.data_size);
+  CHECK(totals1.disk_size == totals2.disk_size);
+  CHECK(totals1.fragment_cnt == totals2.fragment_cnt);
+  CHECK(totals1.file_cnt == totals2.file_cnt);
+  CHECK(totals1.dir_cnt == totals2.dir_cnt);
+  CHECK(totals1.hl_cnt == totals2.hl_cnt);
+  CHECK(totals1.file_rp_cnt == totals2.file_rp_cnt);
+  CHECK(totals1.dir_rp_cnt == totals2.dir_rp_cnt);
+}
+
+// both indexes are sorted by (parent, name), so equal indexes have equal records at every position
+static void compare_indexes(const MftIndex& index, const MftIndex& expected, u64 seed) {
+  CHECK(index.size() == expected.size());
+  for (unsigned i = 0; i < index.size(); i++) {
+    CHECK(index.file_ref_num(i) == expected.file_ref_num(i));
+    CHECK(index.parent_ref_num(i) == expected.parent_ref_num(i));
+    CHECK(index.file_name(i) == expected.file_name(i));
+    CHECK(index.file_attr(i) == expected.file_attr(i));
+    CHECK(memcmp(&index.creation_time(i), &expected.creation_time(i), sizeof(FILETIME)) == 0);
+    CHECK(memcmp(&index.last_access_time(i), &expected.last_access_time(i), sizeof(FILETIME)) == 0);
+    CHECK(memcmp(&index.last_write_time(i), &expected.last_write_time(i), sizeof(FILETIME)) == 0);
+    CHECK(index.data_size(i) == expected.data_size(i));
+    CHECK(index.disk_size(i) == expected.disk_size(i));
+    CHECK(index.valid_size(i) == expected.valid_size(i));
+    CHECK(index.fragment_cnt(i) == expected.fragment_cnt(i));
+    CHECK(index.mft_rec_cnt(i) == expected.mft_rec_cnt(i));
+    CHECK(index.stream_cnt(i) == expected.stream_cnt(i));
+    CHECK(index.hard_link_cnt(i) == expected.hard_link_cnt(i));
+    CHECK(index.flags(i) == expected.flags(i));
+  }
+
+  // lookup tables
+  CHECK(index.find_root() == expected.find_root());
+  CHECK(index.end_file_ref() == expected.end_file_ref());
+  for (unsigned i = 0; i < expected.size(); i++) {
+    CHECK(index.find(expected.parent_ref_num(i), expected.file_name(i)) == i);
+    u64 ref = FILE_REF(expected.file_ref_num(i));
+    CHECK(index.find_dir(ref) == expected.find_dir(ref));
+    unsigned first_idx, end_idx, exp_first_idx, exp_end_idx;
+    index.get_children(ref, first_idx, end_idx);
+    expected.get_children(ref, exp_first_idx, exp_end_idx);
+    CHECK((first_idx == exp_first_idx) && (end_idx == exp_end_idx));
+  }
+  for (u64 ref = 0; ref < expected.end_file_ref(); ref++) {
+    const u32* rec_idxs;
+    const u32* exp_rec_idxs;
+    unsigned rec_cnt, exp_rec_cnt;
+    index.get_file_records(ref, rec_idxs, rec_cnt);
+    expected.get_file_records(ref, exp_rec_idxs, exp_rec_cnt);
+    CHECK(rec_cnt == exp_rec_cnt);
+    std::set<u32> recs(rec_idxs, rec_idxs + rec_cnt);
+    CHECK(recs == std::set<u32>(exp_rec_idxs, exp_rec_idxs + exp_rec_cnt));
+  }
+
+  // totals of root contents and of random selections (directory totals and hard links)
+  u64 root = expected.find_root();
+  unsigned first_idx, end_idx;
+  expected.get_children(root, first_idx, end_idx);
+  Array<unsigned> rec_idxs;
+  for (unsigned i = first_idx; i < end_idx; i++) {
+    if (FILE_REF(expected.file_ref_num(i)) != FILE_REF(root)) rec_idxs.add(i);
+  }
+  compare_totals(index.get_totals(rec_idxs), expected.get_totals(rec_idxs));
+  Random rnd(seed);
+  for (unsigned i = 0; i < 100; i++) {
+    rec_idxs.clear();
+    unsigned cnt = rnd.next(8) + 1;
+    for (unsigned j = 0; j < cnt; j++) rec_idxs.add(rnd.next(expected.size()));
+    compare_totals(index.get_totals(rec_idxs), expected.get_totals(rec_idxs));
+  }
+}
+
+static void replay_changes(NtfsImage& image, MftIndex& mft_index, const char* file_path, unsigned change_cnt, bool show_streams, u64 seed) {
+  image.clear_usn_records();
+  USN start_usn = image.next_usn;
+  change_tree(image, change_cnt, seed);
+
+  NtfsVolume volume;
+  open_image(volume, image, file_path);
+
+  double t_start = time_now();
+  RecordedUsnJournal journal(image.journal_id, image.usn_records);
+  USN end_usn = start_usn;
+  std::set<u64> file_refs;
+  read_usn_changes(journal, image.journal_id, end_usn, file_refs);
+  CHECK(end_usn == image.next_usn);
+  std::list<FileRecord> file_list;
+  load_file_records(volume, file_refs, file_list, show_streams);
+  mft_index.update(file_refs, file_list);
+  double t_update = time_now() - t_start;
+
+  // nothing left to read
+  std::set<u64> more_refs;
+  read_usn_changes(journal, image.journal_id, end_usn, more_refs);
+  CHECK(more_refs.empty() && (end_usn == image.next_usn));
+
+  t_start = time_now();
+  MftIndex expected;
+  std::list<FileRecord> scan_list;
+  scan_volume(volume, scan_list, show_streams);
+  build_index(expected, scan_list);
+  double t_scan = time_now() - t_start;
+
+  compare_indexes(mft_index, expected, seed);
+  printf("%u changes (%u files, %u USN bytes): update %.2f ms, fresh scan %.2f ms\n", change_cnt, static_cast<unsigned>(file_refs.size()), image.usn_records.size(), t_update * 1000, t_scan * 1000);
+}
+
+static void usn_replay(int argc, char* argv[]) {
+  unsigned file_cnt = argc > 1 ? atoi(argv[1]) : 20000;
+  char file_path[] = "/tmp/usn_replay_XXXXXX";
+  int fd = mkstemp(file_path);
+  CHECK(fd != -1);
+  close(fd);
+  try {
+    for (unsigned show_streams = 0; show_streams < 2; show_streams++) {
+      NtfsImage image(file_cnt * 2);
+      generate_tree(image, file_cnt, 1 + show_streams);
+
+      MftIndex mft_index;
+      {
+        NtfsVolume volume;
+        open_image(volume, image, file_path);
+        std::list<FileRecord> file_list;
+        scan_volume(volume, file_list, show_streams != 0);
+        build_index(mft_index, file_list);
+      }
+      printf("%u records, streams %s\n", mft_index.size(), show_streams ? "on" : "off");
+
+      // cache file round trip: lookup tables are taken from sections
+      Array<MftIndexSection> sections;
+      mft_index.get_sections(sections);
+      MftIndex loaded_index;
+      CHECK(loaded_index.set_sections(sections));
+      compare_indexes(loaded_index, mft_index, 1);
+      MftIndex copy;
+      copy.copy(mft_index);
+      compare_indexes(copy, mft_index, 2);
+
+      // small batches patch lookup tables, large ones rebuild them
+      const unsigned c_change_cnts[] = { 1, 5, 20, 100, 1000, file_cnt / 2 };
+      for (unsigned i = 0; i < ARRAYSIZE(c_change_cnts); i++) {
+        replay_changes(image, mft_index, file_path, c_change_cnts[i], show_streams != 0, 100 + i);
+      }
+
+      // copy taken for cache compaction is not changed by updates of source index
+      compare_indexes(copy, loaded_index, 2);
+    }
+  }
+  catch (...) {
+    unlink(file_path);
+    throw;
+  }
+  unlink(file_path);
+}
+
+int main(int argc, char* argv[]) {
+  return run_bench(usn_replay, argc, argv);
+}
@@ -0,0 +1,235 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include <unistd.h>
+
+#include "utils.h"
+#include "volume.h"
+#include "volume_io.h"
+#include "bench.h"
+
+// BlockCache: cached reads must return the same data as backend,
+// blocks read while cache is invalidated must not be stored.
+// NtfsVolume::flush() must drop cached blocks only if volume has changed.
+
+// volume data in memory; contents can be changed between reads
+class MemoryBackend: public VolumeBackend {
+public:
+  Array<u8> data;
+  CriticalSection sync;
+  // called in the middle of every read (simulates concurrent volume change)
+  void (*read_hook)(MemoryBackend& backend);
+  void* hook_param;
+  MemoryBackend(): read_hook(NULL), hook_param(NULL) {
+  }
+  virtual unsigned read(u64 pos, void* buffer, unsigned size) {
+    unsigned copy_size;
+    {
+      CriticalSectionLock lock(sync);
+      if (pos >= data.size()) return 0;
+      copy_size = static_cast<unsigned>(min<u64>(size, data.size() - pos));
+      memcpy(buffer, data.data() + pos, copy_size);
+    }
+    if (read_hook) read_hook(*this);
+    return copy_size;
+  }
+  // every byte of volume is set to stamp
+  void fill(u8 stamp) {
+    CriticalSectionLock lock(sync);
+    memset(data.buf(), stamp, data.size());
+  }
+};
+
+static void compare_reads(VolumeBackend& backend, BlockCache& cache, unsigned volume_size, unsigned read_cnt, u64 seed) {
+  Random rnd(seed);
+  Array<u8> expected, actual;
+  for (unsigned i = 0; i < read_cnt; i++) {
+    // mix of small random reads, sequential runs and reads past the end
+    u64 pos = i % 4 == 0 ? (i / 4) * 4096 % volume_size : rnd.next(volume_size + 4096);
+    unsigned size = i % 16 == 0 ? rnd.next(1024 * 1024) + 1 : rnd.next(16 * 1024) + 1;
+    unsigned expected_size = backend.read(pos, expected.buf(size), size);
+    unsigned actual_size = cache.read(pos, actual.buf(size), size);
+    CHECK(actual_size == expected_size);
+    CHECK(memcmp(actual.data(), expected.data(), actual_size) == 0);
+  }
+}
+
+static void invalidate_during_read(MemoryBackend& backend) {
+  BlockCache* cache = static_cast<BlockCache*>(backend.hook_param);
+  backend.read_hook = NULL;
+  backend.fill(2);
+  cache->invalidate();
+}
+
+struct StressParam {
+  MemoryBackend* backend;
+  BlockCache* cache;
+  volatile bool stop;
+  u8 last_stamp;
+};
+
+// volume contents are changed and cache is invalidated while readers are running
+static void* writer_proc(void* param) {
+  StressParam* stress = static_cast<StressParam*>(param);
+  for (unsigned i = 0; i < 500; i++) {
+    stress->last_stamp = static_cast<u8>(10 + i % 200);
+    stress->backend->fill(stress->last_stamp);
+    stress->cache->invalidate();
+    usleep(50);
+  }
+  stress->stop = true;
+  return NULL;
+}
+
+static void* reader_proc(void* param) {
+  StressParam* stress = static_cast<StressParam*>(param);
+  Random rnd(reinterpret_cast<uintptr_t>(&rnd));
+  u8 buffer[8192];
+  while (!stress->stop) {
+    unsigned size = rnd.next(sizeof(buffer)) + 1;
+    stress->cache->read(rnd.next(stress->backend->data.size() - size), buffer, size);
+  }
+  return NULL;
+}
+
+// live volume USN journal (FSCTL_QUERY_USN_JOURNAL)
+static USN_JOURNAL_DATA g_journal;
+static bool g_journal_active;
+
+static BOOL query_journal(HANDLE handle, DWORD code, LPVOID in_buf, DWORD in_size, LPVOID out_buf, DWORD out_size, DWORD* bytes_ret) {
+  if (code != FSCTL_QUERY_USN_JOURNAL) {
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+  }
+  if (!g_journal_active) {
+    SetLastError(ERROR_JOURNAL_NOT_ACTIVE);
+    return FALSE;
+  }
+  CHECK(out_size >= sizeof(g_journal));
+  memcpy(out_buf, &g_journal, sizeof(g_journal));
+  *bytes_ret = sizeof(g_journal);
+  return TRUE;
+}
+
+static u8 read_volume(NtfsVolume& volume) {
+  u8 value;
+  volume.flush();
+  volume.read(12345, &value, 1);
+  return value;
+}
+
+static void test(int argc, char* argv[]) {
+  const unsigned c_volume_size = 16 * 1024 * 1024 + 1000; // partial block at the end
+  MemoryBackend backend;
+  Random(1).fill(backend.data.buf(c_volume_size), c_volume_size);
+  backend.data.set_size(c_volume_size);
+
+  {
+    BlockCache cache(backend, 64 * 1024, 64);
+    compare_reads(backend, cache, c_volume_size, 20000, 2);
+    printf("random reads: %llu hits, %llu misses\n", static_cast<unsigned long long>(cache.hit_cnt), static_cast<unsigned long long>(cache.miss_cnt));
+    cache.invalidate();
+    compare_reads(backend, cache, c_volume_size, 1000, 3);
+  }
+
+  // volume is changed and cache invalidated after block is read from backend but before it is stored
+  {
+    BlockCache cache(backend, 64 * 1024, 64);
+    backend.fill(1);
+    backend.hook_param = &cache;
+    backend.read_hook = invalidate_during_read;
+    u8 value;
+    CHECK(cache.read(100, &value, 1) == 1);
+    CHECK(value == 1); // data read before invalidation is returned to caller
+    CHECK(cache.read(100, &value, 1) == 1);
+    CHECK(value == 2); // but not cached
+  }
+
+  // concurrent readers and invalidation: once readers are stopped, cache must hold only current data
+  {
+    MemoryBackend small_backend;
+    small_backend.data.extend(1024 * 1024);
+    small_backend.data.set_size(1024 * 1024);
+    BlockCache cache(small_backend, 4096, 64, 4);
+    StressParam stress;
+    stress.backend = &small_backend;
+    stress.cache = &cache;
+    stress.stop = false;
+    const unsigned c_reader_cnt = 4;
+    pthread_t threads[c_reader_cnt + 1];
+    for (unsigned i = 0; i < c_reader_cnt; i++) CHECK(pthread_create(&threads[i], NULL, reader_proc, &stress) == 0);
+    CHECK(pthread_create(&threads[c_reader_cnt], NULL, writer_proc, &stress) == 0);
+    for (unsigned i = 0; i <= c_reader_cnt; i++) pthread_join(threads[i], NULL);
+    u8 buffer[4096];
+    for (u64 pos = 0; pos < small_backend.data.size(); pos += sizeof(buffer)) {
+      CHECK(cache.read(pos, buffer, sizeof(buffer)) == sizeof(buffer));
+      for (unsigned i = 0; i < sizeof(buffer); i++) CHECK(buffer[i] == stress.last_stamp);
+    }
+    printf("stress: %llu hits, %llu misses\n", static_cast<unsigned long long>(cache.hit_cnt), static_cast<unsigned long long>(cache.miss_cnt));
+  }
+
+  // live volume: cached blocks are kept while USN journal does not move
+  {
+    MemoryBackend* volume_backend = new MemoryBackend();
+    volume_backend->data.extend(1024 * 1024);
+    volume_backend->data.set_size(1024 * 1024);
+    volume_backend->fill(1);
+    NtfsVolume volume;
+    volume.name = L"test";
+    volume.synced = false;
+    volume.backend = volume_backend;
+    volume.cache = new BlockCache(*volume_backend);
+    g_device_io_control = query_journal;
+    memzero(g_journal);
+    g_journal.UsnJournalID = 1;
+    g_journal.NextUsn = 1000;
+    g_journal_active = true;
+    CHECK(read_volume(volume) == 1);
+    volume_backend->fill(2); // not seen by journal
+    for (unsigned i = 0; i < 1000; i++) CHECK(read_volume(volume) == 1);
+    CHECK(volume.cache->hit_cnt == 1000);
+    g_journal.NextUsn += 96;
+    CHECK(read_volume(volume) == 2);
+    volume_backend->fill(3);
+    g_journal.UsnJournalID = 2; // journal recreated
+    CHECK(read_volume(volume) == 3);
+
+    // no journal: flushed only if synced is reset
+    g_journal_active = false;
+    volume_backend->fill(4);
+    CHECK(read_volume(volume) == 3);
+    volume.synced = false;
+    CHECK(read_volume(volume) == 4);
+    g_device_io_control = NULL;
+  }
+
+  // image file backend
+  {
+    char file_path[] = "/tmp/volume_cache_XXXXXX";
+    int fd = mkstemp(file_path);
+    CHECK(fd != -1);
+    Random(4).fill(backend.data.buf(), backend.data.size());
+    CHECK(write(fd, backend.data.data(), backend.data.size()) == static_cast<ssize_t>(backend.data.size()));
+    ::close(fd);
+    PosixFileBackend file_backend(file_path);
+    unlink(file_path);
+    BlockCache cache(file_backend);
+    compare_reads(backend, cache, c_volume_size, 5000, 5);
+
+    // small reads: direct from file vs cached
+    const unsigned c_read_cnt = 200000;
+    Random rnd(6);
+    u8 buffer[512];
+    double t0 = time_now();
+    for (unsigned i = 0; i < c_read_cnt; i++) file_backend.read(rnd.next(c_volume_size / 512) * 512, buffer, sizeof(buffer));
+    double t1 = time_now();
+    rnd = Random(6);
+    for (unsigned i = 0; i < c_read_cnt; i++) cache.read(rnd.next(c_volume_size / 512) * 512, buffer, sizeof(buffer));
+    double t2 = time_now();
+    printf("512 byte random reads: pread %.0f ns, cache %.0f ns\n", (t1 - t0) * 1e9 / c_read_cnt, (t2 - t1) * 1e9 / c_read_cnt);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  return run_bench(test, argc, argv);
+}
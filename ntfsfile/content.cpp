@@ -6,10 +6,16 @@
 #include "utils.h"
 #include "options.h"
 #include "dlgapi.h"
+#include "ntfs.h"
+#include "volume.h"
+#include "mft_index.h"
+#include "name_search.h"
+#include "file_panel.h"
+#include "crc.h"
+#include "mb_hash.h"
+#include "read_queue.h"
 #include "content.h"
 
-#include "crc16.cpp"
-
 extern struct PluginStartupInfo g_far;
 extern Array<FarColor> g_colors;
 
@@ -39,6 +45,24 @@ public:
 
 #define CHECK_LZO(code) { int __err = (code); if (__err != LZO_E_OK) FAIL(LzoError(__err)); }
 
+// compression ratio is estimated on blocks of NTFS compression unit size (16 clusters)
+const unsigned c_comp_block_size = 16 * 4 * 1024;
+// output buffer size required to compress one block
+const unsigned c_comp_buffer_size = c_comp_block_size + c_comp_block_size / 16 + 64 + 3;
+
+// LZO compressed size of data, every block is compressed independently
+// (incompressible block is counted as stored)
+unsigned compressed_size(const u8* data, unsigned size, u8* comp_buffer, u8* work_buffer) {
+  unsigned comp_size = 0;
+  for (unsigned pos = 0; pos < size; pos += c_comp_block_size) {
+    unsigned block_size = min(size - pos, c_comp_block_size);
+    lzo_uint block_comp_size;
+    CHECK_LZO(lzo1x_1_compress(data + pos, block_size, comp_buffer, &block_comp_size, work_buffer));
+    comp_size += min(static_cast<unsigned>(block_comp_size), block_size);
+  }
+  return comp_size;
+}
+
 struct OptionsDlgData {
   // control ids
   int compression_ctrl_id;
@@ -59,49 +83,39 @@ intptr_t WINAPI options_dlg_proc(HANDLE h_dlg, intptr_t msg, intptr_t param1, vo
   FarDialog* dlg = FarDialog::get_dlg(h_dlg);
   const OptionsDlgData* dlg_data = (const OptionsDlgData*) dlg->get_dlg_data(0);
   ContentOptions* options = (ContentOptions*) dlg->get_dlg_data(1);
-  bool single_file = *(bool*) dlg->get_dlg_data(2);
-  if (single_file) {
-    if (msg == DN_BTNCLICK) {
-      if (param1 == dlg_data->set_all_ctrl_id) {
-        dlg->set_check(dlg_data->compression_ctrl_id, true);
-        dlg->set_check(dlg_data->crc32_ctrl_id, true);
-        dlg->set_check(dlg_data->md5_ctrl_id, true);
-        dlg->set_check(dlg_data->sha1_ctrl_id, true);
-        dlg->set_check(dlg_data->sha256_ctrl_id, true);
-        dlg->set_check(dlg_data->ed2k_ctrl_id, true);
-        dlg->set_check(dlg_data->crc16_ctrl_id, true);
-        dlg->set_focus(dlg_data->ok_ctrl_id);
-        return TRUE;
-      }
-      else if (param1 == dlg_data->reset_all_ctrl_id) {
-        dlg->set_check(dlg_data->compression_ctrl_id, false);
-        dlg->set_check(dlg_data->crc32_ctrl_id, false);
-        dlg->set_check(dlg_data->md5_ctrl_id, false);
-        dlg->set_check(dlg_data->sha1_ctrl_id, false);
-        dlg->set_check(dlg_data->sha256_ctrl_id, false);
-        dlg->set_check(dlg_data->ed2k_ctrl_id, false);
-        dlg->set_check(dlg_data->crc16_ctrl_id, false);
-        dlg->set_focus(dlg_data->ok_ctrl_id);
-        return TRUE;
-      }
+  if (msg == DN_BTNCLICK) {
+    if (param1 == dlg_data->set_all_ctrl_id) {
+      dlg->set_check(dlg_data->compression_ctrl_id, true);
+      dlg->set_check(dlg_data->crc32_ctrl_id, true);
+      dlg->set_check(dlg_data->md5_ctrl_id, true);
+      dlg->set_check(dlg_data->sha1_ctrl_id, true);
+      dlg->set_check(dlg_data->sha256_ctrl_id, true);
+      dlg->set_check(dlg_data->ed2k_ctrl_id, true);
+      dlg->set_check(dlg_data->crc16_ctrl_id, true);
+      dlg->set_focus(dlg_data->ok_ctrl_id);
+      return TRUE;
     }
-    else if ((msg == DN_CLOSE) && (param1 >= 0) && (param1 != dlg_data->cancel_ctrl_id)) {
-      // fill options structrure
-      options->compression = dlg->get_check(dlg_data->compression_ctrl_id);
-      options->crc32 = dlg->get_check(dlg_data->crc32_ctrl_id);
-      options->md5 = dlg->get_check(dlg_data->md5_ctrl_id);
-      options->sha1 = dlg->get_check(dlg_data->sha1_ctrl_id);
-      options->sha256 = dlg->get_check(dlg_data->sha256_ctrl_id);
-      options->ed2k = dlg->get_check(dlg_data->ed2k_ctrl_id);
-      options->crc16 = dlg->get_check(dlg_data->crc16_ctrl_id);
+    else if (param1 == dlg_data->reset_all_ctrl_id) {
+      dlg->set_check(dlg_data->compression_ctrl_id, false);
+      dlg->set_check(dlg_data->crc32_ctrl_id, false);
+      dlg->set_check(dlg_data->md5_ctrl_id, false);
+      dlg->set_check(dlg_data->sha1_ctrl_id, false);
+      dlg->set_check(dlg_data->sha256_ctrl_id, false);
+      dlg->set_check(dlg_data->ed2k_ctrl_id, false);
+      dlg->set_check(dlg_data->crc16_ctrl_id, false);
+      dlg->set_focus(dlg_data->ok_ctrl_id);
+      return TRUE;
     }
   }
-  else {
-    if (msg == DN_INITDIALOG) {
-      dlg->set_check(dlg_data->compression_ctrl_id, true);
-      dlg->enable(dlg_data->compression_ctrl_id, false);
-      return FALSE;
-    }
+  else if ((msg == DN_CLOSE) && (param1 >= 0) && (param1 != dlg_data->cancel_ctrl_id)) {
+    // fill options structrure
+    options->compression = dlg->get_check(dlg_data->compression_ctrl_id);
+    options->crc32 = dlg->get_check(dlg_data->crc32_ctrl_id);
+    options->md5 = dlg->get_check(dlg_data->md5_ctrl_id);
+    options->sha1 = dlg->get_check(dlg_data->sha1_ctrl_id);
+    options->sha256 = dlg->get_check(dlg_data->sha256_ctrl_id);
+    options->ed2k = dlg->get_check(dlg_data->ed2k_ctrl_id);
+    options->crc16 = dlg->get_check(dlg_data->crc16_ctrl_id);
   }
   END_ERROR_HANDLER(;,;);
   return g_far.DefDlgProc(h_dlg, msg, param1, param2);
@@ -110,34 +124,31 @@ intptr_t WINAPI options_dlg_proc(HANDLE h_dlg, intptr_t msg, intptr_t param1, vo
 // show content analysis options dialog
 // returns false if user cancelled dialog
 // fills 'options' structure otherwise
-bool show_options_dialog(ContentOptions& options, bool single_file) {
+bool show_options_dialog(ContentOptions& options) {
   FarDialog dlg(c_content_options_dialog_guid, far_get_msg(MSG_CONTENT_SETTINGS_TITLE), 30);
   OptionsDlgData dlg_data;
   dlg.add_dlg_data(&dlg_data);
   dlg.add_dlg_data(&options);
-  dlg.add_dlg_data(&single_file);
 
   dlg_data.compression_ctrl_id = dlg.check_box(far_get_msg(MSG_CONTENT_SETTINGS_COMPRESSION), options.compression);
   dlg.new_line();
-  if (single_file) {
-    dlg_data.crc32_ctrl_id = dlg.check_box(far_get_msg(MSG_CONTENT_SETTINGS_CRC32), options.crc32);
-    dlg.new_line();
-    dlg_data.md5_ctrl_id = dlg.check_box(far_get_msg(MSG_CONTENT_SETTINGS_MD5), options.md5);
-    dlg.new_line();
-    dlg_data.sha1_ctrl_id = dlg.check_box(far_get_msg(MSG_CONTENT_SETTINGS_SHA1), options.sha1);
-    dlg.new_line();
-    dlg_data.sha256_ctrl_id = dlg.check_box(far_get_msg(MSG_CONTENT_SETTINGS_SHA256), options.sha256);
-    dlg.new_line();
-    dlg_data.ed2k_ctrl_id = dlg.check_box(far_get_msg(MSG_CONTENT_SETTINGS_ED2K), options.ed2k);
-    dlg.new_line();
-    dlg_data.crc16_ctrl_id = dlg.check_box(far_get_msg(MSG_CONTENT_SETTINGS_CRC16), options.crc16);
-    dlg.new_line();
+  dlg_data.crc32_ctrl_id = dlg.check_box(far_get_msg(MSG_CONTENT_SETTINGS_CRC32), options.crc32);
+  dlg.new_line();
+  dlg_data.md5_ctrl_id = dlg.check_box(far_get_msg(MSG_CONTENT_SETTINGS_MD5), options.md5);
+  dlg.new_line();
+  dlg_data.sha1_ctrl_id = dlg.check_box(far_get_msg(MSG_CONTENT_SETTINGS_SHA1), options.sha1);
+  dlg.new_line();
+  dlg_data.sha256_ctrl_id = dlg.check_box(far_get_msg(MSG_CONTENT_SETTINGS_SHA256), options.sha256);
+  dlg.new_line();
+  dlg_data.ed2k_ctrl_id = dlg.check_box(far_get_msg(MSG_CONTENT_SETTINGS_ED2K), options.ed2k);
+  dlg.new_line();
+  dlg_data.crc16_ctrl_id = dlg.check_box(far_get_msg(MSG_CONTENT_SETTINGS_CRC16), options.crc16);
+  dlg.new_line();
 
-    // Set & Reset All buttons
-    dlg_data.set_all_ctrl_id = dlg.button(far_get_msg(MSG_CONTENT_SETTINGS_SET_ALL), DIF_CENTERGROUP | DIF_BTNNOCLOSE);
-    dlg_data.reset_all_ctrl_id = dlg.button(far_get_msg(MSG_CONTENT_SETTINGS_RESET_ALL), DIF_CENTERGROUP | DIF_BTNNOCLOSE);
-    dlg.new_line();
-  }
+  // Set & Reset All buttons
+  dlg_data.set_all_ctrl_id = dlg.button(far_get_msg(MSG_CONTENT_SETTINGS_SET_ALL), DIF_CENTERGROUP | DIF_BTNNOCLOSE);
+  dlg_data.reset_all_ctrl_id = dlg.button(far_get_msg(MSG_CONTENT_SETTINGS_RESET_ALL), DIF_CENTERGROUP | DIF_BTNNOCLOSE);
+  dlg.new_line();
 
   dlg.separator();
   dlg.new_line();
@@ -166,6 +177,18 @@ UnicodeString ed2k_extract_hash_from_url(const UnicodeString& url) {
   return UnicodeString(url.data() + p, p_end - p);
 }
 
+// selected hashes in text form, one per line
+AnsiString format_hash_lines(const ContentOptions& options, const ContentInfo& info) {
+  AnsiString lines;
+  if (options.crc32) lines += "CRC32: " + unicode_to_oem(format_hex_array(info.crc32)) + "\n";
+  if (options.md5) lines += "MD5: " + unicode_to_oem(format_hex_array(info.md5)) + "\n";
+  if (options.sha1) lines += "SHA1: " + unicode_to_oem(format_hex_array(info.sha1)) + "\n";
+  if (options.sha256) lines += "SHA256: " + unicode_to_oem(format_hex_array(info.sha256)) + "\n";
+  if (options.ed2k) lines += "ED2K: " + unicode_to_oem(format_hex_array(info.ed2k)) + "\n";
+  if (options.crc16) lines += "CRC16: " + unicode_to_oem(format_hex_array(info.crc16)) + "\n";
+  return lines;
+}
+
 void save_hashes_to_file(const UnicodeString& file_name, const ContentOptions& options, const ContentInfo& info) {
   UnicodeString hashes_file_name = file_name + L".hashes";
   if (GetFileAttributesW(hashes_file_name.data()) != INVALID_FILE_ATTRIBUTES) { // file already exists
@@ -174,31 +197,9 @@ void save_hashes_to_file(const UnicodeString& file_name, const ContentOptions& o
   HANDLE h_file = CreateFileW(hashes_file_name.data(), FILE_WRITE_DATA, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
   CHECK_SYS(h_file != INVALID_HANDLE_VALUE);
   CLEAN(HANDLE, h_file, CloseHandle(h_file));
+  AnsiString lines = format_hash_lines(options, info);
   DWORD bw;
-  if (options.crc32) {
-    AnsiString line = "CRC32: " + unicode_to_oem(format_hex_array(info.crc32)) + "\n";
-    CHECK_SYS(WriteFile(h_file, line.data(), line.size(), &bw, NULL));
-  }
-  if (options.md5) {
-    AnsiString line = "MD5: " + unicode_to_oem(format_hex_array(info.md5)) + "\n";
-    CHECK_SYS(WriteFile(h_file, line.data(), line.size(), &bw, NULL));
-  }
-  if (options.sha1) {
-    AnsiString line = "SHA1: " + unicode_to_oem(format_hex_array(info.sha1)) + "\n";
-    CHECK_SYS(WriteFile(h_file, line.data(), line.size(), &bw, NULL));
-  }
-  if (options.sha256) {
-    AnsiString line = "SHA256: " + unicode_to_oem(format_hex_array(info.sha256)) + "\n";
-    CHECK_SYS(WriteFile(h_file, line.data(), line.size(), &bw, NULL));
-  }
-  if (options.ed2k) {
-    AnsiString line = "ED2K: " + unicode_to_oem(format_hex_array(info.ed2k)) + "\n";
-    CHECK_SYS(WriteFile(h_file, line.data(), line.size(), &bw, NULL));
-  }
-  if (options.crc16) {
-    AnsiString line = "CRC16: " + unicode_to_oem(format_hex_array(info.crc16)) + "\n";
-    CHECK_SYS(WriteFile(h_file, line.data(), line.size(), &bw, NULL));
-  }
+  CHECK_SYS(WriteFile(h_file, lines.data(), lines.size(), &bw, NULL));
   far_message(c_file_saved_dialog_guid, far_get_msg(MSG_CONTENT_RESULT_TITLE) + L"\n" + word_wrap(far_get_msg(MSG_CONTENT_RESULT_FILE_SAVED), get_msg_width()) + L"\n" + far_get_msg(MSG_BUTTON_OK), 1);
 }
 
@@ -447,25 +448,6 @@ enum BufState {
   bs_processing,
 };
 
-struct SharedData {
-  unsigned num_th;
-  unsigned num_buf;
-  Array<BufState> buffer_state;
-  u8* buffer;
-  unsigned buffer_size;
-  Array<unsigned> buffer_data_size;
-  u8* comp_buffer;
-  unsigned comp_buffer_size;
-  u8* comp_work_buffer;
-  unsigned comp_work_buffer_size;
-  HANDLE h_stop_event;
-  CRITICAL_SECTION sync;
-  HANDLE h_io_ready_sem;
-  HANDLE h_proc_ready_sem;
-  u64 data_size;
-  u64 comp_size;
-};
-
 template<typename Data> bool compress_buffer(Data* d) {
   unsigned buf_idx;
   EnterCriticalSection(&d->sync);
@@ -476,13 +458,12 @@ template<typename Data> bool compress_buffer(Data* d) {
   finally (LeaveCriticalSection(&d->sync));
   if (buf_idx == -1) return false;
 
-  lzo_uint comp_size;
-  CHECK_LZO(lzo1x_1_compress(d->buffer + buf_idx * d->buffer_size, d->buffer_data_size[buf_idx], d->comp_buffer + buf_idx * d->comp_buffer_size, &comp_size, d->comp_work_buffer + buf_idx * d->comp_work_buffer_size));
+  unsigned comp_size = compressed_size(d->buffer + buf_idx * d->buffer_size, d->buffer_data_size[buf_idx], d->comp_buffer + buf_idx * c_comp_buffer_size, d->comp_work_buffer + buf_idx * LZO1X_1_MEM_COMPRESS);
 
   EnterCriticalSection(&d->sync);
   try {
     // update stats
-    d->comp_size += min(comp_size, d->buffer_data_size[buf_idx]);
+    d->comp_size += comp_size;
     d->data_size += d->buffer_data_size[buf_idx];
     // mark buffer ready for I/O
     d->buffer_state.item(buf_idx) = bs_io_ready;
@@ -517,6 +498,234 @@ template<typename Data> unsigned __stdcall wth_proc(void* wth_param) {
   }
 }
 
+// File data buffers shared by all consumers of content analysis.
+// Every buffer holds reference count of pending consumers and returns to I/O thread when it drops to zero.
+struct ContentBuffers: private NonCopyable {
+  unsigned buffer_size;
+  unsigned num_buf;
+  u8* data;
+  Array<unsigned> data_size; // amount of data in every buffer
+  Array<LONG> ref_cnt; // 0 - buffer is ready for I/O
+  Semaphore free_sem; // counts buffers ready for I/O
+  Event stop_event; // processing is aborted
+  CriticalSection sync; // protects statistics below
+  u64 proc_size; // data released by all consumers
+  u64 comp_size; // compressed data size
+  ContentBuffers(unsigned buffer_size, unsigned num_buf);
+  ~ContentBuffers();
+  u8* buffer(unsigned buf_idx) const {
+    return data + buf_idx * buffer_size;
+  }
+  // find buffer ready for I/O (free_sem must be acquired)
+  unsigned acquire();
+  // drop one reference to buffer
+  void release(unsigned buf_idx);
+};
+
+ContentBuffers::ContentBuffers(unsigned buffer_size, unsigned num_buf): buffer_size(buffer_size), num_buf(num_buf), free_sem(num_buf, num_buf), stop_event(true, false), proc_size(0), comp_size(0) {
+  for (unsigned i = 0; i < num_buf; i++) {
+    data_size += 0;
+    ref_cnt += 0;
+  }
+  data = (u8*) VirtualAlloc(NULL, buffer_size * num_buf, MEM_COMMIT, PAGE_READWRITE);
+  CHECK_SYS(data != NULL);
+}
+
+ContentBuffers::~ContentBuffers() {
+  VERIFY(VirtualFree(data, 0, MEM_RELEASE) != 0);
+}
+
+unsigned ContentBuffers::acquire() {
+  unsigned buf_idx = ref_cnt.search(0);
+  assert(buf_idx != -1);
+  ref_cnt.item(buf_idx) = 1;
+  return buf_idx;
+}
+
+void ContentBuffers::release(unsigned buf_idx) {
+  if (InterlockedDecrement(&ref_cnt.item(buf_idx)) == 0) {
+    {
+      CriticalSectionLock lock(sync);
+      proc_size += data_size[buf_idx];
+    }
+    CHECK_SYS(ReleaseSemaphore(free_sem.handle(), 1, NULL) != 0);
+  }
+}
+
+// Consumer of file data running on its own threads.
+// Buffers are queued in file order; stage with one thread processes them in the same order.
+class ContentStage: private NonCopyable {
+private:
+  unsigned num_th;
+  Semaphore ready_sem; // counts queued buffers
+  Array<unsigned> queue; // ring of queued buffers (-1 - end of data)
+  volatile LONG queue_head;
+  unsigned queue_tail;
+  volatile LONG th_cnt;
+  static unsigned __stdcall th_proc(void* param);
+protected:
+  ContentBuffers& buffers;
+  virtual void process(const u8* data, unsigned size, unsigned th_idx) = 0;
+public:
+  ContentStage(ContentBuffers& buffers, unsigned num_th);
+  virtual ~ContentStage() {
+  }
+  // create stage threads, handles are added to h_threads
+  void start(Array<HANDLE>& h_threads);
+  // I/O thread: pass buffer to stage (buffer reference is owned by stage until processed)
+  void push(unsigned buf_idx);
+  // I/O thread: no more data, threads exit after processing queued buffers
+  void finish() {
+    for (unsigned i = 0; i < num_th; i++) push(-1);
+  }
+};
+
+ContentStage::ContentStage(ContentBuffers& buffers, unsigned num_th): num_th(num_th), ready_sem(0, buffers.num_buf + num_th), queue_head(0), queue_tail(0), th_cnt(0), buffers(buffers) {
+  // every buffer is queued once at most plus end markers
+  for (unsigned i = 0; i < buffers.num_buf + num_th; i++) {
+    queue += -1;
+  }
+}
+
+unsigned __stdcall ContentStage::th_proc(void* param) {
+  try {
+    ContentStage* stage = (ContentStage*) param;
+    unsigned th_idx = InterlockedIncrement(&stage->th_cnt) - 1;
+    while (true) {
+      HANDLE h[2] = { stage->buffers.stop_event.handle(), stage->ready_sem.handle() };
+      DWORD w = WaitForMultipleObjects(2, h, FALSE, INFINITE);
+      CHECK_SYS(w != WAIT_FAILED);
+      if (w == WAIT_OBJECT_0) break;
+      unsigned buf_idx = stage->queue[(InterlockedIncrement(&stage->queue_head) - 1) % stage->queue.size()];
+      if (buf_idx == -1) break;
+      stage->process(stage->buffers.buffer(buf_idx), stage->buffers.data_size[buf_idx], th_idx);
+      stage->buffers.release(buf_idx);
+    }
+    return TRUE;
+  }
+  catch (...) {
+    return FALSE;
+  }
+}
+
+void ContentStage::start(Array<HANDLE>& h_threads) {
+  for (unsigned i = 0; i < num_th; i++) {
+    unsigned th_id;
+    HANDLE h = (HANDLE) _beginthreadex(NULL, 0, th_proc, this, 0, &th_id);
+    CHECK_SYS(h != NULL);
+    h_threads += h;
+  }
+}
+
+void ContentStage::push(unsigned buf_idx) {
+  queue.item(queue_tail % queue.size()) = buf_idx;
+  queue_tail++;
+  CHECK_SYS(ReleaseSemaphore(ready_sem.handle(), 1, NULL) != 0);
+}
+
+enum ContentHash {
+  ch_crc32,
+  ch_md5,
+  ch_sha1,
+  ch_sha256,
+  ch_ed2k,
+  ch_crc16,
+};
+
+// running value of single hash
+class HashContext {
+private:
+  ContentHash hash;
+  u32 crc32;
+  MD5_CTX md5_ctx;
+  SHA_CTX sha1_ctx;
+  SHA256_CTX sha256_ctx;
+  Array<u8> ed2k_block_hashes;
+  unsigned ed2k_last_block_slack;
+  MD4_CTX md4_ctx;
+  u16 crc16;
+public:
+  HashContext(ContentHash hash): hash(hash), crc32(0), ed2k_last_block_slack(0), crc16(c_crc16_init) {
+    MD5_Init(&md5_ctx);
+    SHA1_Init(&sha1_ctx);
+    SHA256_Init(&sha256_ctx);
+  }
+  void update(const u8* data, unsigned size) {
+    if (hash == ch_crc32) crc32 = crc32_update(crc32, data, size);
+    else if (hash == ch_md5) MD5_Update(&md5_ctx, data, size);
+    else if (hash == ch_sha1) SHA1_Update(&sha1_ctx, data, size);
+    else if (hash == ch_sha256) SHA256_Update(&sha256_ctx, data, size);
+    else if (hash == ch_ed2k) ed2k_update_block_hashes(data, size, ed2k_block_hashes, ed2k_last_block_slack, md4_ctx);
+    else if (hash == ch_crc16) crc16 = crc16_update(crc16, data, size);
+  }
+  // store hash value (context cannot be updated after that)
+  void finalize(ContentInfo& result) {
+    if (hash == ch_crc32) {
+      const u8* c = (const u8*) &crc32;
+      result.crc32.copy(c[3]).add(c[2]).add(c[1]).add(c[0]);
+    }
+    else if (hash == ch_md5) {
+      u8 md5[MD5_DIGEST_LENGTH];
+      MD5_Final(md5, &md5_ctx);
+      result.md5.copy(md5, sizeof(md5));
+    }
+    else if (hash == ch_sha1) {
+      u8 sha1[SHA_DIGEST_LENGTH];
+      SHA1_Final(sha1, &sha1_ctx);
+      result.sha1.copy(sha1, sizeof(sha1));
+    }
+    else if (hash == ch_sha256) {
+      u8 sha256[SHA256_DIGEST_LENGTH];
+      SHA256_Final(sha256, &sha256_ctx);
+      result.sha256.copy(sha256, sizeof(sha256));
+    }
+    else if (hash == ch_ed2k) {
+      result.ed2k = ed2k_finalize_block_hashes(ed2k_block_hashes, ed2k_last_block_slack, md4_ctx);
+    }
+    else if (hash == ch_crc16) {
+      const u8* c = (const u8*) &crc16;
+      result.crc16.copy(c[1]).add(c[0]);
+    }
+  }
+};
+
+// single hash calculated sequentially over whole file
+class HashStage: public ContentStage {
+private:
+  HashContext context;
+protected:
+  virtual void process(const u8* data, unsigned size, unsigned th_idx) {
+    context.update(data, size);
+  }
+public:
+  HashStage(ContentBuffers& buffers, ContentHash hash): ContentStage(buffers, 1), context(hash) {
+  }
+  // store hash value (stage threads must be finished)
+  void finalize(ContentInfo& result) {
+    context.finalize(result);
+  }
+};
+
+// LZO compression ratio estimation, buffers are compressed independently on several threads
+class CompressionStage: public ContentStage {
+private:
+  u8* comp_buffers; // output buffer of every thread
+  u8* work_buffers; // work memory of every thread
+  Array<u8> comp_buffer_data;
+  Array<u8> work_buffer_data;
+protected:
+  virtual void process(const u8* data, unsigned size, unsigned th_idx) {
+    unsigned comp_size = compressed_size(data, size, comp_buffers + th_idx * c_comp_buffer_size, work_buffers + th_idx * LZO1X_1_MEM_COMPRESS);
+    CriticalSectionLock lock(buffers.sync);
+    buffers.comp_size += comp_size;
+  }
+public:
+  CompressionStage(ContentBuffers& buffers, unsigned num_th): ContentStage(buffers, num_th) {
+    comp_buffers = comp_buffer_data.buf(c_comp_buffer_size * num_th);
+    work_buffers = work_buffer_data.buf(LZO1X_1_MEM_COMPRESS * num_th);
+  }
+};
+
 class ProcessFileProgress: public ProgressMonitor {
 protected:
   virtual void do_update_ui() {
@@ -525,12 +734,11 @@ protected:
 
     u64 data_size;
     u64 comp_size;
-    if (sd.num_th != 0) EnterCriticalSection(&sd.sync);
-    try {
-      data_size = sd.data_size;
-      comp_size = sd.comp_size;
+    {
+      CriticalSectionLock lock(buffers.sync);
+      data_size = buffers.proc_size;
+      comp_size = buffers.comp_size;
     }
-    finally (if (sd.num_th != 0) LeaveCriticalSection(&sd.sync));
     u64 file_size = result.file_size;
     u64 time = time_elapsed();
 
@@ -578,240 +786,152 @@ protected:
     far_set_progress_value(percent_done, 100);
   }
 public:
-  SharedData& sd;
+  ContentBuffers& buffers;
   const ContentInfo& result;
   const ContentOptions& options;
-  ProcessFileProgress(SharedData& sd, const ContentInfo& result, const ContentOptions& options): ProgressMonitor(true), sd(sd), result(result), options(options) {
+  ProcessFileProgress(ContentBuffers& buffers, const ContentInfo& result, const ContentOptions& options): ProgressMonitor(true), buffers(buffers), result(result), options(options) {
   }
 };
 
-void process_file_content(const UnicodeString& file_name, const ContentOptions& options, ContentInfo& result) {
-  ALLOC_RSRC(HANDLE h_scr = g_far.SaveScreen(0, 0, -1, -1));
 
-  SharedData sd;
+void process_file_content(const UnicodeString& file_name, const ContentOptions& options, ContentInfo& result, FilePanel* panel) {
+  // tiny file listed by MFT panel: take data from its MFT record instead of opening it
+  Array<u8> resident_data;
+  bool resident = false;
+  WIN32_FILE_ATTRIBUTE_DATA file_attr_data;
+  if (panel && GetFileAttributesExW(long_path(file_name).data(), GetFileExInfoStandard, &file_attr_data)) {
+    resident = panel->mft_read_resident(file_name, ((u64) file_attr_data.nFileSizeHigh << 32) | file_attr_data.nFileSizeLow, resident_data);
+  }
 
-  sd.buffer_size = 16 * 4 * 1024; // NTFS compression unit = 16 clusters
+  ALLOC_RSRC(HANDLE h_scr = g_far.SaveScreen(0, 0, -1, -1));
 
+  // every hash runs on its own thread, compression uses all processors
+  Array<ContentHash> hashes;
+  if (options.crc32) hashes += ch_crc32;
+  if (options.md5) hashes += ch_md5;
+  if (options.sha1) hashes += ch_sha1;
+  if (options.sha256) hashes += ch_sha256;
+  if (options.ed2k) hashes += ch_ed2k;
+  if (options.crc16) hashes += ch_crc16;
   SYSTEM_INFO sys_info;
   GetSystemInfo(&sys_info);
-  sd.num_th = options.compression ? (sys_info.dwNumberOfProcessors > 1 ? sys_info.dwNumberOfProcessors : 0) : 0;
-  sd.num_buf = options.compression ? sys_info.dwNumberOfProcessors * 2 : 2;
-
-  ALLOC_RSRC(if (sd.num_th != 0) { sd.h_stop_event = CreateEvent(NULL, TRUE, FALSE, NULL); CHECK_SYS(sd.h_stop_event != NULL); });
-  ALLOC_RSRC(if (sd.num_th != 0) InitializeCriticalSection(&sd.sync););
-  ALLOC_RSRC(if (sd.num_th != 0) { sd.h_io_ready_sem = CreateSemaphore(NULL, sd.num_buf, sd.num_buf, NULL); CHECK_SYS(sd.h_io_ready_sem != NULL); });
-  ALLOC_RSRC(if (sd.num_th != 0) { sd.h_proc_ready_sem = CreateSemaphore(NULL, 0, sd.num_buf, NULL); CHECK_SYS(sd.h_proc_ready_sem != NULL); });
-  ALLOC_RSRC(HANDLE h_io_event = CreateEvent(NULL, TRUE, FALSE, NULL); CHECK_SYS(h_io_event != NULL)); // async. I/O event
-  ALLOC_RSRC(sd.buffer = (u8*) VirtualAlloc(NULL, sd.buffer_size * sd.num_buf, MEM_COMMIT, PAGE_READWRITE); CHECK_SYS(sd.buffer != NULL));
-  sd.comp_buffer_size = sd.buffer_size + sd.buffer_size / 16 + 64 + 3;
-  ALLOC_RSRC(if (options.compression) { sd.comp_buffer = new u8[sd.comp_buffer_size * (sd.num_th != 0 ? sd.num_buf : 1)]; });
-  sd.comp_work_buffer_size = LZO1X_1_MEM_COMPRESS;
-  ALLOC_RSRC(if (options.compression) { sd.comp_work_buffer = new u8[sd.comp_work_buffer_size * (sd.num_th != 0 ? sd.num_buf : 1)]; });
-
-  for (unsigned i = 0; i < sd.num_buf; i++) {
-    sd.buffer_state += bs_io_ready;
-    sd.buffer_data_size += 0;
-  }
-
-  sd.data_size = 0; // file data size
-  sd.comp_size = 0; // compressed file size
-
-  // crc32 checksum
-  u32 crc32 = 0;
-  // MD5 hash
-  MD5_CTX md5_ctx;
-  MD5_Init(&md5_ctx);
-  // SHA1 hash
-  SHA_CTX sha1_ctx;
-  SHA1_Init(&sha1_ctx);
-  // SHA256 hash
-  SHA256_CTX sha256_ctx;
-  SHA256_Init(&sha256_ctx);
-  // ed2k hash
-  Array<u8> ed2k_block_hashes;
-  unsigned ed2k_last_block_slack = 0;
-  MD4_CTX md4_ctx;
-  // crc16 checksum
-  u16 crc16 = CRC16::init();
+  unsigned num_comp_th = 0;
+  if (options.compression) num_comp_th = resident ? 1 : min(max(static_cast<unsigned>(sys_info.dwNumberOfProcessors), 1u), MAXIMUM_WAIT_OBJECTS - 1 - hashes.size());
+  unsigned num_th = hashes.size() + num_comp_th;
+
+  // buffers are released when all stages are done with them, so slowest stage limits read ahead
+  unsigned num_buf = num_th * 2 + 1 + ReadQueue::c_depth;
+  ContentBuffers buffers(ReadQueue::get_max_block_size(num_buf), num_buf);
+
+  ALLOC_RSRC(Array<ContentStage*> stages; Array<HashStage*> hash_stages);
+  for (unsigned i = 0; i < hashes.size(); i++) {
+    hash_stages += new HashStage(buffers, hashes[i]);
+    stages += hash_stages.last();
+  }
+  if (num_comp_th != 0) stages += new CompressionStage(buffers, num_comp_th);
 
-  ProcessFileProgress progress(sd, result, options);
+  ProcessFileProgress progress(buffers, result, options);
 
-  // create compression threads
+  // create stage threads
   ALLOC_RSRC(Array<HANDLE> h_wth);
-  for (unsigned i = 0; i < sd.num_th; i++) {
-    unsigned th_id;
-    HANDLE h = (HANDLE) _beginthreadex(NULL, 0, wth_proc<SharedData>, &sd, 0, &th_id);
-    CHECK_SYS(h != NULL);
-    h_wth += h;
-  }
   try {
-    if (sd.num_th != 0) CHECK_SYS(SetThreadPriority(h_wth.last(), THREAD_PRIORITY_BELOW_NORMAL) != 0);
+    for (unsigned i = 0; i < stages.size(); i++) stages[i]->start(h_wth);
+    if (num_comp_th > 1) CHECK_SYS(SetThreadPriority(h_wth.last(), THREAD_PRIORITY_BELOW_NORMAL) != 0);
 
-    ALLOC_RSRC(HANDLE h_file = CreateFileW(long_path(file_name).data(), FILE_READ_DATA, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED | FILE_FLAG_POSIX_SEMANTICS | FILE_FLAG_SEQUENTIAL_SCAN, NULL); CHECK_SYS(h_file != INVALID_HANDLE_VALUE));
+    ALLOC_RSRC(HANDLE h_file = resident ? INVALID_HANDLE_VALUE : CreateFileW(long_path(file_name).data(), FILE_READ_DATA, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED | FILE_FLAG_POSIX_SEMANTICS | FILE_FLAG_SEQUENTIAL_SCAN, NULL); CHECK_SYS(resident || (h_file != INVALID_HANDLE_VALUE)));
 
     // determine file size
-    DWORD fsize_hi;
-    DWORD fsize_lo = GetFileSize(h_file, &fsize_hi);
-    CHECK_SYS((fsize_lo != INVALID_FILE_SIZE) || (GetLastError() == NO_ERROR));
-    result.file_size = ((u64) fsize_hi << 32) | fsize_lo;
-
-    unsigned prev_buf_idx = -1; // previous I/O buffer
-    u64 file_ptr = 0; // file pointer
-    OVERLAPPED ov; // overlapped I/O structure
-    DWORD last_error; // file read operation result
-
-    // file read loop
-    Array<HANDLE> h = sd.h_io_ready_sem + h_wth;
-    bool eof = false;
-    while (!eof) {
-      if (sd.num_th != 0) {
+    if (resident) {
+      result.file_size = resident_data.size();
+    }
+    else {
+      DWORD fsize_hi;
+      DWORD fsize_lo = GetFileSize(h_file, &fsize_hi);
+      CHECK_SYS((fsize_lo != INVALID_FILE_SIZE) || (GetLastError() == NO_ERROR));
+      result.file_size = ((u64) fsize_hi << 32) | fsize_lo;
+    }
+
+    Array<HANDLE> h = buffers.free_sem.handle() + h_wth;
+    if (resident) {
+      // whole file fits into single buffer
+      if (resident_data.size() != 0) {
         DWORD w = WaitForMultipleObjects(h.size(), h.data(), FALSE, INFINITE);
         CHECK_SYS(w != WAIT_FAILED);
         CHECK_MSG(w == WAIT_OBJECT_0, L"Unexpected thread death");
+        unsigned buf_idx = buffers.acquire();
+        memcpy(buffers.buffer(buf_idx), resident_data.data(), resident_data.size());
+        buffers.data_size.item(buf_idx) = resident_data.size();
+        InterlockedExchangeAdd(&buffers.ref_cnt.item(buf_idx), stages.size());
+        for (unsigned i = 0; i < stages.size(); i++) stages[i]->push(buf_idx);
+        buffers.release(buf_idx);
       }
-
-      // find buffer ready for I/O
-      unsigned buf_idx = 0;
-      if (sd.num_th != 0) {
-        EnterCriticalSection(&sd.sync);
-        try {
-          buf_idx = sd.buffer_state.search(bs_io_ready);
-          assert(buf_idx != -1);
-          sd.buffer_state.item(buf_idx) = bs_io_in_progress;
-        }
-        finally (LeaveCriticalSection(&sd.sync));
-      }
-      else {
-        if (prev_buf_idx == 0) buf_idx = 1;
-      }
-
-      // specify file read offset
-      memset(&ov, 0, sizeof(ov));
-      ov.Offset = (DWORD) (file_ptr & 0xFFFFFFFF);
-      ov.OffsetHigh = (DWORD) ((file_ptr >> 32) & 0xFFFFFFFF);
-      ov.hEvent = h_io_event;
-
-      unsigned buffer_data_size;
-      ReadFile(h_file, sd.buffer + buf_idx * sd.buffer_size, sd.buffer_size, (LPDWORD) &buffer_data_size, &ov);
-      last_error = GetLastError();
-
-      CHECK_SYS((last_error == NO_ERROR) || (last_error == ERROR_IO_PENDING) || (last_error == ERROR_HANDLE_EOF));
-
-      // process previous I/O buffer while async. I/O is in progress
-      if (prev_buf_idx != -1) {
-        u8* buffer = sd.buffer + prev_buf_idx * sd.buffer_size;
-        unsigned size = sd.buffer_data_size[prev_buf_idx];
-        if (sd.num_th == 0) {
-          if (options.compression) {
-            lzo_uint comp_size;
-            CHECK_LZO(lzo1x_1_compress(buffer, size, sd.comp_buffer, &comp_size, sd.comp_work_buffer));
-            sd.comp_size += min(comp_size, size);
+    }
+    else {
+      // file read loop: read queue is kept full while there are free buffers
+      ReadQueue queue(h_file, result.file_size, ReadQueue::c_depth, buffers.buffer_size);
+      while (queue.active()) {
+        if (queue.can_submit()) {
+          // do not wait for free buffer if there is completed read to pass on
+          DWORD w = WaitForMultipleObjects(h.size(), h.data(), FALSE, queue.pending() ? 0 : INFINITE);
+          CHECK_SYS(w != WAIT_FAILED);
+          if (w != WAIT_TIMEOUT) {
+            CHECK_MSG(w == WAIT_OBJECT_0, L"Unexpected thread death");
+            unsigned buf_idx = buffers.acquire();
+            queue.submit(buffers.buffer(buf_idx), buf_idx);
+            continue;
           }
-          sd.data_size += size;
         }
-        if (options.crc32) crc32 = lzo_crc32(crc32, buffer, size);
-        if (options.md5) MD5_Update(&md5_ctx, buffer, size);
-        if (options.sha1) SHA1_Update(&sha1_ctx, buffer, size);
-        if (options.sha256) SHA256_Update(&sha256_ctx, buffer, size);
-        if (options.ed2k) ed2k_update_block_hashes(buffer, size, ed2k_block_hashes, ed2k_last_block_slack, md4_ctx);
-        if (options.crc16) crc16 = CRC16::update(crc16, buffer, size);
-      }
-
-      progress.update_ui();
 
-      // check for end of file
-      eof = last_error == ERROR_HANDLE_EOF;
-      // determine number of bytes returned by last read operation
-      if (last_error == ERROR_IO_PENDING) {
-        // asynchronous operation
-        if (GetOverlappedResult(h_file, &ov, (LPDWORD) &buffer_data_size, TRUE) == 0) {
-          // check for end of file
-          if (GetLastError() == ERROR_HANDLE_EOF) eof = true;
-          // else async. operation failed
-          else CHECK_SYS(false);
+        // pass oldest read buffer to all stages
+        unsigned size;
+        unsigned buf_idx = queue.complete(size);
+        buffers.data_size.item(buf_idx) = size;
+        if (size != 0) {
+          InterlockedExchangeAdd(&buffers.ref_cnt.item(buf_idx), stages.size());
+          for (unsigned i = 0; i < stages.size(); i++) stages[i]->push(buf_idx);
         }
-      }
-      sd.buffer_data_size.item(buf_idx) = buffer_data_size;
-      assert(eof || (!eof && ((prev_buf_idx == -1) || (sd.buffer_data_size[prev_buf_idx] == sd.buffer_size))));
+        buffers.release(buf_idx);
 
-      if (!eof) {
-        // mark buffer ready for processing and signal worker threads
-        if (sd.num_th != 0) {
-          EnterCriticalSection(&sd.sync);
-          try {
-            sd.buffer_state.item(buf_idx) = bs_proc_ready;
-          }
-          finally (LeaveCriticalSection(&sd.sync));
-          CHECK_SYS(ReleaseSemaphore(sd.h_proc_ready_sem, 1, NULL) != 0);
-        }
+        progress.update_ui();
       }
+    }
+    FREE_RSRC(if (!resident) VERIFY(CloseHandle(h_file) != 0));
 
-      // advance file pointer
-      file_ptr += sd.buffer_size;
-
-      // this buffer will be processed next
-      prev_buf_idx = buf_idx;
+    // wait for stages to process remaining buffers
+    for (unsigned i = 0; i < stages.size(); i++) stages[i]->finish();
+    if (h_wth.size() != 0) CHECK_SYS(WaitForMultipleObjects(h_wth.size(), h_wth.data(), TRUE, INFINITE) != WAIT_FAILED);
+    for (unsigned i = 0; i < h_wth.size(); i++) {
+      DWORD exit_code;
+      CHECK_SYS(GetExitCodeThread(h_wth[i], &exit_code) != 0);
+      CHECK_MSG(exit_code == TRUE, L"Unexpected thread death");
     }
-    FREE_RSRC(VERIFY(CloseHandle(h_file) != 0));
   }
   finally (
-    if (sd.num_th != 0) {
-      VERIFY(SetEvent(sd.h_stop_event) != 0);
+    if (h_wth.size() != 0) {
+      VERIFY(SetEvent(buffers.stop_event.handle()) != 0);
       VERIFY(WaitForMultipleObjects(h_wth.size(), h_wth.data(), TRUE, INFINITE) != WAIT_FAILED);
     }
   );
   FREE_RSRC(
-    // must use h_wth.size() instead of sd.num_th
     for (unsigned i = 0; i < h_wth.size(); i++) {
       VERIFY(CloseHandle(h_wth[i]) != 0);
     }
   );
 
   // populate result structure
-  assert(sd.data_size == result.file_size);
+  assert(buffers.proc_size == result.file_size);
   progress.update_ui();
   result.time = progress.time_elapsed();
-  if (options.compression) result.comp_size = sd.comp_size;
-  if (options.crc32) {
-    const u8* c = (const u8*) &crc32;
-    result.crc32.copy(c[3]).add(c[2]).add(c[1]).add(c[0]);
-  }
-  if (options.md5) {
-    u8 md5[MD5_DIGEST_LENGTH];
-    MD5_Final(md5, &md5_ctx);
-    result.md5.copy(md5, sizeof(md5));
-  }
-  if (options.sha1) {
-    u8 sha1[SHA_DIGEST_LENGTH];
-    SHA1_Final(sha1, &sha1_ctx);
-    result.sha1.copy(sha1, sizeof(sha1));
-  }
-  if (options.sha256) {
-    u8 sha256[SHA256_DIGEST_LENGTH];
-    SHA256_Final(sha256, &sha256_ctx);
-    result.sha256.copy(sha256, sizeof(sha256));
-  }
-  if (options.ed2k) {
-    result.ed2k = ed2k_finalize_block_hashes(ed2k_block_hashes, ed2k_last_block_slack, md4_ctx);
-  }
-  if (options.crc16) {
-    const u8* c = (const u8*) &crc16;
-    result.crc16.copy(c[1]).add(c[0]);
-  }
-
-  FREE_RSRC(if (options.compression) delete[] sd.comp_work_buffer);
-  FREE_RSRC(if (options.compression) delete[] sd.comp_buffer);
-  FREE_RSRC(VERIFY(VirtualFree(sd.buffer, 0, MEM_RELEASE) != 0));
-  FREE_RSRC(VERIFY(CloseHandle(h_io_event) != 0));
-  FREE_RSRC(if (sd.num_th != 0) VERIFY(CloseHandle(sd.h_proc_ready_sem) != 0));
-  FREE_RSRC(if (sd.num_th != 0) VERIFY(CloseHandle(sd.h_io_ready_sem) != 0));
-  FREE_RSRC(if (sd.num_th != 0) DeleteCriticalSection(&sd.sync));
-  FREE_RSRC(if (sd.num_th != 0) VERIFY(CloseHandle(sd.h_stop_event) != 0));
+  if (options.compression) result.comp_size = buffers.comp_size;
+  for (unsigned i = 0; i < hash_stages.size(); i++) hash_stages[i]->finalize(result);
+
+  FREE_RSRC(for (unsigned i = 0; i < stages.size(); i++) delete stages[i]);
   FREE_RSRC(g_far.RestoreScreen(NULL); g_far.RestoreScreen(h_scr));
 }
 
 // show content analysis result dialog
-void show_result_dialog(const CompressionStats& stats) {
+// (compression ratio is shown if requested, hash list file if not empty)
+void show_multi_result_dialog(const CompressionStats& stats, bool compression, const UnicodeString& list_file_name) {
   UnicodeString str;
   FarDialog dlg(c_content_result_dialog_guid, far_get_msg(MSG_CONTENT_MULTI_RESULT_TITLE), 30);
   if (stats.file_cnt != 0) {
@@ -824,16 +944,18 @@ void show_result_dialog(const CompressionStats& stats) {
     dlg.new_line();
 
     // compression ratio
-    str.copy_fmt(far_get_msg(MSG_CONTENT_MULTI_RESULT_COMPRESSION).data(), &format_inf_amount_short(stats.comp_size), &format_inf_amount_short(stats.data_size));
-    if (stats.data_size != 0) {
-      str.add_fmt(L" %Lu", stats.comp_size * 100 / stats.data_size);
-    }
-    else {
-      str.add_fmt(L" %u", 100);
+    if (compression) {
+      str.copy_fmt(far_get_msg(MSG_CONTENT_MULTI_RESULT_COMPRESSION).data(), &format_inf_amount_short(stats.comp_size), &format_inf_amount_short(stats.data_size));
+      if (stats.data_size != 0) {
+        str.add_fmt(L" %Lu", stats.comp_size * 100 / stats.data_size);
+      }
+      else {
+        str.add_fmt(L" %u", 100);
+      }
+      str.add('%');
+      dlg.label(str);
+      dlg.new_line();
     }
-    str.add('%');
-    dlg.label(str);
-    dlg.new_line();
     dlg.separator();
     dlg.new_line();
   }
@@ -855,6 +977,10 @@ void show_result_dialog(const CompressionStats& stats) {
     dlg.label(UnicodeString::format(far_get_msg(MSG_CONTENT_MULTI_RESULT_ERRORS).data(), stats.err_cnt));
     dlg.new_line();
   }
+  if (list_file_name.size() != 0) {
+    dlg.label(UnicodeString::format(far_get_msg(MSG_CONTENT_MULTI_RESULT_HASH_LIST).data(), &fit_str(list_file_name, 50)));
+    dlg.new_line();
+  }
   dlg.separator();
   dlg.new_line();
 
@@ -864,28 +990,38 @@ void show_result_dialog(const CompressionStats& stats) {
   dlg.show();
 }
 
-struct CompressionState: public CompressionStats {
+void show_result_dialog(const CompressionStats& stats) {
+  show_multi_result_dialog(stats, true, UnicodeString());
+}
+
+void show_result_dialog(const HashFilesStats& stats) {
+  show_multi_result_dialog(stats, stats.compression, stats.list_file_name);
+}
+
+struct EstimationStats {
+  u64 est_size; // estimated total file data size
+  unsigned est_file_cnt; // estimated number of files processed
+  unsigned est_dir_cnt; // estimated number of dirs processed
+  unsigned est_reparse_cnt; // estimated number of reparse points skipped
+  unsigned est_err_cnt; // estimated number of files/dirs skipped because of errors
+};
+
+struct CompressionState: public CompressionStats, public EstimationStats {
   unsigned num_th; // number of worker threads
   unsigned num_buf; // number of I/O buffers
   Array<BufState> buffer_state;
   u8* buffer; // I/O buffers
   unsigned buffer_size; // I/O buffer size
+  unsigned block_size; // read size tuned on previous files
   Array<unsigned> buffer_data_size; // valid data size in each buffer
   u8* comp_buffer; // compression buffers
-  unsigned comp_buffer_size;
   u8* comp_work_buffer;
-  unsigned comp_work_buffer_size;
-  HANDLE h_aio_event; // async. I/O event
   Array<HANDLE> h_wth; // worker thread handles
   HANDLE h_stop_event;
   CRITICAL_SECTION sync;
   HANDLE h_io_ready_sem;
   HANDLE h_proc_ready_sem;
-  u64 est_size; // estimated total file data size
-  unsigned est_file_cnt; // estimated number of files processed
-  unsigned est_dir_cnt; // estimated number of dirs processed
-  unsigned est_reparse_cnt; // estimated number of reparse points skipped
-  unsigned est_err_cnt; // estimated number of files/dirs skipped because of errors
+  FilePanel* panel; // source of resident file data (optional)
 };
 
 class CompressFilesProgress: public ProgressMonitor {
@@ -985,8 +1121,8 @@ protected:
     far_set_progress_state(TBPF_INDETERMINATE);
   }
 public:
-  const CompressionState& st;
-  EstimationProgress(const CompressionState& st): ProgressMonitor(true), st(st) {
+  const EstimationStats& st;
+  EstimationProgress(const EstimationStats& st): ProgressMonitor(true), st(st) {
   }
 };
 
@@ -1042,106 +1178,110 @@ void estimate_directory_size(const UnicodeString& dir_name, CompressionState& st
   }
 }
 
-void compress_file(const UnicodeString& file_name, CompressionState& st, CompressFilesProgress& progress) {
+// data of resident file is passed to worker threads as a regular I/O buffer
+void compress_resident_data(const Array<u8>& data, CompressionState& st) {
+  if (data.size() == 0) return;
+  if (st.num_th != 0) {
+    Array<HANDLE> h = st.h_io_ready_sem + st.h_wth;
+    DWORD w = WaitForMultipleObjects(h.size(), h.data(), FALSE, INFINITE);
+    CHECK_SYS(w != WAIT_FAILED);
+    CHECK_MSG(w == WAIT_OBJECT_0, L"Unexpected thread death");
+
+    unsigned buf_idx;
+    EnterCriticalSection(&st.sync);
+    try {
+      buf_idx = st.buffer_state.search(bs_io_ready);
+      assert(buf_idx != -1);
+      st.buffer_state.item(buf_idx) = bs_io_in_progress;
+    }
+    finally (LeaveCriticalSection(&st.sync));
+
+    memcpy(st.buffer + buf_idx * st.buffer_size, data.data(), data.size());
+
+    EnterCriticalSection(&st.sync);
+    try {
+      st.buffer_data_size.item(buf_idx) = data.size();
+      st.buffer_state.item(buf_idx) = bs_proc_ready;
+    }
+    finally (LeaveCriticalSection(&st.sync));
+    CHECK_SYS(ReleaseSemaphore(st.h_proc_ready_sem, 1, NULL) != 0);
+  }
+  else {
+    st.comp_size += compressed_size(data.data(), data.size(), st.comp_buffer, st.comp_work_buffer);
+    st.data_size += data.size();
+  }
+}
+
+void compress_file(const UnicodeString& file_name, u64 file_size, CompressionState& st, CompressFilesProgress& progress) {
+  Array<u8> resident_data;
+  if (st.panel && st.panel->mft_read_resident(file_name, file_size, resident_data)) {
+    compress_resident_data(resident_data, st);
+    st.file_cnt++;
+    return;
+  }
+
   HANDLE h_file = CreateFileW(long_path(file_name).data(), FILE_READ_DATA, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED | FILE_FLAG_POSIX_SEMANTICS | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
   if (h_file == INVALID_HANDLE_VALUE) st.err_cnt++;
   else {
     ALLOC_RSRC(;);
 
-    unsigned prev_buf_idx = -1; // previous I/O buffer
-    u64 file_ptr = 0; // file pointer
-    OVERLAPPED ov; // overlapped I/O structure
-    DWORD last_error; // file read operation result
-
     // determine file size
     DWORD fsize_hi;
     DWORD fsize_lo = GetFileSize(h_file, &fsize_hi);
     CHECK_SYS((fsize_lo != INVALID_FILE_SIZE) || (GetLastError() == NO_ERROR));
     u64 file_size = ((u64) fsize_hi << 32) | fsize_lo;
 
-    // file read loop
+    // file read loop: read queue is kept full while there are free buffers
+    ReadQueue queue(h_file, file_size, ReadQueue::c_depth, st.buffer_size, st.block_size);
     Array<HANDLE> h = st.h_io_ready_sem + st.h_wth;
-    bool eof = false;
-    while (!eof) {
-      if (st.num_th != 0) {
-        DWORD w = WaitForMultipleObjects(h.size(), h.data(), FALSE, INFINITE);
-        CHECK_SYS(w != WAIT_FAILED);
-        CHECK_MSG(w == WAIT_OBJECT_0, L"Unexpected thread death");
-      }
-
-      // find buffer ready for I/O
-      unsigned buf_idx = 0;
-      if (st.num_th != 0) {
-        EnterCriticalSection(&st.sync);
-        try {
-          buf_idx = st.buffer_state.search(bs_io_ready);
-          assert(buf_idx != -1);
-          st.buffer_state.item(buf_idx) = bs_io_in_progress;
-        }
-        finally (LeaveCriticalSection(&st.sync));
-      }
-      else {
-        if (prev_buf_idx == 0) buf_idx = 1;
-      }
-
-      // specify file read offset
-      memset(&ov, 0, sizeof(ov));
-      ov.Offset = (DWORD) (file_ptr & 0xFFFFFFFF);
-      ov.OffsetHigh = (DWORD) ((file_ptr >> 32) & 0xFFFFFFFF);
-      ov.hEvent = st.h_aio_event;
-
-      unsigned buffer_data_size;
-      ReadFile(h_file, st.buffer + buf_idx * st.buffer_size, st.buffer_size, (LPDWORD) &buffer_data_size, &ov);
-      last_error = GetLastError();
-
-      CHECK_SYS((last_error == NO_ERROR) || (last_error == ERROR_IO_PENDING) || (last_error == ERROR_HANDLE_EOF));
-
-      // process previous I/O buffer while async. I/O is in progress
-      if (prev_buf_idx != -1) {
+    unsigned next_buf_idx = 0; // without worker threads buffers are used in turn
+    while (queue.active()) {
+      if (queue.can_submit()) {
         if (st.num_th == 0) {
-          // compress buffer
-          u8* buffer = st.buffer + prev_buf_idx * st.buffer_size;
-          unsigned size = st.buffer_data_size[prev_buf_idx];
-          lzo_uint comp_size;
-          CHECK_LZO(lzo1x_1_compress(buffer, size, st.comp_buffer, &comp_size, st.comp_work_buffer));
-          st.comp_size += min(comp_size, size);
-          st.data_size += size;
+          queue.submit(st.buffer + next_buf_idx * st.buffer_size, next_buf_idx);
+          next_buf_idx = (next_buf_idx + 1) % st.num_buf;
+          continue;
         }
-      }
-
-      progress.update_ui();
-
-      // check for end of file
-      eof = last_error == ERROR_HANDLE_EOF;
-      // determine number of bytes returned by last read operation
-      if (last_error == ERROR_IO_PENDING) {
-        // asynchronous operation
-        if (GetOverlappedResult(h_file, &ov, (LPDWORD) &buffer_data_size, TRUE) == 0) {
-          // check for end of file
-          if (GetLastError() == ERROR_HANDLE_EOF) eof = true;
-          // else async. operation failed
-          else CHECK_SYS(false);
+        // do not wait for free buffer if there is completed read to pass on
+        DWORD w = WaitForMultipleObjects(h.size(), h.data(), FALSE, queue.pending() ? 0 : INFINITE);
+        CHECK_SYS(w != WAIT_FAILED);
+        if (w != WAIT_TIMEOUT) {
+          CHECK_MSG(w == WAIT_OBJECT_0, L"Unexpected thread death");
+          // find buffer ready for I/O
+          unsigned buf_idx;
+          EnterCriticalSection(&st.sync);
+          try {
+            buf_idx = st.buffer_state.search(bs_io_ready);
+            assert(buf_idx != -1);
+            st.buffer_state.item(buf_idx) = bs_io_in_progress;
+          }
+          finally (LeaveCriticalSection(&st.sync));
+          queue.submit(st.buffer + buf_idx * st.buffer_size, buf_idx);
+          continue;
         }
       }
-      st.buffer_data_size.item(buf_idx) = buffer_data_size;
-      assert(eof || (!eof && ((prev_buf_idx == -1) || (st.buffer_data_size[prev_buf_idx] == st.buffer_size))));
 
-      // mark buffer ready for processing and signal worker threads
-      if (st.num_th != 0) {
+      // process oldest read buffer
+      unsigned size;
+      unsigned buf_idx = queue.complete(size);
+      if (st.num_th == 0) {
+        st.comp_size += compressed_size(st.buffer + buf_idx * st.buffer_size, size, st.comp_buffer, st.comp_work_buffer);
+        st.data_size += size;
+      }
+      else {
+        // mark buffer ready for processing and signal worker threads
         EnterCriticalSection(&st.sync);
         try {
-          st.buffer_state.item(buf_idx) = eof ? bs_io_ready : bs_proc_ready;
+          st.buffer_data_size.item(buf_idx) = size;
+          st.buffer_state.item(buf_idx) = size != 0 ? bs_proc_ready : bs_io_ready;
         }
         finally (LeaveCriticalSection(&st.sync));
-        CHECK_SYS(ReleaseSemaphore(eof ? st.h_io_ready_sem : st.h_proc_ready_sem, 1, NULL) != 0);
+        CHECK_SYS(ReleaseSemaphore(size != 0 ? st.h_proc_ready_sem : st.h_io_ready_sem, 1, NULL) != 0);
       }
 
-      // advance file pointer
-      file_ptr += st.buffer_size;
-
-      // this buffer will be processed next
-      prev_buf_idx = buf_idx;
+      progress.update_ui();
     } // end file read loop
+    st.block_size = queue.get_block_size();
     FREE_RSRC(VERIFY(CloseHandle(h_file) != 0));
     st.file_cnt++;
   }
@@ -1169,7 +1309,7 @@ void compress_directory(const UnicodeString& dir_name, CompressionState& st, Com
           compress_directory(file_name, st, progress);
         }
         else {
-          compress_file(file_name, st, progress);
+          compress_file(file_name, ((u64) find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow, st, progress);
         }
       }
 
@@ -1185,29 +1325,26 @@ void compress_directory(const UnicodeString& dir_name, CompressionState& st, Com
   }
 }
 
-void compress_files(const ObjectArray<UnicodeString>& file_list, CompressionStats& result) {
+void compress_files(const ObjectArray<UnicodeString>& file_list, CompressionStats& result, FilePanel* panel) {
   CompressionState st;
 
   // save Far creen
   ALLOC_RSRC(HANDLE h_scr = g_far.SaveScreen(0, 0, -1, -1));
 
-  st.buffer_size = 16 * 4 * 1024; // NTFS compression unit = 16 clusters
-
   SYSTEM_INFO sys_info;
   GetSystemInfo(&sys_info);
   st.num_th = sys_info.dwNumberOfProcessors > 1 ? sys_info.dwNumberOfProcessors : 0;
-  st.num_buf = sys_info.dwNumberOfProcessors * 2;
+  st.num_buf = st.num_th * 2 + ReadQueue::c_depth;
+  st.buffer_size = ReadQueue::get_max_block_size(st.num_buf);
+  st.block_size = ReadQueue::c_min_block_size;
 
   ALLOC_RSRC(if (st.num_th != 0) { st.h_stop_event = CreateEvent(NULL, TRUE, FALSE, NULL); CHECK_SYS(st.h_stop_event != NULL); });
   ALLOC_RSRC(if (st.num_th != 0) InitializeCriticalSection(&st.sync););
   ALLOC_RSRC(if (st.num_th != 0) { st.h_io_ready_sem = CreateSemaphore(NULL, st.num_buf, st.num_buf, NULL); CHECK_SYS(st.h_io_ready_sem != NULL); });
   ALLOC_RSRC(if (st.num_th != 0) { st.h_proc_ready_sem = CreateSemaphore(NULL, 0, st.num_buf, NULL); CHECK_SYS(st.h_proc_ready_sem != NULL); });
-  ALLOC_RSRC(st.h_aio_event = CreateEvent(NULL, TRUE, FALSE, NULL); CHECK_SYS(st.h_aio_event != NULL)); // async. I/O event
   ALLOC_RSRC(st.buffer = (u8*) VirtualAlloc(NULL, st.buffer_size * st.num_buf, MEM_COMMIT, PAGE_READWRITE); CHECK_SYS(st.buffer != NULL));
-  st.comp_buffer_size = st.buffer_size + st.buffer_size / 16 + 64 + 3;
-  ALLOC_RSRC(st.comp_buffer = new u8[st.comp_buffer_size * (st.num_th != 0 ? st.num_buf : 1)]);
-  st.comp_work_buffer_size = LZO1X_1_MEM_COMPRESS;
-  ALLOC_RSRC(st.comp_work_buffer = new u8[st.comp_work_buffer_size * (st.num_th != 0 ? st.num_buf : 1)]);
+  ALLOC_RSRC(st.comp_buffer = new u8[c_comp_buffer_size * (st.num_th != 0 ? st.num_buf : 1)]);
+  ALLOC_RSRC(st.comp_work_buffer = new u8[LZO1X_1_MEM_COMPRESS * (st.num_th != 0 ? st.num_buf : 1)]);
 
   for (unsigned i = 0; i < st.num_buf; i++) {
     st.buffer_state += bs_io_ready;
@@ -1248,6 +1385,8 @@ void compress_files(const ObjectArray<UnicodeString>& file_list, CompressionStat
 
   CompressFilesProgress progress(st);
 
+  st.panel = panel;
+
   // create compression threads
   ALLOC_RSRC(st.h_wth);
   for (unsigned i = 0; i < st.num_th; i++) {
@@ -1262,18 +1401,18 @@ void compress_files(const ObjectArray<UnicodeString>& file_list, CompressionStat
     unsigned i;
     for (i = 0; i < file_list.size(); i++) {
       const UnicodeString& file_name = file_list[i];
-      DWORD fattr = GetFileAttributesW(file_name.data());
-      if (fattr == INVALID_FILE_ATTRIBUTES) {
+      WIN32_FILE_ATTRIBUTE_DATA fattr;
+      if (!GetFileAttributesExW(file_name.data(), GetFileExInfoStandard, &fattr)) {
         st.err_cnt++;
       }
-      else if ((fattr & FILE_ATTRIBUTE_REPARSE_POINT) == FILE_ATTRIBUTE_REPARSE_POINT) {
+      else if ((fattr.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == FILE_ATTRIBUTE_REPARSE_POINT) {
         st.reparse_cnt++;
       }
-      else if ((fattr & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY) {
+      else if ((fattr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY) {
         compress_directory(file_name, st, progress);
       }
       else {
-        compress_file(file_name, st, progress);
+        compress_file(file_name, ((u64) fattr.nFileSizeHigh << 32) | fattr.nFileSizeLow, st, progress);
       }
     }
   }
@@ -1298,10 +1437,520 @@ void compress_files(const ObjectArray<UnicodeString>& file_list, CompressionStat
   FREE_RSRC(delete[] st.comp_work_buffer);
   FREE_RSRC(delete[] st.comp_buffer);
   FREE_RSRC(VERIFY(VirtualFree(st.buffer, 0, MEM_RELEASE) != 0));
-  FREE_RSRC(VERIFY(CloseHandle(st.h_aio_event) != 0));
   FREE_RSRC(if (st.num_th != 0) VERIFY(CloseHandle(st.h_proc_ready_sem) != 0));
   FREE_RSRC(if (st.num_th != 0) VERIFY(CloseHandle(st.h_io_ready_sem) != 0));
   FREE_RSRC(if (st.num_th != 0) DeleteCriticalSection(&st.sync));
   FREE_RSRC(if (st.num_th != 0) VERIFY(CloseHandle(st.h_stop_event) != 0));
   FREE_RSRC(g_far.RestoreScreen(NULL); g_far.RestoreScreen(h_scr));
 }
+
+// Batch content analysis: hashes of all selected files are written to hash list file.
+// Files are listed first and split into work items: every large file is item of its own,
+// consecutive small files are packed into batches that one worker reads into memory whole,
+// so workers spend as little time as possible waiting for open/close of tiny files.
+// Every worker holds at most one open file, which bounds number of open handles.
+// Items are claimed in order and their hash list entries are written in the same order.
+
+// files not bigger than this are packed into batches
+const unsigned c_small_file_size = 1024 * 1024;
+// batch limits (batch data size is also read size for large files)
+const unsigned c_batch_data_size = 4 * 1024 * 1024;
+const unsigned c_batch_file_cnt = 128;
+
+struct HashFilesState: public HashFilesStats, public EstimationStats {
+  ContentOptions options;
+  Array<ContentHash> hashes;
+  // full path of file i is names[name_offs[i]] .. names[name_offs[i + 1] - 1]
+  // (workers must not share UnicodeString objects: reference counts are not atomic)
+  Array<wchar_t> names;
+  Array<unsigned> name_offs;
+  Array<u64> file_sizes;
+  unsigned base_path_len; // hash list contains paths relative to directory of selected files
+  // work item i is files item_offs[i] .. item_offs[i + 1] - 1
+  Array<unsigned> item_offs;
+  volatile LONG next_item; // next item to be claimed by worker
+  ObjectArray<AnsiString> item_text; // hash list entries of completed items not yet written
+  Array<bool> item_done;
+  unsigned next_write; // next item to be written to hash list
+  HANDLE h_list_file;
+  volatile LONG stop; // workers must exit (failure or user break)
+  UnicodeString error; // first worker failure
+  CriticalSection sync; // protects statistics and everything related to hash list writing
+  unsigned file_count() const {
+    return file_sizes.size();
+  }
+  unsigned item_count() const {
+    return item_offs.size() - 1;
+  }
+  UnicodeString file_name(unsigned file_idx) const {
+    return UnicodeString(names.data() + name_offs[file_idx], name_offs[file_idx + 1] - name_offs[file_idx]);
+  }
+  void add_file(const UnicodeString& file_name, u64 file_size);
+  void pack_items();
+  void write_item(unsigned item_idx, const AnsiString& text);
+  void fail(const UnicodeString& message);
+};
+
+void HashFilesState::add_file(const UnicodeString& file_name, u64 file_size) {
+  if (_wcsicmp(file_name.data(), list_file_name.data()) == 0) return; // hash list itself
+  names.add(file_name.data(), file_name.size());
+  name_offs += names.size();
+  file_sizes += file_size;
+  est_file_cnt++;
+  est_size += file_size;
+}
+
+void HashFilesState::pack_items() {
+  item_offs.clear();
+  item_offs += 0;
+  u64 batch_size = 0;
+  for (unsigned i = 0; i < file_count(); i++) {
+    bool small_file = file_sizes[i] <= c_small_file_size;
+    // close current batch
+    if ((i != item_offs.last()) && (!small_file || (batch_size + file_sizes[i] > c_batch_data_size) || (i - item_offs.last() == c_batch_file_cnt))) {
+      item_offs += i;
+      batch_size = 0;
+    }
+    if (small_file) batch_size += file_sizes[i];
+    else item_offs += i + 1;
+  }
+  if (item_offs.last() != file_count()) item_offs += file_count();
+  item_text.clear();
+  item_done.clear();
+  for (unsigned i = 0; i < item_count(); i++) {
+    item_text += AnsiString();
+    item_done += false;
+  }
+  next_item = 0;
+  next_write = 0;
+}
+
+void HashFilesState::write_item(unsigned item_idx, const AnsiString& text) {
+  CriticalSectionLock lock(sync);
+  // copy text data: string buffer of worker must not be shared
+  item_text.item(item_idx).copy(text.data(), text.size());
+  item_done.item(item_idx) = true;
+  while ((next_write < item_count()) && item_done[next_write]) {
+    const AnsiString& entries = item_text[next_write];
+    DWORD bw;
+    CHECK_SYS(WriteFile(h_list_file, entries.data(), entries.size(), &bw, NULL));
+    item_text.item(next_write).clear();
+    next_write++;
+  }
+}
+
+void HashFilesState::fail(const UnicodeString& message) {
+  CriticalSectionLock lock(sync);
+  if (error.size() == 0) error.copy(message.data(), message.size());
+  InterlockedExchange(&stop, TRUE);
+}
+
+class HashFilesWorker: private NonCopyable {
+private:
+  HashFilesState& st;
+  u8* data_buffer; // batch data or read buffer for large files
+  Array<u8> data_buffer_data;
+  Array<u8> comp_buffer;
+  Array<u8> work_buffer;
+  unsigned compressed_size(const u8* data, unsigned size) {
+    return ::compressed_size(data, size, comp_buffer.buf(), work_buffer.buf());
+  }
+  void hash_file(HANDLE h_file, ContentInfo& info);
+  AnsiString file_entry(unsigned file_idx, const ContentInfo& info);
+  AnsiString error_entry(unsigned file_idx, const Error& e);
+  void file_done(u64 data_size, u64 comp_size, bool error);
+  AnsiString process_item(unsigned first_idx, unsigned end_idx);
+public:
+  HashFilesWorker(HashFilesState& st): st(st) {
+    data_buffer = data_buffer_data.buf(c_batch_data_size);
+    if (st.options.compression) {
+      comp_buffer.extend(c_comp_buffer_size);
+      work_buffer.extend(LZO1X_1_MEM_COMPRESS);
+    }
+  }
+  static unsigned __stdcall th_proc(void* param);
+};
+
+// hash file sequentially (file is too big to be read in one go)
+void HashFilesWorker::hash_file(HANDLE h_file, ContentInfo& info) {
+  ObjectArray<HashContext> contexts;
+  for (unsigned i = 0; i < st.hashes.size(); i++) contexts += HashContext(st.hashes[i]);
+  info.file_size = 0;
+  info.comp_size = 0;
+  while (true) {
+    if (st.stop) BREAK;
+    DWORD size;
+    CHECK_SYS(ReadFile(h_file, data_buffer, c_batch_data_size, &size, NULL));
+    if (size == 0) break;
+    for (unsigned i = 0; i < contexts.size(); i++) contexts.item(i).update(data_buffer, size);
+    unsigned comp_size = st.options.compression ? compressed_size(data_buffer, size) : 0;
+    info.file_size += size;
+    info.comp_size += comp_size;
+    // large file progress is reported while it is read
+    CriticalSectionLock lock(st.sync);
+    st.data_size += size;
+    st.comp_size += comp_size;
+  }
+  for (unsigned i = 0; i < contexts.size(); i++) contexts.item(i).finalize(info);
+}
+
+AnsiString HashFilesWorker::file_entry(unsigned file_idx, const ContentInfo& info) {
+  UnicodeString rel_path = st.file_name(file_idx).slice(st.base_path_len);
+  return "File: " + unicode_to_ansi(rel_path, CP_UTF8) + "\n" + format_hash_lines(st.options, info) + "\n";
+}
+
+AnsiString HashFilesWorker::error_entry(unsigned file_idx, const Error& e) {
+  UnicodeString rel_path = st.file_name(file_idx).slice(st.base_path_len);
+  UnicodeString message = e.message();
+  while ((message.size() != 0) && ((message.last() == L'\n') || (message.last() == L'\r'))) message.remove(message.size() - 1);
+  return "File: " + unicode_to_ansi(rel_path, CP_UTF8) + "\nError: " + unicode_to_ansi(message, CP_UTF8) + "\n\n";
+}
+
+void HashFilesWorker::file_done(u64 data_size, u64 comp_size, bool error) {
+  CriticalSectionLock lock(st.sync);
+  st.data_size += data_size;
+  st.comp_size += comp_size;
+  if (error) st.err_cnt++;
+  else st.file_cnt++;
+}
+
+// Small files are read into batch buffer first and hashed afterwards: MD5/SHA of all
+// buffered files are calculated at once by multi-buffer engine.
+// File that turns out to be bigger than space left in buffer is hashed right away.
+AnsiString HashFilesWorker::process_item(unsigned first_idx, unsigned end_idx) {
+  unsigned file_cnt = end_idx - first_idx;
+  ObjectArray<AnsiString> entries;
+  Array<unsigned> data_offs; // file data offset in batch buffer, -1 if file is not buffered
+  Array<unsigned> data_sizes;
+  unsigned data_end = 0;
+  unsigned buffered_cnt = 0;
+  for (unsigned i = 0; i < file_cnt; i++) {
+    if (st.stop) BREAK;
+    entries += AnsiString();
+    data_offs += -1;
+    data_sizes += 0;
+    try {
+      HANDLE h_file = CreateFileW(long_path(st.file_name(first_idx + i)).data(), FILE_READ_DATA, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+      CHECK_SYS(h_file != INVALID_HANDLE_VALUE);
+      CLEAN(HANDLE, h_file, CloseHandle(h_file));
+      DWORD fsize_hi;
+      DWORD fsize_lo = GetFileSize(h_file, &fsize_hi);
+      CHECK_SYS((fsize_lo != INVALID_FILE_SIZE) || (GetLastError() == NO_ERROR));
+      u64 file_size = ((u64) fsize_hi << 32) | fsize_lo;
+      if (file_size <= c_batch_data_size - data_end) {
+        // whole file is read into buffer (it may shrink meanwhile)
+        unsigned size = 0;
+        while (size < file_size) {
+          DWORD size_read;
+          CHECK_SYS(ReadFile(h_file, data_buffer + data_end + size, static_cast<unsigned>(file_size) - size, &size_read, NULL));
+          if (size_read == 0) break;
+          size += size_read;
+        }
+        data_offs.item(i) = data_end;
+        data_sizes.item(i) = size;
+        data_end += size;
+        buffered_cnt++;
+      }
+      else {
+        ContentInfo info;
+        hash_file(h_file, info);
+        entries.item(i) = file_entry(first_idx + i, info);
+        file_done(0, 0, false);
+      }
+    }
+    catch (Error& e) {
+      entries.item(i) = error_entry(first_idx + i, e);
+      file_done(0, 0, true);
+    }
+  }
+
+  // hash buffered files (single file gains nothing from multi-buffer engine)
+  ObjectArray<ContentInfo> infos;
+  for (unsigned i = 0; i < file_cnt; i++) {
+    ContentInfo info;
+    info.file_size = data_sizes[i];
+    info.comp_size = 0;
+    infos += info;
+  }
+  for (unsigned h = 0; h < st.hashes.size(); h++) {
+    ContentHash hash = st.hashes[h];
+    if ((buffered_cnt > 1) && ((hash == ch_md5) || (hash == ch_sha1) || (hash == ch_sha256))) {
+      MbHashType type = hash == ch_md5 ? mbh_md5 : hash == ch_sha1 ? mbh_sha1 : mbh_sha256;
+      unsigned digest_size = MultiBufferHash::digest_size(type);
+      Array<u8> digests;
+      u8* digest = digests.buf(file_cnt * digest_size);
+      MultiBufferHash mb_hash(type);
+      for (unsigned i = 0; i < file_cnt; i++) {
+        if (data_offs[i] != -1) mb_hash.submit(data_buffer + data_offs[i], data_sizes[i], digest + i * digest_size);
+      }
+      mb_hash.flush();
+      for (unsigned i = 0; i < file_cnt; i++) {
+        if (data_offs[i] == -1) continue;
+        ContentInfo& info = infos.item(i);
+        Array<u8>& value = hash == ch_md5 ? info.md5 : hash == ch_sha1 ? info.sha1 : info.sha256;
+        value.copy(digest + i * digest_size, digest_size);
+      }
+    }
+    else {
+      for (unsigned i = 0; i < file_cnt; i++) {
+        if (data_offs[i] == -1) continue;
+        HashContext context(hash);
+        context.update(data_buffer + data_offs[i], data_sizes[i]);
+        context.finalize(infos.item(i));
+      }
+    }
+  }
+  for (unsigned i = 0; i < file_cnt; i++) {
+    if (data_offs[i] == -1) continue;
+    ContentInfo& info = infos.item(i);
+    if (st.options.compression) info.comp_size = compressed_size(data_buffer + data_offs[i], data_sizes[i]);
+    entries.item(i) = file_entry(first_idx + i, info);
+    file_done(info.file_size, info.comp_size, false);
+  }
+
+  AnsiString text;
+  for (unsigned i = 0; i < file_cnt; i++) text += entries[i];
+  return text;
+}
+
+unsigned __stdcall HashFilesWorker::th_proc(void* param) {
+  HashFilesState& st = *static_cast<HashFilesState*>(param);
+  try {
+    HashFilesWorker worker(st);
+    while (!st.stop) {
+      LONG item_idx = InterlockedIncrement(&st.next_item) - 1;
+      if (static_cast<unsigned>(item_idx) >= st.item_count()) break;
+      AnsiString text = worker.process_item(st.item_offs[item_idx], st.item_offs[item_idx + 1]);
+      st.write_item(item_idx, text);
+    }
+    return TRUE;
+  }
+  catch (Break&) {
+    return TRUE;
+  }
+  catch (Error& e) {
+    st.fail(e.message());
+    return FALSE;
+  }
+  catch (...) {
+    st.fail(L"Unexpected error");
+    return FALSE;
+  }
+}
+
+class HashFilesProgress: public ProgressMonitor {
+protected:
+  virtual void do_update_ui() {
+    const unsigned c_client_xs = 55;
+    ObjectArray<UnicodeString> lines;
+
+    u64 data_size, comp_size;
+    u64 time = time_elapsed();
+    unsigned file_cnt, err_cnt;
+    {
+      CriticalSectionLock lock(st.sync);
+      data_size = st.data_size;
+      comp_size = st.comp_size;
+      file_cnt = st.file_cnt;
+      err_cnt = st.err_cnt;
+    }
+    u64 est_size = st.est_size;
+
+    // percent done
+    unsigned percent_done;
+    if (est_size == 0) percent_done = 100;
+    else percent_done = (unsigned) (data_size * 100 / est_size);
+    if (percent_done > 100) percent_done = 100;
+
+    lines += UnicodeString::format(far_get_msg(MSG_CONTENT_MULTI_PROGRESS_PROCESSED).data(),
+      &format_inf_amount_short(data_size),
+      &format_inf_amount_short(est_size), percent_done);
+    if (time != 0) {
+      lines.item(lines.size() - 1).add(L' ').add_fmt(far_get_msg(MSG_CONTENT_MULTI_PROGRESS_SPEED).data(), &format_inf_amount_short(data_size * 1000 / time, true));
+    }
+
+    if (st.options.compression && (data_size != 0)) {
+      lines += UnicodeString::format(far_get_msg(MSG_CONTENT_MULTI_PROGRESS_COMPRESSION).data(), &format_inf_amount_short(comp_size),
+        &format_inf_amount_short(data_size), 100 * comp_size / data_size);
+    }
+    lines += L"\x1";
+
+    // progress bar
+    if (est_size != 0) {
+      unsigned len1 = (unsigned) (data_size * c_client_xs / est_size);
+      if (len1 > c_client_xs) len1 = c_client_xs;
+      unsigned len2 = c_client_xs - len1;
+      lines += UnicodeString::format(L"%.*c%.*c", len1, c_pb_black, len2, c_pb_white);
+    }
+
+    // time left
+    if ((time != 0) && (data_size != 0)) {
+      u64 total_time = est_size * time / data_size;
+      if (total_time < time) total_time = time;
+      lines += UnicodeString::format(far_get_msg(MSG_CONTENT_MULTI_PROGRESS_ELAPSED).data(), &format_time(time),
+        &format_time(total_time - time), &format_time(total_time));
+    }
+
+    lines += L"\x1";
+    lines += UnicodeString::format(far_get_msg(MSG_CONTENT_MULTI_PROGRESS_FILES).data(), file_cnt, st.est_file_cnt);
+    if (st.reparse_cnt != 0) lines += UnicodeString::format(far_get_msg(MSG_CONTENT_MULTI_PROGRESS_REPARSE).data(), st.reparse_cnt);
+    if (err_cnt != 0) lines += UnicodeString::format(far_get_msg(MSG_CONTENT_MULTI_PROGRESS_ERRORS).data(), err_cnt);
+
+    draw_text_box(far_get_msg(MSG_CONTENT_MULTI_PROGRESS_TITLE), lines, c_client_xs);
+    SetConsoleTitleW(UnicodeString::format(far_get_msg(MSG_CONTENT_MULTI_PROGRESS_CONSOLE_TITLE).data(), percent_done).data());
+    far_set_progress_state(TBPF_NORMAL);
+    far_set_progress_value(percent_done, 100);
+  }
+public:
+  HashFilesState& st;
+  HashFilesProgress(HashFilesState& st): ProgressMonitor(false), st(st) {
+  }
+};
+
+void list_directory_files(const UnicodeString& dir_name, HashFilesState& st, EstimationProgress& progress) {
+  bool root_dir = dir_name.last() == L'\\';
+  UnicodeString file_name;
+  WIN32_FIND_DATAW find_data;
+  bool more = true;
+  HANDLE h_find = FindFirstFileW(long_path(dir_name + (root_dir ? L"*" : L"\\*")).data(), &find_data);
+  if (h_find == INVALID_HANDLE_VALUE) {
+    if (GetLastError() != ERROR_NO_MORE_FILES) st.est_err_cnt++;
+  }
+  else {
+    ALLOC_RSRC(;);
+    while (more) {
+      if ((wcscmp(find_data.cFileName, L".") != 0) && (wcscmp(find_data.cFileName, L"..") != 0)) {
+        file_name = dir_name + (root_dir ? L"" : L"\\") + find_data.cFileName;
+
+        if ((find_data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == FILE_ATTRIBUTE_REPARSE_POINT) {
+          st.est_reparse_cnt++;
+        }
+        else if ((find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY) {
+          list_directory_files(file_name, st, progress);
+        }
+        else {
+          st.add_file(file_name, ((u64) find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow);
+        }
+      }
+
+      progress.update_ui();
+
+      if (FindNextFileW(h_find, &find_data) == 0) {
+        CHECK_SYS(GetLastError() == ERROR_NO_MORE_FILES);
+        more = false;
+      }
+    } // while
+    FREE_RSRC(VERIFY(FindClose(h_find) != 0));
+    st.est_dir_cnt++;
+  }
+}
+
+// ask for hash list file name
+// returns false if user cancelled dialog
+bool show_hash_list_dialog(const ObjectArray<UnicodeString>& file_list, UnicodeString& list_file_name) {
+  if (file_list.size() == 1) list_file_name = file_list[0] + L".hashes";
+  else list_file_name = add_trailing_slash(extract_file_path(file_list[0])) + L"files.hashes";
+  while (true) {
+    if (!far_input_box(c_hash_list_dialog_guid, far_get_msg(MSG_CONTENT_HASH_LIST_TITLE), far_get_msg(MSG_CONTENT_HASH_LIST_PROMPT), list_file_name, L"NTFSFile.HashList", L"Contents")) return false;
+    list_file_name = far_get_full_path(list_file_name);
+    if (GetFileAttributesW(long_path(list_file_name).data()) == INVALID_FILE_ATTRIBUTES) return true;
+    if (far_message(c_file_exists_dialog_guid, far_get_msg(MSG_CONTENT_HASH_LIST_TITLE) + L"\n" + word_wrap(far_get_msg(MSG_CONTENT_RESULT_FILE_EXISTS), get_msg_width()) + L"\n" + far_get_msg(MSG_BUTTON_OK) + L"\n" + far_get_msg(MSG_BUTTON_CANCEL), 2) == 0) return true;
+  }
+}
+
+void hash_files(const ObjectArray<UnicodeString>& file_list, const ContentOptions& options, const UnicodeString& list_file_name, HashFilesStats& result) {
+  HashFilesState st;
+  st.options = options;
+  if (options.crc32) st.hashes += ch_crc32;
+  if (options.md5) st.hashes += ch_md5;
+  if (options.sha1) st.hashes += ch_sha1;
+  if (options.sha256) st.hashes += ch_sha256;
+  if (options.ed2k) st.hashes += ch_ed2k;
+  if (options.crc16) st.hashes += ch_crc16;
+  st.compression = options.compression;
+  st.list_file_name = list_file_name;
+  st.base_path_len = add_trailing_slash(extract_file_path(file_list[0])).size();
+  st.name_offs += 0;
+  st.stop = FALSE;
+
+  // save Far screen
+  ALLOC_RSRC(HANDLE h_scr = g_far.SaveScreen(0, 0, -1, -1));
+
+  {
+    EstimationProgress progress(st);
+
+    st.est_size = st.est_file_cnt = st.est_dir_cnt = st.est_reparse_cnt = st.est_err_cnt = 0;
+
+    // list all files
+    for (unsigned i = 0; i < file_list.size(); i++) {
+      const UnicodeString& file_name = file_list[i];
+      WIN32_FILE_ATTRIBUTE_DATA fattr;
+      if (!GetFileAttributesExW(long_path(file_name).data(), GetFileExInfoStandard, &fattr)) {
+        st.est_err_cnt++;
+      }
+      else if ((fattr.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == FILE_ATTRIBUTE_REPARSE_POINT) {
+        st.est_reparse_cnt++;
+      }
+      else if ((fattr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY) {
+        list_directory_files(file_name, st, progress);
+      }
+      else {
+        st.add_file(file_name, ((u64) fattr.nFileSizeHigh << 32) | fattr.nFileSizeLow);
+      }
+    }
+  }
+  st.pack_items();
+
+  st.data_size = 0;
+  st.comp_size = 0;
+  st.time = 0;
+  st.file_cnt = 0;
+  st.dir_cnt = st.est_dir_cnt;
+  st.reparse_cnt = st.est_reparse_cnt;
+  st.err_cnt = st.est_err_cnt;
+
+  ALLOC_RSRC(st.h_list_file = CreateFileW(long_path(list_file_name).data(), FILE_WRITE_DATA, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL); CHECK_SYS(st.h_list_file != INVALID_HANDLE_VALUE));
+
+  HashFilesProgress progress(st);
+
+  // workers are mostly waiting for I/O, so there are more of them than processors
+  SYSTEM_INFO sys_info;
+  GetSystemInfo(&sys_info);
+  unsigned num_th = min(min(max(static_cast<unsigned>(sys_info.dwNumberOfProcessors), 1u) * 2, static_cast<unsigned>(MAXIMUM_WAIT_OBJECTS)), st.item_count());
+
+  ALLOC_RSRC(Array<HANDLE> h_wth);
+  try {
+    for (unsigned i = 0; i < num_th; i++) {
+      unsigned th_id;
+      HANDLE h = (HANDLE) _beginthreadex(NULL, 0, HashFilesWorker::th_proc, &st, 0, &th_id);
+      CHECK_SYS(h != NULL);
+      h_wth += h;
+    }
+    while (h_wth.size() != 0) {
+      DWORD w = WaitForMultipleObjects(h_wth.size(), h_wth.data(), TRUE, 100);
+      CHECK_SYS(w != WAIT_FAILED);
+      if (w != WAIT_TIMEOUT) break;
+      progress.update_ui();
+    }
+    CHECK_MSG(st.error.size() == 0, st.error);
+  }
+  finally (
+    if (h_wth.size() != 0) {
+      InterlockedExchange(&st.stop, TRUE);
+      VERIFY(WaitForMultipleObjects(h_wth.size(), h_wth.data(), TRUE, INFINITE) != WAIT_FAILED);
+    }
+  );
+  FREE_RSRC(
+    for (unsigned i = 0; i < h_wth.size(); i++) {
+      VERIFY(CloseHandle(h_wth[i]) != 0);
+    }
+  );
+
+  // populate result structure
+  progress.update_ui();
+  st.time = progress.time_elapsed();
+  result = st;
+
+  FREE_RSRC(VERIFY(CloseHandle(st.h_list_file) != 0));
+  FREE_RSRC(g_far.RestoreScreen(NULL); g_far.RestoreScreen(h_scr));
+}
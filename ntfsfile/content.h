@@ -24,10 +24,21 @@ struct CompressionStats {
   unsigned err_cnt; // number of files/dirs skipped because of errors
 };
 
-bool show_options_dialog(ContentOptions& options, bool single_file);
-void process_file_content(const UnicodeString& file_name, const ContentOptions& options, ContentInfo& result);
+struct HashFilesStats: public CompressionStats {
+  bool compression; // comp_size is calculated
+  UnicodeString list_file_name; // hash list file
+};
+
+class FilePanel;
+
+bool show_options_dialog(ContentOptions& options);
+// data of resident files is taken from MFT records if files are listed by MFT panel (panel is not NULL)
+void process_file_content(const UnicodeString& file_name, const ContentOptions& options, ContentInfo& result, FilePanel* panel = NULL);
 void show_result_dialog(const UnicodeString& file_name, const ContentOptions& options, const ContentInfo& info);
-void compress_files(const ObjectArray<UnicodeString>& file_list, CompressionStats& result);
+void compress_files(const ObjectArray<UnicodeString>& file_list, CompressionStats& result, FilePanel* panel = NULL);
 void show_result_dialog(const CompressionStats& stats);
+bool show_hash_list_dialog(const ObjectArray<UnicodeString>& file_list, UnicodeString& list_file_name);
+void hash_files(const ObjectArray<UnicodeString>& file_list, const ContentOptions& options, const UnicodeString& list_file_name, HashFilesStats& result);
+void show_result_dialog(const HashFilesStats& stats);
 
 #endif /* _CONTENT_H */
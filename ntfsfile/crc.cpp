@@ -0,0 +1,147 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include "utils.h"
+#include "crc.h"
+
+#if defined(_M_IX86) || defined(_M_X64)
+#define CRC_CLMUL
+#include <intrin.h>
+#include <wmmintrin.h>
+#endif
+
+// Reflected CRC of width up to 32 bits.
+// Portable kernel is slicing by 16: every 16 bytes go through 16 tables at once.
+// Carry-less multiplication kernel (PCLMULQDQ) folds 64 bytes per iteration into four 128-bit
+// accumulators; folded value is congruent to processed data modulo CRC polynomial, so last
+// accumulator is finished with tables.
+class CrcKernel: private NonCopyable {
+private:
+  u32 poly;
+  unsigned width;
+  u32 table[16][256]; // table[k][b] - CRC of byte b followed by k zero bytes
+#ifdef CRC_CLMUL
+  bool use_clmul;
+  u64 fold_64[2]; // multipliers to move 16 bytes 64 bytes forward
+  u64 fold_16[2]; // multipliers to move 16 bytes 16 bytes forward
+  u32 update_clmul(u32 crc, const u8* data, size_t size) const;
+#endif
+  u32 update_table(u32 crc, const u8* data, size_t size) const;
+  u64 xpow_mod(unsigned n) const;
+public:
+  CrcKernel(u32 poly, unsigned width);
+  u32 update(u32 crc, const u8* data, size_t size) const {
+#ifdef CRC_CLMUL
+    if (use_clmul) return update_clmul(crc, data, size);
+#endif
+    return update_table(crc, data, size);
+  }
+};
+
+CrcKernel::CrcKernel(u32 poly, unsigned width): poly(poly), width(width) {
+  for (unsigned i = 0; i < 256; i++) {
+    u32 crc = i;
+    for (unsigned j = 0; j < 8; j++) crc = crc & 1 ? (crc >> 1) ^ poly : crc >> 1;
+    table[0][i] = crc;
+  }
+  for (unsigned k = 1; k < 16; k++) {
+    for (unsigned i = 0; i < 256; i++) {
+      table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+    }
+  }
+#ifdef CRC_CLMUL
+  // product of reflected operands is shifted by one bit, hence one less power of x;
+  // low half of accumulator holds higher degree coefficients
+  fold_64[0] = xpow_mod(8 * 64 + 64 - 1);
+  fold_64[1] = xpow_mod(8 * 64 - 1);
+  fold_16[0] = xpow_mod(8 * 16 + 64 - 1);
+  fold_16[1] = xpow_mod(8 * 16 - 1);
+  int cpu_info[4];
+  __cpuid(cpu_info, 1);
+  bool sse2 = (cpu_info[3] & (1 << 26)) != 0;
+  bool pclmulqdq = (cpu_info[2] & (1 << 1)) != 0;
+  use_clmul = sse2 && pclmulqdq;
+#endif
+}
+
+// x^n modulo CRC polynomial as reflected 64-bit operand of carry-less multiplication
+u64 CrcKernel::xpow_mod(unsigned n) const {
+  u32 rem = 1u << (width - 1);
+  for (unsigned i = 0; i < n; i++) rem = rem & 1 ? (rem >> 1) ^ poly : rem >> 1;
+  return static_cast<u64>(rem) << (64 - width);
+}
+
+u32 CrcKernel::update_table(u32 crc, const u8* data, size_t size) const {
+  while (size >= 16) {
+    // CRC register (at most 32 bits) is combined with first data bytes
+    u32 v0 = crc ^ *reinterpret_cast<const u32*>(data);
+    u32 v1 = *reinterpret_cast<const u32*>(data + 4);
+    u32 v2 = *reinterpret_cast<const u32*>(data + 8);
+    u32 v3 = *reinterpret_cast<const u32*>(data + 12);
+    crc = table[15][v0 & 0xFF] ^ table[14][(v0 >> 8) & 0xFF] ^ table[13][(v0 >> 16) & 0xFF] ^ table[12][v0 >> 24] ^
+      table[11][v1 & 0xFF] ^ table[10][(v1 >> 8) & 0xFF] ^ table[9][(v1 >> 16) & 0xFF] ^ table[8][v1 >> 24] ^
+      table[7][v2 & 0xFF] ^ table[6][(v2 >> 8) & 0xFF] ^ table[5][(v2 >> 16) & 0xFF] ^ table[4][v2 >> 24] ^
+      table[3][v3 & 0xFF] ^ table[2][(v3 >> 8) & 0xFF] ^ table[1][(v3 >> 16) & 0xFF] ^ table[0][v3 >> 24];
+    data += 16;
+    size -= 16;
+  }
+  while (size) {
+    crc = (crc >> 8) ^ table[0][(crc ^ *data) & 0xFF];
+    data++;
+    size--;
+  }
+  return crc;
+}
+
+#ifdef CRC_CLMUL
+
+// x * x^(8 * distance) + next
+static inline __m128i crc_fold(__m128i x, __m128i k, __m128i next) {
+  return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), next);
+}
+
+u32 CrcKernel::update_clmul(u32 crc, const u8* data, size_t size) const {
+  if (size < 128) return update_table(crc, data, size);
+  const __m128i* p = reinterpret_cast<const __m128i*>(data);
+  __m128i x0 = _mm_xor_si128(_mm_loadu_si128(p), _mm_cvtsi32_si128(crc));
+  __m128i x1 = _mm_loadu_si128(p + 1);
+  __m128i x2 = _mm_loadu_si128(p + 2);
+  __m128i x3 = _mm_loadu_si128(p + 3);
+  p += 4;
+  size -= 64;
+  __m128i k = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fold_64));
+  while (size >= 64) {
+    x0 = crc_fold(x0, k, _mm_loadu_si128(p));
+    x1 = crc_fold(x1, k, _mm_loadu_si128(p + 1));
+    x2 = crc_fold(x2, k, _mm_loadu_si128(p + 2));
+    x3 = crc_fold(x3, k, _mm_loadu_si128(p + 3));
+    p += 4;
+    size -= 64;
+  }
+  k = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fold_16));
+  x0 = crc_fold(x0, k, x1);
+  x0 = crc_fold(x0, k, x2);
+  x0 = crc_fold(x0, k, x3);
+  while (size >= 16) {
+    x0 = crc_fold(x0, k, _mm_loadu_si128(p));
+    p++;
+    size -= 16;
+  }
+  u8 rem[16];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(rem), x0);
+  crc = update_table(0, rem, sizeof(rem));
+  return update_table(crc, reinterpret_cast<const u8*>(p), size);
+}
+
+#endif
+
+static const CrcKernel g_crc32_kernel(0xEDB88320, 32);
+static const CrcKernel g_crc16_kernel(0xA001, 16);
+
+u32 crc32_update(u32 crc, const u8* data, size_t size) {
+  return ~g_crc32_kernel.update(~crc, data, size);
+}
+
+u16 crc16_update(u16 crc, const u8* data, size_t size) {
+  return static_cast<u16>(g_crc16_kernel.update(crc, data, size));
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// CRC-32 (IEEE 802.3), same result as lzo_crc32(): 0 is passed for first block, previous result for next blocks
+u32 crc32_update(u32 crc, const u8* data, size_t size);
+
+const u16 c_crc16_init = 0xFFFF;
+// CRC-16 (reflected polynomial 0xA001) without final inversion
+u16 crc16_update(u16 crc, const u8* data, size_t size);
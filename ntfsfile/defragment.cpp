@@ -3,8 +3,8 @@
 
 #include "msg.h"
 
-#include "volume.h"
 #include "utils.h"
+#include "volume.h"
 #include "dlgapi.h"
 #include "log.h"
 #include "defragment.h"
@@ -72,6 +72,10 @@ void defragment(const UnicodeString& file_name, IDefragProgress& progress) {
   progress.total_clusters = progress.moved_clusters = 0;
   progress.update_defrag_ui(true);
   UnicodeString real_path = add_trailing_slash(get_real_path(extract_file_path(file_name))) + extract_file_name(file_name);
+  // Clusters are only queried and moved through file system (FSCTL_GET_VOLUME_BITMAP, FSCTL_MOVE_FILE),
+  // raw volume data is never read, so defragmenter does not use NtfsVolume::read() and its cache.
+  // USN close record written after clusters are moved makes NtfsVolume::flush() of other instances
+  // drop cached blocks.
   NtfsVolume volume;
   volume.open(extract_path_root(real_path));
   // file fragments
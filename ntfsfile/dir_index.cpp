@@ -0,0 +1,162 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include "utils.h"
+#include "ntfs.h"
+#include "volume.h"
+#include "ntfs_file.h"
+#include "mft_reader.h"
+#include "dir_index.h"
+
+#define CHECK_FMT(code) { if (!(code)) FAIL(MsgError(L"NTFS data structure parsing problem")); }
+
+// records below this number are NTFS metafiles (hidden from directory listings)
+const u64 c_first_user_file_rec = 16;
+// sanity limit for index attributes loaded into memory
+const u64 c_max_index_size = 256 * 1024 * 1024;
+
+// collects $I30 index attributes of a directory
+class I30Collector: public FileInfo::AttrVisitor {
+public:
+  Array<u8> root;
+  Array<FileInfo::DataRun> alloc_runs;
+  u64 alloc_size;
+  Array<u8> bitmap;
+  Array<FileInfo::DataRun> bitmap_runs;
+  u64 bitmap_size;
+  bool root_found;
+  I30Collector(): alloc_size(0), bitmap_size(0), root_found(false) {
+  }
+  virtual void visit(const MftRecView& file_rec, unsigned attr_off) {
+    const ATTR_HEADER* attr_header = file_rec.attr_header(attr_off);
+    if ((attr_header->type != AT_INDEX_ROOT) && (attr_header->type != AT_INDEX_ALLOCATION) && (attr_header->type != AT_BITMAP)) return;
+    if ((attr_header->name_length != 4) || (wcsncmp(file_rec.str(attr_off + attr_header->name_offset, 4), L"$I30", 4) != 0)) return;
+    if (attr_header->non_resident) {
+      CHECK_FMT(attr_header->type != AT_INDEX_ROOT);
+      const ATTR_NONRESIDENT* attr_info = file_rec.attr_info<ATTR_NONRESIDENT>(attr_off);
+      // extents are listed in VCN order
+      if (attr_header->type == AT_INDEX_ALLOCATION) {
+        FileInfo::decode_data_runs(file_rec, attr_off, &alloc_runs);
+        if (attr_info->lowest_vcn == 0) alloc_size = attr_info->initialized_size;
+      }
+      else {
+        FileInfo::decode_data_runs(file_rec, attr_off, &bitmap_runs);
+        if (attr_info->lowest_vcn == 0) bitmap_size = attr_info->initialized_size;
+      }
+    }
+    else {
+      CHECK_FMT(attr_header->type != AT_INDEX_ALLOCATION);
+      const ATTR_RESIDENT* attr_info = file_rec.attr_info<ATTR_RESIDENT>(attr_off);
+      const u8* value = file_rec.at<u8>(attr_off + attr_info->value_offset, attr_info->value_length);
+      if (attr_header->type == AT_INDEX_ROOT) {
+        root.copy(value, attr_info->value_length);
+        root_found = true;
+      }
+      else bitmap.copy(value, attr_info->value_length);
+    }
+  }
+};
+
+Array<u8> DirIndexReader::read_attr_data(const Array<FileInfo::DataRun>& data_runs, u64 data_size) {
+  u64 disk_size = 0;
+  for (unsigned i = 0; i < data_runs.size(); i++) {
+    CHECK_FMT(data_runs[i].lcn != -1); // index attributes cannot be sparse
+    disk_size += data_runs[i].len * volume.cluster_size;
+  }
+  CHECK_FMT((data_size <= disk_size) && (disk_size <= c_max_index_size));
+  Array<u8> data;
+  u8* buf = data.buf(static_cast<unsigned>(disk_size));
+  unsigned pos = 0;
+  for (unsigned i = 0; i < data_runs.size(); i++) {
+    unsigned size = static_cast<unsigned>(data_runs[i].len * volume.cluster_size);
+    volume.read(data_runs[i].lcn * volume.cluster_size, buf + pos, size);
+    pos += size;
+  }
+  data.set_size(static_cast<unsigned>(data_size));
+  return data;
+}
+
+void DirIndexReader::parse_entries(const MftRecView& node, unsigned index_off, std::list<DirEntry>& entries, std::map<u64, UnicodeString>& dos_names) {
+  const INDEX_HEADER* index = node.at<INDEX_HEADER>(index_off);
+  node.check(index_off, index->index_length);
+  unsigned end_off = index_off + index->index_length;
+  unsigned entry_off = index_off + index->entries_offset;
+  while (true) {
+    CHECK_FMT(entry_off + sizeof(INDEX_ENTRY_HEADER) <= end_off);
+    const INDEX_ENTRY_HEADER* entry = node.at<INDEX_ENTRY_HEADER>(entry_off);
+    if (entry->flags & INDEX_ENTRY_END) break;
+    CHECK_FMT((entry->length >= sizeof(INDEX_ENTRY_HEADER)) && (entry_off + entry->length <= end_off));
+    CHECK_FMT(entry->key_length >= sizeof(FILE_NAME_ATTR));
+
+    unsigned key_off = entry_off + sizeof(INDEX_ENTRY_HEADER);
+    const FILE_NAME_ATTR* fn_attr = node.at<FILE_NAME_ATTR>(key_off);
+    const wchar_t* name = node.str(key_off + sizeof(FILE_NAME_ATTR), fn_attr->file_name_length);
+    if (FILE_REF(entry->indexed_file) >= c_first_user_file_rec) {
+      if (fn_attr->file_name_type == FILE_NAME_DOS) {
+        dos_names[entry->indexed_file].copy(name, fn_attr->file_name_length);
+      }
+      else {
+        DirEntry dir_entry;
+        dir_entry.file_ref_num = entry->indexed_file;
+        dir_entry.file_name.copy(name, fn_attr->file_name_length);
+        dir_entry.file_attr = fn_attr->file_attributes & FILE_ATTR_VALID_FLAGS;
+        if (fn_attr->file_attributes & FILE_ATTR_I30_INDEX_PRESENT) dir_entry.file_attr |= FILE_ATTRIBUTE_DIRECTORY;
+        U64_TO_FILETIME(dir_entry.creation_time, fn_attr->creation_time);
+        U64_TO_FILETIME(dir_entry.last_access_time, fn_attr->last_access_time);
+        U64_TO_FILETIME(dir_entry.last_write_time, fn_attr->last_data_change_time);
+        dir_entry.data_size = fn_attr->data_size;
+        dir_entry.file_name_type = fn_attr->file_name_type;
+        entries.push_back(dir_entry);
+      }
+    }
+    entry_off += entry->length;
+  }
+}
+
+void DirIndexReader::read(u64 dir_ref_num, std::list<DirEntry>& entries) {
+  FileInfo dir_info;
+  dir_info.volume = &volume;
+  dir_info.ext_rec_cache = &ext_rec_cache;
+  dir_info.load_base_file_rec(dir_ref_num);
+  CHECK_FMT(dir_info.base_mft_rec()->flags & MFT_RECORD_IS_DIRECTORY);
+  I30Collector index;
+  dir_info.enum_attributes(index);
+  CHECK_FMT(index.root_found);
+
+  std::map<u64, UnicodeString> dos_names;
+  MftRecView root(index.root);
+  const INDEX_ROOT* index_root = root.at<INDEX_ROOT>(0);
+  CHECK_FMT(index_root->type == AT_FILE_NAME);
+  parse_entries(root, offsetof(INDEX_ROOT, index), entries, dos_names);
+
+  if (index_root->index.flags & LARGE_INDEX) {
+    unsigned block_size = index_root->index_block_size;
+    CHECK_FMT((block_size >= NTFS_BLOCK_SIZE) && (block_size % NTFS_BLOCK_SIZE == 0));
+    volume.flush();
+    Array<u8> alloc = read_attr_data(index.alloc_runs, index.alloc_size);
+    Array<u8> bitmap = index.bitmap_runs.size() ? read_attr_data(index.bitmap_runs, index.bitmap_size) : index.bitmap;
+    // node VCNs are counted in clusters, or in 512 byte blocks if node is smaller than cluster
+    unsigned vcn_size = block_size >= volume.cluster_size ? volume.cluster_size : NTFS_BLOCK_SIZE;
+    unsigned block_cnt = alloc.size() / block_size;
+    u8* alloc_buf = alloc.buf();
+    for (unsigned i = 0; i < block_cnt; i++) {
+      // free nodes may contain stale entries
+      if ((i / 8 >= bitmap.size()) || ((bitmap[i / 8] & (1 << (i % 8))) == 0)) continue;
+      u8* block = alloc_buf + i * block_size;
+      const INDEX_BLOCK* index_block = reinterpret_cast<const INDEX_BLOCK*>(block);
+      CHECK_FMT(index_block->magic == magic_INDX);
+      CHECK_FMT(apply_usa_fixups(block, block_size));
+      CHECK_FMT(index_block->index_block_vcn == static_cast<u64>(i) * block_size / vcn_size);
+      parse_entries(MftRecView(block, block_size), offsetof(INDEX_BLOCK, index), entries, dos_names);
+    }
+  }
+
+  // attach 8.3 names to their long names
+  if (dos_names.size()) {
+    for (std::list<DirEntry>::iterator entry = entries.begin(); entry != entries.end(); entry++) {
+      if (entry->file_name_type != FILE_NAME_WIN32) continue;
+      std::map<u64, UnicodeString>::const_iterator dos_name = dos_names.find(entry->file_ref_num);
+      if (dos_name != dos_names.end()) entry->alt_file_name = dos_name->second;
+    }
+  }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+// directory entry (as stored in $I30 index or returned by FindFirstFile)
+struct DirEntry {
+  u64 file_ref_num; // -1 if unknown
+  UnicodeString file_name;
+  UnicodeString alt_file_name;
+  DWORD file_attr;
+  FILETIME creation_time;
+  FILETIME last_access_time;
+  FILETIME last_write_time;
+  u64 data_size;
+  u8 file_name_type; // FILE_NAME namespace
+};
+
+// Reads directory listing directly from $I30 index:
+// INDEX_ROOT and in-use INDEX_ALLOCATION nodes (fixups applied, node VCNs verified).
+// All nodes are read sequentially, so entries are returned in no particular order.
+class DirIndexReader: private NonCopyable {
+private:
+  NtfsVolume& volume;
+  ExtRecCache ext_rec_cache;
+  Array<u8> read_attr_data(const Array<FileInfo::DataRun>& data_runs, u64 data_size);
+  void parse_entries(const MftRecView& node, unsigned index_off, std::list<DirEntry>& entries, std::map<u64, UnicodeString>& dos_names);
+public:
+  DirIndexReader(NtfsVolume& volume): volume(volume) {
+  }
+  void read(u64 dir_ref_num, std::list<DirEntry>& entries);
+};
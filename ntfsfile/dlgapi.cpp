@@ -66,6 +66,14 @@ int far_menu(const GUID& guid, const UnicodeString& title, const ObjectArray<Uni
   return g_far.Menu(&c_plugin_guid, &guid, -1, -1, 0, FMENU_WRAPMODE, title.data(), NULL, help, NULL, NULL, menu_items.data(), menu_items.size());
 }
 
+bool far_input_box(const GUID& guid, const UnicodeString& title, const UnicodeString& prompt, UnicodeString& text, const wchar_t* history, const wchar_t* help) {
+  const unsigned c_max_text_size = 1024;
+  UnicodeString src_text = text;
+  if (!g_far.InputBox(&c_plugin_guid, &guid, title.data(), prompt.data(), history, src_text.data(), text.buf(c_max_text_size), c_max_text_size, help, FIB_BUTTONS | FIB_NOUSELASTHISTORY)) return false;
+  text.set_size();
+  return true;
+}
+
 int far_viewer(const UnicodeString& file_name, const UnicodeString& title) {
   return g_far.Viewer(file_name.data(), title.data(), 0, 0, -1, -1, VF_DISABLEHISTORY | VF_ENABLE_F6 | VF_NONMODAL, CP_UNICODE);
 }
@@ -28,6 +28,7 @@ const wchar_t* far_msg_ptr(int id);
 unsigned get_msg_width();
 int far_message(const GUID& guid, const UnicodeString& msg, int button_cnt = 0, FARMESSAGEFLAGS flags = 0);
 int far_menu(const GUID& guid, const UnicodeString& title, const ObjectArray<UnicodeString>& items, const wchar_t* help = NULL);
+bool far_input_box(const GUID& guid, const UnicodeString& title, const UnicodeString& prompt, UnicodeString& text, const wchar_t* history = NULL, const wchar_t* help = NULL);
 int far_viewer(const UnicodeString& file_name, const UnicodeString& title);
 
 unsigned get_label_len(const UnicodeString& str);
@@ -15,7 +15,7 @@
 
 #define NOFAIL(code) try { code; } catch (...) { }
 
-#define CHECK(code) { if (!(code)) FAIL(MsgError(L#code)); }
+#define CHECK(code) { if (!(code)) FAIL(MsgError(L ## #code)); }
 #define CHECK_MSG(code, msg) { if (!(code)) FAIL(MsgError(msg)); }
 #define CHECK_STD(code) { if (!(code)) FAIL(StdIoError()); }
 #define CHECK_SYS(code) { if (!(code)) FAIL(SystemError()); }
@@ -9,6 +9,9 @@
 #include "ntfs.h"
 #include "volume.h"
 #include "ntfs_file.h"
+#include "dir_index.h"
+#include "mft_index.h"
+#include "name_search.h"
 #include "file_panel.h"
 
 #define IS_DIR(find_data) (((find_data).dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY)
@@ -116,13 +119,15 @@ void FilePanel::close() {
 }
 
 void FilePanel::on_close() {
+  stop_usn_monitor();
   if (g_file_panel_mode.use_usn_journal && is_journal_used() && g_file_panel_mode.use_cache) {
     try {
-      store_mft_index();
+      save_mft_index();
     }
     catch (...) {
     }
   }
+  finish_cache_compaction();
   delete_usn_journal();
   PanelInfo pi = { sizeof(PanelInfo) };
   if (far_control_ptr(this, FCTL_GETPANELINFO, &pi)) {
@@ -267,169 +272,211 @@ PluginItemList FilePanel::create_panel_items(const std::list<PanelItemData>& pid
   return pi_list;
 }
 
-void FilePanel::scan_dir(const UnicodeString& root_path, const UnicodeString& rel_path, std::list<PanelItemData>& pid_list, FileListProgress& progress) {
-  UnicodeString path = add_trailing_slash(root_path) + rel_path;
-  bool more = true;
+// list directory using $I30 index (no need to open every file to get its reference number)
+// falls back to FindFirstFile if index cannot be read (not an NTFS directory of current volume, no access, etc.)
+void FilePanel::list_dir(const UnicodeString& path, std::list<DirEntry>& dir_list) {
+  try {
+    BY_HANDLE_FILE_INFORMATION h_dir_info;
+    HANDLE h_dir = CreateFileW(long_path(path).data(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    CHECK_SYS(h_dir != INVALID_HANDLE_VALUE);
+    try {
+      CHECK_SYS(GetFileInformationByHandle(h_dir, &h_dir_info));
+    }
+    finally (CloseHandle(h_dir));
+    CHECK(h_dir_info.dwVolumeSerialNumber == volume.serial);
+    u64 dir_ref_num = ((u64) h_dir_info.nFileIndexHigh << 32) + h_dir_info.nFileIndexLow;
+    DirIndexReader index_reader(volume);
+    index_reader.read(dir_ref_num, dir_list);
+    return;
+  }
+  catch (Error& e) {
+    DBG_LOG(L"list_dir(): " + e.message());
+    dir_list.clear();
+  }
+
   WIN32_FIND_DATAW find_data;
   HANDLE h_find = FindFirstFileW(long_path(add_trailing_slash(path) + L"*").data(), &find_data);
-  try {
-    if (h_find == INVALID_HANDLE_VALUE) {
-      // special case: symlink that denies access to directory, try real path
-      if (GetLastError() == ERROR_ACCESS_DENIED) {
-        DWORD attr = GetFileAttributesW(long_path(path).data());
-        CHECK_SYS(attr != INVALID_FILE_ATTRIBUTES);
-        if (attr & FILE_ATTRIBUTE_REPARSE_POINT) {
-          h_find = FindFirstFileW(long_path(add_trailing_slash(get_real_path(path)) + L"*").data(), &find_data);
-        }
-        else CHECK_SYS(false);
+  if (h_find == INVALID_HANDLE_VALUE) {
+    // special case: symlink that denies access to directory, try real path
+    if (GetLastError() == ERROR_ACCESS_DENIED) {
+      DWORD attr = GetFileAttributesW(long_path(path).data());
+      CHECK_SYS(attr != INVALID_FILE_ATTRIBUTES);
+      if (attr & FILE_ATTRIBUTE_REPARSE_POINT) {
+        h_find = FindFirstFileW(long_path(add_trailing_slash(get_real_path(path)) + L"*").data(), &find_data);
       }
+      else CHECK_SYS(false);
     }
-    if (h_find == INVALID_HANDLE_VALUE) {
-      CHECK_SYS(GetLastError() == ERROR_NO_MORE_FILES);
-      more = false;
+  }
+  if (h_find == INVALID_HANDLE_VALUE) {
+    CHECK_SYS(GetLastError() == ERROR_NO_MORE_FILES);
+    return;
+  }
+  try {
+    while (true) {
+      if (!IS_DOT_DIR(find_data)) {
+        DirEntry dir_entry;
+        dir_entry.file_ref_num = -1;
+        dir_entry.file_name = find_data.cFileName;
+        dir_entry.alt_file_name = find_data.cAlternateFileName;
+        dir_entry.file_attr = find_data.dwFileAttributes;
+        dir_entry.creation_time = find_data.ftCreationTime;
+        dir_entry.last_access_time = find_data.ftLastAccessTime;
+        dir_entry.last_write_time = find_data.ftLastWriteTime;
+        dir_entry.data_size = FILE_SIZE(find_data);
+        dir_entry.file_name_type = FILE_NAME_WIN32;
+        dir_list.push_back(dir_entry);
+      }
+      if (FindNextFileW(h_find, &find_data) == 0) {
+        CHECK_SYS(GetLastError() == ERROR_NO_MORE_FILES);
+        break;
+      }
     }
   }
+  finally (VERIFY(FindClose(h_find)));
+}
+
+void FilePanel::scan_dir(const UnicodeString& root_path, const UnicodeString& rel_path, std::list<PanelItemData>& pid_list, FileListProgress& progress) {
+  UnicodeString path = add_trailing_slash(root_path) + rel_path;
+  std::list<DirEntry> dir_list;
+  try {
+    list_dir(path, dir_list);
+  }
   catch (...) {
-    if (flat_mode) more = false;
+    if (flat_mode) return;
     else throw;
   }
-  ALLOC_RSRC(;);
-  while (more) {
-    if (!IS_DOT_DIR(find_data)) {
-      UnicodeString file_path = add_trailing_slash(path) + find_data.cFileName;
-      UnicodeString rel_file_path = add_trailing_slash(rel_path) + find_data.cFileName;
-
-      UnicodeString file_name = flat_mode ? rel_file_path : find_data.cFileName;
-      u64 data_size = 0;
-      u64 nr_disk_size = 0;
-      u64 valid_size = 0;
-      unsigned stream_cnt = 0;
-      unsigned fragment_cnt = 0;
-      unsigned hard_link_cnt = 0;
-      unsigned mft_rec_cnt = 0;
-      bool error = false;
-      FileInfo file_info;
-      volume.synced = false;
-      try {
+  for (std::list<DirEntry>::const_iterator dir_entry = dir_list.begin(); dir_entry != dir_list.end(); dir_entry++) {
+    UnicodeString file_path = add_trailing_slash(path) + dir_entry->file_name;
+    UnicodeString rel_file_path = add_trailing_slash(rel_path) + dir_entry->file_name;
+
+    UnicodeString file_name = flat_mode ? rel_file_path : dir_entry->file_name;
+    u64 data_size = 0;
+    u64 nr_disk_size = 0;
+    u64 valid_size = 0;
+    unsigned stream_cnt = 0;
+    unsigned fragment_cnt = 0;
+    unsigned hard_link_cnt = 0;
+    unsigned mft_rec_cnt = 0;
+    bool error = false;
+    FileInfo file_info;
+    try {
+      u64 file_ref_num = dir_entry->file_ref_num;
+      if (file_ref_num == -1) {
         BY_HANDLE_FILE_INFORMATION h_file_info;
         HANDLE h_file = CreateFileW(long_path(file_path).data(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_POSIX_SEMANTICS, NULL);
         CHECK_SYS(h_file != INVALID_HANDLE_VALUE);
         ALLOC_RSRC(;);
         CHECK_SYS(GetFileInformationByHandle(h_file, &h_file_info));
         FREE_RSRC(CloseHandle(h_file));
+        file_ref_num = ((u64) h_file_info.nFileIndexHigh << 32) + h_file_info.nFileIndexLow;
+      }
+      file_info.volume = &volume;
+      file_info.process_file(file_ref_num);
 
-        u64 file_ref_num = ((u64) h_file_info.nFileIndexHigh << 32) + h_file_info.nFileIndexLow;
-        file_info.volume = &volume;
-        file_info.process_file(file_ref_num);
-
-        hard_link_cnt = h_file_info.nNumberOfLinks;
-        mft_rec_cnt = file_info.mft_rec_cnt;
-        for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
-          const AttrInfo& attr_info = file_info.attr_list[i];
-          if (!attr_info.resident) {
-            nr_disk_size += attr_info.disk_size;
-          }
-          if (attr_info.type == AT_DATA) {
-            data_size += attr_info.data_size;
-            valid_size += attr_info.valid_size;
-            stream_cnt++;
-          }
-          if (attr_info.fragments > 1) fragment_cnt += (unsigned) (attr_info.fragments - 1);
+      for (unsigned i = 0; i < file_info.file_name_list.size(); i++) {
+        if (file_info.file_name_list[i].file_name_type != FILE_NAME_DOS) hard_link_cnt++;
+      }
+      mft_rec_cnt = file_info.mft_rec_cnt;
+      for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
+        const AttrInfo& attr_info = file_info.attr_list[i];
+        if (!attr_info.resident) {
+          nr_disk_size += attr_info.disk_size;
         }
+        if (attr_info.type == AT_DATA) {
+          data_size += attr_info.data_size;
+          valid_size += attr_info.valid_size;
+          stream_cnt++;
+        }
+        if (attr_info.fragments > 1) fragment_cnt += (unsigned) (attr_info.fragments - 1);
       }
-      catch (...) {
-        error = true;
+    }
+    catch (...) {
+      error = true;
+    }
+
+    // is file fully resident?
+    bool fully_resident = true;
+    for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
+      if (!file_info.attr_list[i].resident) {
+        fully_resident = false;
+        break;
       }
+    }
 
-      // is file fully resident?
-      bool fully_resident = true;
+    PanelItemData pid;
+    pid.file_name = file_name;
+    pid.alt_file_name = dir_entry->alt_file_name;
+    pid.file_attr = dir_entry->file_attr;
+    pid.creation_time = dir_entry->creation_time;
+    pid.last_access_time = dir_entry->last_access_time;
+    pid.last_write_time = dir_entry->last_write_time;
+    pid.data_size = data_size;
+    pid.disk_size = nr_disk_size;
+    pid.valid_size = valid_size;
+    pid.fragment_cnt = fragment_cnt;
+    pid.stream_cnt = stream_cnt;
+    pid.hard_link_cnt = hard_link_cnt;
+    pid.mft_rec_cnt = mft_rec_cnt;
+    pid.error = error;
+    pid.ntfs_attr = false;
+    pid.resident = fully_resident;
+    pid_list.push_back(pid);
+
+    if (g_file_panel_mode.show_streams && !error) {
+      unsigned cnt = 0;
+      bool named_data = false;
       for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
-        if (!file_info.attr_list[i].resident) {
-          fully_resident = false;
-          break;
-        }
+        const AttrInfo& attr = file_info.attr_list[i];
+        if (!attr.resident || (attr.type == AT_DATA)) cnt++;
+        if ((attr.type == AT_DATA) && (attr.name.size() != 0)) named_data = true;
       }
-
-      PanelItemData pid;
-      pid.file_name = file_name;
-      pid.alt_file_name = find_data.cAlternateFileName;
-      pid.file_attr = find_data.dwFileAttributes;
-      pid.creation_time = find_data.ftCreationTime;
-      pid.last_access_time = find_data.ftLastAccessTime;
-      pid.last_write_time = find_data.ftLastWriteTime;
-      pid.data_size = data_size;
-      pid.disk_size = nr_disk_size;
-      pid.valid_size = valid_size;
-      pid.fragment_cnt = fragment_cnt;
-      pid.stream_cnt = stream_cnt;
-      pid.hard_link_cnt = hard_link_cnt;
-      pid.mft_rec_cnt = mft_rec_cnt;
-      pid.error = error;
-      pid.ntfs_attr = false;
-      pid.resident = fully_resident;
-      pid_list.push_back(pid);
-
-      if (g_file_panel_mode.show_streams && !error) {
-        unsigned cnt = 0;
-        bool named_data = false;
+      // multiple non-resident/data attributes or at least one named data attribute
+      if ((cnt > 1) || named_data) {
         for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
           const AttrInfo& attr = file_info.attr_list[i];
-          if (!attr.resident || (attr.type == AT_DATA)) cnt++;
-          if ((attr.type == AT_DATA) && (attr.name.size() != 0)) named_data = true;
-        }
-        // multiple non-resident/data attributes or at least one named data attribute
-        if ((cnt > 1) || named_data) {
-          for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
-            const AttrInfo& attr = file_info.attr_list[i];
-            if (attr.resident && (attr.type != AT_DATA)) continue;
-            if (!g_file_panel_mode.show_main_stream && (attr.type == AT_DATA) && (attr.name.size() == 0)) continue;
-
-            UnicodeString file_name = UnicodeString(flat_mode ? rel_file_path : find_data.cFileName) + L":" + attr.name + L":$" + attr.type_name();
-
-            unsigned fragment_cnt = (unsigned) attr.fragments;
-            if (fragment_cnt != 0) fragment_cnt--;
-
-            DWORD file_attr = find_data.dwFileAttributes & ~FILE_ATTRIBUTE_DIRECTORY & ~FILE_ATTRIBUTE_REPARSE_POINT;
-            if (attr.compressed) file_attr |= FILE_ATTRIBUTE_COMPRESSED;
-            else file_attr &= ~FILE_ATTRIBUTE_COMPRESSED;
-            if (attr.encrypted) file_attr |= FILE_ATTRIBUTE_ENCRYPTED;
-            else file_attr &= ~FILE_ATTRIBUTE_ENCRYPTED;
-            if (attr.sparse) file_attr |= FILE_ATTRIBUTE_SPARSE_FILE;
-            else file_attr &= ~FILE_ATTRIBUTE_SPARSE_FILE;
-
-            PanelItemData pid;
-            pid.file_name = file_name;
-            pid.alt_file_name = L"";
-            pid.file_attr = file_attr;
-            pid.creation_time = find_data.ftCreationTime;
-            pid.last_access_time = find_data.ftLastAccessTime;
-            pid.last_write_time = find_data.ftLastWriteTime;
-            pid.data_size = attr.data_size;
-            pid.disk_size = attr.disk_size;
-            pid.valid_size = attr.valid_size;
-            pid.fragment_cnt = fragment_cnt;
-            pid.stream_cnt = 0;
-            pid.hard_link_cnt = 0;
-            pid.mft_rec_cnt = 0;
-            pid.error = false;
-            pid.ntfs_attr = true;
-            pid.resident = attr.resident;
-            pid_list.push_back(pid);
-          }
+          if (attr.resident && (attr.type != AT_DATA)) continue;
+          if (!g_file_panel_mode.show_main_stream && (attr.type == AT_DATA) && (attr.name.size() == 0)) continue;
+
+          UnicodeString file_name = (flat_mode ? rel_file_path : dir_entry->file_name) + L":" + attr.name + L":$" + attr.type_name();
+
+          unsigned fragment_cnt = (unsigned) attr.fragments;
+          if (fragment_cnt != 0) fragment_cnt--;
+
+          DWORD file_attr = dir_entry->file_attr & ~FILE_ATTRIBUTE_DIRECTORY & ~FILE_ATTRIBUTE_REPARSE_POINT;
+          if (attr.compressed) file_attr |= FILE_ATTRIBUTE_COMPRESSED;
+          else file_attr &= ~FILE_ATTRIBUTE_COMPRESSED;
+          if (attr.encrypted) file_attr |= FILE_ATTRIBUTE_ENCRYPTED;
+          else file_attr &= ~FILE_ATTRIBUTE_ENCRYPTED;
+          if (attr.sparse) file_attr |= FILE_ATTRIBUTE_SPARSE_FILE;
+          else file_attr &= ~FILE_ATTRIBUTE_SPARSE_FILE;
+
+          PanelItemData pid;
+          pid.file_name = file_name;
+          pid.alt_file_name = L"";
+          pid.file_attr = file_attr;
+          pid.creation_time = dir_entry->creation_time;
+          pid.last_access_time = dir_entry->last_access_time;
+          pid.last_write_time = dir_entry->last_write_time;
+          pid.data_size = attr.data_size;
+          pid.disk_size = attr.disk_size;
+          pid.valid_size = attr.valid_size;
+          pid.fragment_cnt = fragment_cnt;
+          pid.stream_cnt = 0;
+          pid.hard_link_cnt = 0;
+          pid.mft_rec_cnt = 0;
+          pid.error = false;
+          pid.ntfs_attr = true;
+          pid.resident = attr.resident;
+          pid_list.push_back(pid);
         }
       }
+    }
 
-      progress.count++;
-      progress.update_ui();
+    progress.count++;
+    progress.update_ui();
 
-      if (flat_mode && IS_DIR(find_data) && !IS_REPARSE(find_data)) scan_dir(root_path, rel_file_path, pid_list, progress);
-    }
-    if (FindNextFileW(h_find, &find_data) == 0) {
-      CHECK_SYS(GetLastError() == ERROR_NO_MORE_FILES);
-      more = false;
-    }
+    if (flat_mode && (dir_entry->file_attr & FILE_ATTRIBUTE_DIRECTORY) && !(dir_entry->file_attr & FILE_ATTRIBUTE_REPARSE_POINT)) scan_dir(root_path, rel_file_path, pid_list, progress);
   }
-  FREE_RSRC(if (h_find != INVALID_HANDLE_VALUE) VERIFY(FindClose(h_find)));
 }
 
 void FilePanel::sort_file_list(std::list<PanelItemData>& pid_list) {
@@ -525,18 +572,16 @@ void FilePanel::new_file_list(PluginPanelItem*& panel_items, size_t& item_num, b
   }
   else {
     if (mft_mode) {
-      if (g_file_panel_mode.use_usn_journal && is_journal_used() && !search_mode) {
-        try {
-          update_mft_index_from_usn();
-        }
-        catch (...) {
-          create_mft_index();
-        }
-      }
-      mft_scan_dir(mft_find_path(current_dir), L"", pid_list, progress);
+      if (g_file_panel_mode.use_usn_journal && !search_mode) update_mft_index();
+      SharedLock lock(index_sync);
+      if (search_mask.size() && !search_mode) mft_search_names(mft_find_path(current_dir), pid_list, progress);
+      else mft_scan_dir(mft_find_path(current_dir), L"", pid_list, progress);
     }
-    else
+    else {
+      // volume without USN journal is flushed once per listing (see NtfsVolume::flush())
+      volume.synced = false;
       scan_dir(current_dir, L"", pid_list, progress);
+    }
     if (!search_mode) sort_file_list(pid_list);
     file_lists += create_panel_items(pid_list, search_mode);
   }
@@ -572,6 +617,7 @@ void FilePanel::change_directory(const UnicodeString& target_dir, bool search_mo
     new_cur_dir = add_trailing_slash(current_dir) + target_dir;
   }
   if (new_cur_dir.size() == 0) {
+    stop_usn_monitor();
     invalidate_mft_index();
     delete_usn_journal();
   }
@@ -582,15 +628,11 @@ void FilePanel::change_directory(const UnicodeString& target_dir, bool search_mo
       if (current_dir.size() == 0) {
         open_volume(new_cur_dir);
       }
-      if (g_file_panel_mode.use_usn_journal && is_journal_used() && !search_mode) {
-        try {
-          update_mft_index_from_usn();
-        }
-        catch (...) {
-          create_mft_index();
-        }
+      if (g_file_panel_mode.use_usn_journal && !search_mode) update_mft_index();
+      {
+        SharedLock lock(index_sync);
+        mft_find_path(new_cur_dir);
       }
-      mft_find_path(new_cur_dir);
       if (!search_mode) SetCurrentDirectoryW(new_cur_dir.data());
     }
     else {
@@ -604,6 +646,7 @@ void FilePanel::change_directory(const UnicodeString& target_dir, bool search_mo
   }
   current_dir = new_cur_dir;
   if (g_file_panel_mode.flat_mode_auto_off) flat_mode = false;
+  search_mask.clear();
 }
 
 void FilePanel::fill_plugin_info(OpenPanelInfo* info) {
@@ -623,6 +666,7 @@ void FilePanel::fill_plugin_info(OpenPanelInfo* info) {
   panel_title += L':';
   info->CurDir = current_dir.data();
   panel_title += current_dir;
+  if (search_mask.size()) panel_title += L" [" + search_mask + L"]";
   info->PanelTitle = panel_title.data();
 
   col_indices.clear();
@@ -670,8 +714,8 @@ private:
   int delete_usn_journal_ctrl_id;
   int delete_own_usn_journal_ctrl_id;
   int use_cache_ctrl_id;
+  int live_update_ctrl_id;
   int default_mft_mode_ctrl_id;
-  int backward_mft_scan_ctrl_id;
   int cache_dir_lbl_id;
   int cache_dir_ctrl_id;
   int flat_mode_auto_off_ctrl_id;
@@ -696,8 +740,8 @@ private:
       dlg->mode.delete_usn_journal = dlg->get_check(dlg->delete_usn_journal_ctrl_id);
       dlg->mode.delete_own_usn_journal = dlg->get_check(dlg->delete_own_usn_journal_ctrl_id);
       dlg->mode.use_cache = dlg->get_check(dlg->use_cache_ctrl_id);
+      dlg->mode.live_update = dlg->get_check(dlg->live_update_ctrl_id);
       dlg->mode.default_mft_mode = dlg->get_check(dlg->default_mft_mode_ctrl_id);
-      dlg->mode.backward_mft_scan = dlg->get_check(dlg->backward_mft_scan_ctrl_id);
       dlg->mode.cache_dir = dlg->get_text(dlg->cache_dir_ctrl_id);
       dlg->mode.flat_mode_auto_off = dlg->get_check(dlg->flat_mode_auto_off_ctrl_id);
     }
@@ -711,6 +755,7 @@ private:
       dlg->enable(dlg->use_cache_ctrl_id, param2 != 0);
       dlg->enable(dlg->cache_dir_lbl_id, param2 != 0 && dlg->get_check(dlg->use_cache_ctrl_id));
       dlg->enable(dlg->cache_dir_ctrl_id, param2 != 0 && dlg->get_check(dlg->use_cache_ctrl_id));
+      dlg->enable(dlg->live_update_ctrl_id, param2 != 0);
     }
     else if ((msg == DN_BTNCLICK) && (param1 == dlg->use_cache_ctrl_id)) {
       dlg->enable(dlg->cache_dir_lbl_id, param2 != 0);
@@ -780,8 +825,6 @@ public:
     sort_mode_ctrl_id = combo_box(items, mode.custom_sort_mode, max_size + 1, DIF_DROPDOWNLIST);
     new_line();
     default_mft_mode_ctrl_id = check_box(far_get_msg(MSG_FILE_PANEL_DEFAULT_MFT_MODE), mode.default_mft_mode);
-    spacer(2);
-    backward_mft_scan_ctrl_id = check_box(far_get_msg(MSG_FILE_PANEL_BACKWARD_MFT_SCAN), mode.backward_mft_scan);
     new_line();
     separator();
     new_line();
@@ -807,6 +850,8 @@ public:
     spacer(1);
     cache_dir_ctrl_id = var_edit_box(mode.cache_dir, AUTO_SIZE, mode.use_cache && mode.use_usn_journal ? 0 : DIF_DISABLE);
     new_line();
+    live_update_ctrl_id = check_box(far_get_msg(MSG_FILE_PANEL_LIVE_UPDATE), mode.live_update, mode.use_usn_journal ? 0 : DIF_DISABLE);
+    new_line();
     separator();
     new_line();
 
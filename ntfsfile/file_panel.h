@@ -1,5 +1,9 @@
 #pragma once
 
+struct DirEntry;
+struct DirPath;
+class UsnJournalSource;
+
 struct PluginItemList: public Array<PluginPanelItem> {
   ObjectArray<UnicodeString> names;
   ObjectArray<UnicodeString> col_str;
@@ -61,54 +65,71 @@ private:
   void parse_column_spec(const UnicodeString& src_col_types, const UnicodeString& src_col_widths, UnicodeString& col_types, UnicodeString& col_widths, bool title);
   PluginItemList create_panel_items(const std::list<PanelItemData>& pid_list, bool search_mode);
   PluginItemList create_volume_items();
+  void list_dir(const UnicodeString& path, std::list<DirEntry>& dir_list);
   void scan_dir(const UnicodeString& root_path, const UnicodeString& rel_path, std::list<PanelItemData>& pid_list, FileListProgress& progress);
   void sort_file_list(std::list<PanelItemData>& pid_list);
-  struct FileRecord {
-    u64 file_ref_num;
-    u64 parent_ref_num;
-    UnicodeString file_name;
-    DWORD file_attr;
-    FILETIME creation_time;
-    FILETIME last_access_time;
-    FILETIME last_write_time;
-    u64 data_size;
-    u64 disk_size;
-    u64 valid_size;
-    u32 fragment_cnt;
-    u32 mft_rec_cnt;
-    u16 stream_cnt;
-    u16 hard_link_cnt;
-    u8 flags;
-    bool ntfs_attr() const { return (flags & 1) != 0; }
-    bool resident() const { return (flags & 2) != 0; }
-    void set_flags(bool ntfs_attr, bool resident) { flags = (ntfs_attr ? 1 : 0) | (resident ? 2 : 0); }
-  };
-  struct FileRecordCompare;
   DWORDLONG usn_journal_id;
   USN next_usn;
   bool is_journal_created;
   bool is_journal_used() const {
     return usn_journal_id != 0;
   }
-  ObjectArray<FileRecord> mft_index;
+  MftIndex mft_index;
+  NameSearchIndex name_search; // built on first search
+  UnicodeString search_mask; // panel shows files matching mask instead of directory contents
   void invalidate_mft_index() {
     mft_index.clear();
+    name_search.clear();
     usn_journal_id = 0;
+    cache_synced = false;
   }
   u64 root_dir_ref_num;
-  void add_file_records(std::list<FileRecord>& file_list, const FileInfo& file_info);
+  // cache file and USN log together match the index
+  bool cache_synced;
+  u64 usn_log_size;
+  class CacheCompactor;
+  CacheCompactor* cache_compactor;
+  // Index is updated by live update thread while it is running. Thread takes exclusive lock to merge
+  // changes and to write USN log (cache_synced, usn_log_size, cache_compactor), UI thread takes shared
+  // lock to read index and stops the thread before any other index change.
+  ReadWriteLock index_sync;
+  class UsnMonitor;
+  UsnMonitor* usn_monitor;
+  UnicodeString mft_index_cache_name;
+  class RecordLoadProgress;
   void prepare_usn_journal();
   void delete_usn_journal();
   void create_mft_index();
   void update_mft_index_from_usn();
+  void apply_usn_changes(USN start_usn, USN end_usn, const std::set<u64>& file_refs, const std::list<FileRecord>& file_list, Array<u8>& log_entry);
+  // takes ownership of journal source (volume journal is used if NULL)
+  void start_usn_monitor(UsnJournalSource* journal = NULL);
+  void stop_usn_monitor();
+  // bring index up to date with USN journal (unless live update thread does it)
+  void update_mft_index();
+  void mft_fill_item(PanelItemData& pid, unsigned idx, const UnicodeString& rel_path);
   void mft_scan_dir(u64 parent_file_index, const UnicodeString& rel_path, std::list<PanelItemData>& pid_list, FileListProgress& progress);
-  u64 mft_find_root() const;
-  u64 mft_find_path(const UnicodeString& path);
+  bool mft_rel_path(u64 dir_ref_num, u64 base_ref_num, std::map<u64, DirPath>& dir_paths, UnicodeString& rel_path);
+  void mft_search_names(u64 dir_ref_num, std::list<PanelItemData>& pid_list, FileListProgress& progress);
+  // file_idx receives index record of path (optional)
+  u64 mft_find_path(const UnicodeString& path, unsigned* file_idx = NULL);
   void store_mft_index();
   void load_mft_index();
+  UnicodeString get_usn_log_name();
+  void encode_usn_log_entry(Array<u8>& entry, USN start_usn, const std::set<u64>& file_refs, const std::list<FileRecord>& file_list);
+  void append_usn_log(const Array<u8>& entry);
+  void write_usn_log(const Array<u8>& log_entry);
+  void replay_usn_log();
+  void start_cache_compaction();
+  void finish_cache_compaction();
+  // store index changes into USN log or rewrite cache file
+  void save_mft_index();
+  void load_file_records(NtfsVolume& volume, const std::set<u64>& file_refs, std::list<FileRecord>& file_list, RecordLoadProgress* progress = NULL);
+  // replace index records of given files with current ones from MFT
+  void reload_file_records(const std::set<u64>& file_refs);
   UnicodeString get_mft_index_cache_name();
   void open_volume(const UnicodeString& dir);
-  FilePanel(): usn_journal_id(0), is_journal_created(false) {}
+  FilePanel(): usn_journal_id(0), is_journal_created(false), cache_synced(false), usn_log_size(0), cache_compactor(NULL), usn_monitor(NULL) {}
 public:
   UnicodeString current_dir;
   bool flat_mode;
@@ -123,22 +144,15 @@ public:
   void change_directory(const UnicodeString& target_dir, bool search_mode);
   void fill_plugin_info(OpenPanelInfo* info);
   void toggle_mft_mode();
+  // show files with names matching mask in current directory and its subdirectories (empty mask - normal view)
+  void mft_search(const UnicodeString& mask);
   void reload_mft();
   static void reload_mft_all();
-  struct Totals {
-    u64 data_size;
-    u64 disk_size;
-    u64 fragment_cnt;
-    unsigned file_cnt;
-    unsigned dir_cnt;
-    unsigned hl_cnt;
-    unsigned file_rp_cnt;
-    unsigned dir_rp_cnt;
-    Totals() {
-      memset(this, 0, sizeof(*this));
-    }
-  };
+  typedef MftTotals Totals;
   Totals mft_get_totals(const ObjectArray<UnicodeString>& file_list);
+  // Data of file stored resident in its MFT record. Record is loaded only if MFT index marks file
+  // resident with the same size; false if file must be read normally.
+  bool mft_read_resident(const UnicodeString& file_name, u64 file_size, Array<u8>& data);
 };
 
 bool show_file_panel_mode_dialog(FilePanelMode& mode);
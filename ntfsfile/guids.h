@@ -69,3 +69,11 @@ DEFINE_GUID(c_show_totals_dialog_guid,
 // {5CA0007C-F16D-4087-B566-05A615CC48FE}
 DEFINE_GUID(c_progress_dialog_guid,
 0x5ca0007c, 0xf16d, 0x4087, 0xb5, 0x66, 0x5, 0xa6, 0x15, 0xcc, 0x48, 0xfe);
+
+// {5C2F7E4A-9B1D-4E83-A6F0-3D8B2C71E95A}
+DEFINE_GUID(c_mft_search_dialog_guid,
+0x5c2f7e4a, 0x9b1d, 0x4e83, 0xa6, 0xf0, 0x3d, 0x8b, 0x2c, 0x71, 0xe9, 0x5a);
+
+// {A3E61D28-47C5-4B9F-8E02-6D9C14F7B3A1}
+DEFINE_GUID(c_hash_list_dialog_guid,
+0xa3e61d28, 0x47c5, 0x4b9f, 0x8e, 0x02, 0x6d, 0x9c, 0x14, 0xf7, 0xb3, 0xa1);
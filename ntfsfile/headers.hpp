@@ -21,6 +21,8 @@
 #include <list>
 #include <set>
 #include <map>
+#include <unordered_set>
+#include <unordered_map>
 #include <algorithm>
 #include <memory>
 using namespace std;
@@ -0,0 +1,140 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include "utils.h"
+#include "crc.h"
+#include "lzo_chunks.h"
+
+unsigned lzo_chunk_buffer_size(unsigned src_size) {
+  return src_size + src_size / 16 + 64 + 3;
+}
+
+void LzoChunkCodec::process(LzoChunk& chunk, u8* work_buf) {
+  if (compress) {
+    lzo_uint sz = chunk.dst_size;
+    if ((lzo1x_1_compress(chunk.src, chunk.src_size, chunk.dst, &sz, work_buf) == LZO_E_OK) && (sz < chunk.src_size)) {
+      chunk.compressed = true;
+      chunk.dst_size = static_cast<unsigned>(sz);
+    }
+    else {
+      // incompressible data is stored as is
+      memcpy(chunk.dst, chunk.src, chunk.src_size);
+      chunk.compressed = false;
+      chunk.dst_size = chunk.src_size;
+    }
+    chunk.checksum = crc32_update(0, chunk.dst, chunk.dst_size);
+    chunk.valid = true;
+  }
+  else {
+    chunk.valid = false;
+    if (crc32_update(0, chunk.src, chunk.src_size) == chunk.checksum) {
+      if (chunk.compressed) {
+        lzo_uint sz = chunk.dst_size;
+        chunk.valid = (lzo1x_decompress_safe(chunk.src, chunk.src_size, chunk.dst, &sz, NULL) == LZO_E_OK) && (sz == chunk.dst_size);
+      }
+      else if (chunk.src_size == chunk.dst_size) {
+        memcpy(chunk.dst, chunk.src, chunk.src_size);
+        chunk.valid = true;
+      }
+    }
+    if (!chunk.valid) memset(chunk.dst, 0, chunk.dst_size);
+  }
+}
+
+unsigned __stdcall LzoChunkCodec::Worker::th_proc(void* param) {
+  Worker* w = static_cast<Worker*>(param);
+  LzoChunkCodec* codec = w->codec;
+  while (true) {
+    if (WaitForSingleObject(w->h_start_event, INFINITE) != WAIT_OBJECT_0) return FALSE;
+    if (codec->stop) return TRUE;
+    while (true) {
+      LONG idx = InterlockedIncrement(&codec->next_chunk) - 1;
+      if (static_cast<unsigned>(idx) >= codec->chunk_cnt) break;
+      codec->process(codec->chunks[idx], w->work_buf.buf());
+      InterlockedIncrement(&codec->done_cnt);
+    }
+    if (!SetEvent(w->h_done_event)) return FALSE;
+  }
+}
+
+LzoChunkCodec::LzoChunkCodec(): chunks(NULL), chunk_cnt(0), compress(false), running(false), stop(false), next_chunk(0), done_cnt(0) {
+  SYSTEM_INFO sys_info;
+  GetSystemInfo(&sys_info);
+  unsigned num_th = min(max(static_cast<unsigned>(sys_info.dwNumberOfProcessors), 1u), static_cast<unsigned>(MAXIMUM_WAIT_OBJECTS));
+  try {
+    for (unsigned i = 0; i < num_th; i++) {
+      Worker* w = new Worker();
+      workers += w;
+      w->codec = this;
+      w->work_buf.extend(LZO1X_1_MEM_COMPRESS);
+      w->h_start_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+      CHECK_SYS(w->h_start_event != NULL);
+      w->h_done_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+      CHECK_SYS(w->h_done_event != NULL);
+      h_done_events += w->h_done_event;
+      unsigned th_id;
+      w->h_thread = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0, Worker::th_proc, w, 0, &th_id));
+      CHECK_SYS(w->h_thread != NULL);
+    }
+  }
+  catch (...) {
+    shutdown();
+    throw;
+  }
+}
+
+void LzoChunkCodec::start(Array<LzoChunk>& chunk_list, bool compress_chunks) {
+  cancel();
+  chunks = chunk_list.buf();
+  chunk_cnt = chunk_list.size();
+  compress = compress_chunks;
+  next_chunk = 0;
+  done_cnt = 0;
+  for (unsigned i = 0; i < chunk_cnt; i++) chunks[i].valid = false;
+  running = true;
+  for (unsigned i = 0; i < workers.size(); i++) {
+    if (!SetEvent(workers[i]->h_start_event)) {
+      SystemError error;
+      // workers that were not started are reported as done
+      for (unsigned j = i; j < workers.size(); j++) SetEvent(workers[j]->h_done_event);
+      FAIL(error);
+    }
+  }
+}
+
+void LzoChunkCodec::cancel() {
+  if (!running) return;
+  // remaining chunks are skipped
+  InterlockedExchange(&next_chunk, chunk_cnt);
+  WaitForMultipleObjects(h_done_events.size(), h_done_events.data(), TRUE, INFINITE);
+  running = false;
+}
+
+void LzoChunkCodec::shutdown() {
+  cancel();
+  stop = true;
+  for (unsigned i = 0; i < workers.size(); i++) {
+    Worker* w = workers[i];
+    if (w->h_thread) {
+      SetEvent(w->h_start_event);
+      WaitForSingleObject(w->h_thread, INFINITE);
+      CloseHandle(w->h_thread);
+    }
+    if (w->h_done_event) CloseHandle(w->h_done_event);
+    if (w->h_start_event) CloseHandle(w->h_start_event);
+    delete w;
+  }
+  workers.clear();
+  h_done_events.clear();
+}
+
+bool LzoChunkCodec::wait(unsigned timeout) {
+  if (running) {
+    DWORD w = WaitForMultipleObjects(h_done_events.size(), h_done_events.data(), TRUE, timeout);
+    CHECK_SYS(w != WAIT_FAILED);
+    if (w == WAIT_TIMEOUT) return false;
+    running = false;
+  }
+  CHECK(done_cnt == chunk_cnt);
+  return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+const unsigned c_lzo_chunk_size = 4 * 1024 * 1024;
+
+// Block of data LZO compressed independently of other blocks and protected by own CRC.
+struct LzoChunk {
+  const u8* src;
+  unsigned src_size;
+  u8* dst;
+  unsigned dst_size; // compression: buffer size on input, result size on output
+  bool compressed; // stored data is compressed (otherwise stored as is)
+  lzo_uint32 checksum; // CRC of stored data
+  bool valid; // decompression result
+};
+
+// output buffer size required to compress src_size bytes
+unsigned lzo_chunk_buffer_size(unsigned src_size);
+
+// Compresses or decompresses chunks on all processors.
+// Worker threads are created once and reused by every start_compress/start_decompress call.
+// Chunks array must not be modified until processing is complete.
+class LzoChunkCodec: private NonCopyable {
+private:
+  struct Worker {
+    LzoChunkCodec* codec;
+    Array<u8> work_buf;
+    HANDLE h_thread;
+    HANDLE h_start_event;
+    HANDLE h_done_event;
+    Worker(): h_thread(NULL), h_start_event(NULL), h_done_event(NULL) {
+    }
+    static unsigned __stdcall th_proc(void* param);
+  };
+  LzoChunk* chunks;
+  unsigned chunk_cnt;
+  bool compress;
+  bool running;
+  volatile bool stop;
+  volatile LONG next_chunk;
+  volatile LONG done_cnt;
+  Array<Worker*> workers;
+  Array<HANDLE> h_done_events;
+  void process(LzoChunk& chunk, u8* work_buf);
+  void start(Array<LzoChunk>& chunk_list, bool compress_chunks);
+  // skip remaining chunks and wait for workers
+  void cancel();
+  void shutdown();
+public:
+  LzoChunkCodec();
+  ~LzoChunkCodec() {
+    shutdown();
+  }
+  unsigned thread_count() const {
+    return workers.size();
+  }
+  // src -> dst, sets compressed flag, checksum and dst_size
+  void start_compress(Array<LzoChunk>& chunk_list) {
+    start(chunk_list, true);
+  }
+  // Verifies and decompresses chunks, dst_size must be equal to original data size.
+  // Damaged chunks are filled with zeroes and marked invalid.
+  void start_decompress(Array<LzoChunk>& chunk_list) {
+    start(chunk_list, false);
+  }
+  // returns false on timeout
+  bool wait(unsigned timeout);
+  unsigned done_count() const {
+    return done_cnt;
+  }
+};
@@ -12,6 +12,8 @@
 #include "content.h"
 #include "dlgapi.h"
 #include "ntfs_file.h"
+#include "mft_index.h"
+#include "name_search.h"
 #include "file_panel.h"
 #include "log.h"
 #include "defragment.h"
@@ -61,6 +63,7 @@ struct FileAnalyzer {
   FileInfo file_info;
   ObjectArray<FileInfo> hard_links;
   NtfsVolume volume;
+  ExtRecCache ext_rec_cache;
   FileTotals totals;
   HANDLE h_dlg;
   Array<FarDialogItem> dlg_items;
@@ -754,8 +757,10 @@ void FileAnalyzer::process_file(FileInfo& file_info, bool full_info) {
   file_info.directory = (h_file_info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY;
   if (volume.serial != h_file_info.dwVolumeSerialNumber) { // volume changed
     volume.open(extract_path_root(get_real_path(extract_file_path(file_info.file_name))));
+    ext_rec_cache.clear();
   }
   file_info.volume = &volume;
+  file_info.ext_rec_cache = &ext_rec_cache;
 
   if (file_info.hard_link_cnt > 1) {
     unsigned idx = hard_links.bsearch(file_info);
@@ -772,6 +777,7 @@ void FileAnalyzer::process_file(FileInfo& file_info, bool full_info) {
   }
   else {
     file_info.process_file(file_ref_num);
+    if (file_info.directory) file_info.cache_dir_name();
     if (full_info) file_info.find_full_paths();
     update_totals(file_info, false);
   }
@@ -903,6 +909,7 @@ void FileAnalyzer::process() {
       update_timer = ctime;
     }
   }
+  DBG_LOG(UnicodeString::format(L"FileAnalyzer: ext. record cache: %Lu hits, %Lu misses", ext_rec_cache.hit_cnt, ext_rec_cache.miss_cnt));
   display_file_info();
 }
 
@@ -1087,18 +1094,28 @@ void plugin_show_metadata(const ObjectArray<UnicodeString>& file_list) {
   fa.display_file_info();
 }
 
-void plugin_process_contents(const ObjectArray<UnicodeString>& file_list) {
+// panel - plugin panel files are listed from (optional)
+void plugin_process_contents(const ObjectArray<UnicodeString>& file_list, FilePanel* panel = NULL) {
   bool single_file = (file_list.size() == 1) && (get_file_type(file_list[0]) == ftFile);
-  if (show_options_dialog(g_content_options, single_file)) {
+  if (show_options_dialog(g_content_options)) {
     store_plugin_options();
     if (single_file) {
       ContentInfo content_info;
-      process_file_content(file_list[0], g_content_options, content_info);
+      process_file_content(file_list[0], g_content_options, content_info, panel);
       show_result_dialog(file_list[0], g_content_options, content_info);
     }
-    else {
+    else if (g_content_options.crc32 || g_content_options.md5 || g_content_options.sha1 || g_content_options.sha256 || g_content_options.ed2k || g_content_options.crc16) {
+      // hashes of all files go to hash list
+      UnicodeString list_file_name;
+      if (show_hash_list_dialog(file_list, list_file_name)) {
+        HashFilesStats stats;
+        hash_files(file_list, g_content_options, list_file_name, stats);
+        show_result_dialog(stats);
+      }
+    }
+    else if (g_content_options.compression) { // no hashes: files are read only if compression ratio is requested
       CompressionStats stats;
-      compress_files(file_list, stats);
+      compress_files(file_list, stats, panel);
       show_result_dialog(stats);
     }
   }
@@ -1169,6 +1186,7 @@ HANDLE WINAPI OpenW(const OpenInfo* info) {
     unsigned flat_mode_menu_id = -1;
     unsigned mft_mode_menu_id = -1;
     unsigned show_totals_menu_id = -1;
+    unsigned mft_search_menu_id = -1;
     if (active_panel && active_panel->current_dir.size()) {
       menu_items += far_get_msg(active_panel->flat_mode ? MSG_MENU_FLAT_MODE_OFF : MSG_MENU_FLAT_MODE_ON);
       flat_mode_menu_id = menu_items.size() - 1;
@@ -1177,6 +1195,8 @@ HANDLE WINAPI OpenW(const OpenInfo* info) {
       if (active_panel->mft_mode) {
         menu_items += far_get_msg(MSG_MENU_SHOW_TOTALS);
         show_totals_menu_id = menu_items.size() - 1;
+        menu_items += far_get_msg(MSG_MENU_MFT_SEARCH);
+        mft_search_menu_id = menu_items.size() - 1;
       }
     }
     int item_idx = far_menu(c_main_menu_guid, far_get_msg(MSG_PLUGIN_NAME), menu_items, L"plugin_menu");
@@ -1205,7 +1225,7 @@ HANDLE WINAPI OpenW(const OpenInfo* info) {
       }
     }
     else if (item_idx == content_menu_id) {
-      plugin_process_contents(file_list);
+      plugin_process_contents(file_list, from_viewer ? NULL : active_panel);
     }
     else if (item_idx == toggle_panel_menu_id) {
       if (active_panel == NULL) {
@@ -1252,6 +1272,15 @@ HANDLE WINAPI OpenW(const OpenInfo* info) {
       active_panel->toggle_mft_mode();
       far_control_int(active_panel, FCTL_UPDATEPANEL, 1);
     }
+    else if (item_idx == mft_search_menu_id) {
+      UnicodeString mask;
+      if (far_input_box(c_mft_search_dialog_guid, far_get_msg(MSG_MFT_SEARCH_TITLE), far_get_msg(MSG_MFT_SEARCH_PROMPT), mask, L"NTFSFile.MftSearch", L"plugin_menu")) {
+        active_panel->mft_search(mask);
+        far_control_int(active_panel, FCTL_UPDATEPANEL, 0);
+        PanelRedrawInfo pri = { sizeof(PanelRedrawInfo) };
+        far_control_ptr(active_panel, FCTL_REDRAWPANEL, &pri);
+      }
+    }
     else if (item_idx == show_totals_menu_id) {
       if (file_list_from_panel(file_list, true)) {
         FilePanel::Totals totals = active_panel->mft_get_totals(file_list);
@@ -0,0 +1,411 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include "utils.h"
+#include "mb_hash.h"
+
+#if defined(_M_IX86) || defined(_M_X64)
+#define MB_HASH_SSE2
+#include <intrin.h>
+#include <emmintrin.h>
+#if _MSC_VER >= 1700
+#define MB_HASH_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#ifdef MB_HASH_SSE2
+
+static inline u32 load_word(const u8* p, unsigned i) {
+  return reinterpret_cast<const u32*>(p)[i];
+}
+
+static inline u32 load_word_be(const u8* p, unsigned i) {
+  return _byteswap_ulong(reinterpret_cast<const u32*>(p)[i]);
+}
+
+// 4 lanes of 32-bit words
+struct Sse2Vec {
+  typedef __m128i T;
+  enum { c_lanes = 4 };
+  static T add(T a, T b) { return _mm_add_epi32(a, b); }
+  static T bit_xor(T a, T b) { return _mm_xor_si128(a, b); }
+  static T bit_and(T a, T b) { return _mm_and_si128(a, b); }
+  static T bit_or(T a, T b) { return _mm_or_si128(a, b); }
+  static T shr(T x, int n) { return _mm_srli_epi32(x, n); }
+  static T rol(T x, int n) { return _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - n)); }
+  static T ror(T x, int n) { return _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n)); }
+  static T set1(u32 v) { return _mm_set1_epi32(v); }
+  static T load(const u32* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+  static void store(u32* p, T x) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), x); }
+  // message word i of every lane
+  static T load_le(const u8* const p[], unsigned i) {
+    return _mm_set_epi32(load_word(p[3], i), load_word(p[2], i), load_word(p[1], i), load_word(p[0], i));
+  }
+  static T load_be(const u8* const p[], unsigned i) {
+    return _mm_set_epi32(load_word_be(p[3], i), load_word_be(p[2], i), load_word_be(p[1], i), load_word_be(p[0], i));
+  }
+  static void done() {
+  }
+};
+
+#ifdef MB_HASH_AVX2
+// 8 lanes of 32-bit words
+struct Avx2Vec {
+  typedef __m256i T;
+  enum { c_lanes = 8 };
+  static T add(T a, T b) { return _mm256_add_epi32(a, b); }
+  static T bit_xor(T a, T b) { return _mm256_xor_si256(a, b); }
+  static T bit_and(T a, T b) { return _mm256_and_si256(a, b); }
+  static T bit_or(T a, T b) { return _mm256_or_si256(a, b); }
+  static T shr(T x, int n) { return _mm256_srli_epi32(x, n); }
+  static T rol(T x, int n) { return _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n)); }
+  static T ror(T x, int n) { return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n)); }
+  static T set1(u32 v) { return _mm256_set1_epi32(v); }
+  static T load(const u32* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+  static void store(u32* p, T x) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), x); }
+  static T load_le(const u8* const p[], unsigned i) {
+    return _mm256_set_epi32(load_word(p[7], i), load_word(p[6], i), load_word(p[5], i), load_word(p[4], i), load_word(p[3], i), load_word(p[2], i), load_word(p[1], i), load_word(p[0], i));
+  }
+  static T load_be(const u8* const p[], unsigned i) {
+    return _mm256_set_epi32(load_word_be(p[7], i), load_word_be(p[6], i), load_word_be(p[5], i), load_word_be(p[4], i), load_word_be(p[3], i), load_word_be(p[2], i), load_word_be(p[1], i), load_word_be(p[0], i));
+  }
+  // avoid AVX-SSE transition penalty in following code
+  static void done() {
+    _mm256_zeroupper();
+  }
+};
+#endif
+
+static const u32 c_md5_k[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+  0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+  0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+  0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+  0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+  0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+#define MD5_F(b, c, d) V::bit_xor(d, V::bit_and(b, V::bit_xor(c, d)))
+#define MD5_G(b, c, d) V::bit_xor(c, V::bit_and(d, V::bit_xor(b, c)))
+#define MD5_H(b, c, d) V::bit_xor(V::bit_xor(b, c), d)
+#define MD5_I(b, c, d) V::bit_xor(c, V::bit_or(b, V::bit_xor(d, ones)))
+#define MD5_STEP(f, a, b, c, d, i, g, s) \
+  a = V::add(b, V::rol(V::add(V::add(a, f(b, c, d)), V::add(V::set1(c_md5_k[i]), w[g])), s))
+
+// State word i of lane l is state[i][l]. Data pointer of every lane advances by its step after each block.
+template<class V> void md5_mb(u32 state[][8], const u8* data[], const unsigned step[], size_t block_cnt) {
+  typedef typename V::T T;
+  const T ones = V::set1(0xFFFFFFFF);
+  T s[4];
+  for (unsigned i = 0; i < 4; i++) s[i] = V::load(state[i]);
+  while (block_cnt--) {
+    T w[16];
+    for (unsigned i = 0; i < 16; i++) w[i] = V::load_le(data, i);
+    T a = s[0], b = s[1], c = s[2], d = s[3];
+    for (unsigned i = 0; i < 16; i += 4) {
+      MD5_STEP(MD5_F, a, b, c, d, i, i, 7);
+      MD5_STEP(MD5_F, d, a, b, c, i + 1, i + 1, 12);
+      MD5_STEP(MD5_F, c, d, a, b, i + 2, i + 2, 17);
+      MD5_STEP(MD5_F, b, c, d, a, i + 3, i + 3, 22);
+    }
+    for (unsigned i = 16; i < 32; i += 4) {
+      MD5_STEP(MD5_G, a, b, c, d, i, (5 * i + 1) & 15, 5);
+      MD5_STEP(MD5_G, d, a, b, c, i + 1, (5 * i + 6) & 15, 9);
+      MD5_STEP(MD5_G, c, d, a, b, i + 2, (5 * i + 11) & 15, 14);
+      MD5_STEP(MD5_G, b, c, d, a, i + 3, (5 * i + 16) & 15, 20);
+    }
+    for (unsigned i = 32; i < 48; i += 4) {
+      MD5_STEP(MD5_H, a, b, c, d, i, (3 * i + 5) & 15, 4);
+      MD5_STEP(MD5_H, d, a, b, c, i + 1, (3 * i + 8) & 15, 11);
+      MD5_STEP(MD5_H, c, d, a, b, i + 2, (3 * i + 11) & 15, 16);
+      MD5_STEP(MD5_H, b, c, d, a, i + 3, (3 * i + 14) & 15, 23);
+    }
+    for (unsigned i = 48; i < 64; i += 4) {
+      MD5_STEP(MD5_I, a, b, c, d, i, (7 * i) & 15, 6);
+      MD5_STEP(MD5_I, d, a, b, c, i + 1, (7 * i + 7) & 15, 10);
+      MD5_STEP(MD5_I, c, d, a, b, i + 2, (7 * i + 14) & 15, 15);
+      MD5_STEP(MD5_I, b, c, d, a, i + 3, (7 * i + 21) & 15, 21);
+    }
+    s[0] = V::add(s[0], a);
+    s[1] = V::add(s[1], b);
+    s[2] = V::add(s[2], c);
+    s[3] = V::add(s[3], d);
+    for (unsigned l = 0; l < V::c_lanes; l++) data[l] += step[l];
+  }
+  for (unsigned i = 0; i < 4; i++) V::store(state[i], s[i]);
+  V::done();
+}
+
+template<class V> void sha1_mb(u32 state[][8], const u8* data[], const unsigned step[], size_t block_cnt) {
+  typedef typename V::T T;
+  T s[5];
+  for (unsigned i = 0; i < 5; i++) s[i] = V::load(state[i]);
+  while (block_cnt--) {
+    T w[16];
+    T a = s[0], b = s[1], c = s[2], d = s[3], e = s[4];
+    for (unsigned t = 0; t < 80; t++) {
+      T wt;
+      if (t < 16) {
+        wt = w[t] = V::load_be(data, t);
+      }
+      else {
+        wt = V::bit_xor(V::bit_xor(w[(t - 3) & 15], w[(t - 8) & 15]), V::bit_xor(w[(t - 14) & 15], w[t & 15]));
+        wt = w[t & 15] = V::rol(wt, 1);
+      }
+      T f, k;
+      if (t < 20) {
+        f = V::bit_xor(d, V::bit_and(b, V::bit_xor(c, d)));
+        k = V::set1(0x5a827999);
+      }
+      else if (t < 40) {
+        f = V::bit_xor(V::bit_xor(b, c), d);
+        k = V::set1(0x6ed9eba1);
+      }
+      else if (t < 60) {
+        f = V::bit_or(V::bit_and(b, c), V::bit_and(d, V::bit_or(b, c)));
+        k = V::set1(0x8f1bbcdc);
+      }
+      else {
+        f = V::bit_xor(V::bit_xor(b, c), d);
+        k = V::set1(0xca62c1d6);
+      }
+      T temp = V::add(V::add(V::rol(a, 5), f), V::add(V::add(e, k), wt));
+      e = d;
+      d = c;
+      c = V::rol(b, 30);
+      b = a;
+      a = temp;
+    }
+    s[0] = V::add(s[0], a);
+    s[1] = V::add(s[1], b);
+    s[2] = V::add(s[2], c);
+    s[3] = V::add(s[3], d);
+    s[4] = V::add(s[4], e);
+    for (unsigned l = 0; l < V::c_lanes; l++) data[l] += step[l];
+  }
+  for (unsigned i = 0; i < 5; i++) V::store(state[i], s[i]);
+  V::done();
+}
+
+static const u32 c_sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+template<class V> void sha256_mb(u32 state[][8], const u8* data[], const unsigned step[], size_t block_cnt) {
+  typedef typename V::T T;
+  T s[8];
+  for (unsigned i = 0; i < 8; i++) s[i] = V::load(state[i]);
+  while (block_cnt--) {
+    T w[16];
+    T a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (unsigned t = 0; t < 64; t++) {
+      T wt;
+      if (t < 16) {
+        wt = w[t] = V::load_be(data, t);
+      }
+      else {
+        T w2 = w[(t - 2) & 15];
+        T w15 = w[(t - 15) & 15];
+        T sigma1 = V::bit_xor(V::bit_xor(V::ror(w2, 17), V::ror(w2, 19)), V::shr(w2, 10));
+        T sigma0 = V::bit_xor(V::bit_xor(V::ror(w15, 7), V::ror(w15, 18)), V::shr(w15, 3));
+        wt = w[t & 15] = V::add(V::add(sigma1, w[(t - 7) & 15]), V::add(sigma0, w[t & 15]));
+      }
+      T sum1 = V::bit_xor(V::bit_xor(V::ror(e, 6), V::ror(e, 11)), V::ror(e, 25));
+      T ch = V::bit_xor(g, V::bit_and(e, V::bit_xor(f, g)));
+      T t1 = V::add(V::add(V::add(h, sum1), V::add(ch, V::set1(c_sha256_k[t]))), wt);
+      T sum0 = V::bit_xor(V::bit_xor(V::ror(a, 2), V::ror(a, 13)), V::ror(a, 22));
+      T maj = V::bit_or(V::bit_and(a, b), V::bit_and(c, V::bit_or(a, b)));
+      h = g;
+      g = f;
+      f = e;
+      e = V::add(d, t1);
+      d = c;
+      c = b;
+      b = a;
+      a = V::add(t1, V::add(sum0, maj));
+    }
+    s[0] = V::add(s[0], a);
+    s[1] = V::add(s[1], b);
+    s[2] = V::add(s[2], c);
+    s[3] = V::add(s[3], d);
+    s[4] = V::add(s[4], e);
+    s[5] = V::add(s[5], f);
+    s[6] = V::add(s[6], g);
+    s[7] = V::add(s[7], h);
+    for (unsigned l = 0; l < V::c_lanes; l++) data[l] += step[l];
+  }
+  for (unsigned i = 0; i < 8; i++) V::store(state[i], s[i]);
+  V::done();
+}
+
+typedef void (*MbCompress)(u32 state[][8], const u8* data[], const unsigned step[], size_t block_cnt);
+
+// number of lanes supported by processor and OS (0 - no SIMD)
+static unsigned simd_lanes() {
+  int cpu_info[4];
+  __cpuid(cpu_info, 0);
+  int max_leaf = cpu_info[0];
+  __cpuid(cpu_info, 1);
+  if ((cpu_info[3] & (1 << 26)) == 0) return 0;
+#ifdef MB_HASH_AVX2
+  bool osxsave = (cpu_info[2] & (1 << 27)) != 0;
+  bool avx = (cpu_info[2] & (1 << 28)) != 0;
+  if ((max_leaf >= 7) && osxsave && avx && ((_xgetbv(0) & 6) == 6)) {
+    __cpuidex(cpu_info, 7, 0);
+    if (cpu_info[1] & (1 << 5)) return Avx2Vec::c_lanes;
+  }
+#endif
+  return Sse2Vec::c_lanes;
+}
+
+static const unsigned g_simd_lanes = simd_lanes();
+
+static MbCompress get_compress(MbHashType type) {
+#ifdef MB_HASH_AVX2
+  if (g_simd_lanes == Avx2Vec::c_lanes) {
+    return type == mbh_md5 ? md5_mb<Avx2Vec> : type == mbh_sha1 ? sha1_mb<Avx2Vec> : sha256_mb<Avx2Vec>;
+  }
+#endif
+  return type == mbh_md5 ? md5_mb<Sse2Vec> : type == mbh_sha1 ? sha1_mb<Sse2Vec> : sha256_mb<Sse2Vec>;
+}
+
+#endif
+
+static const u32 c_md5_init[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+static const u32 c_sha1_init[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+static const u32 c_sha256_init[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+unsigned MultiBufferHash::digest_size(MbHashType type) {
+  if (type == mbh_md5) return MD5_DIGEST_LENGTH;
+  else if (type == mbh_sha1) return SHA_DIGEST_LENGTH;
+  else return SHA256_DIGEST_LENGTH;
+}
+
+void MultiBufferHash::submit(const u8* data, size_t size, u8* digest) {
+  Job job;
+  job.data = data;
+  job.size = size;
+  job.digest = digest;
+  jobs += job;
+}
+
+void MultiBufferHash::hash_openssl(const Job& job) {
+  if (type == mbh_md5) {
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, job.data, job.size);
+    MD5_Final(job.digest, &ctx);
+  }
+  else if (type == mbh_sha1) {
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+    SHA1_Update(&ctx, job.data, job.size);
+    SHA1_Final(job.digest, &ctx);
+  }
+  else {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, job.data, job.size);
+    SHA256_Final(job.digest, &ctx);
+  }
+}
+
+void MultiBufferHash::start_lane(unsigned lane_idx, unsigned job_idx) {
+  Lane& lane = lanes[lane_idx];
+  const Job& job = jobs[job_idx];
+  lane.job_idx = job_idx;
+  lane.data = job.data;
+  lane.block_cnt = job.size / c_block_size;
+  lane.padded = false;
+  const u32* init = type == mbh_md5 ? c_md5_init : type == mbh_sha1 ? c_sha1_init : c_sha256_init;
+  unsigned word_cnt = digest_size(type) / sizeof(u32);
+  for (unsigned i = 0; i < word_cnt; i++) state[i][lane_idx] = init[i];
+  if (lane.block_cnt == 0) pad_lane(lane_idx);
+}
+
+// message tail, 0x80 marker and bit length
+void MultiBufferHash::pad_lane(unsigned lane_idx) {
+  Lane& lane = lanes[lane_idx];
+  const Job& job = jobs[lane.job_idx];
+  unsigned tail_size = static_cast<unsigned>(job.size % c_block_size);
+  unsigned pad_size = tail_size + 1 + sizeof(u64) <= c_block_size ? c_block_size : 2 * c_block_size;
+  memcpy(lane.pad, job.data + job.size - tail_size, tail_size);
+  lane.pad[tail_size] = 0x80;
+  memset(lane.pad + tail_size + 1, 0, pad_size - tail_size - 1);
+  u64 bit_size = static_cast<u64>(job.size) * 8;
+  for (unsigned i = 0; i < sizeof(u64); i++) {
+    unsigned shift = type == mbh_md5 ? i * 8 : (sizeof(u64) - 1 - i) * 8;
+    lane.pad[pad_size - sizeof(u64) + i] = static_cast<u8>(bit_size >> shift);
+  }
+  lane.data = lane.pad;
+  lane.block_cnt = pad_size / c_block_size;
+  lane.padded = true;
+}
+
+void MultiBufferHash::finish_lane(unsigned lane_idx) {
+  Lane& lane = lanes[lane_idx];
+  u8* digest = jobs[lane.job_idx].digest;
+  unsigned word_cnt = digest_size(type) / sizeof(u32);
+  for (unsigned i = 0; i < word_cnt; i++) {
+    u32 v = state[i][lane_idx];
+    for (unsigned j = 0; j < sizeof(u32); j++) {
+      unsigned shift = type == mbh_md5 ? j * 8 : (sizeof(u32) - 1 - j) * 8;
+      digest[i * sizeof(u32) + j] = static_cast<u8>(v >> shift);
+    }
+  }
+  lane.job_idx = -1;
+}
+
+void MultiBufferHash::flush() {
+#ifdef MB_HASH_SSE2
+  if (g_simd_lanes != 0) {
+    MbCompress compress = get_compress(type);
+    static const u8 c_idle_block[c_block_size] = {};
+    unsigned next_job = 0;
+    for (unsigned l = 0; l < g_simd_lanes; l++) lanes[l].job_idx = -1;
+    while (true) {
+      for (unsigned l = 0; l < g_simd_lanes; l++) {
+        if ((lanes[l].job_idx == -1) && (next_job < jobs.size())) start_lane(l, next_job++);
+      }
+      // all lanes advance by the number of blocks left in the shortest one
+      size_t block_cnt = 0;
+      for (unsigned l = 0; l < g_simd_lanes; l++) {
+        if ((lanes[l].job_idx != -1) && ((block_cnt == 0) || (lanes[l].block_cnt < block_cnt))) block_cnt = lanes[l].block_cnt;
+      }
+      if (block_cnt == 0) break;
+      const u8* data[c_max_lanes];
+      unsigned step[c_max_lanes];
+      for (unsigned l = 0; l < g_simd_lanes; l++) {
+        bool active = lanes[l].job_idx != -1;
+        data[l] = active ? lanes[l].data : c_idle_block;
+        step[l] = active ? c_block_size : 0;
+      }
+      compress(state, data, step, block_cnt);
+      for (unsigned l = 0; l < g_simd_lanes; l++) {
+        Lane& lane = lanes[l];
+        if (lane.job_idx == -1) continue;
+        lane.data += block_cnt * c_block_size;
+        lane.block_cnt -= block_cnt;
+        if (lane.block_cnt == 0) {
+          if (lane.padded) finish_lane(l);
+          else pad_lane(l);
+        }
+      }
+    }
+    jobs.clear();
+    return;
+  }
+#endif
+  for (unsigned i = 0; i < jobs.size(); i++) hash_openssl(jobs[i]);
+  jobs.clear();
+}
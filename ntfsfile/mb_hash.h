@@ -0,0 +1,47 @@
+#pragma once
+
+enum MbHashType {
+  mbh_md5,
+  mbh_sha1,
+  mbh_sha256,
+};
+
+// Calculates MD5/SHA-1/SHA-256 of many independent messages kept in memory.
+// Several messages are hashed at once in SIMD lanes (8 with AVX2, 4 with SSE2), which keeps
+// vector units busy when every message is small; OpenSSL is used if SIMD is not available.
+// Intended for small files: lanes advance together, so single large message gets no gain.
+class MultiBufferHash: private NonCopyable {
+private:
+  enum {
+    c_max_lanes = 8,
+    c_block_size = 64,
+  };
+  struct Job {
+    const u8* data;
+    size_t size;
+    u8* digest;
+  };
+  struct Lane {
+    unsigned job_idx; // -1 - lane is idle
+    const u8* data;
+    size_t block_cnt; // blocks left in data
+    bool padded; // data points to padding blocks
+    u8 pad[2 * c_block_size];
+  };
+  MbHashType type;
+  Array<Job> jobs;
+  Lane lanes[c_max_lanes];
+  u32 state[8][c_max_lanes]; // state word i of lane l is state[i][l]
+  void start_lane(unsigned lane_idx, unsigned job_idx);
+  void pad_lane(unsigned lane_idx);
+  void finish_lane(unsigned lane_idx);
+  void hash_openssl(const Job& job);
+public:
+  MultiBufferHash(MbHashType type): type(type) {
+  }
+  static unsigned digest_size(MbHashType type);
+  // message and digest buffer must stay valid until flush()
+  void submit(const u8* data, size_t size, u8* digest);
+  // hash all submitted messages
+  void flush();
+};
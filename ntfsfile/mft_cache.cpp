@@ -0,0 +1,383 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include "utils.h"
+#include "crc.h"
+#include "lzo_chunks.h"
+#include "mft_index.h"
+#include "mft_cache.h"
+
+static void write_cache_data(HANDLE h_file, const void* data, u64 size) {
+  const unsigned c_max_write_size = 16 * 1024 * 1024;
+  const u8* block = static_cast<const u8*>(data);
+  while (size) {
+    DWORD block_size = size > c_max_write_size ? c_max_write_size : static_cast<DWORD>(size);
+    DWORD bw;
+    CHECK_SYS(WriteFile(h_file, block, block_size, &bw, NULL));
+    CHECK(bw == block_size);
+    block += block_size;
+    size -= block_size;
+  }
+}
+
+// Chunks are compressed and written in groups (one chunk per codec thread); output buffers
+// of two groups are reused (one group is written while the next one is compressed).
+void write_mft_cache(const UnicodeString& file_name, const MftIndex& mft_index, DWORDLONG usn_journal_id, USN next_usn, CacheProgress* progress) {
+  DWORD t_start = GetTickCount();
+  Array<MftIndexSection> sections;
+  mft_index.get_sections(sections);
+
+  // split sections into chunks
+  Array<MftCacheSection> section_table;
+  Array<LzoChunk> chunks;
+  u64 total_size = 0;
+  for (unsigned i = 0; i < sections.size(); i++) {
+    MftCacheSection section;
+    section.size = sections[i].size;
+    section.first_chunk = chunks.size();
+    for (u64 pos = 0; pos < sections[i].size; pos += c_lzo_chunk_size) {
+      LzoChunk chunk;
+      memset(&chunk, 0, sizeof(chunk));
+      chunk.src = static_cast<const u8*>(sections[i].data) + pos;
+      chunk.src_size = sections[i].size - pos > c_lzo_chunk_size ? c_lzo_chunk_size : static_cast<unsigned>(sections[i].size - pos);
+      chunks += chunk;
+    }
+    section.chunk_cnt = chunks.size() - section.first_chunk;
+    section_table += section;
+    total_size += sections[i].size;
+  }
+
+  // header and tables are written when chunk sizes are known
+  u64 data_offset = sizeof(MftCacheHeader) + section_table.size() * sizeof(MftCacheSection) + chunks.size() * sizeof(MftCacheChunk);
+  LzoChunkCodec codec;
+  unsigned group_size = codec.thread_count();
+  unsigned group_cnt = (chunks.size() + group_size - 1) / group_size;
+  unsigned chunk_buf_size = lzo_chunk_buffer_size(c_lzo_chunk_size);
+  Array<u8> comp_buffer;
+  u8* comp_buf = comp_buffer.buf(2 * group_size * chunk_buf_size);
+
+  // new file replaces old one only after it is completely written
+  UnicodeString tmp_file_name = file_name + L".tmp";
+  u64 comp_size = 0;
+  HANDLE h_file = CreateFileW(tmp_file_name.data(), GENERIC_WRITE | GENERIC_READ, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  CHECK_SYS(h_file != INVALID_HANDLE_VALUE);
+  try {
+    CLEAN(HANDLE, h_file, CloseHandle(h_file));
+    LARGE_INTEGER file_pos;
+    file_pos.QuadPart = data_offset;
+    CHECK_SYS(SetFilePointerEx(h_file, file_pos, NULL, FILE_BEGIN));
+
+    Array<LzoChunk> groups[2];
+    for (unsigned group_idx = 0; group_idx <= group_cnt; group_idx++) {
+      if (group_idx < group_cnt) {
+        Array<LzoChunk>& group = groups[group_idx % 2];
+        group.clear();
+        u8* dst = comp_buf + (group_idx % 2) * group_size * chunk_buf_size;
+        for (unsigned i = group_idx * group_size; (i < chunks.size()) && (i < (group_idx + 1) * group_size); i++) {
+          LzoChunk chunk = chunks[i];
+          chunk.dst = dst;
+          chunk.dst_size = chunk_buf_size;
+          group += chunk;
+          dst += chunk_buf_size;
+        }
+        codec.start_compress(group);
+      }
+      if (group_idx > 0) {
+        const Array<LzoChunk>& group = groups[(group_idx - 1) % 2];
+        unsigned first_chunk = (group_idx - 1) * group_size;
+        for (unsigned i = 0; i < group.size(); i++) {
+          write_cache_data(h_file, group[i].dst, group[i].dst_size);
+          chunks.item(first_chunk + i) = group[i];
+        }
+      }
+      if (group_idx < group_cnt) {
+        while (!codec.wait(100)) {
+          if (progress) {
+            progress->percent = (group_idx * group_size + codec.done_count()) * 100 / chunks.size();
+            progress->update_ui();
+          }
+        }
+      }
+    }
+
+    MftCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.version = c_cache_version;
+    header.section_cnt = section_table.size();
+    header.chunk_cnt = chunks.size();
+    header.usn_journal_id = usn_journal_id;
+    header.next_usn = next_usn;
+    Array<MftCacheChunk> chunk_table;
+    chunk_table.extend(chunks.size());
+    u64 offset = data_offset;
+    for (unsigned i = 0; i < chunks.size(); i++) {
+      MftCacheChunk chunk;
+      chunk.offset = offset;
+      chunk.size = chunks[i].dst_size;
+      chunk.data_size = chunks[i].src_size;
+      chunk.checksum = chunks[i].checksum;
+      chunk.flags = chunks[i].compressed ? c_cache_chunk_compressed : 0;
+      chunk_table += chunk;
+      offset += chunk.size;
+    }
+    comp_size = offset - data_offset;
+    header.header_checksum = crc32_update(0, reinterpret_cast<const lzo_bytep>(&header.version), sizeof(header) - offsetof(MftCacheHeader, version));
+    header.header_checksum = crc32_update(header.header_checksum, reinterpret_cast<const lzo_bytep>(section_table.data()), section_table.size() * sizeof(MftCacheSection));
+    header.header_checksum = crc32_update(header.header_checksum, reinterpret_cast<const lzo_bytep>(chunk_table.data()), chunk_table.size() * sizeof(MftCacheChunk));
+
+    file_pos.QuadPart = 0;
+    CHECK_SYS(SetFilePointerEx(h_file, file_pos, NULL, FILE_BEGIN));
+    write_cache_data(h_file, &header, sizeof(header));
+    write_cache_data(h_file, section_table.data(), section_table.size() * sizeof(MftCacheSection));
+    write_cache_data(h_file, chunk_table.data(), chunk_table.size() * sizeof(MftCacheChunk));
+  }
+  catch (...) {
+    DeleteFileW(tmp_file_name.data());
+    throw;
+  }
+  CHECK_SYS(MoveFileExW(tmp_file_name.data(), file_name.data(), MOVEFILE_REPLACE_EXISTING));
+  DBG_LOG(UnicodeString::format(L"write_mft_cache(): %u chunks, %Lu -> %Lu bytes in %u ms, %u threads", chunks.size(), total_size, comp_size, GetTickCount() - t_start, group_size));
+
+  if (progress) {
+    progress->percent = 100;
+    progress->update_ui();
+  }
+}
+
+void encode_file_record(Array<u8>& buffer, const FileRecord& rec) {
+  #define ENCODE(var) buffer.add(reinterpret_cast<const u8*>(&var), sizeof(var));
+  ENCODE(rec.file_ref_num);
+  ENCODE(rec.parent_ref_num);
+  unsigned file_name_size = rec.file_name.size();
+  ENCODE(file_name_size);
+  buffer.add(reinterpret_cast<const u8*>(rec.file_name.data()), file_name_size * sizeof(wchar_t));
+  ENCODE(rec.file_attr);
+  ENCODE(rec.creation_time);
+  ENCODE(rec.last_access_time);
+  ENCODE(rec.last_write_time);
+  ENCODE(rec.data_size);
+  ENCODE(rec.disk_size);
+  ENCODE(rec.valid_size);
+  ENCODE(rec.fragment_cnt);
+  ENCODE(rec.mft_rec_cnt);
+  ENCODE(rec.stream_cnt);
+  ENCODE(rec.hard_link_cnt);
+  ENCODE(rec.flags);
+  #undef ENCODE
+}
+
+bool decode_file_record(const u8* data, unsigned size, unsigned& pos, FileRecord& rec) {
+  #define DECODE(var) if (size - pos < sizeof(var)) return false; memcpy(&var, data + pos, sizeof(var)); pos += sizeof(var);
+  DECODE(rec.file_ref_num);
+  DECODE(rec.parent_ref_num);
+  unsigned file_name_size;
+  DECODE(file_name_size);
+  if ((size - pos) / sizeof(wchar_t) < file_name_size) return false;
+  rec.file_name.copy(reinterpret_cast<const wchar_t*>(data + pos), file_name_size); // buffer is reused
+  pos += file_name_size * sizeof(wchar_t);
+  DECODE(rec.file_attr);
+  DECODE(rec.creation_time);
+  DECODE(rec.last_access_time);
+  DECODE(rec.last_write_time);
+  DECODE(rec.data_size);
+  DECODE(rec.disk_size);
+  DECODE(rec.valid_size);
+  DECODE(rec.fragment_cnt);
+  DECODE(rec.mft_rec_cnt);
+  DECODE(rec.stream_cnt);
+  DECODE(rec.hard_link_cnt);
+  DECODE(rec.flags);
+  #undef DECODE
+  return true;
+}
+
+// version 0 cache: single LZO compressed block of serialized records
+static void load_mft_index_v0(const u8* data, u64 data_size, MftIndex& mft_index, DWORDLONG& usn_journal_id, USN& next_usn) {
+  const wchar_t* c_corrupted_msg = L"Corrupted cache file";
+  u32 buffer_size;
+  u32 comp_buffer_size;
+  lzo_uint32 saved_header_checksum, saved_comp_buffer_checksum;
+  const unsigned c_header_size = sizeof(saved_header_checksum) + sizeof(u8) + sizeof(buffer_size) + sizeof(comp_buffer_size) + sizeof(saved_comp_buffer_checksum);
+  if (data_size < c_header_size) FAIL(MsgError(c_corrupted_msg));
+  unsigned pos = 0;
+  #define DECODE(var) memcpy(&var, data + pos, sizeof(var)); pos += sizeof(var);
+  DECODE(saved_header_checksum);
+  pos += sizeof(u8); // cache version
+  DECODE(buffer_size);
+  DECODE(comp_buffer_size);
+  lzo_uint32 header_checksum = crc32_update(0, data + sizeof(saved_header_checksum), sizeof(u8) + sizeof(buffer_size) + sizeof(comp_buffer_size));
+  if (header_checksum != saved_header_checksum) FAIL(MsgError(c_corrupted_msg));
+  DECODE(saved_comp_buffer_checksum);
+  if (data_size - c_header_size < comp_buffer_size) FAIL(MsgError(c_corrupted_msg));
+  const u8* comp_buffer = data + c_header_size;
+  lzo_uint32 comp_buffer_checksum = crc32_update(0, comp_buffer, comp_buffer_size);
+  if (comp_buffer_checksum != saved_comp_buffer_checksum) FAIL(MsgError(c_corrupted_msg));
+
+  Array<unsigned char> buffer;
+  buffer.extend(buffer_size + 3);
+#ifdef _M_X64
+#  define decompress lzo1x_decompress
+#else
+#  define decompress lzo1x_decompress_asm_fast
+#endif
+  lzo_uint sz = buffer_size;
+  if (decompress(comp_buffer, comp_buffer_size, buffer.buf(), &sz, NULL) != LZO_E_OK) FAIL(MsgError(c_corrupted_msg));
+  if (sz != buffer_size) FAIL(MsgError(c_corrupted_msg));
+  buffer.set_size(buffer_size);
+
+  data = buffer.data();
+  pos = 0;
+  DECODE(usn_journal_id);
+  DECODE(next_usn);
+  unsigned count;
+  DECODE(count);
+  mft_index.reserve(count);
+  #undef DECODE
+  FileRecord rec;
+  for (unsigned i = 0; i < count; i++) {
+    if (!decode_file_record(data, buffer_size, pos, rec)) FAIL(MsgError(c_corrupted_msg));
+    mft_index.add(rec);
+  }
+  if (pos != buffer_size) FAIL(MsgError(c_corrupted_msg));
+}
+
+
+void load_mft_cache(const UnicodeString& file_name, MftIndex& mft_index, MftCacheInfo& info, CacheProgress* progress) {
+  const wchar_t* c_corrupted_msg = L"Corrupted cache file";
+  const wchar_t* c_wrong_version_msg = L"Wrong cache file version";
+  HANDLE h_file = CreateFileW(file_name.data(), FILE_READ_DATA, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  CHECK_SYS(h_file != INVALID_HANDLE_VALUE);
+  CLEAN(HANDLE, h_file, CloseHandle(h_file));
+  LARGE_INTEGER file_size;
+  CHECK_SYS(GetFileSizeEx(h_file, &file_size));
+  if (file_size.QuadPart <= offsetof(MftCacheHeader, version)) FAIL(MsgError(c_corrupted_msg));
+  HANDLE h_mapping = CreateFileMappingW(h_file, NULL, PAGE_READONLY, 0, 0, NULL);
+  CHECK_SYS(h_mapping != NULL);
+  CLEAN(HANDLE, h_mapping, CloseHandle(h_mapping));
+  const u8* view = static_cast<const u8*>(MapViewOfFile(h_mapping, FILE_MAP_READ, 0, 0, 0));
+  CHECK_SYS(view != NULL);
+  CLEAN(const u8*, view, UnmapViewOfFile(view));
+  u64 view_size = file_size.QuadPart;
+
+  info.version = view[offsetof(MftCacheHeader, version)];
+  info.damaged_file_refs.clear();
+  info.lookup_loaded = false;
+  try {
+    if (info.version == 0) {
+      load_mft_index_v0(view, view_size, mft_index, info.usn_journal_id, info.next_usn);
+      mft_index.update_lookup();
+    }
+    else if (info.version == c_cache_version) {
+      MftCacheHeader header;
+      if (view_size < sizeof(header)) FAIL(MsgError(c_corrupted_msg));
+      memcpy(&header, view, sizeof(header));
+      if (header.section_cnt != MftIndex::c_section_cnt + MftIndex::c_lookup_section_cnt) FAIL(MsgError(c_corrupted_msg));
+      u64 tables_size = header.section_cnt * sizeof(MftCacheSection) + static_cast<u64>(header.chunk_cnt) * sizeof(MftCacheChunk);
+      if (view_size - sizeof(header) < tables_size) FAIL(MsgError(c_corrupted_msg));
+      const MftCacheSection* section_table = reinterpret_cast<const MftCacheSection*>(view + sizeof(header));
+      const MftCacheChunk* chunk_table = reinterpret_cast<const MftCacheChunk*>(view + sizeof(header) + header.section_cnt * sizeof(MftCacheSection));
+      lzo_uint32 header_checksum = crc32_update(0, view + offsetof(MftCacheHeader, version), sizeof(header) - offsetof(MftCacheHeader, version));
+      header_checksum = crc32_update(header_checksum, view + sizeof(header), static_cast<size_t>(tables_size));
+      if (header_checksum != header.header_checksum) FAIL(MsgError(c_corrupted_msg));
+
+      Array<u64> sizes;
+      u64 data_size = 0;
+      for (unsigned i = 0; i < header.section_cnt; i++) {
+        const MftCacheSection& section = section_table[i];
+        if ((section.first_chunk > header.chunk_cnt) || (section.chunk_cnt > header.chunk_cnt - section.first_chunk)) FAIL(MsgError(c_corrupted_msg));
+        u64 size = 0;
+        for (unsigned j = section.first_chunk; j < section.first_chunk + section.chunk_cnt; j++) {
+          const MftCacheChunk& chunk = chunk_table[j];
+          if ((chunk.offset > view_size) || (chunk.size > view_size - chunk.offset)) FAIL(MsgError(c_corrupted_msg));
+          size += chunk.data_size;
+        }
+        if (size != section.size) FAIL(MsgError(c_corrupted_msg));
+        sizes += size;
+        data_size += size;
+      }
+      // sections are decompressed directly into index columns and lookup tables
+      Array<u8*> buffers;
+      mft_index.alloc_sections(sizes, buffers);
+      bool lookup_damaged = false;
+      Array<LzoChunk> chunks;
+      chunks.extend(header.chunk_cnt);
+      Array<unsigned> chunk_sections;
+      for (unsigned i = 0; i < header.section_cnt; i++) {
+        // lookup table of unexpected size is rebuilt
+        if (buffers[i] == NULL) {
+          lookup_damaged = true;
+          continue;
+        }
+        u8* dst = buffers[i];
+        for (unsigned j = section_table[i].first_chunk; j < section_table[i].first_chunk + section_table[i].chunk_cnt; j++) {
+          LzoChunk chunk;
+          chunk.src = view + chunk_table[j].offset;
+          chunk.src_size = chunk_table[j].size;
+          chunk.dst = dst;
+          chunk.dst_size = chunk_table[j].data_size;
+          chunk.compressed = (chunk_table[j].flags & c_cache_chunk_compressed) != 0;
+          chunk.checksum = chunk_table[j].checksum;
+          chunks += chunk;
+          chunk_sections += i;
+          dst += chunk.dst_size;
+        }
+      }
+      DWORD t_start = GetTickCount();
+      LzoChunkCodec codec;
+      codec.start_decompress(chunks);
+      while (!codec.wait(100)) {
+        if (progress) {
+          progress->percent = codec.done_count() * 70 / chunks.size();
+          progress->update_ui();
+        }
+      }
+      DBG_LOG(UnicodeString::format(L"load_mft_cache(): %u chunks, %Lu bytes decompressed in %u ms, %u threads", chunks.size(), data_size, GetTickCount() - t_start, codec.thread_count()));
+
+      // records affected by damaged chunks
+      const u64* file_ref_nums = reinterpret_cast<const u64*>(buffers[0]);
+      unsigned rec_cnt = mft_index.size();
+      const u32* name_offs = reinterpret_cast<const u32*>(buffers[2]);
+      for (unsigned i = 0; i < chunks.size(); i++) {
+        if (chunks[i].valid) continue;
+        unsigned section_idx = chunk_sections[i];
+        DBG_LOG(UnicodeString::format(L"load_mft_cache(): damaged chunk %u of section %u", i, section_idx));
+        if (section_idx >= MftIndex::c_section_cnt) {
+          lookup_damaged = true;
+          continue;
+        }
+        // record references, names offsets and parent references are required to locate records
+        if (section_idx <= 2) FAIL(MsgError(c_corrupted_msg));
+        u64 first_pos = chunks[i].dst - buffers[section_idx];
+        u64 end_pos = first_pos + chunks[i].dst_size;
+        unsigned first_rec, end_rec;
+        if (section_idx == 3) {
+          // names of records overlapping damaged range
+          first_rec = static_cast<unsigned>(std::upper_bound(name_offs, name_offs + rec_cnt + 1, static_cast<u32>(first_pos / sizeof(wchar_t))) - name_offs);
+          first_rec = first_rec ? first_rec - 1 : 0;
+          end_rec = static_cast<unsigned>(std::lower_bound(name_offs, name_offs + rec_cnt + 1, static_cast<u32>((end_pos + sizeof(wchar_t) - 1) / sizeof(wchar_t))) - name_offs);
+        }
+        else {
+          if (rec_cnt == 0) FAIL(MsgError(c_corrupted_msg));
+          u64 item_size = sizes[section_idx] / rec_cnt;
+          first_rec = static_cast<unsigned>(first_pos / item_size);
+          end_rec = static_cast<unsigned>((end_pos + item_size - 1) / item_size);
+        }
+        for (unsigned rec_idx = first_rec; (rec_idx < end_rec) && (rec_idx < rec_cnt); rec_idx++) info.damaged_file_refs.insert(file_ref_nums[rec_idx]);
+      }
+      info.usn_journal_id = header.usn_journal_id;
+      info.next_usn = header.next_usn;
+      // lookup tables are derived from damaged column data: rebuild
+      info.lookup_loaded = mft_index.check_sections(!lookup_damaged && !info.damaged_file_refs.size());
+    }
+    else FAIL(MsgError(c_wrong_version_msg));
+  }
+  catch (...) {
+    mft_index.clear();
+    throw;
+  }
+
+  if (progress) {
+    progress->percent = 70;
+    progress->update_ui();
+  }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+const u8 c_cache_version = 3;
+
+// Cache file (version 3): header, section table, chunk table and chunk data.
+// Every section (column or lookup table of MftIndex) is split into chunks that are LZO compressed
+// independently and protected by own CRC. Damaged chunk of column invalidates only records
+// stored in it, these records are reloaded from MFT. Lookup tables are stored so that they are
+// not rebuilt on every load; damaged lookup table chunk only causes rebuild.
+// Version 0 (single LZO compressed block of serialized records) is converted on load. Versions 1
+// and 2 were never released and are not supported.
+struct MftCacheHeader {
+  lzo_uint32 header_checksum; // rest of header, section and chunk tables
+  u8 version; // same position as in version 0 header
+  u8 reserved[3];
+  u32 section_cnt;
+  u32 chunk_cnt;
+  u64 usn_journal_id;
+  u64 next_usn;
+};
+
+struct MftCacheSection {
+  u64 size;
+  u32 first_chunk;
+  u32 chunk_cnt;
+};
+
+struct MftCacheChunk {
+  u64 offset;
+  u32 size; // stored size
+  u32 data_size; // size after decompression
+  lzo_uint32 checksum; // stored data
+  u32 flags;
+};
+
+const u32 c_cache_chunk_compressed = 1;
+
+// progress of cache file write or load
+class CacheProgress: public ProgressMonitor {
+public:
+  unsigned percent;
+  CacheProgress(): ProgressMonitor(true), percent(0) {
+  }
+};
+
+// state of cache file returned by load_mft_cache()
+struct MftCacheInfo {
+  u8 version;
+  DWORDLONG usn_journal_id;
+  USN next_usn;
+  std::set<u64> damaged_file_refs; // records stored in damaged chunks
+  bool lookup_loaded; // lookup tables are taken from cache file (otherwise rebuilt)
+  MftCacheInfo(): version(0), usn_journal_id(0), next_usn(0), lookup_loaded(false) {
+  }
+};
+
+// Writes cache file (version 3), progress is optional.
+// Does not use panel state, so it can be called on background thread.
+void write_mft_cache(const UnicodeString& file_name, const MftIndex& mft_index, DWORDLONG usn_journal_id, USN next_usn, CacheProgress* progress);
+
+// Loads index from cache file (version 0 or current one), sections are decompressed directly into
+// index columns. Records stored in damaged chunks are kept (with zeroed fields) and listed in info
+// to be reloaded from MFT. Index is cleared on error. Progress is optional and goes up to 70%
+// (rest is left to caller).
+void load_mft_cache(const UnicodeString& file_name, MftIndex& mft_index, MftCacheInfo& info, CacheProgress* progress);
+
+// serialized index record (USN log entries and version 0 cache)
+void encode_file_record(Array<u8>& buffer, const FileRecord& rec);
+// returns false if record does not fit into buffer
+bool decode_file_record(const u8* data, unsigned size, unsigned& pos, FileRecord& rec);
@@ -0,0 +1,1114 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include "utils.h"
+#include "volume.h"
+#include "ntfs.h"
+#include "ntfs_file.h"
+#include "mft_index.h"
+
+MftTotals& MftTotals::operator+=(const MftTotals& totals) {
+  data_size += totals.data_size;
+  disk_size += totals.disk_size;
+  fragment_cnt += totals.fragment_cnt;
+  file_cnt += totals.file_cnt;
+  dir_cnt += totals.dir_cnt;
+  hl_cnt += totals.hl_cnt;
+  file_rp_cnt += totals.file_rp_cnt;
+  dir_rp_cnt += totals.dir_rp_cnt;
+  return *this;
+}
+
+MftTotals& MftTotals::operator-=(const MftTotals& totals) {
+  data_size -= totals.data_size;
+  disk_size -= totals.disk_size;
+  fragment_cnt -= totals.fragment_cnt;
+  file_cnt -= totals.file_cnt;
+  dir_cnt -= totals.dir_cnt;
+  hl_cnt -= totals.hl_cnt;
+  file_rp_cnt -= totals.file_rp_cnt;
+  dir_rp_cnt -= totals.dir_rp_cnt;
+  return *this;
+}
+
+struct MftIndex::RecordCompare {
+  const MftIndex& index;
+  RecordCompare(const MftIndex& index): index(index) {
+  }
+  bool operator()(unsigned idx1, unsigned idx2) const {
+    return index.compare(idx1, index.parent_ref_nums[idx2], index.file_name_data(idx2), index.file_name_size(idx2)) < 0;
+  }
+};
+
+// same order as UnicodeString::compare() (cached indexes are stored sorted)
+int MftIndex::compare(unsigned idx, u64 parent_ref_num, const wchar_t* name, unsigned name_len) const {
+  if (parent_ref_nums[idx] != parent_ref_num) return parent_ref_nums[idx] > parent_ref_num ? 1 : -1;
+  unsigned len = file_name_size(idx);
+  int res = memcmp(file_name_data(idx), name, min(len, name_len) * sizeof(wchar_t));
+  if (res != 0) return res;
+  if (len > name_len) return 1;
+  else if (len == name_len) return 0;
+  else return -1;
+}
+
+bool MftIndex::equal_nocase(unsigned idx, u64 parent_ref_num, const wchar_t* name, unsigned name_len) const {
+  if ((parent_ref_nums[idx] != parent_ref_num) || (file_name_size(idx) != name_len)) return false;
+  const wchar_t* rec_name = file_name_data(idx);
+  const wchar_t* upcase = upcase_table.data();
+  for (unsigned i = 0; i < name_len; i++) {
+    if (upcase[static_cast<u16>(rec_name[i])] != upcase[static_cast<u16>(name[i])]) return false;
+  }
+  return true;
+}
+
+// FNV-1a over parent reference and upper case name
+u32 MftIndex::name_hash(u64 parent_ref_num, const wchar_t* name, unsigned name_len) const {
+  const u32 c_fnv_prime = 16777619;
+  u32 hash = 2166136261;
+  for (unsigned i = 0; i < sizeof(parent_ref_num); i++) {
+    hash = (hash ^ static_cast<u8>(parent_ref_num >> (i * 8))) * c_fnv_prime;
+  }
+  const wchar_t* upcase = upcase_table.data();
+  for (unsigned i = 0; i < name_len; i++) {
+    u16 c = upcase[static_cast<u16>(name[i])];
+    hash = (hash ^ (c & 0xFF)) * c_fnv_prime;
+    hash = (hash ^ (c >> 8)) * c_fnv_prime;
+  }
+  return hash;
+}
+
+// maps index of record kept by update() to its new position
+// (position shift changes only at run boundaries)
+struct MftIndex::RecordRemap {
+  static const unsigned c_bucket_bits = 12;
+  Array<unsigned> old_idxs; // first record of every run of kept records
+  Array<unsigned> new_idxs; // its new position
+  Array<unsigned> bucket_runs; // last run starting at or before first record of bucket
+  RecordRemap(const Array<MftRecordRun>& runs, unsigned old_size) {
+    unsigned new_idx = 0;
+    for (unsigned i = 0; i < runs.size(); i++) {
+      if (runs[i].src_idx < old_size) {
+        old_idxs += runs[i].src_idx;
+        new_idxs += new_idx;
+      }
+      new_idx += runs[i].cnt;
+    }
+    unsigned bucket_cnt = (old_size >> c_bucket_bits) + 1;
+    bucket_runs.extend(bucket_cnt);
+    unsigned run = 0;
+    for (unsigned bucket = 0; bucket < bucket_cnt; bucket++) {
+      while ((run + 1 < old_idxs.size()) && (old_idxs[run + 1] <= bucket << c_bucket_bits)) run++;
+      bucket_runs += run;
+    }
+  }
+  unsigned operator()(unsigned old_idx) const {
+    unsigned run = bucket_runs[old_idx >> c_bucket_bits];
+    while ((run + 1 < old_idxs.size()) && (old_idxs[run + 1] <= old_idx)) run++;
+    return new_idxs[run] + (old_idx - old_idxs[run]);
+  }
+};
+
+void add_run(Array<MftRecordRun>& runs, unsigned src_idx, unsigned cnt) {
+  if (cnt == 0) return;
+  if (runs.size() && (runs.last().src_idx + runs.last().cnt == src_idx)) runs.last_item().cnt += cnt;
+  else {
+    MftRecordRun run;
+    run.src_idx = src_idx;
+    run.cnt = cnt;
+    runs += run;
+  }
+}
+
+// runs of records [first_idx, end_idx) except removed ones (removed_idxs are sorted, removed_pos is advanced)
+void add_kept_runs(Array<MftRecordRun>& runs, unsigned first_idx, unsigned end_idx, const Array<unsigned>& removed_idxs, unsigned& removed_pos) {
+  while ((removed_pos < removed_idxs.size()) && (removed_idxs[removed_pos] < end_idx)) {
+    add_run(runs, first_idx, removed_idxs[removed_pos] - first_idx);
+    first_idx = removed_idxs[removed_pos++] + 1;
+  }
+  add_run(runs, first_idx, end_idx - first_idx);
+}
+
+template<typename T> void gather_column(Array<T>& column, const Array<unsigned>& order) {
+  Array<T> result;
+  T* data = result.buf(order.size());
+  for (unsigned i = 0; i < order.size(); i++) data[i] = column[order[i]];
+  result.set_size(order.size());
+  column = result;
+}
+
+void MftIndex::gather(const Array<unsigned>& order) {
+  Array<u32> new_name_offs;
+  Array<wchar_t> new_names;
+  new_name_offs.extend(order.size() + 1);
+  unsigned names_size = 0;
+  for (unsigned i = 0; i < order.size(); i++) names_size += file_name_size(order[i]);
+  new_names.extend(names_size);
+  for (unsigned i = 0; i < order.size(); i++) {
+    new_name_offs += new_names.size();
+    new_names.add(file_name_data(order[i]), file_name_size(order[i]));
+  }
+  new_name_offs += new_names.size();
+  name_offs = new_name_offs;
+  names = new_names;
+
+  gather_column(file_ref_nums, order);
+  gather_column(parent_ref_nums, order);
+  gather_column(file_attrs, order);
+  gather_column(creation_times, order);
+  gather_column(last_access_times, order);
+  gather_column(last_write_times, order);
+  gather_column(data_sizes, order);
+  gather_column(disk_sizes, order);
+  gather_column(valid_sizes, order);
+  gather_column(fragment_cnts, order);
+  gather_column(mft_rec_cnts, order);
+  gather_column(stream_cnts, order);
+  gather_column(hard_link_cnts, order);
+  gather_column(flag_bits, order);
+  gather_column(name_hashes, order);
+}
+
+// Runs (in destination order) are moved inside the same buffer. Kept items do not change their
+// relative order, so runs moving left are moved in order, and consecutive runs moving right
+// are moved in reverse order before following items overwrite them.
+// Items at or after tail_idx (new records) are copied out first.
+template<typename T> void move_runs(T* data, unsigned data_size, const Array<MftRecordRun>& runs, unsigned tail_idx) {
+  Array<T> tail;
+  tail.add(data + tail_idx, data_size - tail_idx);
+  unsigned dst_idx = 0;
+  unsigned group_idx = 0; // first run of group moved in reverse order
+  for (unsigned i = 0; i <= runs.size(); i++) {
+    if ((i < runs.size()) && ((runs[i].src_idx >= tail_idx) || (runs[i].src_idx < dst_idx))) {
+      dst_idx += runs[i].cnt;
+      continue;
+    }
+    unsigned end_idx = dst_idx;
+    for (unsigned j = i; j > group_idx; j--) {
+      const MftRecordRun& run = runs[j - 1];
+      end_idx -= run.cnt;
+      if (run.src_idx >= tail_idx) memcpy(data + end_idx, tail.data() + (run.src_idx - tail_idx), run.cnt * sizeof(T));
+      else memmove(data + end_idx, data + run.src_idx, run.cnt * sizeof(T));
+    }
+    if (i == runs.size()) break;
+    if (runs[i].src_idx != dst_idx) memmove(data + dst_idx, data + runs[i].src_idx, runs[i].cnt * sizeof(T));
+    dst_idx += runs[i].cnt;
+    group_idx = i + 1;
+  }
+}
+
+template<typename T> void move_column(Array<T>& column, const Array<MftRecordRun>& runs, unsigned tail_idx, unsigned rec_cnt) {
+  move_runs(column.buf(), column.size(), runs, tail_idx);
+  column.set_size(rec_cnt);
+}
+
+// records are moved in place to avoid allocating second copy of index
+void MftIndex::move_records(const Array<MftRecordRun>& runs, unsigned tail_idx, unsigned rec_cnt) {
+  Array<MftRecordRun> name_runs;
+  name_runs.extend(runs.size());
+  for (unsigned i = 0; i < runs.size(); i++) {
+    MftRecordRun name_run;
+    name_run.src_idx = name_offs[runs[i].src_idx];
+    name_run.cnt = name_offs[runs[i].src_idx + runs[i].cnt] - name_run.src_idx;
+    name_runs += name_run;
+  }
+  unsigned names_size = 0;
+  for (unsigned i = 0; i < name_runs.size(); i++) names_size += name_runs[i].cnt;
+  move_runs(names.buf(), names.size(), name_runs, name_offs[tail_idx]);
+  names.set_size(names_size);
+
+  // name_offs[idx + 1] is end offset of record idx
+  u32* offs = name_offs.buf();
+  move_runs(offs + 1, name_offs.size() - 1, runs, tail_idx);
+  unsigned new_idx = 0;
+  unsigned new_off = 0;
+  for (unsigned i = 0; i < runs.size(); i++) {
+    if (new_off != name_runs[i].src_idx) {
+      for (unsigned j = new_idx; j < new_idx + runs[i].cnt; j++) offs[j + 1] += new_off - name_runs[i].src_idx;
+    }
+    new_idx += runs[i].cnt;
+    new_off += name_runs[i].cnt;
+  }
+  name_offs.set_size(rec_cnt + 1);
+
+  move_column(file_ref_nums, runs, tail_idx, rec_cnt);
+  move_column(parent_ref_nums, runs, tail_idx, rec_cnt);
+  move_column(file_attrs, runs, tail_idx, rec_cnt);
+  move_column(creation_times, runs, tail_idx, rec_cnt);
+  move_column(last_access_times, runs, tail_idx, rec_cnt);
+  move_column(last_write_times, runs, tail_idx, rec_cnt);
+  move_column(data_sizes, runs, tail_idx, rec_cnt);
+  move_column(disk_sizes, runs, tail_idx, rec_cnt);
+  move_column(valid_sizes, runs, tail_idx, rec_cnt);
+  move_column(fragment_cnts, runs, tail_idx, rec_cnt);
+  move_column(mft_rec_cnts, runs, tail_idx, rec_cnt);
+  move_column(stream_cnts, runs, tail_idx, rec_cnt);
+  move_column(hard_link_cnts, runs, tail_idx, rec_cnt);
+  move_column(flag_bits, runs, tail_idx, rec_cnt);
+  move_column(name_hashes, runs, tail_idx, rec_cnt);
+}
+
+template<typename T> MftIndexSection column_section(const Array<T>& column) {
+  MftIndexSection section;
+  section.data = column.data();
+  section.size = static_cast<u64>(column.size()) * sizeof(T);
+  return section;
+}
+
+// column of item_cnt items, section data is written directly into it
+template<typename T> u8* alloc_column(Array<T>& column, u64 size, u64 item_cnt) {
+  CHECK((item_cnt < 0xFFFFFFFF) && (size == item_cnt * sizeof(T)));
+  column.buf(static_cast<unsigned>(item_cnt));
+  column.set_size(static_cast<unsigned>(item_cnt));
+  return reinterpret_cast<u8*>(column.buf());
+}
+
+// lookup table stays empty (NULL is returned) if section size does not match table items
+template<typename T> u8* alloc_table(Array<T>& table, u64 size) {
+  if (size % sizeof(T) || (size / sizeof(T) >= 0xFFFFFFFF)) return NULL;
+  return alloc_column(table, size, size / sizeof(T));
+}
+
+void MftIndex::get_sections(Array<MftIndexSection>& sections) const {
+  sections.clear();
+  sections.extend(c_section_cnt);
+  sections += column_section(file_ref_nums);
+  sections += column_section(parent_ref_nums);
+  sections += column_section(name_offs);
+  sections += column_section(names);
+  sections += column_section(file_attrs);
+  sections += column_section(creation_times);
+  sections += column_section(last_access_times);
+  sections += column_section(last_write_times);
+  sections += column_section(data_sizes);
+  sections += column_section(disk_sizes);
+  sections += column_section(valid_sizes);
+  sections += column_section(fragment_cnts);
+  sections += column_section(mft_rec_cnts);
+  sections += column_section(stream_cnts);
+  sections += column_section(hard_link_cnts);
+  sections += column_section(flag_bits);
+  assert(sections.size() == c_section_cnt);
+  sections += column_section(name_hashes);
+  sections += column_section(child_offs);
+  sections += column_section(ref_offs);
+  sections += column_section(ref_rec_idxs);
+  sections += column_section(name_slots);
+  sections += column_section(dir_slots);
+  sections += column_section(dir_rec_idxs);
+  sections += column_section(dir_totals);
+  sections += column_section(dir_hl_cnts);
+  sections += column_section(upcase_table);
+  assert(sections.size() == c_section_cnt + c_lookup_section_cnt);
+}
+
+// own buffer, not shared with source array
+template<typename T> void copy_column(Array<T>& column, const Array<T>& src) {
+  column.copy(src.data(), src.size());
+}
+
+void MftIndex::copy(const MftIndex& index) {
+  clear();
+  copy_column(file_ref_nums, index.file_ref_nums);
+  copy_column(parent_ref_nums, index.parent_ref_nums);
+  copy_column(name_offs, index.name_offs);
+  copy_column(names, index.names);
+  copy_column(file_attrs, index.file_attrs);
+  copy_column(creation_times, index.creation_times);
+  copy_column(last_access_times, index.last_access_times);
+  copy_column(last_write_times, index.last_write_times);
+  copy_column(data_sizes, index.data_sizes);
+  copy_column(disk_sizes, index.disk_sizes);
+  copy_column(valid_sizes, index.valid_sizes);
+  copy_column(fragment_cnts, index.fragment_cnts);
+  copy_column(mft_rec_cnts, index.mft_rec_cnts);
+  copy_column(stream_cnts, index.stream_cnts);
+  copy_column(hard_link_cnts, index.hard_link_cnts);
+  copy_column(flag_bits, index.flag_bits);
+  copy_column(name_hashes, index.name_hashes);
+  copy_column(child_offs, index.child_offs);
+  copy_column(ref_offs, index.ref_offs);
+  copy_column(ref_rec_idxs, index.ref_rec_idxs);
+  copy_column(name_slots, index.name_slots);
+  copy_column(dir_slots, index.dir_slots);
+  copy_column(dir_rec_idxs, index.dir_rec_idxs);
+  copy_column(dir_totals, index.dir_totals);
+  copy_column(dir_hl_cnts, index.dir_hl_cnts);
+  copy_column(upcase_table, index.upcase_table);
+}
+
+void MftIndex::alloc_sections(const Array<u64>& sizes, Array<u8*>& buffers) {
+  CHECK((sizes.size() == c_section_cnt) || (sizes.size() == c_section_cnt + c_lookup_section_cnt));
+  clear();
+  try {
+    CHECK(sizes[0] % sizeof(u64) == 0);
+    u64 rec_cnt = sizes[0] / sizeof(u64);
+    CHECK(sizes[3] % sizeof(wchar_t) == 0);
+    buffers.clear();
+    buffers.extend(sizes.size());
+    buffers += alloc_column(file_ref_nums, sizes[0], rec_cnt);
+    buffers += alloc_column(parent_ref_nums, sizes[1], rec_cnt);
+    buffers += alloc_column(name_offs, sizes[2], rec_cnt + 1);
+    buffers += alloc_column(names, sizes[3], sizes[3] / sizeof(wchar_t));
+    buffers += alloc_column(file_attrs, sizes[4], rec_cnt);
+    buffers += alloc_column(creation_times, sizes[5], rec_cnt);
+    buffers += alloc_column(last_access_times, sizes[6], rec_cnt);
+    buffers += alloc_column(last_write_times, sizes[7], rec_cnt);
+    buffers += alloc_column(data_sizes, sizes[8], rec_cnt);
+    buffers += alloc_column(disk_sizes, sizes[9], rec_cnt);
+    buffers += alloc_column(valid_sizes, sizes[10], rec_cnt);
+    buffers += alloc_column(fragment_cnts, sizes[11], rec_cnt);
+    buffers += alloc_column(mft_rec_cnts, sizes[12], rec_cnt);
+    buffers += alloc_column(stream_cnts, sizes[13], rec_cnt);
+    buffers += alloc_column(hard_link_cnts, sizes[14], rec_cnt);
+    buffers += alloc_column(flag_bits, sizes[15], rec_cnt);
+    if (sizes.size() > c_section_cnt) {
+      buffers += alloc_table(name_hashes, sizes[16]);
+      buffers += alloc_table(child_offs, sizes[17]);
+      buffers += alloc_table(ref_offs, sizes[18]);
+      buffers += alloc_table(ref_rec_idxs, sizes[19]);
+      buffers += alloc_table(name_slots, sizes[20]);
+      buffers += alloc_table(dir_slots, sizes[21]);
+      buffers += alloc_table(dir_rec_idxs, sizes[22]);
+      buffers += alloc_table(dir_totals, sizes[23]);
+      buffers += alloc_table(dir_hl_cnts, sizes[24]);
+      buffers += alloc_table(loaded_upcase_table, sizes[25]);
+    }
+  }
+  catch (...) {
+    clear();
+    throw;
+  }
+}
+
+bool MftIndex::check_sections(bool lookup) {
+  try {
+    unsigned rec_cnt = size();
+    CHECK((name_offs[0] == 0) && (name_offs[rec_cnt] == names.size()));
+    for (unsigned i = 0; i < rec_cnt; i++) CHECK(name_offs[i] <= name_offs[i + 1]);
+  }
+  catch (...) {
+    clear();
+    throw;
+  }
+  bool valid = lookup && check_lookup();
+  loaded_upcase_table = Array<wchar_t>();
+  if (valid) return true;
+  name_hashes.clear();
+  child_offs.clear();
+  ref_offs.clear();
+  ref_rec_idxs.clear();
+  name_slots.clear();
+  dir_slots.clear();
+  dir_rec_idxs.clear();
+  dir_totals.clear();
+  dir_hl_cnts.clear();
+  update_name_hashes();
+  update_lookup();
+  return false;
+}
+
+bool MftIndex::set_sections(const Array<MftIndexSection>& sections) {
+  Array<u64> sizes;
+  for (unsigned i = 0; i < sections.size(); i++) sizes += sections[i].size;
+  Array<u8*> buffers;
+  alloc_sections(sizes, buffers);
+  for (unsigned i = 0; i < buffers.size(); i++) {
+    if (buffers[i]) memcpy(buffers[i], sections[i].data, static_cast<size_t>(sections[i].size));
+  }
+  return check_sections(sections.size() > c_section_cnt);
+}
+
+// Loaded lookup tables are used only if every stored record index and offset is in range,
+// so that damaged or mismatched tables cannot cause out of bounds access.
+bool MftIndex::check_lookup() {
+  unsigned rec_cnt = size();
+  // name hashes depend on case folding table
+  bool valid = (loaded_upcase_table.size() == upcase_table.size()) && (memcmp(loaded_upcase_table.data(), upcase_table.data(), upcase_table.size() * sizeof(wchar_t)) == 0);
+  valid = valid && (name_hashes.size() == rec_cnt) && child_offs.size() && (ref_offs.size() == child_offs.size()) && (ref_rec_idxs.size() == rec_cnt);
+  valid = valid && (name_slots.size() >= 16) && ((name_slots.size() & (name_slots.size() - 1)) == 0) && (name_slots.size() >= rec_cnt * 2);
+  valid = valid && (dir_slots.size() == child_offs.size() - 1) && (dir_totals.size() == dir_rec_idxs.size()) && (dir_hl_cnts.size() == dir_rec_idxs.size());
+  for (unsigned i = 0; valid && (i < child_offs.size()); i++) {
+    valid = (child_offs[i] <= rec_cnt) && (ref_offs[i] <= rec_cnt) && ((i == 0) || ((child_offs[i - 1] <= child_offs[i]) && (ref_offs[i - 1] <= ref_offs[i])));
+  }
+  valid = valid && (ref_offs[0] == 0) && (ref_offs.last() == rec_cnt);
+  for (unsigned i = 0; valid && (i < rec_cnt); i++) valid = ref_rec_idxs[i] < rec_cnt;
+  for (unsigned i = 0; valid && (i < name_slots.size()); i++) valid = name_slots[i] <= rec_cnt;
+  for (unsigned i = 0; valid && (i < dir_slots.size()); i++) valid = (dir_slots[i] == -1) || (dir_slots[i] < dir_rec_idxs.size());
+  for (unsigned i = 0; valid && (i < dir_rec_idxs.size()); i++) valid = (dir_rec_idxs[i] == -1) || (dir_rec_idxs[i] < rec_cnt);
+  return valid;
+}
+
+void MftIndex::clear() {
+  file_ref_nums = Array<u64>();
+  parent_ref_nums = Array<u64>();
+  name_offs = Array<u32>();
+  names = Array<wchar_t>();
+  file_attrs = Array<DWORD>();
+  creation_times = Array<FILETIME>();
+  last_access_times = Array<FILETIME>();
+  last_write_times = Array<FILETIME>();
+  data_sizes = Array<u64>();
+  disk_sizes = Array<u64>();
+  valid_sizes = Array<u64>();
+  fragment_cnts = Array<u32>();
+  mft_rec_cnts = Array<u32>();
+  stream_cnts = Array<u16>();
+  hard_link_cnts = Array<u16>();
+  flag_bits = Array<u8>();
+  name_hashes = Array<u32>();
+  child_offs = Array<u32>();
+  ref_offs = Array<u32>();
+  ref_rec_idxs = Array<u32>();
+  name_slots = Array<u32>();
+  dir_slots = Array<u32>();
+  dir_rec_idxs = Array<u32>();
+  dir_totals = Array<MftTotals>();
+  dir_hl_cnts = Array<u32>();
+  loaded_upcase_table = Array<wchar_t>();
+  name_offs += 0;
+}
+
+void MftIndex::reserve(unsigned rec_cnt) {
+  file_ref_nums.extend(rec_cnt);
+  parent_ref_nums.extend(rec_cnt);
+  name_offs.extend(rec_cnt + 1);
+  file_attrs.extend(rec_cnt);
+  creation_times.extend(rec_cnt);
+  last_access_times.extend(rec_cnt);
+  last_write_times.extend(rec_cnt);
+  data_sizes.extend(rec_cnt);
+  disk_sizes.extend(rec_cnt);
+  valid_sizes.extend(rec_cnt);
+  fragment_cnts.extend(rec_cnt);
+  mft_rec_cnts.extend(rec_cnt);
+  stream_cnts.extend(rec_cnt);
+  hard_link_cnts.extend(rec_cnt);
+  flag_bits.extend(rec_cnt);
+  name_hashes.extend(rec_cnt);
+}
+
+void MftIndex::add(const FileRecord& rec) {
+  if (child_offs.size()) {
+    child_offs.clear();
+    ref_offs.clear();
+    ref_rec_idxs.clear();
+    name_slots.clear();
+    dir_slots.clear();
+  }
+  append(rec);
+}
+
+// add record without dropping lookup tables
+void MftIndex::append(const FileRecord& rec) {
+  CHECK(names.size() + rec.file_name.size() >= names.size()); // name arena offsets are 32 bit
+  names.add(rec.file_name.data(), rec.file_name.size());
+  name_offs += names.size();
+  file_ref_nums += rec.file_ref_num;
+  parent_ref_nums += rec.parent_ref_num;
+  file_attrs += rec.file_attr;
+  creation_times += rec.creation_time;
+  last_access_times += rec.last_access_time;
+  last_write_times += rec.last_write_time;
+  data_sizes += rec.data_size;
+  disk_sizes += rec.disk_size;
+  valid_sizes += rec.valid_size;
+  fragment_cnts += rec.fragment_cnt;
+  mft_rec_cnts += rec.mft_rec_cnt;
+  stream_cnts += rec.stream_cnt;
+  hard_link_cnts += rec.hard_link_cnt;
+  flag_bits += rec.flags;
+  name_hashes += name_hash(rec.parent_ref_num, rec.file_name.data(), rec.file_name.size());
+}
+
+void MftIndex::sort() {
+  Array<unsigned> order;
+  unsigned* data = order.buf(size());
+  for (unsigned i = 0; i < size(); i++) data[i] = i;
+  order.set_size(size());
+  std::sort(data, data + size(), RecordCompare(*this));
+  gather(order);
+  update_lookup();
+}
+
+// lookup tables are patched if number of replaced and new records is below index size / c_patch_ratio
+const unsigned c_patch_ratio = 16;
+
+void MftIndex::update(const std::set<u64>& file_refs, const std::list<FileRecord>& file_list) {
+  unsigned old_size = size();
+  // records to be replaced (sorted) are located through file reference table if it is available
+  Array<unsigned> removed_idxs;
+  if (ref_offs.size()) {
+    for (std::set<u64>::const_iterator file_ref = file_refs.begin(); file_ref != file_refs.end(); file_ref++) {
+      if (*file_ref + 1 >= ref_offs.size()) continue;
+      unsigned ref = static_cast<unsigned>(*file_ref);
+      removed_idxs.add(ref_rec_idxs.data() + ref_offs[ref], ref_offs[ref + 1] - ref_offs[ref]);
+    }
+    std::sort(removed_idxs.buf(), removed_idxs.buf() + removed_idxs.size());
+  }
+  else {
+    for (unsigned i = 0; i < old_size; i++) {
+      if (file_refs.count(file_ref_nums[i])) removed_idxs += i;
+    }
+  }
+
+  // replaced records are taken out of lookup tables while their indexes are valid
+  bool patch = child_offs.size() && (static_cast<u64>(removed_idxs.size() + file_list.size()) * c_patch_ratio <= old_size);
+  Array<u64> removed_parents;
+  std::map<unsigned, u64> detached_slots; // directories with totals not included into their parents
+  if (patch) {
+    removed_parents.extend(removed_idxs.size());
+    for (unsigned i = 0; i < removed_idxs.size(); i++) {
+      remove_name_slot(removed_idxs[i]);
+      remove_rec_totals(removed_idxs[i], detached_slots);
+      removed_parents += parent_ref_nums[removed_idxs[i]];
+    }
+  }
+
+  // new records are appended and sorted separately
+  reserve(old_size + static_cast<unsigned>(file_list.size()));
+  for (std::list<FileRecord>::const_iterator file_rec = file_list.begin(); file_rec != file_list.end(); file_rec++) append(*file_rec);
+  Array<unsigned> delta_order;
+  unsigned* delta = delta_order.buf(size() - old_size);
+  for (unsigned i = old_size; i < size(); i++) delta[i - old_size] = i;
+  delta_order.set_size(size() - old_size);
+  std::sort(delta, delta + delta_order.size(), RecordCompare(*this));
+
+  // every new record is inserted after remaining records which are not greater (binary search),
+  // so remaining records are moved as runs between insertion points
+  Array<MftRecordRun> runs;
+  unsigned old_idx = 0;
+  unsigned removed_pos = 0;
+  for (unsigned i = 0; i < delta_order.size(); i++) {
+    unsigned first = old_idx;
+    unsigned last = old_size;
+    while (first < last) {
+      unsigned mid = first + (last - first) / 2;
+      if (compare(mid, parent_ref_nums[delta[i]], file_name_data(delta[i]), file_name_size(delta[i])) <= 0) first = mid + 1;
+      else last = mid;
+    }
+    add_kept_runs(runs, old_idx, first, removed_idxs, removed_pos);
+    add_run(runs, delta[i], 1);
+    old_idx = first;
+  }
+  add_kept_runs(runs, old_idx, old_size, removed_idxs, removed_pos);
+  move_records(runs, old_size, old_size - removed_idxs.size() + delta_order.size());
+
+  if (patch) patch_lookup(old_size, runs, removed_idxs, removed_parents, file_refs, detached_slots);
+  else update_lookup();
+}
+
+void MftIndex::update_lookup() {
+  update_child_offs();
+  update_ref_offs();
+  update_name_slots();
+  update_dir_totals();
+}
+
+void MftIndex::set_upcase_table(const Array<wchar_t>& table) {
+  if (table.size() == c_upcase_table_size) upcase_table = table;
+  else {
+    wchar_t* upcase = upcase_table.buf(c_upcase_table_size);
+    for (unsigned i = 0; i < c_upcase_table_size; i++) upcase[i] = static_cast<wchar_t>(i);
+    CharUpperBuffW(upcase, c_upcase_table_size);
+    upcase_table.set_size(c_upcase_table_size);
+  }
+  if (size()) {
+    update_name_hashes();
+    if (name_slots.size()) update_name_slots();
+  }
+}
+
+void MftIndex::update_name_hashes() {
+  u32* hashes = name_hashes.buf(size());
+  for (unsigned i = 0; i < size(); i++) hashes[i] = name_hash(parent_ref_nums[i], file_name_data(i), file_name_size(i));
+  name_hashes.set_size(size());
+}
+
+void MftIndex::update_child_offs() {
+  // only existing records can be parents: table size is bounded by MFT size
+  // (records of orphaned files with larger parent references are never listed)
+  u64 end_ref = 0;
+  for (unsigned i = 0; i < size(); i++) {
+    if (file_ref_nums[i] >= end_ref) end_ref = file_ref_nums[i] + 1;
+  }
+  CHECK(end_ref < 0xFFFFFFFF);
+  u32* offs = child_offs.buf(static_cast<unsigned>(end_ref) + 1);
+  unsigned idx = 0;
+  for (unsigned ref = 0; ref <= end_ref; ref++) {
+    offs[ref] = idx;
+    while ((idx < size()) && (parent_ref_nums[idx] == ref)) idx++;
+  }
+  child_offs.set_size(static_cast<unsigned>(end_ref) + 1);
+}
+
+void MftIndex::update_name_slots() {
+  // load factor <= 0.5
+  unsigned slot_cnt = 16;
+  while (slot_cnt < size() * 2) {
+    CHECK(slot_cnt < 0x80000000);
+    slot_cnt *= 2;
+  }
+  unsigned mask = slot_cnt - 1;
+  u32* slots = name_slots.buf(slot_cnt);
+  memset(slots, 0, slot_cnt * sizeof(u32));
+  for (unsigned i = 0; i < size(); i++) {
+    unsigned slot = name_hashes[i] & mask;
+    while (slots[slot]) slot = (slot + 1) & mask;
+    slots[slot] = i + 1;
+  }
+  name_slots.set_size(slot_cnt);
+}
+
+void MftIndex::add_name_slot(unsigned idx) {
+  unsigned mask = name_slots.size() - 1;
+  u32* slots = name_slots.buf();
+  unsigned slot = name_hashes[idx] & mask;
+  while (slots[slot]) slot = (slot + 1) & mask;
+  slots[slot] = idx + 1;
+}
+
+// backward shift deletion: following records of the probe sequence are moved into the gap
+// unless gap is before their home slot
+void MftIndex::remove_name_slot(unsigned idx) {
+  unsigned mask = name_slots.size() - 1;
+  u32* slots = name_slots.buf();
+  unsigned gap = name_hashes[idx] & mask;
+  while (slots[gap] != idx + 1) {
+    CHECK(slots[gap]);
+    gap = (gap + 1) & mask;
+  }
+  for (unsigned slot = (gap + 1) & mask; slots[slot]; slot = (slot + 1) & mask) {
+    unsigned home = name_hashes[slots[slot] - 1] & mask;
+    if (((slot - home) & mask) >= ((slot - gap) & mask)) {
+      slots[gap] = slots[slot];
+      gap = slot;
+    }
+  }
+  slots[gap] = 0;
+}
+
+// Replaced records are already removed from name slots and directory totals.
+// Record indexes stored in tables are shifted, only entries of changed files are rebuilt.
+void MftIndex::patch_lookup(unsigned old_size, const Array<MftRecordRun>& runs, const Array<unsigned>& removed_idxs, const Array<u64>& removed_parents, const std::set<u64>& file_refs, std::map<unsigned, u64>& detached_slots) {
+  RecordRemap remap(runs, old_size);
+  Array<unsigned> added_idxs; // new positions of added records (ascending)
+  unsigned new_idx = 0;
+  for (unsigned i = 0; i < runs.size(); i++) {
+    // run may continue from last old record to first added one
+    for (unsigned src_idx = max(runs[i].src_idx, old_size); src_idx < runs[i].src_idx + runs[i].cnt; src_idx++) added_idxs += new_idx + (src_idx - runs[i].src_idx);
+    new_idx += runs[i].cnt;
+  }
+
+  unsigned old_end_ref = child_offs.size() - 1;
+  patch_child_offs(old_end_ref, removed_parents, added_idxs);
+  patch_ref_offs(old_end_ref, remap, file_refs, added_idxs);
+  unsigned end_ref = child_offs.size() - 1;
+
+  if (size() * 2 > name_slots.size()) update_name_slots();
+  else {
+    u32* slots = name_slots.buf();
+    for (unsigned i = 0; i < name_slots.size(); i++) {
+      if (slots[i]) slots[i] = remap(slots[i] - 1) + 1;
+    }
+    for (unsigned i = 0; i < added_idxs.size(); i++) add_name_slot(added_idxs[i]);
+  }
+
+  u32* dir_slot_buf = dir_slots.buf(end_ref);
+  for (unsigned ref = old_end_ref; ref < end_ref; ref++) dir_slot_buf[ref] = -1;
+  dir_slots.set_size(end_ref);
+  u32* dir_idxs = dir_rec_idxs.buf();
+  for (unsigned i = 0; i < dir_rec_idxs.size(); i++) {
+    if (dir_idxs[i] != -1) dir_idxs[i] = remap(dir_idxs[i]);
+  }
+
+  // new directories first, so that their contents are added to them
+  for (unsigned i = 0; i < added_idxs.size(); i++) {
+    unsigned idx = added_idxs[i];
+    if (!counted(idx) || !(file_attrs[idx] & FILE_ATTRIBUTE_DIRECTORY)) continue;
+    unsigned ref = static_cast<unsigned>(file_ref_nums[idx]);
+    unsigned slot = dir_slots[ref];
+    if (slot == -1) {
+      slot = dir_rec_idxs.size();
+      dir_rec_idxs += -1;
+      dir_totals += MftTotals();
+      dir_hl_cnts += 0;
+      dir_slots.item(ref) = slot;
+      detached_slots[slot] = ref;
+    }
+    else if (dir_rec_idxs[slot] != -1) continue;
+    dir_rec_idxs.item(slot) = idx;
+    add_rec_totals(dir_totals.item(slot), idx);
+  }
+  for (unsigned i = 0; i < added_idxs.size(); i++) {
+    unsigned idx = added_idxs[i];
+    if (!counted(idx) || (file_attrs[idx] & FILE_ATTRIBUTE_DIRECTORY)) continue;
+    if (hard_link_cnts[idx] > 1) add_dir_totals(parent_ref_nums[idx], MftTotals(), 1, false, detached_slots);
+    else {
+      MftTotals rec_totals;
+      add_rec_totals(rec_totals, idx);
+      add_dir_totals(parent_ref_nums[idx], rec_totals, 0, false, detached_slots);
+    }
+  }
+
+  // detached directories are added to their (new) parents, slots of deleted ones stay unused
+  for (std::map<unsigned, u64>::iterator detached = detached_slots.begin(); detached != detached_slots.end();) {
+    unsigned slot = detached->first;
+    unsigned rec_idx = dir_rec_idxs[slot];
+    if (rec_idx == -1) {
+      dir_slots.item(static_cast<unsigned>(detached->second)) = -1;
+      dir_totals.item(slot) = MftTotals();
+      dir_hl_cnts.item(slot) = 0;
+      detached_slots.erase(detached++);
+      continue;
+    }
+    detached_slots.erase(detached++);
+    if (parent_ref_nums[rec_idx] != file_ref_nums[rec_idx]) {
+      MftTotals totals = dir_totals[slot];
+      add_dir_totals(parent_ref_nums[rec_idx], totals, dir_hl_cnts[slot], false, detached_slots);
+    }
+  }
+}
+
+// entry N is number of records with parent below N
+void MftIndex::patch_child_offs(unsigned old_end_ref, const Array<u64>& removed_parents, const Array<unsigned>& added_idxs) {
+  u64 end_ref = old_end_ref;
+  for (unsigned i = 0; i < added_idxs.size(); i++) {
+    if (file_ref_nums[added_idxs[i]] >= end_ref) end_ref = file_ref_nums[added_idxs[i]] + 1;
+  }
+  CHECK(end_ref < 0xFFFFFFFF);
+  u32* offs = child_offs.buf(static_cast<unsigned>(end_ref) + 1);
+  // removed and added records are sorted by parent
+  int shift = 0;
+  unsigned removed_pos = 0;
+  unsigned added_pos = 0;
+  u64 first_ref = -1;
+  if (removed_parents.size()) first_ref = removed_parents[0] + 1;
+  if (added_idxs.size() && (parent_ref_nums[added_idxs[0]] + 1 < first_ref)) first_ref = parent_ref_nums[added_idxs[0]] + 1;
+  for (u64 ref = first_ref; ref <= old_end_ref; ref++) {
+    while ((removed_pos < removed_parents.size()) && (removed_parents[removed_pos] < ref)) {
+      shift--;
+      removed_pos++;
+    }
+    while ((added_pos < added_idxs.size()) && (parent_ref_nums[added_idxs[added_pos]] < ref)) {
+      shift++;
+      added_pos++;
+    }
+    offs[ref] += shift;
+  }
+  // entries of new MFT records are found in sorted records
+  for (unsigned ref = old_end_ref + 1; ref <= end_ref; ref++) {
+    unsigned first = 0;
+    unsigned last = size();
+    while (first < last) {
+      unsigned mid = first + (last - first) / 2;
+      if (parent_ref_nums[mid] < ref) first = mid + 1;
+      else last = mid;
+    }
+    offs[ref] = first;
+  }
+  child_offs.set_size(static_cast<unsigned>(end_ref) + 1);
+}
+
+// records of unchanged files keep their order in ref_rec_idxs and are remapped
+void MftIndex::patch_ref_offs(unsigned old_end_ref, const RecordRemap& remap, const std::set<u64>& file_refs, const Array<unsigned>& added_idxs) {
+  unsigned end_ref = child_offs.size() - 1;
+  u32* offs = ref_offs.buf(end_ref + 1);
+  for (unsigned ref = old_end_ref + 1; ref <= end_ref; ref++) offs[ref] = offs[old_end_ref];
+  ref_offs.set_size(end_ref + 1);
+  // new records ordered by file reference, then by index
+  Array<u64> added_keys;
+  added_keys.extend(added_idxs.size());
+  std::set<u64> changed_refs(file_refs);
+  for (unsigned i = 0; i < added_idxs.size(); i++) {
+    added_keys += (file_ref_nums[added_idxs[i]] << 32) | added_idxs[i];
+    changed_refs.insert(file_ref_nums[added_idxs[i]]);
+  }
+  std::sort(added_keys.buf(), added_keys.buf() + added_keys.size());
+
+  Array<u32> rec_idxs;
+  u32* idxs = rec_idxs.buf(size());
+  unsigned old_pos = 0;
+  unsigned new_pos = 0;
+  unsigned added_pos = 0;
+  unsigned ref = 0;
+  int shift = 0;
+  for (std::set<u64>::const_iterator changed_ref = changed_refs.begin(); (changed_ref != changed_refs.end()) && (*changed_ref < end_ref); changed_ref++) {
+    unsigned changed = static_cast<unsigned>(*changed_ref);
+    unsigned old_first = offs[changed];
+    unsigned old_end = offs[changed + 1];
+    for (; old_pos < old_first; old_pos++) idxs[new_pos++] = remap(ref_rec_idxs[old_pos]);
+    for (; ref <= changed; ref++) offs[ref] += shift;
+    while ((added_pos < added_keys.size()) && ((added_keys[added_pos] >> 32) == changed)) idxs[new_pos++] = static_cast<u32>(added_keys[added_pos++]);
+    old_pos = old_end;
+    shift = static_cast<int>(new_pos) - static_cast<int>(old_end);
+  }
+  for (; old_pos < ref_rec_idxs.size(); old_pos++) idxs[new_pos++] = remap(ref_rec_idxs[old_pos]);
+  for (; ref <= end_ref; ref++) offs[ref] += shift;
+  assert(new_pos == size());
+  rec_idxs.set_size(size());
+  ref_rec_idxs = rec_idxs;
+}
+
+bool MftIndex::counted(unsigned idx) const {
+  return !ntfs_attr(idx) && (file_ref_nums[idx] != c_bad_clus_file_rec);
+}
+
+void MftIndex::add_rec_totals(MftTotals& totals, unsigned idx) const {
+  totals.data_size += data_sizes[idx];
+  totals.disk_size += disk_sizes[idx];
+  totals.fragment_cnt += fragment_cnts[idx];
+  if (file_attrs[idx] & FILE_ATTRIBUTE_DIRECTORY) {
+    totals.dir_cnt++;
+    if (file_attrs[idx] & FILE_ATTRIBUTE_REPARSE_POINT) totals.dir_rp_cnt++;
+  }
+  else {
+    totals.file_cnt++;
+    if (file_attrs[idx] & FILE_ATTRIBUTE_REPARSE_POINT) totals.file_rp_cnt++;
+  }
+  if (hard_link_cnts[idx] > 1) totals.hl_cnt++;
+}
+
+// add (subtract) totals and hard link count to directory and its parents; parents of directories
+// which are not yet included into their parents are not updated
+void MftIndex::add_dir_totals(u64 dir_ref_num, const MftTotals& totals, unsigned hl_cnt, bool subtract, const std::map<unsigned, u64>& detached_slots) {
+  // number of steps is limited in case of directory loop in damaged file system
+  for (unsigned i = 0; i < dir_rec_idxs.size(); i++) {
+    unsigned slot = dir_slot(dir_ref_num);
+    if (slot == -1) break;
+    if (subtract) {
+      dir_totals.item(slot) -= totals;
+      dir_hl_cnts.item(slot) -= hl_cnt;
+    }
+    else {
+      dir_totals.item(slot) += totals;
+      dir_hl_cnts.item(slot) += hl_cnt;
+    }
+    if (detached_slots.count(slot)) break;
+    u64 parent_ref_num = parent_ref_nums[dir_rec_idxs[slot]];
+    if (parent_ref_num == dir_ref_num) break;
+    dir_ref_num = parent_ref_num;
+  }
+}
+
+// Record is subtracted from totals of its parents. Directory subtree is subtracted as a whole,
+// directory keeps totals of its contents and stays detached until update is completed.
+void MftIndex::remove_rec_totals(unsigned idx, std::map<unsigned, u64>& detached_slots) {
+  if (!counted(idx)) return;
+  if (file_attrs[idx] & FILE_ATTRIBUTE_DIRECTORY) {
+    unsigned slot = dir_slot(file_ref_nums[idx]);
+    if ((slot == -1) || (dir_rec_idxs[slot] != idx)) return;
+    if (parent_ref_nums[idx] != file_ref_nums[idx]) {
+      MftTotals totals = dir_totals[slot];
+      add_dir_totals(parent_ref_nums[idx], totals, dir_hl_cnts[slot], true, detached_slots);
+    }
+    MftTotals rec_totals;
+    add_rec_totals(rec_totals, idx);
+    dir_totals.item(slot) -= rec_totals;
+    dir_rec_idxs.item(slot) = -1;
+    detached_slots[slot] = file_ref_nums[idx];
+  }
+  else if (hard_link_cnts[idx] > 1) add_dir_totals(parent_ref_nums[idx], MftTotals(), 1, true, detached_slots);
+  else {
+    MftTotals rec_totals;
+    add_rec_totals(rec_totals, idx);
+    add_dir_totals(parent_ref_nums[idx], rec_totals, 0, true, detached_slots);
+  }
+}
+
+void MftIndex::update_dir_totals() {
+  unsigned end_ref = child_offs.size() - 1;
+  u32* slots = dir_slots.buf(end_ref);
+  for (unsigned i = 0; i < end_ref; i++) slots[i] = -1;
+  dir_slots.set_size(end_ref);
+  dir_rec_idxs.clear();
+  for (unsigned i = 0; i < size(); i++) {
+    if (counted(i) && (file_attrs[i] & FILE_ATTRIBUTE_DIRECTORY)) {
+      unsigned ref = static_cast<unsigned>(file_ref_nums[i]);
+      if (slots[ref] == -1) {
+        slots[ref] = dir_rec_idxs.size();
+        dir_rec_idxs += i;
+      }
+    }
+  }
+
+  unsigned dir_cnt = dir_rec_idxs.size();
+  MftTotals* totals = dir_totals.buf(dir_cnt);
+  for (unsigned i = 0; i < dir_cnt; i++) totals[i] = MftTotals();
+  dir_totals.set_size(dir_cnt);
+  u32* hl_cnts = dir_hl_cnts.buf(dir_cnt);
+  memset(hl_cnts, 0, dir_cnt * sizeof(u32));
+  dir_hl_cnts.set_size(dir_cnt);
+  // post-order traversal: totals of subtree are added to parent after all its children are processed
+  enum { c_new, c_open, c_done };
+  Array<u8> states;
+  u8* state = states.buf(dir_cnt);
+  memset(state, c_new, dir_cnt);
+  states.set_size(dir_cnt);
+  Array<unsigned> stack;
+  for (unsigned start_slot = 0; start_slot < dir_cnt; start_slot++) {
+    // traversal starts from root and from orphaned directories (with missing parent)
+    u64 parent_ref_num = parent_ref_nums[dir_rec_idxs[start_slot]];
+    if ((parent_ref_num != file_ref_nums[dir_rec_idxs[start_slot]]) && (dir_slot(parent_ref_num) != -1)) continue;
+    stack += start_slot;
+    while (stack.size()) {
+      unsigned slot = stack.last();
+      unsigned rec_idx = dir_rec_idxs[slot];
+      if (state[slot] == c_new) {
+        state[slot] = c_open;
+        add_rec_totals(totals[slot], rec_idx);
+        unsigned first, end;
+        get_children(file_ref_nums[rec_idx], first, end);
+        for (unsigned idx = first; idx < end; idx++) {
+          if (!counted(idx)) continue;
+          if (file_attrs[idx] & FILE_ATTRIBUTE_DIRECTORY) {
+            unsigned child_slot = slots[static_cast<unsigned>(file_ref_nums[idx])];
+            if ((dir_rec_idxs[child_slot] == idx) && (child_slot != slot) && (state[child_slot] == c_new)) stack += child_slot;
+          }
+          else if (hard_link_cnts[idx] > 1) hl_cnts[slot]++;
+          else add_rec_totals(totals[slot], idx);
+        }
+      }
+      else {
+        stack.remove(stack.size() - 1);
+        state[slot] = c_done;
+        unsigned parent_slot = dir_slot(parent_ref_nums[rec_idx]);
+        if ((parent_slot != -1) && (parent_slot != slot)) {
+          totals[parent_slot] += totals[slot];
+          hl_cnts[parent_slot] += hl_cnts[slot];
+        }
+      }
+    }
+  }
+}
+
+bool MftIndex::inside_dirs(u64 file_ref_num, const std::set<u64>& dir_refs) const {
+  // number of steps is limited in case of directory loop in damaged file system
+  for (unsigned i = 0; i <= dir_rec_idxs.size(); i++) {
+    if (dir_refs.count(file_ref_num)) return true;
+    unsigned rec_idx = find_dir(file_ref_num);
+    if ((rec_idx == -1) || (parent_ref_nums[rec_idx] == file_ref_num)) return false;
+    file_ref_num = parent_ref_nums[rec_idx];
+  }
+  return false;
+}
+
+// collect hard linked files inside directory subtree; only directories with hard links
+// in their subtrees are entered
+void MftIndex::add_subtree_hard_links(unsigned dir_idx, std::set<u64>& visited, std::map<u64, unsigned>& hard_links) const {
+  Array<unsigned> stack;
+  stack += dir_idx;
+  while (stack.size()) {
+    unsigned rec_idx = stack.last();
+    stack.remove(stack.size() - 1);
+    // directory loop in damaged file system
+    if (!visited.insert(file_ref_nums[rec_idx]).second) continue;
+    unsigned first, end;
+    get_children(file_ref_nums[rec_idx], first, end);
+    for (unsigned idx = first; idx < end; idx++) {
+      if (!counted(idx)) continue;
+      if (file_attrs[idx] & FILE_ATTRIBUTE_DIRECTORY) {
+        unsigned slot = dir_slot(file_ref_nums[idx]);
+        if ((slot != -1) && (dir_rec_idxs[slot] == idx) && dir_hl_cnts[slot]) stack += idx;
+      }
+      else if (hard_link_cnts[idx] > 1) hard_links.insert(std::make_pair(file_ref_nums[idx], idx));
+    }
+  }
+}
+
+MftTotals MftIndex::get_totals(const Array<unsigned>& rec_idxs) const {
+  std::set<u64> dir_refs;
+  for (unsigned i = 0; i < rec_idxs.size(); i++) {
+    unsigned idx = rec_idxs[i];
+    if (counted(idx) && (file_attrs[idx] & FILE_ATTRIBUTE_DIRECTORY) && (find_dir(file_ref_nums[idx]) == idx)) dir_refs.insert(file_ref_nums[idx]);
+  }
+
+  MftTotals totals;
+  std::set<u64> selected_refs;
+  std::map<u64, unsigned> hard_links; // file reference -> one of its records
+  std::set<u64> visited_dirs;
+  for (unsigned i = 0; i < rec_idxs.size(); i++) {
+    unsigned idx = rec_idxs[i];
+    if (!counted(idx) || !selected_refs.insert(file_ref_nums[idx]).second) continue;
+    // skip records already counted as part of another selected directory
+    if ((parent_ref_nums[idx] != file_ref_nums[idx]) && inside_dirs(parent_ref_nums[idx], dir_refs)) continue;
+    if (dir_refs.count(file_ref_nums[idx])) {
+      unsigned slot = dir_slot(file_ref_nums[idx]);
+      totals += dir_totals[slot];
+      if (dir_hl_cnts[slot]) add_subtree_hard_links(idx, visited_dirs, hard_links);
+    }
+    else if (hard_link_cnts[idx] > 1) hard_links.insert(std::make_pair(file_ref_nums[idx], idx));
+    else add_rec_totals(totals, idx);
+  }
+  // hard linked file is counted once if any of its names is selected or inside selected directories
+  for (std::map<u64, unsigned>::const_iterator hard_link = hard_links.begin(); hard_link != hard_links.end(); hard_link++) {
+    add_rec_totals(totals, hard_link->second);
+  }
+  return totals;
+}
+
+void MftIndex::update_ref_offs() {
+  // counting sort of record indexes by file reference
+  unsigned end_ref = child_offs.size() - 1;
+  u32* offs = ref_offs.buf(end_ref + 1);
+  memset(offs, 0, (end_ref + 1) * sizeof(u32));
+  for (unsigned i = 0; i < size(); i++) offs[static_cast<unsigned>(file_ref_nums[i]) + 1]++;
+  for (unsigned ref = 0; ref < end_ref; ref++) offs[ref + 1] += offs[ref];
+  u32* idxs = ref_rec_idxs.buf(size());
+  for (unsigned i = 0; i < size(); i++) idxs[offs[static_cast<unsigned>(file_ref_nums[i])]++] = i;
+  // offs[N] now points to the end of records of N
+  for (unsigned ref = end_ref; ref > 0; ref--) offs[ref] = offs[ref - 1];
+  offs[0] = 0;
+  ref_offs.set_size(end_ref + 1);
+  ref_rec_idxs.set_size(size());
+}
+
+unsigned MftIndex::find(u64 parent_ref_num, const UnicodeString& file_name) const {
+  if (name_slots.size()) {
+    u32 hash = name_hash(parent_ref_num, file_name.data(), file_name.size());
+    unsigned mask = name_slots.size() - 1;
+    unsigned nocase_idx = -1;
+    for (unsigned slot = hash & mask; name_slots[slot]; slot = (slot + 1) & mask) {
+      unsigned idx = name_slots[slot] - 1;
+      if ((name_hashes[idx] != hash) || !equal_nocase(idx, parent_ref_num, file_name.data(), file_name.size())) continue;
+      if (compare(idx, parent_ref_num, file_name.data(), file_name.size()) == 0) return idx;
+      // several names differing only in case may exist in POSIX namespace
+      if (idx < nocase_idx) nocase_idx = idx;
+    }
+    return nocase_idx;
+  }
+  unsigned first, last;
+  // search only among directory children if offset table is available
+  if (child_offs.size()) get_children(parent_ref_num, first, last);
+  else {
+    first = 0;
+    last = size();
+  }
+  while (first < last) {
+    unsigned mid = first + (last - first) / 2;
+    int res = compare(mid, parent_ref_num, file_name.data(), file_name.size());
+    if (res == 0) return mid;
+    else if (res < 0) first = mid + 1;
+    else last = mid;
+  }
+  return -1;
+}
+
+void MftIndex::get_children(u64 parent_ref_num, unsigned& first_idx, unsigned& end_idx) const {
+  if (parent_ref_num + 1 < child_offs.size()) {
+    first_idx = child_offs[static_cast<unsigned>(parent_ref_num)];
+    end_idx = child_offs[static_cast<unsigned>(parent_ref_num) + 1];
+  }
+  else first_idx = end_idx = 0;
+}
+
+u64 MftIndex::find_root() const {
+  for (unsigned i = 0; i < size(); i++) {
+    if (file_ref_nums[i] == parent_ref_nums[i]) return file_ref_nums[i];
+  }
+  FAIL(SystemError(ERROR_FILE_NOT_FOUND));
+}
+
+u64 MftIndex::mem_size() const {
+  const unsigned c_fixed_rec_size = sizeof(u64) * 2 + sizeof(u32) + sizeof(DWORD) + sizeof(FILETIME) * 3 + sizeof(u64) * 3 + sizeof(u32) * 2 + sizeof(u16) * 2 + sizeof(u8) + sizeof(u32);
+  return static_cast<u64>(size()) * c_fixed_rec_size + sizeof(u32) + static_cast<u64>(names.size()) * sizeof(wchar_t) + static_cast<u64>(child_offs.size() + ref_offs.size() + ref_rec_idxs.size() + name_slots.size() + dir_slots.size() + dir_rec_idxs.size() + dir_hl_cnts.size()) * sizeof(u32) + static_cast<u64>(dir_totals.size()) * sizeof(MftTotals);
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+// file name (hard link) or stream entry of MFT index
+struct FileRecord {
+  u64 file_ref_num;
+  u64 parent_ref_num;
+  UnicodeString file_name;
+  DWORD file_attr;
+  FILETIME creation_time;
+  FILETIME last_access_time;
+  FILETIME last_write_time;
+  u64 data_size;
+  u64 disk_size;
+  u64 valid_size;
+  u32 fragment_cnt;
+  u32 mft_rec_cnt;
+  u16 stream_cnt;
+  u16 hard_link_cnt;
+  u8 flags;
+  bool ntfs_attr() const { return (flags & 1) != 0; }
+  bool resident() const { return (flags & 2) != 0; }
+  void set_flags(bool ntfs_attr, bool resident) { flags = (ntfs_attr ? 1 : 0) | (resident ? 2 : 0); }
+};
+
+// cumulative size and counts of files and directories
+struct MftTotals {
+  u64 data_size;
+  u64 disk_size;
+  u64 fragment_cnt;
+  unsigned file_cnt;
+  unsigned dir_cnt;
+  unsigned hl_cnt;
+  unsigned file_rp_cnt;
+  unsigned dir_rp_cnt;
+  MftTotals() {
+    memset(this, 0, sizeof(*this));
+  }
+  MftTotals& operator+=(const MftTotals& totals);
+  MftTotals& operator-=(const MftTotals& totals);
+};
+
+// records [src_idx, src_idx + cnt) of index placed next to each other when columns are rebuilt
+struct MftRecordRun {
+  unsigned src_idx;
+  unsigned cnt;
+};
+
+// raw column data of MftIndex (section of cache file)
+struct MftIndexSection {
+  const void* data;
+  u64 size;
+};
+
+// MFT index stored column-wise: every field lives in its own array and all names
+// share a single character arena, so there are no per-record allocations.
+// After sort() records are ordered by (parent_ref_num, file_name) and children of
+// every directory form a contiguous range located through CSR style offset table.
+// Name lookup goes through a hash table keyed by (parent_ref_num, upper case name)
+// so that paths are resolved with NTFS (case-insensitive) collation.
+// Every directory also keeps totals of its subtree (excluding files with several
+// hard links, which are counted separately to avoid counting them twice) and number
+// of such hard links inside the subtree, so that only subtrees containing them are searched.
+// Small updates patch lookup tables and directory totals instead of rebuilding them.
+class MftIndex: private NonCopyable {
+private:
+  Array<u64> file_ref_nums;
+  Array<u64> parent_ref_nums;
+  Array<u32> name_offs; // name of record i is names[name_offs[i]] .. names[name_offs[i + 1] - 1]
+  Array<wchar_t> names;
+  Array<DWORD> file_attrs;
+  Array<FILETIME> creation_times;
+  Array<FILETIME> last_access_times;
+  Array<FILETIME> last_write_times;
+  Array<u64> data_sizes;
+  Array<u64> disk_sizes;
+  Array<u64> valid_sizes;
+  Array<u32> fragment_cnts;
+  Array<u32> mft_rec_cnts;
+  Array<u16> stream_cnts;
+  Array<u16> hard_link_cnts;
+  Array<u8> flag_bits;
+  Array<u32> name_hashes; // hash of parent reference and case folded name
+  // children of directory with reference number N are records child_offs[N] .. child_offs[N + 1] - 1
+  // (indexed by MFT record number, empty if index is not sorted)
+  Array<u32> child_offs;
+  // records of file with reference number N are ref_rec_idxs[ref_offs[N]] .. ref_rec_idxs[ref_offs[N + 1] - 1]
+  // (same size as child_offs)
+  Array<u32> ref_offs;
+  Array<u32> ref_rec_idxs;
+  // open addressing hash table over name_hashes: record index + 1, 0 for empty slot
+  // (size is power of 2, empty if lookup tables are not built)
+  Array<u32> name_slots;
+  Array<wchar_t> upcase_table;
+  Array<wchar_t> loaded_upcase_table; // case folding table of loaded lookup tables (until check_sections())
+  // directory with reference number N is directory number dir_slots[N] (-1 if N is not a directory)
+  Array<u32> dir_slots;
+  Array<u32> dir_rec_idxs; // record index of every directory
+  Array<MftTotals> dir_totals; // subtree totals of every directory (directory itself included)
+  Array<u32> dir_hl_cnts; // names of files with more than one hard link inside subtree of every directory
+  struct RecordCompare;
+  struct RecordRemap;
+  int compare(unsigned idx, u64 parent_ref_num, const wchar_t* name, unsigned name_len) const;
+  bool equal_nocase(unsigned idx, u64 parent_ref_num, const wchar_t* name, unsigned name_len) const;
+  u32 name_hash(u64 parent_ref_num, const wchar_t* name, unsigned name_len) const;
+  void update_child_offs();
+  void update_ref_offs();
+  void update_name_hashes();
+  void update_name_slots();
+  void update_dir_totals();
+  void patch_lookup(unsigned old_size, const Array<MftRecordRun>& runs, const Array<unsigned>& removed_idxs, const Array<u64>& removed_parents, const std::set<u64>& file_refs, std::map<unsigned, u64>& detached_slots);
+  void patch_child_offs(unsigned old_end_ref, const Array<u64>& removed_parents, const Array<unsigned>& added_idxs);
+  void patch_ref_offs(unsigned old_end_ref, const RecordRemap& remap, const std::set<u64>& file_refs, const Array<unsigned>& added_idxs);
+  void add_name_slot(unsigned idx);
+  void remove_name_slot(unsigned idx);
+  bool counted(unsigned idx) const;
+  void add_rec_totals(MftTotals& totals, unsigned idx) const;
+  void add_dir_totals(u64 dir_ref_num, const MftTotals& totals, unsigned hl_cnt, bool subtract, const std::map<unsigned, u64>& detached_slots);
+  void remove_rec_totals(unsigned idx, std::map<unsigned, u64>& detached_slots);
+  unsigned dir_slot(u64 file_ref_num) const {
+    return file_ref_num < dir_slots.size() ? dir_slots[static_cast<unsigned>(file_ref_num)] : -1;
+  }
+  bool check_lookup();
+  bool inside_dirs(u64 file_ref_num, const std::set<u64>& dir_refs) const;
+  void add_subtree_hard_links(unsigned dir_idx, std::set<u64>& visited, std::map<u64, unsigned>& hard_links) const;
+  void append(const FileRecord& rec);
+  void gather(const Array<unsigned>& order);
+  void move_records(const Array<MftRecordRun>& runs, unsigned tail_idx, unsigned rec_cnt);
+public:
+  MftIndex() {
+    clear();
+    set_upcase_table(Array<wchar_t>());
+  }
+  unsigned size() const {
+    return file_ref_nums.size();
+  }
+  // release all memory
+  void clear();
+  void reserve(unsigned rec_cnt);
+  void add(const FileRecord& rec);
+  void sort();
+  // replace all records of given files with new records; sorted index is updated
+  // by merging sorted new records with the remaining ones instead of full sort,
+  // lookup tables are patched if only small part of index is changed
+  void update(const std::set<u64>& file_refs, const std::list<FileRecord>& file_list);
+  // rebuild child offset table, file reference table, name hash table and directory totals
+  // (records must be already sorted)
+  void update_lookup();
+  // case folding table (c_upcase_table_size entries), approximated with system
+  // upper case mapping if empty
+  void set_upcase_table(const Array<wchar_t>& table);
+  // Column data (c_section_cnt sections) followed by lookup tables (c_lookup_section_cnt sections)
+  // in fixed order (order is part of cache file format).
+  // Sections point to index memory and become invalid after index is modified.
+  enum {
+    c_section_cnt = 16,
+    c_lookup_section_cnt = 10
+  };
+  void get_sections(Array<MftIndexSection>& sections) const;
+  // Make this index a copy of other index (column data and lookup tables). Nothing is shared
+  // with source index, so copy may be used and destroyed on another thread.
+  void copy(const MftIndex& index);
+  // Replace index contents with columns (and lookup tables if sizes has c_section_cnt +
+  // c_lookup_section_cnt entries) of given section sizes; section data is then written directly
+  // into returned buffers. Lookup table of unexpected size gets NULL buffer and is rebuilt.
+  void alloc_sections(const Array<u64>& sizes, Array<u8*>& buffers);
+  // Validate section data written into alloc_sections() buffers. Lookup tables are kept if lookup
+  // is set and they are consistent with columns and case folding table, otherwise they are
+  // rebuilt; returns false in the latter case.
+  bool check_sections(bool lookup);
+  // Replace index contents with copy of sections (alloc_sections() and check_sections()).
+  bool set_sections(const Array<MftIndexSection>& sections);
+  // index of record with given parent and name, -1 if not found;
+  // exact match is preferred, otherwise first match ignoring case is returned
+  unsigned find(u64 parent_ref_num, const UnicodeString& file_name) const;
+  // range of directory children [first_idx, end_idx)
+  void get_children(u64 parent_ref_num, unsigned& first_idx, unsigned& end_idx) const;
+  u64 find_root() const;
+  // record index of directory, -1 if not found
+  unsigned find_dir(u64 file_ref_num) const {
+    unsigned slot = dir_slot(file_ref_num);
+    return slot == -1 ? -1 : dir_rec_idxs[slot];
+  }
+  // records of file (empty if not found)
+  void get_file_records(u64 file_ref_num, const u32*& rec_idxs, unsigned& rec_cnt) const {
+    if (file_ref_num + 1 < ref_offs.size()) {
+      unsigned ref = static_cast<unsigned>(file_ref_num);
+      rec_idxs = ref_rec_idxs.data() + ref_offs[ref];
+      rec_cnt = ref_offs[ref + 1] - ref_offs[ref];
+    }
+    else {
+      rec_idxs = NULL;
+      rec_cnt = 0;
+    }
+  }
+  // file references are below this value
+  u64 end_file_ref() const {
+    return ref_offs.size() ? ref_offs.size() - 1 : 0;
+  }
+  // case folding used for name comparison
+  wchar_t upcase(wchar_t c) const {
+    return upcase_table[static_cast<u16>(c)];
+  }
+  // totals of selected records including contents of selected directories
+  // (streams and $BadClus are not counted)
+  MftTotals get_totals(const Array<unsigned>& rec_idxs) const;
+  // memory used by index data
+  u64 mem_size() const;
+
+  const u64& file_ref_num(unsigned idx) const { return file_ref_nums[idx]; }
+  const u64& parent_ref_num(unsigned idx) const { return parent_ref_nums[idx]; }
+  const wchar_t* file_name_data(unsigned idx) const { return names.data() + name_offs[idx]; }
+  unsigned file_name_size(unsigned idx) const { return name_offs[idx + 1] - name_offs[idx]; }
+  UnicodeString file_name(unsigned idx) const { return UnicodeString(file_name_data(idx), file_name_size(idx)); }
+  const DWORD& file_attr(unsigned idx) const { return file_attrs[idx]; }
+  const FILETIME& creation_time(unsigned idx) const { return creation_times[idx]; }
+  const FILETIME& last_access_time(unsigned idx) const { return last_access_times[idx]; }
+  const FILETIME& last_write_time(unsigned idx) const { return last_write_times[idx]; }
+  const u64& data_size(unsigned idx) const { return data_sizes[idx]; }
+  const u64& disk_size(unsigned idx) const { return disk_sizes[idx]; }
+  const u64& valid_size(unsigned idx) const { return valid_sizes[idx]; }
+  const u32& fragment_cnt(unsigned idx) const { return fragment_cnts[idx]; }
+  const u32& mft_rec_cnt(unsigned idx) const { return mft_rec_cnts[idx]; }
+  const u16& stream_cnt(unsigned idx) const { return stream_cnts[idx]; }
+  const u16& hard_link_cnt(unsigned idx) const { return hard_link_cnts[idx]; }
+  const u8& flags(unsigned idx) const { return flag_bits[idx]; }
+  bool ntfs_attr(unsigned idx) const { return (flag_bits[idx] & 1) != 0; }
+  bool resident(unsigned idx) const { return (flag_bits[idx] & 2) != 0; }
+};
@@ -0,0 +1,251 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include "utils.h"
+#include "ntfs.h"
+#include "volume.h"
+#include "ntfs_file.h"
+#include "mft_reader.h"
+
+#define CHECK_FMT(code) { if (!(code)) FAIL(MsgError(L"NTFS data structure parsing problem")); }
+
+// apply update sequence array to multi-sector record read from disk
+// returns false if record is torn (incomplete multi-sector write)
+bool apply_usa_fixups(u8* rec_buf, unsigned rec_size) {
+  const MFT_RECORD* rec = reinterpret_cast<const MFT_RECORD*>(rec_buf);
+  if (rec->usa_count == 0) return false;
+  if ((rec->usa_count - 1) * NTFS_BLOCK_SIZE > rec_size) return false;
+  if (rec->usa_ofs + rec->usa_count * sizeof(u16) > rec_size) return false;
+  u16* usa = reinterpret_cast<u16*>(rec_buf + rec->usa_ofs);
+  u16 usn = usa[0];
+  for (unsigned i = 1; i < rec->usa_count; i++) {
+    u16* sector_end = reinterpret_cast<u16*>(rec_buf + i * NTFS_BLOCK_SIZE - sizeof(u16));
+    if (*sector_end != usn) return false;
+    *sector_end = usa[i];
+  }
+  return true;
+}
+
+// index of lowest / highest set bit; value must not be 0
+static unsigned bit_scan_forward(u64 value) {
+  unsigned long idx;
+#ifdef _WIN64
+  _BitScanForward64(&idx, value);
+#else
+  if (static_cast<u32>(value) != 0) _BitScanForward(&idx, static_cast<u32>(value));
+  else {
+    _BitScanForward(&idx, static_cast<u32>(value >> 32));
+    idx += 32;
+  }
+#endif
+  return idx;
+}
+
+void MftBitmap::assign(const u8* data, unsigned size, u64 rec_cnt) {
+  bit_cnt = rec_cnt;
+  unsigned word_cnt = static_cast<unsigned>((rec_cnt + 63) / 64);
+  u64* w = words.buf(word_cnt);
+  memset(w, 0xFF, word_cnt * sizeof(u64));
+  memcpy(w, data, min(size, word_cnt * static_cast<unsigned>(sizeof(u64))));
+  // clear padding bits past the last record
+  if (rec_cnt % 64) w[word_cnt - 1] &= (1ULL << (rec_cnt % 64)) - 1;
+  words.set_size(word_cnt);
+}
+
+u64 MftBitmap::next_set(u64 idx) const {
+  if (idx >= bit_cnt) return bit_cnt;
+  unsigned word_idx = static_cast<unsigned>(idx / 64);
+  u64 word = words[word_idx] & (~0ULL << (idx % 64));
+  while (word == 0) {
+    if (++word_idx == words.size()) return bit_cnt;
+    word = words[word_idx];
+  }
+  return static_cast<u64>(word_idx) * 64 + bit_scan_forward(word);
+}
+
+u64 MftBitmap::next_clear(u64 idx) const {
+  if (idx >= bit_cnt) return bit_cnt;
+  unsigned word_idx = static_cast<unsigned>(idx / 64);
+  u64 word = ~words[word_idx] & (~0ULL << (idx % 64));
+  while (word == 0) {
+    if (++word_idx == words.size()) return bit_cnt;
+    word = ~words[word_idx];
+  }
+  return min(static_cast<u64>(word_idx) * 64 + bit_scan_forward(word), bit_cnt);
+}
+
+MftReader::MftReader(NtfsVolume& volume, unsigned chunk_size, unsigned buffer_cnt): volume(volume), buffer(NULL), buffer_cnt(buffer_cnt), buffer_idx(0), rec_cnt(0), next_rec(0) {
+  memzero(curr_chunk);
+  curr_chunk.rec_size = volume.file_rec_size;
+  // chunk must hold whole records and whole clusters
+  unsigned align = max(volume.file_rec_size, volume.cluster_size);
+  buffer_size = max(chunk_size / align, 1u) * align;
+  load_mft_runs();
+  buffer = static_cast<u8*>(VirtualAlloc(NULL, buffer_size * buffer_cnt, MEM_COMMIT, PAGE_READWRITE));
+  CHECK_SYS(buffer != NULL);
+}
+
+MftReader::~MftReader() {
+  if (buffer) VirtualFree(buffer, 0, MEM_RELEASE);
+}
+
+// bootstrap: $MFT describes itself in record 0
+void MftReader::load_mft_runs() {
+  volume.flush();
+  Array<u8> rec_buf;
+  unsigned read_size = max(volume.file_rec_size, volume.cluster_size);
+  volume.read(volume.mft_start_lcn * volume.cluster_size, rec_buf.buf(read_size), read_size);
+  rec_buf.set_size(volume.file_rec_size);
+  CHECK_FMT(reinterpret_cast<const MFT_RECORD*>(rec_buf.data())->magic == magic_FILE);
+  CHECK_FMT(apply_usa_fixups(rec_buf.buf(), rec_buf.size()));
+
+  MftRecView mft_rec(rec_buf);
+  unsigned attr_off = FileInfo::find_attribute(mft_rec, AT_DATA);
+  CHECK_FMT(attr_off != -1);
+  CHECK_FMT(mft_rec.attr_header(attr_off)->non_resident);
+  u64 mft_data_size = mft_rec.attr_info<ATTR_NONRESIDENT>(attr_off)->initialized_size;
+  mft_runs.clear();
+  FileInfo::decode_data_runs(mft_rec, attr_off, &mft_runs);
+
+  // highly fragmented $MFT: remaining extents are described by ATTRIBUTE_LIST
+  unsigned attr_list_off = FileInfo::find_attribute(mft_rec, AT_ATTRIBUTE_LIST);
+  if (attr_list_off != -1) {
+    CHECK_MSG(!mft_rec.attr_header(attr_list_off)->non_resident, L"Non-resident $MFT attribute list is not supported");
+    const ATTR_RESIDENT* list_info = mft_rec.attr_info<ATTR_RESIDENT>(attr_list_off);
+    unsigned idx = attr_list_off + list_info->value_offset;
+    unsigned end_idx = idx + list_info->value_length;
+    mft_rec.check(idx, list_info->value_length);
+    Array<u8> ext_rec_buf;
+    while (idx < end_idx) {
+      CHECK_FMT(idx + sizeof(ATTR_LIST_ENTRY) <= end_idx);
+      const ATTR_LIST_ENTRY* entry = mft_rec.at<ATTR_LIST_ENTRY>(idx);
+      CHECK_FMT(entry->length != 0);
+      if ((entry->type == AT_DATA) && (entry->name_length == 0) && (FILE_REF(entry->mft_reference) != 0)) {
+        rec_cnt = mft_data_size / volume.file_rec_size;
+        read_record(FILE_REF(entry->mft_reference), ext_rec_buf);
+        MftRecView ext_rec(ext_rec_buf);
+        unsigned ext_attr_off = FileInfo::find_attribute(ext_rec, AT_DATA, entry->instance);
+        CHECK_FMT(ext_attr_off != -1);
+        FileInfo::decode_data_runs(ext_rec, ext_attr_off, &mft_runs);
+      }
+      idx += entry->length;
+    }
+  }
+
+  if (volume.image) volume.mft_size = mft_data_size;
+  rec_cnt = volume.mft_size / volume.file_rec_size;
+  load_mft_bitmap(mft_rec);
+}
+
+void MftReader::load_mft_bitmap(const MftRecView& mft_rec) {
+  Array<u8> bitmap;
+  unsigned attr_off = FileInfo::find_attribute(mft_rec, AT_BITMAP);
+  if (attr_off != -1) {
+    if (mft_rec.attr_header(attr_off)->non_resident) {
+      const ATTR_NONRESIDENT* attr_info = mft_rec.attr_info<ATTR_NONRESIDENT>(attr_off);
+      CHECK_FMT(attr_info->initialized_size <= attr_info->allocated_size);
+      Array<FileInfo::DataRun> data_runs;
+      FileInfo::decode_data_runs(mft_rec, attr_off, &data_runs);
+      u8* data = bitmap.buf(static_cast<unsigned>(attr_info->allocated_size));
+      unsigned pos = 0;
+      for (unsigned i = 0; i < data_runs.size(); i++) {
+        unsigned size = static_cast<unsigned>(data_runs[i].len * volume.cluster_size);
+        CHECK_FMT((data_runs[i].lcn != -1) && (pos + size <= attr_info->allocated_size));
+        volume.read(data_runs[i].lcn * volume.cluster_size, data + pos, size);
+        pos += size;
+      }
+      CHECK_FMT(pos >= attr_info->initialized_size);
+      bitmap.set_size(static_cast<unsigned>(attr_info->initialized_size));
+    }
+    else {
+      const ATTR_RESIDENT* attr_info = mft_rec.attr_info<ATTR_RESIDENT>(attr_off);
+      bitmap.copy(mft_rec.at<u8>(attr_off + attr_info->value_offset, attr_info->value_length), attr_info->value_length);
+    }
+  }
+  // missing bitmap: all records are scanned
+  mft_bitmap.assign(bitmap.data(), bitmap.size(), rec_cnt);
+}
+
+// map byte range of $MFT:$DATA onto volume extents
+void MftReader::read_mft_data(u64 mft_pos, u8* data, unsigned size) {
+  u64 run_pos = 0;
+  for (unsigned i = 0; (i < mft_runs.size()) && (size != 0); i++) {
+    u64 run_size = mft_runs[i].len * volume.cluster_size;
+    if (mft_pos < run_pos + run_size) {
+      CHECK_FMT(mft_runs[i].lcn != -1);
+      u64 off = mft_pos - run_pos;
+      unsigned part_size = static_cast<unsigned>(min(static_cast<u64>(size), run_size - off));
+      volume.read(mft_runs[i].lcn * volume.cluster_size + off, data, part_size);
+      mft_pos += part_size;
+      data += part_size;
+      size -= part_size;
+    }
+    run_pos += run_size;
+  }
+  CHECK_FMT(size == 0);
+}
+
+bool MftReader::read_chunk() {
+  // skip unused records
+  u64 first_used_rec = mft_bitmap.next_set(next_rec);
+  if (first_used_rec >= rec_cnt) return false;
+  // start at cluster boundary (device handles require sector aligned I/O)
+  unsigned cluster_rec_cnt = max(volume.cluster_size / volume.file_rec_size, 1u);
+  next_rec = first_used_rec / cluster_rec_cnt * cluster_rec_cnt;
+  unsigned max_rec_cnt = buffer_size / volume.file_rec_size;
+  u64 end_rec = next_rec + min(static_cast<u64>(max_rec_cnt), rec_cnt - next_rec);
+  // end chunk before large range of unused records, so next read_chunk() skips it
+  const u64 c_min_gap_rec_cnt = max(static_cast<u64>(cluster_rec_cnt), 1024 * 1024 / volume.file_rec_size);
+  u64 gap_start = mft_bitmap.next_clear(first_used_rec);
+  while (gap_start < end_rec) {
+    u64 gap_end = mft_bitmap.next_set(gap_start);
+    if (gap_end - gap_start >= c_min_gap_rec_cnt) {
+      end_rec = gap_start;
+      break;
+    }
+    gap_start = mft_bitmap.next_clear(gap_end);
+  }
+
+  curr_chunk.data = buffer + buffer_idx * buffer_size;
+  buffer_idx = (buffer_idx + 1) % buffer_cnt;
+  curr_chunk.first_rec = next_rec;
+  curr_chunk.rec_cnt = static_cast<unsigned>(end_rec - next_rec);
+  // round read size up to cluster boundary
+  unsigned size = curr_chunk.rec_cnt * volume.file_rec_size;
+  size = (size + volume.cluster_size - 1) / volume.cluster_size * volume.cluster_size;
+  read_mft_data(curr_chunk.first_rec * volume.file_rec_size, curr_chunk.data, size);
+  for (unsigned i = 0; i < curr_chunk.rec_cnt; i++) {
+    u8* rec_buf = curr_chunk.data + i * volume.file_rec_size;
+    MFT_RECORD* rec = reinterpret_cast<MFT_RECORD*>(rec_buf);
+    // invalidate damaged records, so record() can reject them
+    if ((rec->magic != magic_FILE) || !apply_usa_fixups(rec_buf, volume.file_rec_size)) rec->magic = magic_BAAD;
+  }
+  next_rec = end_rec;
+  return true;
+}
+
+const u8* MftChunk::record(unsigned idx) const {
+  assert(idx < rec_cnt);
+  const u8* rec_buf = data + idx * rec_size;
+  const MFT_RECORD* rec = reinterpret_cast<const MFT_RECORD*>(rec_buf);
+  if ((rec->magic != magic_FILE) || ((rec->flags & MFT_RECORD_IN_USE) == 0)) return NULL;
+  return rec_buf;
+}
+
+void MftReader::read_record(u64 rec_num, Array<u8>& rec_buf) {
+  CHECK_FMT(rec_num < rec_cnt);
+  u64 rec_pos = rec_num * volume.file_rec_size;
+  if (volume.file_rec_size >= volume.cluster_size) {
+    read_mft_data(rec_pos, rec_buf.buf(volume.file_rec_size), volume.file_rec_size);
+  }
+  else {
+    // read whole cluster containing the record
+    u64 cluster_pos = rec_pos / volume.cluster_size * volume.cluster_size;
+    Array<u8> cluster_buf;
+    read_mft_data(cluster_pos, cluster_buf.buf(volume.cluster_size), volume.cluster_size);
+    memcpy(rec_buf.buf(volume.file_rec_size), cluster_buf.data() + (rec_pos - cluster_pos), volume.file_rec_size);
+  }
+  rec_buf.set_size(volume.file_rec_size);
+  CHECK_FMT(reinterpret_cast<const MFT_RECORD*>(rec_buf.data())->magic == magic_FILE);
+  CHECK_FMT(apply_usa_fixups(rec_buf.buf(), rec_buf.size()));
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+bool apply_usa_fixups(u8* rec_buf, unsigned rec_size);
+
+// chunk of raw MFT records (fixups applied)
+struct MftChunk {
+  u64 first_rec;
+  unsigned rec_cnt;
+  unsigned rec_size;
+  u8* data;
+  // NULL if record is not in use or damaged
+  const u8* record(unsigned idx) const;
+};
+
+// $MFT:$BITMAP (allocated MFT records), scanned 64 bits at a time.
+// Records not covered by the bitmap (short or missing bitmap) are treated as allocated.
+class MftBitmap {
+private:
+  Array<u64> words;
+  u64 bit_cnt;
+public:
+  MftBitmap(): bit_cnt(0) {
+  }
+  void assign(const u8* data, unsigned size, u64 rec_cnt);
+  bool test(u64 idx) const {
+    if (idx >= bit_cnt) return true;
+    return (words[static_cast<unsigned>(idx / 64)] & (1ULL << (idx % 64))) != 0;
+  }
+  // first allocated record >= idx; bit count if none
+  u64 next_set(u64 idx) const;
+  // first free record >= idx; bit count if none
+  u64 next_clear(u64 idx) const;
+};
+
+// Sequential $MFT reader.
+// Decodes $MFT data runs once and then reads the MFT in large chunks
+// directly from the volume (or volume image), bypassing per-record FSCTL_GET_NTFS_FILE_RECORD.
+// Chunk buffers are rotated, so with buffer_cnt > 1 previously returned chunks stay valid
+// for buffer_cnt - 1 more read_chunk() calls (I/O can overlap record processing).
+// Large ranges of unused records (per $MFT:$BITMAP) are not read at all.
+class MftReader: private NonCopyable {
+private:
+  NtfsVolume& volume;
+  Array<FileInfo::DataRun> mft_runs; // $MFT:$DATA extents (clusters)
+  u8* buffer;
+  unsigned buffer_size;
+  unsigned buffer_cnt;
+  unsigned buffer_idx;
+  u64 rec_cnt; // total number of MFT records
+  u64 next_rec; // first record of the next chunk
+  MftChunk curr_chunk;
+  MftBitmap mft_bitmap;
+  void read_mft_data(u64 mft_pos, u8* data, unsigned size);
+  void load_mft_runs();
+  void load_mft_bitmap(const MftRecView& mft_rec);
+public:
+  MftReader(NtfsVolume& volume, unsigned chunk_size = 4 * 1024 * 1024, unsigned buffer_cnt = 1);
+  ~MftReader();
+  u64 record_count() const {
+    return rec_cnt;
+  }
+  const MftBitmap& bitmap() const {
+    return mft_bitmap;
+  }
+  void seek(u64 rec_num) {
+    next_rec = rec_num;
+  }
+  // read next chunk of records; returns false when MFT end is reached
+  bool read_chunk();
+  const MftChunk& chunk() const {
+    return curr_chunk;
+  }
+  u64 first_record() const {
+    return curr_chunk.first_rec;
+  }
+  unsigned record_cnt() const {
+    return curr_chunk.rec_cnt;
+  }
+  // record from current chunk; NULL if record is not in use or damaged
+  const u8* record(unsigned idx) const {
+    return curr_chunk.record(idx);
+  }
+  // random access to a single record (fixups applied); thread-safe
+  void read_record(u64 rec_num, Array<u8>& rec_buf);
+};
@@ -0,0 +1,250 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include "utils.h"
+#include "ntfs.h"
+#include "volume.h"
+#include "ntfs_file.h"
+#include "mft_reader.h"
+#include "mft_index.h"
+#include "mft_scan.h"
+
+void add_file_records(std::list<FileRecord>& file_list, const FileInfo& file_info, bool show_streams, bool show_main_stream) {
+  u64 data_size = 0;
+  u64 nr_disk_size = 0;
+  u64 valid_size = 0;
+  unsigned stream_cnt = 0;
+  unsigned fragment_cnt = 0;
+  unsigned hard_link_cnt = 0;
+  bool fully_resident = true;
+  for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
+    const AttrInfo& attr_info = file_info.attr_list[i];
+    if (!attr_info.resident) {
+      nr_disk_size += attr_info.disk_size;
+      fully_resident = false;
+    }
+    if (attr_info.type == AT_DATA) {
+      data_size += attr_info.data_size;
+      valid_size += attr_info.valid_size;
+      stream_cnt++;
+    }
+    if (attr_info.fragments > 1) fragment_cnt += static_cast<unsigned>(attr_info.fragments - 1);
+  }
+  for (unsigned i = 0; i < file_info.file_name_list.size(); i++) {
+    if (file_info.file_name_list[i].file_name_type != FILE_NAME_DOS) hard_link_cnt++;
+  }
+  DWORD file_attr = file_info.std_info.file_attributes;
+  if (file_info.base_mft_rec()->flags & MFT_RECORD_IS_DIRECTORY) {
+    file_attr |= FILE_ATTRIBUTE_DIRECTORY;
+    file_info.cache_dir_name();
+  }
+
+  for (unsigned i = 0; i < file_info.file_name_list.size(); i++) {
+    const FileNameAttr& name_attr = file_info.file_name_list[i];
+    if (name_attr.file_name_type != FILE_NAME_DOS) {
+      FileRecord rec;
+      rec.file_ref_num = file_info.file_ref_num();
+      rec.parent_ref_num = name_attr.parent_directory;
+      rec.file_name = name_attr.name;
+      rec.file_attr = file_attr;
+      U64_TO_FILETIME(rec.creation_time, file_info.std_info.creation_time);
+      U64_TO_FILETIME(rec.last_access_time, file_info.std_info.last_access_time);
+      U64_TO_FILETIME(rec.last_write_time, file_info.std_info.last_data_change_time);
+      rec.data_size = data_size;
+      rec.disk_size = nr_disk_size;
+      rec.valid_size = valid_size;
+      rec.fragment_cnt = fragment_cnt;
+      rec.stream_cnt = stream_cnt;
+      rec.hard_link_cnt = hard_link_cnt;
+      rec.mft_rec_cnt = file_info.mft_rec_cnt;
+      rec.set_flags(false, fully_resident);
+      file_list.push_back(rec);
+    }
+  }
+
+  if (show_streams) {
+    unsigned data_or_nr_cnt = 0;
+    bool named_data = false;
+    for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
+      const AttrInfo& attr = file_info.attr_list[i];
+      if (!attr.resident || (attr.type == AT_DATA)) data_or_nr_cnt++;
+      if ((attr.type == AT_DATA) && (attr.name.size() != 0)) named_data = true;
+    }
+    // multiple non-resident/data attributes or at least one named data attribute
+    if ((data_or_nr_cnt > 1) || named_data) {
+      for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
+        const AttrInfo& attr = file_info.attr_list[i];
+        if (attr.resident && (attr.type != AT_DATA)) continue;
+        if (!show_main_stream && (attr.type == AT_DATA) && (attr.name.size() == 0)) continue;
+
+        for (unsigned i = 0; i < file_info.file_name_list.size(); i++) {
+          const FileNameAttr& name_attr = file_info.file_name_list[i];
+          if (name_attr.file_name_type != FILE_NAME_DOS) {
+
+            unsigned fragment_cnt = (unsigned) attr.fragments;
+            if (fragment_cnt != 0) fragment_cnt--;
+
+            file_attr &= ~FILE_ATTRIBUTE_DIRECTORY & ~FILE_ATTRIBUTE_REPARSE_POINT;
+            if (attr.compressed) file_attr |= FILE_ATTRIBUTE_COMPRESSED;
+            else file_attr &= ~FILE_ATTRIBUTE_COMPRESSED;
+            if (attr.encrypted) file_attr |= FILE_ATTRIBUTE_ENCRYPTED;
+            else file_attr &= ~FILE_ATTRIBUTE_ENCRYPTED;
+            if (attr.sparse) file_attr |= FILE_ATTRIBUTE_SPARSE_FILE;
+            else file_attr &= ~FILE_ATTRIBUTE_SPARSE_FILE;
+
+            FileRecord rec;
+            rec.file_ref_num = file_info.file_ref_num();
+            rec.parent_ref_num = name_attr.parent_directory;
+            rec.file_name = name_attr.name + L":" + attr.name + L":$" + attr.type_name();
+            rec.file_attr = file_attr;
+            U64_TO_FILETIME(rec.creation_time, file_info.std_info.creation_time);
+            U64_TO_FILETIME(rec.last_access_time, file_info.std_info.last_access_time);
+            U64_TO_FILETIME(rec.last_write_time, file_info.std_info.last_data_change_time);
+            rec.data_size = attr.data_size;
+            rec.disk_size = attr.disk_size;
+            rec.valid_size = attr.valid_size;
+            rec.fragment_cnt = fragment_cnt;
+            rec.stream_cnt = 0;
+            rec.hard_link_cnt = 0;
+            rec.mft_rec_cnt = 0;
+            rec.set_flags(true, attr.resident);
+            file_list.push_back(rec);
+          }
+        }
+      }
+    }
+  }
+}
+
+struct MftScanPool::Worker {
+  MftScanPool* pool;
+  FileInfo file_info;
+  ExtRecCache ext_rec_cache;
+  unsigned first_idx;
+  unsigned end_idx;
+  std::list<FileRecord> file_list;
+  unsigned count;
+  bool failed;
+  UnicodeString error_msg;
+  HANDLE h_thread;
+  HANDLE h_start_event;
+  HANDLE h_done_event;
+  Worker(): h_thread(NULL), h_start_event(NULL), h_done_event(NULL) {
+  }
+  void process() {
+    try {
+      const MftChunk& chunk = pool->chunk;
+      for (unsigned i = first_idx; i < end_idx; i++) {
+        const u8* file_rec = chunk.record(i);
+        if (file_rec && (reinterpret_cast<const MFT_RECORD*>(file_rec)->base_mft_record == 0)) {
+          file_info.set_base_file_rec(chunk.first_rec + i, file_rec, chunk.rec_size);
+          file_info.process_base_file_rec();
+          add_file_records(file_list, file_info, pool->show_streams, pool->show_main_stream);
+          count++;
+        }
+      }
+    }
+    catch (Error& e) {
+      failed = true;
+      error_msg = e.message();
+    }
+    catch (...) {
+      failed = true;
+      error_msg = L"MFT record processing failure";
+    }
+  }
+  static unsigned __stdcall th_proc(void* param) {
+    Worker* w = static_cast<Worker*>(param);
+    while (true) {
+      if (WaitForSingleObject(w->h_start_event, INFINITE) != WAIT_OBJECT_0) return FALSE;
+      if (w->pool->stop) return TRUE;
+      w->process();
+      if (!SetEvent(w->h_done_event)) return FALSE;
+    }
+  }
+};
+
+MftScanPool::MftScanPool(NtfsVolume& volume, unsigned num_th, MftReader* mft_reader, bool show_streams, bool show_main_stream): show_streams(show_streams), show_main_stream(show_main_stream), stop(false) {
+  try {
+    num_th = min(max(num_th, 1u), static_cast<unsigned>(MAXIMUM_WAIT_OBJECTS));
+    for (unsigned i = 0; i < num_th; i++) {
+      Worker* w = new Worker();
+      workers += w;
+      w->pool = this;
+      w->file_info.volume = &volume;
+      w->file_info.mft_reader = mft_reader;
+      w->file_info.ext_rec_cache = &w->ext_rec_cache;
+      w->h_start_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+      CHECK_SYS(w->h_start_event != NULL);
+      w->h_done_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+      CHECK_SYS(w->h_done_event != NULL);
+      h_done_events += w->h_done_event;
+      unsigned th_id;
+      w->h_thread = (HANDLE) _beginthreadex(NULL, 0, Worker::th_proc, w, 0, &th_id);
+      CHECK_SYS(w->h_thread != NULL);
+    }
+  }
+  catch (...) {
+    shutdown();
+    throw;
+  }
+}
+
+MftScanPool::~MftScanPool() {
+  shutdown();
+}
+
+void MftScanPool::shutdown() {
+  stop = true;
+  for (unsigned i = 0; i < workers.size(); i++) {
+    Worker* w = workers[i];
+    if (w->h_thread) {
+      SetEvent(w->h_start_event);
+      WaitForSingleObject(w->h_thread, INFINITE);
+      CloseHandle(w->h_thread);
+    }
+    if (w->h_done_event) CloseHandle(w->h_done_event);
+    if (w->h_start_event) CloseHandle(w->h_start_event);
+    delete w;
+  }
+  workers.clear();
+  h_done_events.clear();
+}
+
+void MftScanPool::start(const MftChunk& new_chunk) {
+  chunk = new_chunk;
+  unsigned slice_size = (chunk.rec_cnt + workers.size() - 1) / workers.size();
+  for (unsigned i = 0; i < workers.size(); i++) {
+    Worker* w = workers[i];
+    w->first_idx = min(i * slice_size, chunk.rec_cnt);
+    w->end_idx = min(w->first_idx + slice_size, chunk.rec_cnt);
+    w->count = 0;
+    w->failed = false;
+    CHECK_SYS(SetEvent(w->h_start_event));
+  }
+}
+
+bool MftScanPool::wait(unsigned timeout) {
+  DWORD w = WaitForMultipleObjects(h_done_events.size(), h_done_events.data(), TRUE, timeout);
+  CHECK_SYS(w != WAIT_FAILED);
+  return w != WAIT_TIMEOUT;
+}
+
+unsigned MftScanPool::collect(std::list<FileRecord>& file_list) {
+  unsigned count = 0;
+  for (unsigned i = 0; i < workers.size(); i++) {
+    Worker* w = workers[i];
+    if (w->failed) FAIL(MsgError(w->error_msg));
+    file_list.splice(file_list.end(), w->file_list);
+    count += w->count;
+  }
+  return count;
+}
+
+void MftScanPool::get_ext_rec_cache_stats(u64& hit_cnt, u64& miss_cnt) const {
+  hit_cnt = miss_cnt = 0;
+  for (unsigned i = 0; i < workers.size(); i++) {
+    hit_cnt += workers[i]->ext_rec_cache.hit_cnt;
+    miss_cnt += workers[i]->ext_rec_cache.miss_cnt;
+  }
+}
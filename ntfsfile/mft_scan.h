@@ -0,0 +1,32 @@
+#pragma once
+
+// Index records of processed base MFT record: one per file name (hard link, DOS names are skipped)
+// and, with show_streams, one per name and stream of files having several streams.
+// Directory names are stored in volume name cache.
+void add_file_records(std::list<FileRecord>& file_list, const FileInfo& file_info, bool show_streams, bool show_main_stream);
+
+// Decodes records of MFT chunk on worker threads.
+// Each worker gets contiguous slice of chunk records and own output list,
+// lists are merged in slice order, so result does not depend on thread timing.
+// Records are read through mft_reader if it is not NULL (image), otherwise through volume ioctl.
+class MftScanPool: private NonCopyable {
+private:
+  struct Worker;
+  bool show_streams;
+  bool show_main_stream;
+  MftChunk chunk;
+  volatile bool stop;
+  Array<Worker*> workers;
+  Array<HANDLE> h_done_events;
+public:
+  MftScanPool(NtfsVolume& volume, unsigned num_th, MftReader* mft_reader, bool show_streams, bool show_main_stream);
+  ~MftScanPool();
+  void shutdown();
+  // split chunk between workers and start processing
+  void start(const MftChunk& new_chunk);
+  // returns false on timeout
+  bool wait(unsigned timeout);
+  // append worker results in slice order, returns number of processed base records
+  unsigned collect(std::list<FileRecord>& file_list);
+  void get_ext_rec_cache_stats(u64& hit_cnt, u64& miss_cnt) const;
+};
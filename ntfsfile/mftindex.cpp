@@ -7,126 +7,19 @@
 #include "ntfs.h"
 #include "volume.h"
 #include "ntfs_file.h"
+#include "mft_reader.h"
+#include "crc.h"
+#include "usn_journal.h"
 #include "options.h"
 #include "dlgapi.h"
+#include "mft_index.h"
+#include "mft_cache.h"
+#include "mft_scan.h"
+#include "name_search.h"
 #include "file_panel.h"
 
 #define NTFS_FILE_REC_HEADER_SIZE offsetof(NTFS_FILE_RECORD_OUTPUT_BUFFER, FileRecordBuffer)
 
-struct FilePanel::FileRecordCompare {
-  int operator()(const FileRecord& item1, const FileRecord& item2) {
-    if (item1.parent_ref_num > item2.parent_ref_num) return 1;
-    else if (item1.parent_ref_num == item2.parent_ref_num) {
-      return item1.file_name.compare(item2.file_name);
-    }
-    else return -1;
-  }
-};
-
-void FilePanel::add_file_records(std::list<FileRecord>& file_list, const FileInfo& file_info) {
-  u64 data_size = 0;
-  u64 nr_disk_size = 0;
-  u64 valid_size = 0;
-  unsigned stream_cnt = 0;
-  unsigned fragment_cnt = 0;
-  unsigned hard_link_cnt = 0;
-  bool fully_resident = true;
-  for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
-    const AttrInfo& attr_info = file_info.attr_list[i];
-    if (!attr_info.resident) {
-      nr_disk_size += attr_info.disk_size;
-      fully_resident = false;
-    }
-    if (attr_info.type == AT_DATA) {
-      data_size += attr_info.data_size;
-      valid_size += attr_info.valid_size;
-      stream_cnt++;
-    }
-    if (attr_info.fragments > 1) fragment_cnt += static_cast<unsigned>(attr_info.fragments - 1);
-  }
-  for (unsigned i = 0; i < file_info.file_name_list.size(); i++) {
-    if (file_info.file_name_list[i].file_name_type != FILE_NAME_DOS) hard_link_cnt++;
-  }
-  DWORD file_attr = file_info.std_info.file_attributes;
-  if (file_info.base_mft_rec()->flags & MFT_RECORD_IS_DIRECTORY) file_attr |= FILE_ATTRIBUTE_DIRECTORY;
-
-  for (unsigned i = 0; i < file_info.file_name_list.size(); i++) {
-    const FileNameAttr& name_attr = file_info.file_name_list[i];
-    if (name_attr.file_name_type != FILE_NAME_DOS) {
-      FileRecord rec;
-      rec.file_ref_num = file_info.file_ref_num();
-      rec.parent_ref_num = name_attr.parent_directory;
-      rec.file_name = name_attr.name;
-      rec.file_attr = file_attr;
-      U64_TO_FILETIME(rec.creation_time, file_info.std_info.creation_time);
-      U64_TO_FILETIME(rec.last_access_time, file_info.std_info.last_access_time);
-      U64_TO_FILETIME(rec.last_write_time, file_info.std_info.last_data_change_time);
-      rec.data_size = data_size;
-      rec.disk_size = nr_disk_size;
-      rec.valid_size = valid_size;
-      rec.fragment_cnt = fragment_cnt;
-      rec.stream_cnt = stream_cnt;
-      rec.hard_link_cnt = hard_link_cnt;
-      rec.mft_rec_cnt = file_info.mft_rec_cnt;
-      rec.set_flags(false, fully_resident);
-      file_list.push_back(rec);
-    }
-  }
-
-  if (g_file_panel_mode.show_streams) {
-    unsigned data_or_nr_cnt = 0;
-    bool named_data = false;
-    for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
-      const AttrInfo& attr = file_info.attr_list[i];
-      if (!attr.resident || (attr.type == AT_DATA)) data_or_nr_cnt++;
-      if ((attr.type == AT_DATA) && (attr.name.size() != 0)) named_data = true;
-    }
-    // multiple non-resident/data attributes or at least one named data attribute
-    if ((data_or_nr_cnt > 1) || named_data) {
-      for (unsigned i = 0; i < file_info.attr_list.size(); i++) {
-        const AttrInfo& attr = file_info.attr_list[i];
-        if (attr.resident && (attr.type != AT_DATA)) continue;
-        if (!g_file_panel_mode.show_main_stream && (attr.type == AT_DATA) && (attr.name.size() == 0)) continue;
-
-        for (unsigned i = 0; i < file_info.file_name_list.size(); i++) {
-          const FileNameAttr& name_attr = file_info.file_name_list[i];
-          if (name_attr.file_name_type != FILE_NAME_DOS) {
-
-            unsigned fragment_cnt = (unsigned) attr.fragments;
-            if (fragment_cnt != 0) fragment_cnt--;
-
-            file_attr &= ~FILE_ATTRIBUTE_DIRECTORY & ~FILE_ATTRIBUTE_REPARSE_POINT;
-            if (attr.compressed) file_attr |= FILE_ATTRIBUTE_COMPRESSED;
-            else file_attr &= ~FILE_ATTRIBUTE_COMPRESSED;
-            if (attr.encrypted) file_attr |= FILE_ATTRIBUTE_ENCRYPTED;
-            else file_attr &= ~FILE_ATTRIBUTE_ENCRYPTED;
-            if (attr.sparse) file_attr |= FILE_ATTRIBUTE_SPARSE_FILE;
-            else file_attr &= ~FILE_ATTRIBUTE_SPARSE_FILE;
-
-            FileRecord rec;
-            rec.file_ref_num = file_info.file_ref_num();
-            rec.parent_ref_num = name_attr.parent_directory;
-            rec.file_name = name_attr.name + L":" + attr.name + L":$" + attr.type_name();
-            rec.file_attr = file_attr;
-            U64_TO_FILETIME(rec.creation_time, file_info.std_info.creation_time);
-            U64_TO_FILETIME(rec.last_access_time, file_info.std_info.last_access_time);
-            U64_TO_FILETIME(rec.last_write_time, file_info.std_info.last_data_change_time);
-            rec.data_size = attr.data_size;
-            rec.disk_size = attr.disk_size;
-            rec.valid_size = attr.valid_size;
-            rec.fragment_cnt = fragment_cnt;
-            rec.stream_cnt = 0;
-            rec.hard_link_cnt = 0;
-            rec.mft_rec_cnt = 0;
-            rec.set_flags(true, attr.resident);
-            file_list.push_back(rec);
-          }
-        }
-      }
-    }
-  }
-}
-
 void FilePanel::prepare_usn_journal() {
   if (!g_file_panel_mode.use_usn_journal)
     return;
@@ -182,6 +75,9 @@ void FilePanel::delete_usn_journal() {
 }
 
 void FilePanel::create_mft_index() {
+  stop_usn_monitor();
+  cache_synced = false;
+  name_search.clear();
   prepare_usn_journal();
 
   class VolumeListProgress: public ProgressMonitor {
@@ -208,210 +104,374 @@ void FilePanel::create_mft_index() {
   };
   VolumeListProgress progress;
 
-  FileInfo file_info;
-  file_info.volume = &volume;
   volume.synced = false;
-  u64 max_file_index = file_info.load_base_file_rec(volume.mft_size / volume.file_rec_size - 1);
+  volume.dir_names.clear(); // repopulated by add_file_records()
   std::list<FileRecord> file_list;
-  progress.max_file_index = max_file_index;
-
-  if (g_file_panel_mode.backward_mft_scan) {
-    u64 file_index = max_file_index + 1;
-    do {
-      file_index--;
 
-      progress.curr_file_index = max_file_index - file_index;
+  SYSTEM_INFO sys_info;
+  GetSystemInfo(&sys_info);
+  // read MFT directly in large sequential chunks; next chunk is read while workers decode current one
+  MftReader mft_reader(volume, 4 * 1024 * 1024, 2);
+  MftScanPool pool(volume, sys_info.dwNumberOfProcessors, volume.image ? &mft_reader : NULL, g_file_panel_mode.show_streams, g_file_panel_mode.show_main_stream);
+  progress.max_file_index = mft_reader.record_count();
+  bool more = mft_reader.read_chunk();
+  while (more) {
+    progress.curr_file_index = mft_reader.first_record();
+    pool.start(mft_reader.chunk());
+    more = mft_reader.read_chunk();
+    const unsigned c_ui_update_period = 100; // ms
+    while (!pool.wait(c_ui_update_period)) {
       progress.update_ui();
-
-      file_index = file_info.load_base_file_rec(file_index);
-
-      if (file_info.base_mft_rec()->base_mft_record == 0) {
-        file_info.process_base_file_rec();
-        add_file_records(file_list, file_info);
-        progress.count++;
-      }
     }
-    while (file_index != 0);
+    progress.count += pool.collect(file_list);
+    progress.update_ui();
   }
-  else {
-    for (u64 file_index = 0; file_index <= max_file_index; file_index++) {
-      progress.curr_file_index = file_index;
-      progress.update_ui();
+  u64 hit_cnt, miss_cnt;
+  pool.get_ext_rec_cache_stats(hit_cnt, miss_cnt);
+  DBG_LOG(UnicodeString::format(L"create_mft_index(): %Lu records in %Lu ms, ext. record cache: %Lu hits, %Lu misses", mft_reader.record_count(), progress.time_elapsed(), hit_cnt, miss_cnt));
 
-      if ((file_index == file_info.load_base_file_rec(file_index)) && (file_info.base_mft_rec()->base_mft_record == 0)) {
-        file_info.process_base_file_rec();
-        add_file_records(file_list, file_info);
-        progress.count++;
-      }
+  try {
+    mft_index.clear();
+    mft_index.reserve(static_cast<unsigned>(file_list.size()));
+    while (file_list.size()) {
+      mft_index.add(file_list.front());
+      file_list.pop_front();
     }
+    mft_index.sort();
+    root_dir_ref_num = mft_index.find_root();
+    DBG_LOG(UnicodeString::format(L"create_mft_index(): %u index records, %Lu bytes/record", mft_index.size(), mft_index.size() ? mft_index.mem_size() / mft_index.size() : 0));
+  }
+  catch (...) {
+    invalidate_mft_index();
+    throw;
   }
+}
 
+class FilePanel::RecordLoadProgress: public ProgressMonitor {
+protected:
+  virtual void do_update_ui() {
+    const unsigned c_client_xs = 60;
+    ObjectArray<UnicodeString> lines;
+    unsigned len1 = static_cast<unsigned>(current * c_client_xs / total);
+    if (len1 > c_client_xs) len1 = c_client_xs;
+    unsigned len2 = c_client_xs - len1;
+    lines += UnicodeString::format(L"%.*c%.*c", len1, c_pb_black, len2, c_pb_white);
+    draw_text_box(far_get_msg(MSG_FILE_PANEL_UPDATE_CACHE_PROGRESS_TITLE), lines, c_client_xs);
+    SetConsoleTitleW(UnicodeString::format(far_get_msg(MSG_FILE_PANEL_UPDATE_CACHE_PROGRESS_CONSOLE_TITLE).data(), static_cast<unsigned>(current * 100 / total)).data());
+    far_set_progress_state(TBPF_NORMAL);
+    far_set_progress_value(current, total);
+  }
+public:
+  u64 current, total;
+  RecordLoadProgress(u64 total): ProgressMonitor(true), current(0), total(total) {
+  }
+};
+
+void FilePanel::update_mft_index_from_usn() {
+  VolumeUsnJournal journal(volume.handle);
+  USN start_usn = next_usn;
+  USN end_usn = next_usn;
+  std::set<u64> upd_file_refs;
+  read_usn_changes(journal, usn_journal_id, end_usn, upd_file_refs);
+  if (upd_file_refs.size() == 0) return;
+
+  RecordLoadProgress progress(upd_file_refs.size());
+  std::list<FileRecord> file_list;
+  load_file_records(volume, upd_file_refs, file_list, &progress);
+
+  Array<u8> log_entry;
+  apply_usn_changes(start_usn, end_usn, upd_file_refs, file_list, log_entry);
+  write_usn_log(log_entry);
+}
+
+// USN log entry is only prepared here, it is written by write_usn_log()
+void FilePanel::apply_usn_changes(USN start_usn, USN end_usn, const std::set<u64>& file_refs, const std::list<FileRecord>& file_list, Array<u8>& log_entry) {
   try {
-    mft_index.clear().extend(static_cast<unsigned>(file_list.size()));
-    for (std::list<FileRecord>::const_iterator file_rec = file_list.begin(); file_rec != file_list.end(); file_rec++) mft_index += *file_rec;
-    mft_index.sort<FileRecordCompare>();
-    root_dir_ref_num = mft_find_root();
+    next_usn = end_usn;
+
+    mft_index.update(file_refs, file_list);
+    name_search.update(file_refs);
+    root_dir_ref_num = mft_index.find_root();
   }
   catch (...) {
     invalidate_mft_index();
     throw;
   }
+
+  if (g_file_panel_mode.use_cache && cache_synced) encode_usn_log_entry(log_entry, start_usn, file_refs, file_list);
 }
 
-void FilePanel::update_mft_index_from_usn() {
-  class Progress: public ProgressMonitor {
-  protected:
-    virtual void do_update_ui() {
-      const unsigned c_client_xs = 60;
-      ObjectArray<UnicodeString> lines;
-      unsigned len1 = static_cast<unsigned>(current * c_client_xs / total);
-      if (len1 > c_client_xs) len1 = c_client_xs;
-      unsigned len2 = c_client_xs - len1;
-      lines += UnicodeString::format(L"%.*c%.*c", len1, c_pb_black, len2, c_pb_white);
-      draw_text_box(far_get_msg(MSG_FILE_PANEL_UPDATE_CACHE_PROGRESS_TITLE), lines, c_client_xs);
-      SetConsoleTitleW(UnicodeString::format(far_get_msg(MSG_FILE_PANEL_UPDATE_CACHE_PROGRESS_CONSOLE_TITLE).data(), static_cast<unsigned>(current * 100 / total)).data());
-      far_set_progress_state(TBPF_NORMAL);
-      far_set_progress_value(current, total);
+const unsigned c_usn_poll_interval = 1000;
+
+// Keeps index current by following USN journal on background thread.
+// Changes are read and file records are loaded without lock, index is locked exclusively to merge
+// changes and to write USN log (log state is shared with UI thread).
+// UI thread wakes it on panel refresh to get changes merged without poll delay but does not wait:
+// panel shows index as it is, merged changes are shown on next refresh.
+class FilePanel::UsnMonitor: private NonCopyable {
+private:
+  FilePanel& panel;
+  NtfsVolume volume; // panel volume belongs to UI thread
+  UsnJournalSource* journal;
+  Event stop_event;
+  Event wake_event;
+  HANDLE h_thread;
+  volatile bool error;
+  UnicodeString error_msg;
+  void poll() {
+    DWORDLONG journal_id;
+    USN start_usn;
+    {
+      SharedLock lock(panel.index_sync);
+      journal_id = panel.usn_journal_id;
+      start_usn = panel.next_usn;
     }
-  public:
-    u64 current, total;
-    Progress(): ProgressMonitor(true), current(0) {
+    USN end_usn = start_usn;
+    std::set<u64> file_refs;
+    read_usn_changes(*journal, journal_id, end_usn, file_refs);
+    if (file_refs.size() == 0) return;
+    std::list<FileRecord> file_list;
+    panel.load_file_records(volume, file_refs, file_list);
+    Array<u8> log_entry;
+    {
+      ExclusiveLock lock(panel.index_sync);
+      panel.apply_usn_changes(start_usn, end_usn, file_refs, file_list, log_entry);
     }
-  };
-  Progress progress;
-
-  READ_USN_JOURNAL_DATA read_usn_data;
-  read_usn_data.StartUsn = next_usn;
-  read_usn_data.ReasonMask = 0xFFFFFFFF;
-  read_usn_data.ReturnOnlyOnClose = FALSE;
-  read_usn_data.Timeout = 0;
-  read_usn_data.BytesToWaitFor = 0;
-  read_usn_data.UsnJournalID = usn_journal_id;
-
-  std::set<u64> upd_file_refs;
-  Array<unsigned char> usn_buffer;
-  const unsigned c_usn_buffer_size = 0x1000;
-  while(true) {
-    DWORD bytes_ret;
-    CHECK_SYS(DeviceIoControl(volume.handle, FSCTL_READ_USN_JOURNAL, &read_usn_data, sizeof(read_usn_data), usn_buffer.buf(c_usn_buffer_size), c_usn_buffer_size, &bytes_ret, NULL));
-    usn_buffer.set_size(bytes_ret);
-    if (usn_buffer.size() < sizeof(USN)) break;
-    read_usn_data.StartUsn = *reinterpret_cast<const USN*>(usn_buffer.data());
-    if (usn_buffer.size() == sizeof(USN)) break;
-    unsigned pos = sizeof(USN);
-    while (pos < usn_buffer.size()) {
-      const USN_RECORD* usn_rec = reinterpret_cast<const USN_RECORD*>(usn_buffer.data() + pos);
-      upd_file_refs.insert(FILE_REF(usn_rec->FileReferenceNumber));
-      pos += usn_rec->RecordLength;
+    panel.write_usn_log(log_entry);
+  }
+  static unsigned __stdcall th_proc(void* param) {
+    UsnMonitor* monitor = static_cast<UsnMonitor*>(param);
+    try {
+      HANDLE h[2] = { monitor->stop_event.handle(), monitor->wake_event.handle() };
+      DWORD w;
+      while (((w = WaitForMultipleObjects(2, h, FALSE, c_usn_poll_interval)) == WAIT_TIMEOUT) || (w == WAIT_OBJECT_0 + 1)) {
+        monitor->poll();
+      }
+    }
+    catch (Error& e) {
+      monitor->error_msg = e.message();
+      monitor->error = true;
+    }
+    catch (...) {
+      monitor->error_msg = L"USN journal monitoring failure";
+      monitor->error = true;
     }
+    return TRUE;
   }
-  if (upd_file_refs.size() == 0) return;
-
-  progress.total = upd_file_refs.size();
-  std::list<FileRecord> file_list;
-  FileInfo file_info;
-  file_info.volume = &volume;
-  volume.synced = false;
-  for (std::set<u64>::const_iterator file_index = upd_file_refs.begin(); file_index != upd_file_refs.end(); file_index++) {
-    DBG_LOG(UnicodeString::format(L"mft_update_index(): %Lx", *file_index));
-    progress.current++;
-    progress.update_ui();
-    if ((*file_index == file_info.load_base_file_rec(*file_index)) && (file_info.base_mft_rec()->base_mft_record == 0)) {
-      file_info.process_base_file_rec();
-      add_file_records(file_list, file_info);
+public:
+  // takes ownership of journal source (volume journal is used if NULL)
+  UsnMonitor(FilePanel& panel, UsnJournalSource* journal = NULL): panel(panel), journal(journal), stop_event(true, false), wake_event(false, false), h_thread(NULL), error(false) {
+    try {
+      // own copy of name (strings are not shared between threads)
+      volume.open(UnicodeString(panel.volume.name.data(), panel.volume.name.size()));
+      if (this->journal == NULL) this->journal = new VolumeUsnJournal(volume.handle);
+      unsigned th_id;
+      h_thread = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0, th_proc, this, 0, &th_id));
+      CHECK_SYS(h_thread);
+    }
+    catch (...) {
+      delete this->journal;
+      throw;
     }
   }
+  ~UsnMonitor() {
+    SetEvent(stop_event.handle());
+    WaitForSingleObject(h_thread, INFINITE);
+    CloseHandle(h_thread);
+    delete journal;
+  }
+  // poll journal now instead of after poll interval (returns at once)
+  void wake() {
+    SetEvent(wake_event.handle());
+  }
+  // thread is stopped by error (index may be invalidated)
+  bool failed() const {
+    return error;
+  }
+  const UnicodeString& error_message() const {
+    return error_msg;
+  }
+};
 
+void FilePanel::start_usn_monitor(UsnJournalSource* journal) {
+  if (usn_monitor || !g_file_panel_mode.use_usn_journal || !g_file_panel_mode.live_update || !is_journal_used() || volume.image) {
+    delete journal;
+    return;
+  }
   try {
-    next_usn = read_usn_data.StartUsn;
-
-    unsigned i = 0;
-    while (i < mft_index.size()) {
-      if (upd_file_refs.count(mft_index[i].file_ref_num)) {
-        // "fast" remove
-        std::swap(mft_index.item(i), mft_index.last_item());
-        mft_index.remove(mft_index.size() - 1);
-      }
-      else i++;
-    }
+    get_mft_index_cache_name();
+    usn_monitor = new UsnMonitor(*this, journal);
+  }
+  catch (Error& e) {
+    DBG_LOG(L"start_usn_monitor(): " + e.message());
+  }
+}
 
-    mft_index.extend(mft_index.size() + static_cast<unsigned>(file_list.size()));
-    for (std::list<FileRecord>::const_iterator file_rec = file_list.begin(); file_rec != file_list.end(); file_rec++) mft_index += *file_rec;
-    mft_index.sort<FileRecordCompare>();
-    root_dir_ref_num = mft_find_root();
+void FilePanel::stop_usn_monitor() {
+  if (usn_monitor == NULL) return;
+  if (usn_monitor->failed()) DBG_LOG(L"UsnMonitor: " + usn_monitor->error_message());
+  delete usn_monitor;
+  usn_monitor = NULL;
+}
+
+void FilePanel::update_mft_index() {
+  // index is kept current by background thread, UI thread does not wait for recent changes
+  if (usn_monitor && !usn_monitor->failed() && g_file_panel_mode.live_update) {
+    usn_monitor->wake();
+    return;
   }
-  catch (...) {
-    invalidate_mft_index();
-    throw;
+  stop_usn_monitor();
+  if (is_journal_used()) {
+    try {
+      update_mft_index_from_usn();
+    }
+    catch (...) {
+      create_mft_index();
+    }
+  }
+  else if (mft_index.size() == 0) {
+    // invalidated by background thread
+    create_mft_index();
   }
+  start_usn_monitor();
+}
+
+void FilePanel::mft_fill_item(PanelItemData& pid, unsigned idx, const UnicodeString& rel_path) {
+  pid.file_name.clear();
+  if (rel_path.size() != 0) pid.file_name = rel_path + L'\\';
+  pid.file_name.add(mft_index.file_name_data(idx), mft_index.file_name_size(idx));
+  pid.alt_file_name.clear();
+  pid.file_attr = mft_index.file_attr(idx);
+  pid.creation_time = mft_index.creation_time(idx);
+  pid.last_access_time = mft_index.last_access_time(idx);
+  pid.last_write_time = mft_index.last_write_time(idx);
+  pid.data_size = mft_index.data_size(idx);
+  pid.disk_size = mft_index.disk_size(idx);
+  pid.valid_size = mft_index.valid_size(idx);
+  pid.fragment_cnt = mft_index.fragment_cnt(idx);
+  pid.stream_cnt = mft_index.stream_cnt(idx);
+  pid.hard_link_cnt = mft_index.hard_link_cnt(idx);
+  pid.mft_rec_cnt = mft_index.mft_rec_cnt(idx);
+  pid.error = false;
+  pid.ntfs_attr = mft_index.ntfs_attr(idx);
+  pid.resident = mft_index.resident(idx);
 }
 
 void FilePanel::mft_scan_dir(u64 parent_file_index, const UnicodeString& rel_path, std::list<PanelItemData>& pid_list, FileListProgress& progress) {
   progress.update_ui();
-  struct ParentFileIndexCompare {
-    int operator()(u64 item1, const FileRecord& item2) {
-      if (item1 > item2.parent_ref_num) return 1;
-      else if (item1 == item2.parent_ref_num) return 0;
-      else return -1;
-    }
-  };
-  unsigned idx = mft_index.bsearch<ParentFileIndexCompare>(parent_file_index);
-  if (idx == -1) return; // empty dir
-  while ((idx != 0) && (mft_index[idx - 1].parent_ref_num == parent_file_index)) idx--; // find first item
-  while ((idx < mft_index.size()) && (mft_index[idx].parent_ref_num == parent_file_index)) {
-    const FileRecord& file_rec = mft_index[idx];
+  unsigned first_idx, end_idx;
+  mft_index.get_children(parent_file_index, first_idx, end_idx);
+  for (unsigned idx = first_idx; idx < end_idx; idx++) {
     PanelItemData pid;
-    if (rel_path.size() != 0) pid.file_name = rel_path + L'\\' + file_rec.file_name;
-    else pid.file_name = file_rec.file_name;
-    pid.alt_file_name.clear();
-    pid.file_attr = file_rec.file_attr;
-    pid.creation_time = file_rec.creation_time;
-    pid.last_access_time = file_rec.last_access_time;
-    pid.last_write_time = file_rec.last_write_time;
-    pid.data_size = file_rec.data_size;
-    pid.disk_size = file_rec.disk_size;
-    pid.valid_size = file_rec.valid_size;
-    pid.fragment_cnt = file_rec.fragment_cnt;
-    pid.stream_cnt = file_rec.stream_cnt;
-    pid.hard_link_cnt = file_rec.hard_link_cnt;
-    pid.mft_rec_cnt = file_rec.mft_rec_cnt;
-    pid.error = false;
-    pid.ntfs_attr = file_rec.ntfs_attr();
-    pid.resident = file_rec.resident();
+    mft_fill_item(pid, idx, rel_path);
     pid_list.push_back(pid);
 
     progress.count++;
 
-    if (flat_mode && (file_rec.file_attr & FILE_ATTRIBUTE_DIRECTORY) && (file_rec.file_ref_num != root_dir_ref_num)) mft_scan_dir(file_rec.file_ref_num, pid.file_name, pid_list, progress);
+    if (flat_mode && (pid.file_attr & FILE_ATTRIBUTE_DIRECTORY) && (mft_index.file_ref_num(idx) != root_dir_ref_num)) mft_scan_dir(mft_index.file_ref_num(idx), pid.file_name, pid_list, progress);
+  }
+}
+
+struct DirPath {
+  bool inside; // directory is inside base directory
+  UnicodeString path; // relative to base directory
+};
 
-    idx++;
+// Path of directory relative to base directory. Results are memorized for every directory on the way.
+bool FilePanel::mft_rel_path(u64 dir_ref_num, u64 base_ref_num, std::map<u64, DirPath>& dir_paths, UnicodeString& rel_path) {
+  const unsigned c_max_depth = 1024;
+  Array<u64> dir_refs; // directories on the way to base directory or directory with known path
+  Array<unsigned> dir_idxs;
+  bool inside;
+  rel_path.clear();
+  u64 ref = dir_ref_num;
+  while (true) {
+    if (ref == base_ref_num) {
+      inside = true;
+      break;
+    }
+    std::map<u64, DirPath>::const_iterator dir_path = dir_paths.find(ref);
+    if (dir_path != dir_paths.end()) {
+      inside = dir_path->second.inside;
+      rel_path = dir_path->second.path;
+      break;
+    }
+    unsigned idx = mft_index.find_dir(ref);
+    if ((idx == -1) || (ref == root_dir_ref_num) || (dir_refs.size() == c_max_depth)) {
+      inside = false;
+      break;
+    }
+    dir_refs += ref;
+    dir_idxs += idx;
+    ref = mft_index.parent_ref_num(idx);
   }
+  for (unsigned i = dir_refs.size(); i > 0; i--) {
+    if (inside) {
+      if (rel_path.size()) rel_path += L'\\';
+      rel_path.add(mft_index.file_name_data(dir_idxs[i - 1]), mft_index.file_name_size(dir_idxs[i - 1]));
+    }
+    DirPath& dir_path = dir_paths[dir_refs[i - 1]];
+    dir_path.inside = inside;
+    dir_path.path = rel_path;
+  }
+  return inside;
 }
 
-u64 FilePanel::mft_find_root() const {
-  for (unsigned i = 0; i < mft_index.size(); i++) {
-    if (mft_index[i].file_ref_num == mft_index[i].parent_ref_num) return mft_index[i].file_ref_num;
+// Name search index is built under shared lock: only UI thread builds it, live update thread
+// changes it under exclusive lock.
+void FilePanel::mft_search_names(u64 dir_ref_num, std::list<PanelItemData>& pid_list, FileListProgress& progress) {
+  if (!name_search.is_built() || name_search.need_rebuild(mft_index)) name_search.build(mft_index);
+  Array<unsigned> rec_idxs;
+  name_search.find(mft_index, search_mask, rec_idxs);
+  std::map<u64, DirPath> dir_paths;
+  UnicodeString rel_path;
+  for (unsigned i = 0; i < rec_idxs.size(); i++) {
+    unsigned idx = rec_idxs[i];
+    if (mft_index.file_ref_num(idx) == root_dir_ref_num) continue;
+    if (!mft_rel_path(mft_index.parent_ref_num(idx), dir_ref_num, dir_paths, rel_path)) continue;
+    PanelItemData pid;
+    mft_fill_item(pid, idx, rel_path);
+    pid_list.push_back(pid);
+    progress.count++;
+    progress.update_ui();
   }
-  FAIL(SystemError(ERROR_FILE_NOT_FOUND));
 }
 
-u64 FilePanel::mft_find_path(const UnicodeString& path) {
+void FilePanel::mft_search(const UnicodeString& mask) {
+  search_mask = mask;
+}
+
+// caller holds index lock (lock is not recursive)
+u64 FilePanel::mft_find_path(const UnicodeString& path, unsigned* file_idx) {
   ObjectArray<UnicodeString> path_parts = split_str(remove_path_root(del_trailing_slash(path)), L'\\');
   u64 file_ref_num = root_dir_ref_num;
+  unsigned idx = mft_index.find_dir(root_dir_ref_num);
   for (unsigned i = 0; i < path_parts.size(); i++) {
-    FileRecord fr;
-    fr.parent_ref_num = file_ref_num;
-    fr.file_name = path_parts[i];
-    unsigned idx = mft_index.bsearch<FileRecordCompare>(fr);
+    idx = mft_index.find(file_ref_num, path_parts[i]);
     if (idx == -1) FAIL(SystemError(ERROR_FILE_NOT_FOUND));
-    file_ref_num = mft_index[idx].file_ref_num;
+    file_ref_num = mft_index.file_ref_num(idx);
+  }
+  if (file_idx) {
+    CHECK(idx != -1);
+    *file_idx = idx;
   }
   return file_ref_num;
 }
 
 void FilePanel::open_volume(const UnicodeString& dir) {
+  stop_usn_monitor();
+  finish_cache_compaction();
   volume.open(extract_path_root(dir));
   invalidate_mft_index();
+  Array<wchar_t> upcase_table;
+  try {
+    load_upcase_table(volume, upcase_table);
+  }
+  catch (Error& e) {
+    DBG_LOG(L"load_upcase_table(): " + e.message());
+    upcase_table.clear();
+  }
+  mft_index.set_upcase_table(upcase_table);
   prepare_usn_journal();
   if (g_file_panel_mode.use_usn_journal && is_journal_used() && g_file_panel_mode.use_cache) {
     try {
@@ -424,6 +484,7 @@ void FilePanel::open_volume(const UnicodeString& dir) {
   }
   if (mft_index.size() == 0)
     create_mft_index();
+  start_usn_monitor();
 }
 
 void FilePanel::toggle_mft_mode() {
@@ -432,19 +493,25 @@ void FilePanel::toggle_mft_mode() {
     if (is_root_path(current_dir))
       current_dir = add_trailing_slash(current_dir);
     open_volume(current_dir);
-    mft_find_path(current_dir);
+    {
+      SharedLock lock(index_sync);
+      mft_find_path(current_dir);
+    }
     mft_mode = true;
   }
   else {
     mft_mode = false;
+    search_mask.clear();
+    stop_usn_monitor();
     if (g_file_panel_mode.use_usn_journal && is_journal_used() && g_file_panel_mode.use_cache) {
       try {
-        store_mft_index();
+        save_mft_index();
       }
       catch (...) {
       }
     }
-    mft_index.clear().compact();
+    finish_cache_compaction();
+    mft_index.clear();
     volume.open(extract_path_root(get_real_path(current_dir)));
   }
 }
@@ -457,107 +524,37 @@ void FilePanel::reload_mft_all() {
   for (unsigned i = 0; i < g_file_panels.size(); i++) g_file_panels[i]->reload_mft();
 }
 
-const u8 c_cache_version = 0;
+class CacheWriteProgress: public CacheProgress {
+protected:
+  virtual void do_update_ui() {
+    const unsigned c_client_xs = 60;
+    ObjectArray<UnicodeString> lines;
+    unsigned len1 = static_cast<unsigned>(percent * c_client_xs / 100);
+    if (len1 > c_client_xs) len1 = c_client_xs;
+    unsigned len2 = c_client_xs - len1;
+    lines += UnicodeString::format(L"%.*c%.*c", len1, c_pb_black, len2, c_pb_white);
+    draw_text_box(far_get_msg(MSG_FILE_PANEL_WRITE_CACHE_PROGRESS_TITLE), lines, c_client_xs);
+    SetConsoleTitleW(UnicodeString::format(far_get_msg(MSG_FILE_PANEL_WRITE_CACHE_PROGRESS_CONSOLE_TITLE).data(), percent).data());
+    far_set_progress_state(TBPF_NORMAL);
+    far_set_progress_value(percent, 100);
+  }
+};
 
 void FilePanel::store_mft_index() {
-  if (mft_index.size() == 0) return;
-
-  class Progress: public ProgressMonitor {
-  protected:
-    virtual void do_update_ui() {
-      const unsigned c_client_xs = 60;
-      ObjectArray<UnicodeString> lines;
-      unsigned len1 = static_cast<unsigned>(percent * c_client_xs / 100);
-      if (len1 > c_client_xs) len1 = c_client_xs;
-      unsigned len2 = c_client_xs - len1;
-      lines += UnicodeString::format(L"%.*c%.*c", len1, c_pb_black, len2, c_pb_white);
-      draw_text_box(far_get_msg(MSG_FILE_PANEL_WRITE_CACHE_PROGRESS_TITLE), lines, c_client_xs);
-      SetConsoleTitleW(UnicodeString::format(far_get_msg(MSG_FILE_PANEL_WRITE_CACHE_PROGRESS_CONSOLE_TITLE).data(), percent).data());
-      far_set_progress_state(TBPF_NORMAL);
-      far_set_progress_value(percent, 100);
-    }
-  public:
-    unsigned percent;
-    Progress(): ProgressMonitor(true), percent(0) {
-    }
-  };
-  Progress progress;
-
-  u32 buffer_size = sizeof(usn_journal_id) + sizeof(next_usn) + sizeof(unsigned);
-  unsigned file_record_size = sizeof(mft_index[0].file_ref_num) + sizeof(mft_index[0].parent_ref_num) + sizeof(mft_index[0].file_attr) + sizeof(mft_index[0].creation_time) + sizeof(mft_index[0].last_access_time) + sizeof(mft_index[0].last_write_time) + sizeof(mft_index[0].data_size) + sizeof(mft_index[0].disk_size) + sizeof(mft_index[0].valid_size) + sizeof(mft_index[0].fragment_cnt) + sizeof(mft_index[0].mft_rec_cnt) + sizeof(mft_index[0].stream_cnt) + sizeof(mft_index[0].hard_link_cnt) + sizeof(mft_index[0].flags);
-  buffer_size += file_record_size * mft_index.size();
-  for (unsigned i = 0; i < mft_index.size(); i++) {
-    buffer_size += sizeof(unsigned) + mft_index[i].file_name.size() * sizeof(mft_index[i].file_name[0]);
-  }
-  Array<unsigned char> buffer;
-  buffer.extend(buffer_size);
-  #define ENCODE(var) buffer.add(reinterpret_cast<const unsigned char*>(&var), sizeof(var));
-  ENCODE(usn_journal_id);
-  ENCODE(next_usn);
-  unsigned count = mft_index.size();
-  ENCODE(count);
-  for (unsigned i = 0; i < mft_index.size(); i++) {
-    progress.percent = i * 30 / count;
-    progress.update_ui();
-
-    ENCODE(mft_index[i].file_ref_num);
-    ENCODE(mft_index[i].parent_ref_num);
-    unsigned file_name_size = mft_index[i].file_name.size();
-    ENCODE(file_name_size);
-    buffer.add(reinterpret_cast<const unsigned char*>(mft_index[i].file_name.data()), mft_index[i].file_name.size() * sizeof(mft_index[i].file_name[0]));
-    ENCODE(mft_index[i].file_attr);
-    ENCODE(mft_index[i].creation_time);
-    ENCODE(mft_index[i].last_access_time);
-    ENCODE(mft_index[i].last_write_time);
-    ENCODE(mft_index[i].data_size);
-    ENCODE(mft_index[i].disk_size);
-    ENCODE(mft_index[i].valid_size);
-    ENCODE(mft_index[i].fragment_cnt);
-    ENCODE(mft_index[i].mft_rec_cnt);
-    ENCODE(mft_index[i].stream_cnt);
-    ENCODE(mft_index[i].hard_link_cnt);
-    ENCODE(mft_index[i].flags);
-  }
-  assert(buffer.size() == buffer_size);
-
-  Array<unsigned char> comp_buffer;
-  u32 comp_buffer_size = buffer.size() + buffer.size() / 16 + 64 + 3;
-  comp_buffer.extend(comp_buffer_size);
-  Array<unsigned char> comp_work_buffer;
-  comp_work_buffer.extend(LZO1X_1_MEM_COMPRESS);
-  lzo_uint sz = comp_buffer_size;
-  if (lzo1x_1_compress(buffer.buf(), buffer.size(), comp_buffer.buf(), &sz, comp_work_buffer.buf()) != LZO_E_OK) FAIL(MsgError(L"Compressor failure"));
-  comp_buffer_size = static_cast<unsigned>(sz);
-  comp_buffer.set_size(comp_buffer_size);
-
-  progress.percent = 70;
-  progress.update_ui();
-
-  lzo_uint32 header_checksum = lzo_crc32(0, reinterpret_cast<const lzo_bytep>(&c_cache_version), sizeof(c_cache_version));
-  header_checksum = lzo_crc32(header_checksum, reinterpret_cast<const lzo_bytep>(&buffer_size), sizeof(buffer_size));
-  header_checksum = lzo_crc32(header_checksum, reinterpret_cast<const lzo_bytep>(&comp_buffer_size), sizeof(comp_buffer_size));
-  lzo_uint32 comp_buffer_checksum = lzo_crc32(0, comp_buffer.data(), comp_buffer.size());
-
-  HANDLE h_file = CreateFileW(get_mft_index_cache_name().data(), GENERIC_WRITE | GENERIC_READ, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-  CHECK_SYS(h_file != INVALID_HANDLE_VALUE);
-  CLEAN(HANDLE, h_file, CloseHandle(h_file));
-  CHECK_SYS(SetFilePointer(h_file, sizeof(header_checksum) + sizeof(buffer_size) + sizeof(comp_buffer_size) + sizeof(comp_buffer_checksum) + comp_buffer.size(), NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER);
-  CHECK_SYS(SetEndOfFile(h_file));
-  CHECK_SYS(SetFilePointer(h_file, 0, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER);
-  DWORD bw;
-  CHECK_SYS(WriteFile(h_file, &header_checksum, sizeof(header_checksum), &bw, NULL));
-  CHECK_SYS(WriteFile(h_file, &c_cache_version, sizeof(c_cache_version), &bw, NULL));
-  CHECK_SYS(WriteFile(h_file, &buffer_size, sizeof(buffer_size), &bw, NULL));
-  CHECK_SYS(WriteFile(h_file, &comp_buffer_size, sizeof(comp_buffer_size), &bw, NULL));
-  CHECK_SYS(WriteFile(h_file, &comp_buffer_checksum, sizeof(comp_buffer_checksum), &bw, NULL));
-  CHECK_SYS(WriteFile(h_file, comp_buffer.data(), comp_buffer.size(), &bw, NULL));
-
-  progress.percent = 100;
-  progress.update_ui();
+  stop_usn_monitor();
+  finish_cache_compaction();
+  CacheWriteProgress progress;
+  write_mft_cache(get_mft_index_cache_name(), mft_index, usn_journal_id, next_usn, &progress);
+  // log entries are included into cache file now
+  UnicodeString log_name = get_usn_log_name();
+  DeleteFileW(log_name.data());
+  DeleteFileW((log_name + L".1").data());
+  usn_log_size = 0;
+  cache_synced = true;
 }
 
 void FilePanel::load_mft_index() {
-  class Progress: public ProgressMonitor {
+  class Progress: public CacheProgress {
   protected:
     virtual void do_update_ui() {
       const unsigned c_client_xs = 60;
@@ -571,111 +568,68 @@ void FilePanel::load_mft_index() {
       far_set_progress_state(TBPF_NORMAL);
       far_set_progress_value(percent, 100);
     }
-  public:
-    unsigned percent;
-    Progress(): ProgressMonitor(true), percent(0) {
-    }
   };
   Progress progress;
 
-  const wchar_t* c_corrupted_msg = L"Corrupted cache file";
-  const wchar_t* c_wrong_version_msg = L"Wrong cache file version";
-  HANDLE h_file = CreateFileW(get_mft_index_cache_name().data(), FILE_READ_DATA, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-  CHECK_SYS(h_file != INVALID_HANDLE_VALUE);
-  CLEAN(HANDLE, h_file, CloseHandle(h_file));
-
-  u8 cache_version;
-  u32 buffer_size;
-  u32 comp_buffer_size;
-  lzo_uint32 saved_header_checksum, saved_comp_buffer_checksum;
-  DWORD br;
-  CHECK_SYS(ReadFile(h_file, &saved_header_checksum, sizeof(saved_header_checksum), &br, NULL));
-  if (br != sizeof(saved_header_checksum)) FAIL(MsgError(c_corrupted_msg));
-  CHECK_SYS(ReadFile(h_file, &cache_version, sizeof(cache_version), &br, NULL));
-  if (br != sizeof(cache_version)) FAIL(MsgError(c_corrupted_msg));
-  CHECK_SYS(ReadFile(h_file, &buffer_size, sizeof(buffer_size), &br, NULL));
-  if (br != sizeof(buffer_size)) FAIL(MsgError(c_corrupted_msg));
-  CHECK_SYS(ReadFile(h_file, &comp_buffer_size, sizeof(comp_buffer_size), &br, NULL));
-  if (br != sizeof(comp_buffer_size)) FAIL(MsgError(c_corrupted_msg));
-
-  lzo_uint32 header_checksum = lzo_crc32(0, reinterpret_cast<const lzo_bytep>(&cache_version), sizeof(cache_version));
-  header_checksum = lzo_crc32(header_checksum, reinterpret_cast<const lzo_bytep>(&buffer_size), sizeof(buffer_size));
-  header_checksum = lzo_crc32(header_checksum, reinterpret_cast<const lzo_bytep>(&comp_buffer_size), sizeof(comp_buffer_size));
-  if (header_checksum != saved_header_checksum) FAIL(MsgError(c_corrupted_msg));
-  if (cache_version != c_cache_version) FAIL(MsgError(c_wrong_version_msg));
-
-  CHECK_SYS(ReadFile(h_file, &saved_comp_buffer_checksum, sizeof(saved_comp_buffer_checksum), &br, NULL));
-  if (br != sizeof(saved_comp_buffer_checksum)) FAIL(MsgError(c_corrupted_msg));
-  Array<unsigned char> comp_buffer;
-  comp_buffer.extend(comp_buffer_size);
-  CHECK_SYS(ReadFile(h_file, comp_buffer.buf(), comp_buffer_size, &br, NULL));
-  if (br != comp_buffer_size) FAIL(MsgError(c_corrupted_msg));
-  comp_buffer.set_size(comp_buffer_size);
-
-  lzo_uint32 comp_buffer_checksum = lzo_crc32(0, comp_buffer.data(), comp_buffer.size());
-  if (comp_buffer_checksum != saved_comp_buffer_checksum) FAIL(MsgError(c_corrupted_msg));
-
-  progress.percent = 30;
-  progress.update_ui();
-
-  Array<unsigned char> buffer;
-  buffer.extend(buffer_size + 3);
-#ifdef _M_X64
-#  define decompress lzo1x_decompress
-#else
-#  define decompress lzo1x_decompress_asm_fast
-#endif
-  lzo_uint sz = buffer_size;
-  if (decompress(comp_buffer.data(), comp_buffer_size, buffer.buf(), &sz, NULL) != LZO_E_OK) FAIL(MsgError(c_corrupted_msg));
-  assert(sz == buffer_size);
-  buffer.set_size(buffer_size);
-
-  progress.percent = 70;
-  progress.update_ui();
-
+  MftCacheInfo cache_info;
   try {
-    #define DECODE(var) memcpy(&var, buffer.data() + pos, sizeof(var)); pos += sizeof(var);
-    unsigned pos = 0;
-    DECODE(usn_journal_id);
-    DECODE(next_usn);
-    unsigned count;
-    DECODE(count);
-    mft_index.extend(count);
-    FileRecord rec;
-    unsigned file_name_size;
-    for (unsigned i = 0; i < count; i++) {
-      progress.percent = 70 + i * 30 / count;
-      progress.update_ui();
-
-      DECODE(rec.file_ref_num);
-      DECODE(rec.parent_ref_num);
-      DECODE(file_name_size);
-      rec.file_name = UnicodeString(reinterpret_cast<const wchar_t*>(buffer.data() + pos), file_name_size);
-      pos += file_name_size * sizeof(wchar_t);
-      DECODE(rec.file_attr);
-      DECODE(rec.creation_time);
-      DECODE(rec.last_access_time);
-      DECODE(rec.last_write_time);
-      DECODE(rec.data_size);
-      DECODE(rec.disk_size);
-      DECODE(rec.valid_size);
-      DECODE(rec.fragment_cnt);
-      DECODE(rec.mft_rec_cnt);
-      DECODE(rec.stream_cnt);
-      DECODE(rec.hard_link_cnt);
-      DECODE(rec.flags);
-      mft_index += rec;
-    }
-    assert(pos == buffer_size);
-    root_dir_ref_num = mft_find_root();
+    load_mft_cache(get_mft_index_cache_name(), mft_index, cache_info, &progress);
+    usn_journal_id = cache_info.usn_journal_id;
+    next_usn = cache_info.next_usn;
+    if (cache_info.damaged_file_refs.size()) reload_file_records(cache_info.damaged_file_refs);
+    try {
+      replay_usn_log();
+    }
+    catch (Error& e) {
+      // index stays at cache file state and is updated from USN journal
+      DBG_LOG(L"replay_usn_log(): " + e.message());
+      cache_synced = false;
+    }
+    root_dir_ref_num = mft_index.find_root();
+    DBG_LOG(UnicodeString::format(L"load_mft_index(): %u index records, %Lu bytes/record", mft_index.size(), mft_index.size() ? mft_index.mem_size() / mft_index.size() : 0));
   }
   catch (...) {
     invalidate_mft_index();
     throw;
   }
+
+  // convert old cache file to current format or replace damaged chunks
+  if ((cache_info.version != c_cache_version) || cache_info.damaged_file_refs.size() || !cache_info.lookup_loaded) {
+    try {
+      store_mft_index();
+    }
+    catch (Error& e) {
+      DBG_LOG(L"store_mft_index(): " + e.message());
+    }
+  }
+}
+
+void FilePanel::load_file_records(NtfsVolume& volume, const std::set<u64>& file_refs, std::list<FileRecord>& file_list, RecordLoadProgress* progress) {
+  FileInfo file_info;
+  file_info.volume = &volume;
+  volume.synced = false;
+  for (std::set<u64>::const_iterator file_ref = file_refs.begin(); file_ref != file_refs.end(); file_ref++) {
+    if (progress) {
+      progress->current++;
+      progress->update_ui();
+    }
+    if ((*file_ref == file_info.load_base_file_rec(*file_ref)) && (file_info.base_mft_rec()->base_mft_record == 0)) {
+      file_info.process_base_file_rec();
+      add_file_records(file_list, file_info, g_file_panel_mode.show_streams, g_file_panel_mode.show_main_stream);
+    }
+  }
+}
+
+void FilePanel::reload_file_records(const std::set<u64>& file_refs) {
+  std::list<FileRecord> file_list;
+  load_file_records(volume, file_refs, file_list);
+  mft_index.update(file_refs, file_list);
+  name_search.update(file_refs);
 }
 
 UnicodeString FilePanel::get_mft_index_cache_name() {
+  // background thread uses name computed before it was started (options and volume belong to UI thread)
+  if (usn_monitor) return mft_index_cache_name;
   UnicodeString cache_dir;
   unsigned cache_dir_size = MAX_PATH;
   cache_dir_size = ExpandEnvironmentStringsW(g_file_panel_mode.cache_dir.data(), cache_dir.buf(cache_dir_size), cache_dir_size);
@@ -684,60 +638,283 @@ UnicodeString FilePanel::get_mft_index_cache_name() {
   }
   CHECK_SYS(cache_dir_size != 0);
   cache_dir.set_size(cache_dir_size - 1);
-  return add_trailing_slash(cache_dir) + get_volume_guid(volume.name) + L".ntfsfile";
+  mft_index_cache_name = add_trailing_slash(cache_dir) + get_volume_guid(volume.name) + L".ntfsfile";
+  return mft_index_cache_name;
 }
 
-FilePanel::Totals FilePanel::mft_get_totals(const ObjectArray<UnicodeString>& file_list) {
-  std::set<u64> file_set;
-  for (unsigned i = 0; i < file_list.size(); i++) {
-    file_set.insert(mft_find_path(file_list[i]));
+// USN log: index changes made after cache file was written. Every entry holds new records of
+// all files changed in USN range [start_usn, next_usn). Entries are only appended, so torn
+// write can damage the last entry only. When log grows too big, it is renamed to "log.1"
+// and cache file is rewritten on background thread from snapshot of the index.
+struct UsnLogEntry {
+  lzo_uint32 checksum; // rest of entry
+  u32 size; // header included
+  u64 usn_journal_id;
+  u64 start_usn;
+  u64 next_usn;
+  u32 file_ref_cnt; // followed by file references and encoded records
+  u32 rec_cnt;
+};
+
+const u64 c_max_usn_log_size = 32 * 1024 * 1024;
+
+UnicodeString FilePanel::get_usn_log_name() {
+  return get_mft_index_cache_name() + L".log";
+}
+
+void FilePanel::encode_usn_log_entry(Array<u8>& entry, USN start_usn, const std::set<u64>& file_refs, const std::list<FileRecord>& file_list) {
+  UsnLogEntry header;
+  entry.clear();
+  entry.extend(sizeof(header));
+  entry.set_size(sizeof(header));
+  for (std::set<u64>::const_iterator file_ref = file_refs.begin(); file_ref != file_refs.end(); file_ref++) {
+    entry.add(reinterpret_cast<const u8*>(&*file_ref), sizeof(u64));
   }
+  for (std::list<FileRecord>::const_iterator rec = file_list.begin(); rec != file_list.end(); rec++) {
+    encode_file_record(entry, *rec);
+  }
+  header.size = entry.size();
+  header.usn_journal_id = usn_journal_id;
+  header.start_usn = start_usn;
+  header.next_usn = next_usn;
+  header.file_ref_cnt = static_cast<u32>(file_refs.size());
+  header.rec_cnt = static_cast<u32>(file_list.size());
+  memcpy(entry.buf(), &header, sizeof(header));
+  header.checksum = crc32_update(0, entry.data() + sizeof(header.checksum), entry.size() - sizeof(header.checksum));
+  memcpy(entry.buf(), &header.checksum, sizeof(header.checksum));
+}
 
-  std::map<u64, unsigned> file_ptrs;
-  Array<bool> tmp_array;
-  bool* untested = tmp_array.buf(mft_index.size());
+void FilePanel::append_usn_log(const Array<u8>& entry) {
+  HANDLE h_file = CreateFileW(get_usn_log_name().data(), FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  CHECK_SYS(h_file != INVALID_HANDLE_VALUE);
+  CLEAN(HANDLE, h_file, CloseHandle(h_file));
+  LARGE_INTEGER file_size;
+  CHECK_SYS(GetFileSizeEx(h_file, &file_size));
+  // another log file (not continuation of cache file)
+  if (static_cast<u64>(file_size.QuadPart) != usn_log_size) FAIL(MsgError(L"USN log is out of sync"));
+  write_cache_data(h_file, entry.data(), entry.size());
+  usn_log_size += entry.size();
+}
 
-  // find $BadClus
-  FileRecord fr;
-  fr.parent_ref_num = root_dir_ref_num;
-  fr.file_name = L"$BadClus";
-  unsigned bad_clus_ref_num = mft_index.bsearch<FileRecordCompare>(fr);
+// Applies valid entries of old and current log to the index (index is at next_usn of cache file).
+// Entries already included into cache file are skipped, replay stops at first damaged entry or USN gap.
+void FilePanel::replay_usn_log() {
+  UnicodeString log_name = get_usn_log_name();
+  std::map<u64, std::list<FileRecord> > file_recs; // current records of every changed file
+  bool old_log = false;
+  usn_log_size = 0;
+  for (unsigned log_idx = 0; log_idx < 2; log_idx++) {
+    UnicodeString file_name = log_idx == 0 ? log_name + L".1" : log_name;
+    HANDLE h_file = CreateFileW(file_name.data(), FILE_READ_DATA | FILE_WRITE_DATA, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h_file == INVALID_HANDLE_VALUE) {
+      CHECK_SYS(GetLastError() == ERROR_FILE_NOT_FOUND);
+      continue;
+    }
+    CLEAN(HANDLE, h_file, CloseHandle(h_file));
+    if (log_idx == 0) old_log = true;
+    LARGE_INTEGER file_size;
+    CHECK_SYS(GetFileSizeEx(h_file, &file_size));
+    if (file_size.QuadPart >= 0xFFFFFFFF) FAIL(MsgError(L"USN log is too big"));
+    unsigned size = static_cast<unsigned>(file_size.QuadPart);
+    Array<u8> data;
+    DWORD size_read;
+    CHECK_SYS(ReadFile(h_file, data.buf(size), size, &size_read, NULL));
+    CHECK(size_read == size);
+    data.set_size(size);
 
-  for (unsigned i = 0; i < mft_index.size(); i++) {
-    if (mft_index[i].ntfs_attr()) untested[i] = false; // do not count streams
-    else if (i == bad_clus_ref_num) untested[i] = false; // do not count $BadClus
-    else if (file_set.count(mft_index[i].file_ref_num)) {
-      file_ptrs.insert(std::pair<u64, unsigned>(mft_index[i].file_ref_num, i));
-      untested[i] = false;
+    unsigned pos = 0;
+    FileRecord rec;
+    while (size - pos >= sizeof(UsnLogEntry)) {
+      UsnLogEntry header;
+      memcpy(&header, data.data() + pos, sizeof(header));
+      if ((header.size < sizeof(header)) || (header.size > size - pos)) break;
+      if (crc32_update(0, data.data() + pos + sizeof(header.checksum), header.size - sizeof(header.checksum)) != header.checksum) break;
+      if (header.usn_journal_id != usn_journal_id) break;
+      if (header.next_usn > static_cast<u64>(next_usn)) {
+        if (header.start_usn > static_cast<u64>(next_usn)) break;
+        const u8* entry = data.data() + pos;
+        unsigned entry_pos = sizeof(header);
+        if ((header.size - entry_pos) / sizeof(u64) < header.file_ref_cnt) break;
+        std::list<FileRecord> file_list;
+        entry_pos += header.file_ref_cnt * sizeof(u64);
+        unsigned i;
+        for (i = 0; (i < header.rec_cnt) && decode_file_record(entry, header.size, entry_pos, rec); i++) file_list.push_back(rec);
+        if ((i != header.rec_cnt) || (entry_pos != header.size)) break;
+        const u64* file_refs = reinterpret_cast<const u64*>(entry + sizeof(header));
+        for (i = 0; i < header.file_ref_cnt; i++) file_recs[file_refs[i]].clear();
+        for (std::list<FileRecord>::const_iterator new_rec = file_list.begin(); new_rec != file_list.end(); new_rec++) file_recs[new_rec->file_ref_num].push_back(*new_rec);
+        next_usn = header.next_usn;
+      }
+      pos += header.size;
+    }
+    if (log_idx == 1) {
+      // drop damaged tail so that new entries follow valid ones
+      if (pos != size) {
+        DBG_LOG(UnicodeString::format(L"replay_usn_log(): log truncated at %u", pos));
+        LARGE_INTEGER file_pos;
+        file_pos.QuadPart = pos;
+        CHECK_SYS(SetFilePointerEx(h_file, file_pos, NULL, FILE_BEGIN));
+        CHECK_SYS(SetEndOfFile(h_file));
+      }
+      usn_log_size = pos;
     }
-    else untested[i] = true;
   }
 
-  while (true) {
-    size_t size = file_ptrs.size();
-    for (unsigned i = 0; i < mft_index.size(); i++) {
-      if (untested[i] && file_ptrs.count(mft_index[i].parent_ref_num)) {
-        untested[i] = false;
-        file_ptrs.insert(std::pair<u64, unsigned>(mft_index[i].file_ref_num, i));
-      }
+  if (file_recs.size()) {
+    std::set<u64> file_refs;
+    std::list<FileRecord> file_list;
+    for (std::map<u64, std::list<FileRecord> >::const_iterator file_rec = file_recs.begin(); file_rec != file_recs.end(); file_rec++) {
+      file_refs.insert(file_refs.end(), file_rec->first);
+      file_list.insert(file_list.end(), file_rec->second.begin(), file_rec->second.end());
     }
-    if (size == file_ptrs.size()) break; // no change in size -> all files are found
+    DBG_LOG(UnicodeString::format(L"replay_usn_log(): %u files updated", file_refs.size()));
+    mft_index.update(file_refs, file_list);
   }
+  // unfinished compaction: cache file must be rewritten
+  cache_synced = !old_log;
+}
 
-  Totals totals;
-  for (std::map<u64, unsigned>::const_iterator i = file_ptrs.begin(); i != file_ptrs.end(); i++) {
-    totals.data_size += mft_index[i->second].data_size;
-    totals.disk_size += mft_index[i->second].disk_size;
-    totals.fragment_cnt += mft_index[i->second].fragment_cnt;
-    if (mft_index[i->second].file_attr & FILE_ATTRIBUTE_DIRECTORY) {
-      totals.dir_cnt++;
-      if (mft_index[i->second].file_attr & FILE_ATTRIBUTE_REPARSE_POINT) totals.dir_rp_cnt++;
+// Writes cache file from index snapshot on background thread.
+class FilePanel::CacheCompactor: private NonCopyable {
+private:
+  MftIndex mft_index;
+  UnicodeString file_name;
+  DWORDLONG usn_journal_id;
+  USN next_usn;
+  HANDLE h_thread;
+  bool failed;
+  UnicodeString error_msg;
+  static unsigned __stdcall th_proc(void* param) {
+    CacheCompactor* compactor = static_cast<CacheCompactor*>(param);
+    try {
+      write_mft_cache(compactor->file_name, compactor->mft_index, compactor->usn_journal_id, compactor->next_usn, NULL);
     }
-    else {
-      totals.file_cnt++;
-      if (mft_index[i->second].file_attr & FILE_ATTRIBUTE_REPARSE_POINT) totals.file_rp_cnt++;
+    catch (Error& e) {
+      compactor->failed = true;
+      compactor->error_msg = e.message();
+    }
+    catch (...) {
+      compactor->failed = true;
+      compactor->error_msg = L"Cache file write failure";
+    }
+    return TRUE;
+  }
+public:
+  CacheCompactor(const UnicodeString& file_name, DWORDLONG usn_journal_id, USN next_usn): file_name(file_name), usn_journal_id(usn_journal_id), next_usn(next_usn), h_thread(NULL), failed(false) {
+  }
+  ~CacheCompactor() {
+    if (h_thread == NULL) return;
+    WaitForSingleObject(h_thread, INFINITE);
+    CloseHandle(h_thread);
+  }
+  // index is copied (not shared), so that snapshot can be released on compactor thread
+  void snapshot(const MftIndex& index) {
+    mft_index.copy(index);
+  }
+  void start() {
+    unsigned th_id;
+    h_thread = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0, th_proc, this, 0, &th_id));
+    CHECK_SYS(h_thread);
+  }
+  bool done() const {
+    return WaitForSingleObject(h_thread, 0) != WAIT_TIMEOUT;
+  }
+  // wait for thread, true if cache file is written
+  bool finish() {
+    WaitForSingleObject(h_thread, INFINITE);
+    if (failed) DBG_LOG(L"CacheCompactor: " + error_msg);
+    return !failed;
+  }
+};
+
+// caller holds exclusive index lock or live update thread is stopped
+void FilePanel::start_cache_compaction() {
+  UnicodeString log_name = get_usn_log_name();
+  UnicodeString old_log_name = log_name + L".1";
+  // previous compaction is not finished
+  if (cache_compactor || (GetFileAttributesW(old_log_name.data()) != INVALID_FILE_ATTRIBUTES)) return;
+  // cache file is going to include all current log entries
+  CHECK_SYS(MoveFileW(log_name.data(), old_log_name.data()));
+  usn_log_size = 0;
+  CacheCompactor* compactor = new CacheCompactor(get_mft_index_cache_name(), usn_journal_id, next_usn);
+  try {
+    compactor->snapshot(mft_index);
+    compactor->start();
+  }
+  catch (...) {
+    delete compactor;
+    throw;
+  }
+  cache_compactor = compactor;
+}
+
+// caller holds exclusive index lock or live update thread is stopped
+void FilePanel::finish_cache_compaction() {
+  if (cache_compactor == NULL) return;
+  bool success = cache_compactor->finish();
+  delete cache_compactor;
+  cache_compactor = NULL;
+  if (success) DeleteFileW((get_usn_log_name() + L".1").data());
+  else cache_synced = false;
+}
+
+// Writes entry prepared by apply_usn_changes(), cache file is rewritten when log grows too big.
+// Called on live update thread too: log and compaction state is changed only under index lock.
+void FilePanel::write_usn_log(const Array<u8>& log_entry) {
+  if (log_entry.size() == 0) return;
+  ExclusiveLock lock(index_sync);
+  try {
+    append_usn_log(log_entry);
+    if (cache_compactor && cache_compactor->done()) finish_cache_compaction();
+    if (usn_log_size > c_max_usn_log_size) start_cache_compaction();
+  }
+  catch (Error& e) {
+    DBG_LOG(L"append_usn_log(): " + e.message());
+    cache_synced = false;
+  }
+}
+
+void FilePanel::save_mft_index() {
+  stop_usn_monitor();
+  // with USN log cache file is always up to date
+  if (cache_synced) finish_cache_compaction();
+  if (!cache_synced) store_mft_index();
+}
+
+FilePanel::Totals FilePanel::mft_get_totals(const ObjectArray<UnicodeString>& file_list) {
+  SharedLock lock(index_sync);
+  Array<unsigned> file_idxs;
+  for (unsigned i = 0; i < file_list.size(); i++) {
+    unsigned file_idx;
+    mft_find_path(file_list[i], &file_idx);
+    file_idxs += file_idx;
+  }
+  return mft_index.get_totals(file_idxs);
+}
+
+bool FilePanel::mft_read_resident(const UnicodeString& file_name, u64 file_size, Array<u8>& data) {
+  if (!mft_mode || (file_size > volume.file_rec_size) || (extract_file_name(file_name).search(L':') != -1)) return false;
+  try {
+    u64 file_ref_num;
+    {
+      SharedLock lock(index_sync);
+      if (mft_index.size() == 0) return false;
+      unsigned file_idx;
+      mft_find_path(file_name, &file_idx);
+      if (!mft_index.resident(file_idx) || (mft_index.file_attr(file_idx) & FILE_ATTRIBUTE_DIRECTORY) || (mft_index.data_size(file_idx) != file_size)) return false;
+      file_ref_num = mft_index.file_ref_num(file_idx);
     }
-    if (mft_index[i->second].hard_link_cnt > 1) totals.hl_cnt++;
+    FileInfo file_info;
+    file_info.volume = &volume;
+    // FSCTL_GET_NTFS_FILE_RECORD returns nearest record in use if requested one is free
+    if (file_info.load_base_file_rec(file_ref_num) != FILE_REF(file_ref_num)) return false;
+    const MFT_RECORD* mft_rec = file_info.base_mft_rec();
+    if ((mft_rec->sequence_number != file_ref_num >> 48) || (mft_rec->flags & MFT_RECORD_IS_DIRECTORY)) return false;
+    // index may be older than file: read normally if sizes differ
+    return file_info.get_resident_data(UnicodeString(), data) && (data.size() == file_size);
+  }
+  catch (Error& e) {
+    DBG_LOG(L"mft_read_resident(): " + e.message());
+    return false;
   }
-  return totals;
 }
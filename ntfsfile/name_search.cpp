@@ -0,0 +1,269 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include "utils.h"
+#include "mft_index.h"
+#include "name_search.h"
+
+const unsigned c_bucket_bits = 20;
+const unsigned c_bucket_cnt = 1 << c_bucket_bits;
+// every build thread needs its own bucket counters
+const unsigned c_max_build_threads = 8;
+
+unsigned trigram_bucket(wchar_t c0, wchar_t c1, wchar_t c2) {
+  u64 key = static_cast<u64>(static_cast<u16>(c0)) | (static_cast<u64>(static_cast<u16>(c1)) << 16) | (static_cast<u64>(static_cast<u16>(c2)) << 32);
+  return static_cast<unsigned>((key * 0x9E3779B97F4A7C15ULL) >> (64 - c_bucket_bits));
+}
+
+// distinct trigram buckets of all names of file
+void get_file_buckets(const MftIndex& index, u64 file_ref_num, Array<u32>& buckets) {
+  const u32* rec_idxs;
+  unsigned rec_cnt;
+  index.get_file_records(file_ref_num, rec_idxs, rec_cnt);
+  unsigned cnt = 0;
+  for (unsigned i = 0; i < rec_cnt; i++) {
+    unsigned name_len = index.file_name_size(rec_idxs[i]);
+    if (name_len > 2) cnt += name_len - 2;
+  }
+  u32* data = buckets.buf(cnt);
+  cnt = 0;
+  for (unsigned i = 0; i < rec_cnt; i++) {
+    const wchar_t* name = index.file_name_data(rec_idxs[i]);
+    unsigned name_len = index.file_name_size(rec_idxs[i]);
+    if (name_len < 3) continue;
+    wchar_t c0 = index.upcase(name[0]);
+    wchar_t c1 = index.upcase(name[1]);
+    for (unsigned j = 2; j < name_len; j++) {
+      wchar_t c2 = index.upcase(name[j]);
+      data[cnt++] = trigram_bucket(c0, c1, c2);
+      c0 = c1;
+      c1 = c2;
+    }
+  }
+  std::sort(data, data + cnt);
+  buckets.set_size(static_cast<unsigned>(std::unique(data, data + cnt) - data));
+}
+
+// wildcard match of name against case folded pattern
+bool match_name(const MftIndex& index, unsigned idx, const UnicodeString& pattern) {
+  const wchar_t* name = index.file_name_data(idx);
+  unsigned name_len = index.file_name_size(idx);
+  const wchar_t* pat = pattern.data();
+  unsigned pat_len = pattern.size();
+  unsigned n = 0;
+  unsigned p = 0;
+  unsigned star_p = -1;
+  unsigned star_n = 0;
+  while (n < name_len) {
+    if ((p < pat_len) && (pat[p] == L'*')) {
+      star_p = p++;
+      star_n = n;
+    }
+    else if ((p < pat_len) && ((pat[p] == L'?') || (pat[p] == index.upcase(name[n])))) {
+      p++;
+      n++;
+    }
+    else if (star_p != -1) {
+      // let last '*' match one more character
+      p = star_p + 1;
+      n = ++star_n;
+    }
+    else return false;
+  }
+  while ((p < pat_len) && (pat[p] == L'*')) p++;
+  return p == pat_len;
+}
+
+struct BucketSizeCompare {
+  const u32* offs;
+  bool operator()(u32 b1, u32 b2) const {
+    return offs[b1 + 1] - offs[b1] < offs[b2 + 1] - offs[b2];
+  }
+};
+
+// range of files processed by one thread
+struct NameSearchIndex::BuildTask {
+  const MftIndex* index;
+  u64 first_ref;
+  u64 end_ref;
+  u32* bucket_pos; // counters (first pass) or write positions (second pass) of every bucket
+  u32* bucket_refs; // NULL on first pass
+  bool failed;
+};
+
+unsigned __stdcall NameSearchIndex::build_proc(void* param) {
+  BuildTask* task = static_cast<BuildTask*>(param);
+  try {
+    Array<u32> buckets;
+    for (u64 ref = task->first_ref; ref < task->end_ref; ref++) {
+      get_file_buckets(*task->index, ref, buckets);
+      for (unsigned i = 0; i < buckets.size(); i++) {
+        if (task->bucket_refs) task->bucket_refs[task->bucket_pos[buckets[i]]++] = static_cast<u32>(ref);
+        else task->bucket_pos[buckets[i]]++;
+      }
+    }
+  }
+  catch (...) {
+    task->failed = true;
+  }
+  return TRUE;
+}
+
+void NameSearchIndex::clear() {
+  bucket_offs.clear();
+  bucket_refs.clear();
+  changed_refs.clear();
+}
+
+bool NameSearchIndex::need_rebuild(const MftIndex& index) const {
+  return changed_refs.size() > index.size() / 32 + 0x10000;
+}
+
+void NameSearchIndex::build(const MftIndex& index) {
+  clear();
+  u64 end_ref = index.end_file_ref();
+  CHECK(end_ref <= 0xFFFFFFFF);
+  SYSTEM_INFO sys_info;
+  GetSystemInfo(&sys_info);
+  unsigned num_th = min(max(static_cast<unsigned>(sys_info.dwNumberOfProcessors), 1u), c_max_build_threads);
+
+  // threads process consecutive ranges of file references, so that every bucket is sorted
+  Array<u32> bucket_pos;
+  u32* pos = bucket_pos.buf(num_th * c_bucket_cnt);
+  memset(pos, 0, num_th * c_bucket_cnt * sizeof(u32));
+  bucket_pos.set_size(num_th * c_bucket_cnt);
+  Array<BuildTask> tasks;
+  for (unsigned i = 0; i < num_th; i++) {
+    BuildTask task;
+    task.index = &index;
+    task.first_ref = end_ref * i / num_th;
+    task.end_ref = end_ref * (i + 1) / num_th;
+    task.bucket_pos = pos + i * c_bucket_cnt;
+    task.bucket_refs = NULL;
+    task.failed = false;
+    tasks += task;
+  }
+
+  for (unsigned pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      // bucket offsets and write positions of every thread
+      u32* offs = bucket_offs.buf(c_bucket_cnt + 1);
+      u32 total = 0;
+      for (unsigned b = 0; b < c_bucket_cnt; b++) {
+        offs[b] = total;
+        for (unsigned i = 0; i < num_th; i++) {
+          u32 cnt = pos[i * c_bucket_cnt + b];
+          pos[i * c_bucket_cnt + b] = total;
+          total += cnt;
+        }
+      }
+      offs[c_bucket_cnt] = total;
+      bucket_offs.set_size(c_bucket_cnt + 1);
+      u32* refs = bucket_refs.buf(total);
+      bucket_refs.set_size(total);
+      for (unsigned i = 0; i < num_th; i++) tasks.item(i).bucket_refs = refs;
+    }
+    Array<HANDLE> h_threads;
+    try {
+      for (unsigned i = 0; i < num_th; i++) {
+        unsigned th_id;
+        HANDLE h_thread = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0, build_proc, &tasks.item(i), 0, &th_id));
+        CHECK_SYS(h_thread);
+        h_threads += h_thread;
+      }
+    }
+    catch (...) {
+      if (h_threads.size()) WaitForMultipleObjects(h_threads.size(), h_threads.data(), TRUE, INFINITE);
+      for (unsigned i = 0; i < h_threads.size(); i++) CloseHandle(h_threads[i]);
+      clear();
+      throw;
+    }
+    WaitForMultipleObjects(h_threads.size(), h_threads.data(), TRUE, INFINITE);
+    for (unsigned i = 0; i < h_threads.size(); i++) CloseHandle(h_threads[i]);
+    for (unsigned i = 0; i < num_th; i++) {
+      if (tasks[i].failed) {
+        clear();
+        FAIL(MsgError(L"Name search index build failure"));
+      }
+    }
+  }
+}
+
+void NameSearchIndex::update(const std::set<u64>& file_refs) {
+  if (is_built()) changed_refs.insert(file_refs.begin(), file_refs.end());
+}
+
+void NameSearchIndex::find(const MftIndex& index, const UnicodeString& mask, Array<unsigned>& rec_idxs) const {
+  rec_idxs.clear();
+  bool wildcards = (mask.search(L'*') != -1) || (mask.search(L'?') != -1);
+  UnicodeString pattern;
+  if (!wildcards) pattern += L'*';
+  for (unsigned i = 0; i < mask.size(); i++) pattern += index.upcase(mask[i]);
+  if (!wildcards) pattern += L'*';
+
+  // trigrams of literal parts of pattern
+  Array<u32> buckets;
+  for (unsigned i = 0; i + 2 < pattern.size(); i++) {
+    bool literal = true;
+    for (unsigned j = i; j < i + 3; j++) {
+      if ((pattern[j] == L'*') || (pattern[j] == L'?')) literal = false;
+    }
+    if (literal) buckets += trigram_bucket(pattern[i], pattern[i + 1], pattern[i + 2]);
+  }
+
+  if (!is_built() || (buckets.size() == 0)) {
+    // nothing to narrow search with
+    for (unsigned idx = 0; idx < index.size(); idx++) {
+      if (match_name(index, idx, pattern)) rec_idxs += idx;
+    }
+    return;
+  }
+
+  // intersect smallest bucket lists first
+  BucketSizeCompare size_cmp;
+  size_cmp.offs = bucket_offs.data();
+  std::sort(buckets.buf(), buckets.buf() + buckets.size(), size_cmp);
+  Array<u32> file_refs;
+  file_refs.copy(bucket_refs.data() + bucket_offs[buckets[0]], bucket_offs[buckets[0] + 1] - bucket_offs[buckets[0]]);
+  Array<u32> result;
+  for (unsigned i = 1; (i < buckets.size()) && file_refs.size(); i++) {
+    const u32* refs = bucket_refs.data() + bucket_offs[buckets[i]];
+    unsigned ref_cnt = bucket_offs[buckets[i] + 1] - bucket_offs[buckets[i]];
+    result.clear();
+    for (unsigned j = 0, k = 0; (j < file_refs.size()) && (k < ref_cnt);) {
+      if (file_refs[j] < refs[k]) j++;
+      else if (file_refs[j] > refs[k]) k++;
+      else {
+        result += file_refs[j];
+        j++;
+        k++;
+      }
+    }
+    file_refs = result;
+  }
+  // names of changed files could be not indexed
+  if (changed_refs.size()) {
+    result.clear();
+    std::set<u64>::const_iterator changed_ref = changed_refs.begin();
+    for (unsigned j = 0; (j < file_refs.size()) || (changed_ref != changed_refs.end());) {
+      if ((changed_ref == changed_refs.end()) || ((j < file_refs.size()) && (file_refs[j] < *changed_ref))) {
+        result += file_refs[j++];
+      }
+      else {
+        if ((j < file_refs.size()) && (file_refs[j] == *changed_ref)) j++;
+        result += static_cast<u32>(*changed_ref++);
+      }
+    }
+    file_refs = result;
+  }
+
+  for (unsigned i = 0; i < file_refs.size(); i++) {
+    const u32* file_rec_idxs;
+    unsigned rec_cnt;
+    index.get_file_records(file_refs[i], file_rec_idxs, rec_cnt);
+    for (unsigned j = 0; j < rec_cnt; j++) {
+      if (match_name(index, file_rec_idxs[j], pattern)) rec_idxs += file_rec_idxs[j];
+    }
+  }
+  std::sort(rec_idxs.buf(), rec_idxs.buf() + rec_idxs.size());
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+// Trigram index of file names in MftIndex. Every bucket (hash of three case folded characters)
+// lists references of files having this trigram in any of their names, sorted by reference.
+// Index refers to files, not records, so it stays usable while MftIndex is updated:
+// files changed after index was built are checked on every search.
+class NameSearchIndex: private NonCopyable {
+private:
+  // files of bucket B are bucket_refs[bucket_offs[B]] .. bucket_refs[bucket_offs[B + 1] - 1]
+  Array<u32> bucket_offs;
+  Array<u32> bucket_refs;
+  std::set<u64> changed_refs;
+  struct BuildTask;
+  static unsigned __stdcall build_proc(void* param);
+public:
+  void clear();
+  bool is_built() const {
+    return bucket_offs.size() != 0;
+  }
+  // too many files changed since index was built
+  bool need_rebuild(const MftIndex& index) const;
+  // build index on all processors (index must be sorted and have lookup tables)
+  void build(const MftIndex& index);
+  // files updated in MftIndex
+  void update(const std::set<u64>& file_refs);
+  // Records with names matching mask (case-insensitive, '*' and '?' wildcards), sorted by record index.
+  // Mask without wildcards matches names containing it.
+  void find(const MftIndex& index, const UnicodeString& mask, Array<unsigned>& rec_idxs) const;
+};
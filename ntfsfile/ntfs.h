@@ -14,6 +14,39 @@ typedef enum {
   magic_empty = 0xffffffff,
 } NTFS_RECORD_TYPES;
 
+#define NTFS_OEM_ID 0x202020205346544eULL // "NTFS    "
+#define NTFS_BLOCK_SIZE 512 // update sequence stride
+
+typedef struct {
+  u8 jump[3];
+  u64 oem_id;
+  u16 bytes_per_sector;
+  u8 sectors_per_cluster;
+  u16 reserved_sectors;
+  u8 fats;
+  u16 root_entries;
+  u16 sectors;
+  u8 media_type;
+  u16 sectors_per_fat;
+  u16 sectors_per_track;
+  u16 heads;
+  u32 hidden_sectors;
+  u32 large_sectors;
+  u8 physical_drive;
+  u8 current_head;
+  u8 extended_boot_signature;
+  u8 reserved2;
+  u64 number_of_sectors;
+  u64 mft_lcn;
+  u64 mftmirr_lcn;
+  s8 clusters_per_mft_record;
+  u8 reserved0[3];
+  s8 clusters_per_index_record;
+  u8 reserved1[3];
+  u64 volume_serial_number;
+  u32 checksum;
+} NTFS_BOOT_SECTOR;
+
 typedef enum {
   MFT_RECORD_IN_USE = 0x0001,
   MFT_RECORD_IS_DIRECTORY = 0x0002,
@@ -61,7 +94,7 @@ typedef enum {
   AT_END = 0xffffffff,
 } ATTR_TYPES;
 
-#define ATTR_TYPE_DEF(name) { AT_##name, L#name },
+#define ATTR_TYPE_DEF(name) { AT_##name, L ## #name },
 
 const struct {
   u32 type;
@@ -203,6 +236,53 @@ typedef struct {
   u32 file_attributes;
 } STANDARD_INFORMATION_ATTR;
 
+typedef enum {
+  SMALL_INDEX = 0, // index fits in INDEX_ROOT
+  LARGE_INDEX = 1, // INDEX_ALLOCATION is present
+} INDEX_HEADER_FLAGS;
+
+// offsets are relative to INDEX_HEADER start
+typedef struct {
+  u32 entries_offset;
+  u32 index_length;
+  u32 allocated_size;
+  u8 flags;
+  u8 reserved[3];
+} INDEX_HEADER;
+
+typedef struct {
+  u32 type;
+  u32 collation_rule;
+  u32 index_block_size;
+  s8 clusters_per_index_block;
+  u8 reserved[3];
+  INDEX_HEADER index;
+} INDEX_ROOT;
+
+// INDEX_ALLOCATION node ("INDX", protected by update sequence array)
+typedef struct {
+  u32 magic;
+  u16 usa_ofs;
+  u16 usa_count;
+  u64 lsn;
+  u64 index_block_vcn;
+  INDEX_HEADER index;
+} INDEX_BLOCK;
+
+typedef enum {
+  INDEX_ENTRY_NODE = 1, // VCN of child node is stored in last 8 bytes of entry
+  INDEX_ENTRY_END = 2,
+} INDEX_ENTRY_FLAGS;
+
+// followed by key (FILE_NAME_ATTR for $I30)
+typedef struct {
+  u64 indexed_file;
+  u16 length;
+  u16 key_length;
+  u16 flags;
+  u16 reserved;
+} INDEX_ENTRY_HEADER;
+
 typedef enum {
   IO_REPARSE_TAG_IS_ALIAS = 0x20000000,
   IO_REPARSE_TAG_IS_HIGH_LATENCY = 0x40000000,
@@ -1,10 +1,11 @@
 #define _ERROR_WINDOWS
 #include "error.h"
 
-#include "volume.h"
 #include "utils.h"
+#include "volume.h"
 #include "ntfs.h"
 #include "ntfs_file.h"
+#include "mft_reader.h"
 
 #define NTFS_FMT_ERR MsgError(L"NTFS data structure parsing problem")
 #define NTFS_FILE_REC_HEADER_SIZE offsetof(NTFS_FILE_RECORD_OUTPUT_BUFFER, FileRecordBuffer)
@@ -25,6 +26,32 @@ UnicodeString AttrInfo::type_name() const {
   return type_name;
 }
 
+// index of name used for directory in full paths (POSIX or Win32 namespace), -1 if none
+unsigned FileInfo::find_dir_name() const {
+  unsigned posix_name_idx = -1;
+  unsigned win32_name_idx = -1;
+  for (unsigned i = 0; i < file_name_list.size(); i++) {
+    const FileNameAttr& attr = file_name_list[i];
+    if (attr.file_name_type == FILE_NAME_POSIX) {
+      posix_name_idx = i;
+    }
+    else if ((attr.file_name_type == FILE_NAME_WIN32) || (attr.file_name_type == FILE_NAME_WIN32_AND_DOS)) {
+      win32_name_idx = i;
+    }
+  }
+  if (posix_name_idx != -1) return posix_name_idx;
+  else return win32_name_idx;
+}
+
+// remember directory name in volume cache, so find_full_paths() does not need to reload it
+void FileInfo::cache_dir_name() const {
+  unsigned name_idx = find_dir_name();
+  if (name_idx == -1) return;
+  const FileNameAttr& attr = file_name_list[name_idx];
+  if ((attr.file_attributes & FILE_ATTR_I30_INDEX_PRESENT) != FILE_ATTR_I30_INDEX_PRESENT) return;
+  volume->dir_names.store(FILE_REF(base_file_rec_num), attr.name, attr.parent_directory);
+}
+
 // determine full file paths for FILE_NAME attributes
 void FileInfo::find_full_paths() {
   unsigned fn_idx = 0;
@@ -37,34 +64,30 @@ void FileInfo::find_full_paths() {
       UnicodeString full_path = file_name_list[fn_idx].name;
       u64 parent_dir_ref = file_name_list[fn_idx].parent_directory;
       while (true) {
-        FileInfo file_info;
-        file_info.volume = volume;
-        file_info.process_file(parent_dir_ref);
-        unsigned posix_name_idx = -1;
-        unsigned win32_name_idx = -1;
-        for (unsigned i = 0; i < file_info.file_name_list.size(); i++) {
-          const FileNameAttr& attr = file_info.file_name_list[i];
-          if (attr.file_name_type == FILE_NAME_POSIX) {
-            posix_name_idx = i;
-          }
-          else if ((attr.file_name_type == FILE_NAME_WIN32) || (attr.file_name_type == FILE_NAME_WIN32_AND_DOS)) {
-            win32_name_idx = i;
-          }
+        UnicodeString dir_name;
+        u64 dir_parent_ref;
+        if (!volume->dir_names.find(parent_dir_ref, dir_name, dir_parent_ref)) {
+          FileInfo file_info;
+          file_info.volume = volume;
+          file_info.mft_reader = mft_reader;
+          file_info.ext_rec_cache = ext_rec_cache;
+          file_info.process_file(parent_dir_ref);
+          unsigned name_idx = file_info.find_dir_name();
+          CHECK_FMT(name_idx != -1);
+          const FileNameAttr& attr = file_info.file_name_list[name_idx];
+          CHECK_FMT((attr.file_attributes & FILE_ATTR_I30_INDEX_PRESENT) == FILE_ATTR_I30_INDEX_PRESENT);
+          dir_name = attr.name;
+          dir_parent_ref = attr.parent_directory;
+          volume->dir_names.store(parent_dir_ref, dir_name, dir_parent_ref);
         }
-        unsigned name_idx;
-        if (posix_name_idx != -1) name_idx = posix_name_idx;
-        else if (win32_name_idx != -1) name_idx = win32_name_idx;
-        else CHECK_FMT(false);
-        const FileNameAttr& attr = file_info.file_name_list[name_idx];
-        CHECK_FMT((attr.file_attributes & FILE_ATTR_I30_INDEX_PRESENT) == FILE_ATTR_I30_INDEX_PRESENT);
-        if (attr.name == L".") { // root directory
+        if (dir_name == L".") { // root directory
           full_path.insert(0, add_trailing_slash(volume->name));
           attr_list.item(attr_idx).name = full_path;
           break;
         }
         else {
-          full_path.insert(0, add_trailing_slash(attr.name));
-          parent_dir_ref = attr.parent_directory;
+          full_path.insert(0, add_trailing_slash(dir_name));
+          parent_dir_ref = dir_parent_ref;
         }
       }
     }
@@ -72,40 +95,72 @@ void FileInfo::find_full_paths() {
   }
 }
 
-u64 FileInfo::load_mft_record(u64 mft_rec_num, Array<u8>& ntfs_file_rec_buf) {
+const MftRecView* ExtRecCache::find(u64 file_ref_num) {
+  unordered_map<u64, EntryList::iterator>::const_iterator pos = index.find(file_ref_num);
+  if (pos == index.end()) {
+    miss_cnt++;
+    return NULL;
+  }
+  hit_cnt++;
+  lru.splice(lru.begin(), lru, pos->second);
+  return &pos->second->file_rec;
+}
+
+void ExtRecCache::store(u64 file_ref_num, const Array<u8>& rec_buf, const MftRecView& file_rec) {
+  if (max_size == 0) return;
+  if (index.count(file_ref_num)) return;
+  if (lru.size() >= max_size) {
+    // recycle least recently used entry
+    index.erase(lru.back().file_ref_num);
+    lru.splice(lru.begin(), lru, --lru.end());
+  }
+  else {
+    lru.push_front(Entry());
+  }
+  Entry& entry = lru.front();
+  entry.file_ref_num = file_ref_num;
+  entry.rec_buf = rec_buf;
+  entry.file_rec = file_rec;
+  index[file_ref_num] = lru.begin();
+}
+
+u64 FileInfo::load_mft_record(u64 mft_rec_num, Array<u8>& io_buf, MftRecView& file_rec) {
+  if (mft_reader) {
+    mft_rec_num = FILE_REF(mft_rec_num);
+    mft_reader->read_record(mft_rec_num, io_buf);
+    file_rec = MftRecView(io_buf);
+    return mft_rec_num;
+  }
+
   NTFS_FILE_RECORD_INPUT_BUFFER ntfs_file_rec_in;
   ntfs_file_rec_in.FileReferenceNumber.QuadPart = mft_rec_num;
 
   unsigned ntfs_file_rec_out_size = NTFS_FILE_REC_HEADER_SIZE + volume->file_rec_size;
 
+  // buffer is reused: no allocation after first record
   DWORD bytes_ret;
-  CHECK_SYS(DeviceIoControl(volume->handle, FSCTL_GET_NTFS_FILE_RECORD, &ntfs_file_rec_in, sizeof(ntfs_file_rec_in), ntfs_file_rec_buf.buf(ntfs_file_rec_out_size), ntfs_file_rec_out_size, &bytes_ret, NULL));
-  ntfs_file_rec_buf.set_size(bytes_ret);
+  CHECK_SYS(DeviceIoControl(volume->handle, FSCTL_GET_NTFS_FILE_RECORD, &ntfs_file_rec_in, sizeof(ntfs_file_rec_in), io_buf.buf(ntfs_file_rec_out_size), ntfs_file_rec_out_size, &bytes_ret, NULL));
+  io_buf.set_size(bytes_ret);
 
-  CHECK_FMT(ntfs_file_rec_buf.size() >= NTFS_FILE_REC_HEADER_SIZE);
-  const NTFS_FILE_RECORD_OUTPUT_BUFFER* ntfs_file_rec_out = reinterpret_cast<const NTFS_FILE_RECORD_OUTPUT_BUFFER*>(ntfs_file_rec_buf.data());
-  CHECK_FMT(ntfs_file_rec_buf.size() == NTFS_FILE_REC_HEADER_SIZE + ntfs_file_rec_out->FileRecordLength);
+  CHECK_FMT(io_buf.size() >= NTFS_FILE_REC_HEADER_SIZE);
+  const NTFS_FILE_RECORD_OUTPUT_BUFFER* ntfs_file_rec_out = reinterpret_cast<const NTFS_FILE_RECORD_OUTPUT_BUFFER*>(io_buf.data());
+  CHECK_FMT(io_buf.size() == NTFS_FILE_REC_HEADER_SIZE + ntfs_file_rec_out->FileRecordLength);
   CHECK_FMT(ntfs_file_rec_out->FileRecordLength >= sizeof(MFT_RECORD));
 
   mft_rec_num = FILE_REF(ntfs_file_rec_out->FileReferenceNumber.QuadPart);
 
-  ntfs_file_rec_buf.remove(0, NTFS_FILE_REC_HEADER_SIZE);
-
-  const MFT_RECORD* mft_rec = reinterpret_cast<const MFT_RECORD*>(ntfs_file_rec_buf.data());
-  CHECK_FMT(mft_rec->magic == magic_FILE);
+  // skip ioctl header without moving record data
+  file_rec = MftRecView(io_buf.data() + NTFS_FILE_REC_HEADER_SIZE, ntfs_file_rec_out->FileRecordLength);
+  CHECK_FMT(file_rec.header()->magic == magic_FILE);
 
   return mft_rec_num;
 }
 
-unsigned FileInfo::find_attribute(const Array<u8>& ntfs_file_rec_buf, u32 type, u16 instance) {
-  const MFT_RECORD* mft_rec = reinterpret_cast<const MFT_RECORD*>(ntfs_file_rec_buf.data());
-
-  unsigned attr_off = mft_rec->attrs_offset;
+unsigned FileInfo::find_attribute(const MftRecView& file_rec, u32 type, u16 instance) {
+  unsigned attr_off = file_rec.header()->attrs_offset;
   while (true) {
-    const ATTR_HEADER* attr_header = reinterpret_cast<const ATTR_HEADER*>(ntfs_file_rec_buf.data() + attr_off);
-    CHECK_FMT(attr_off + sizeof(attr_header->type) <= ntfs_file_rec_buf.size());
-    if (attr_header->type == AT_END) return -1; // not found
-    CHECK_FMT(attr_off + sizeof(ATTR_HEADER) <= ntfs_file_rec_buf.size());
+    if (file_rec.attr_type(attr_off) == AT_END) return -1; // not found
+    const ATTR_HEADER* attr_header = file_rec.attr_header(attr_off);
 
     if (type == attr_header->type) {
       if ((instance == 0) || (instance == attr_header->instance)) return attr_off; // found
@@ -116,48 +171,72 @@ unsigned FileInfo::find_attribute(const Array<u8>& ntfs_file_rec_buf, u32 type,
   }
 }
 
-Array<FileInfo::DataRun> FileInfo::decode_data_runs(const Array<u8>& ntfs_file_rec_buf, unsigned attr_off) {
-  Array<DataRun> data_run_list;
+// masks for little-endian mapping pair fields of 0..8 bytes
+static const u64 c_field_mask[9] = {
+  0, 0xFFULL, 0xFFFFULL, 0xFFFFFFULL, 0xFFFFFFFFULL, 0xFFFFFFFFFFULL, 0xFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL
+};
+
+static inline u64 load_u64(const u8* data) {
+  u64 value;
+  memcpy(&value, data, sizeof(value)); // single unaligned load
+  return value;
+}
+
+static inline u64 load_field(const u8* data, unsigned size) {
+  u64 value = 0;
+  for (unsigned i = 0; i < size; i++) value |= static_cast<u64>(data[i]) << (i * 8);
+  return value;
+}
 
-  CHECK_FMT(attr_off + sizeof(ATTR_HEADER) + sizeof(ATTR_NONRESIDENT) <= ntfs_file_rec_buf.size());
-  const ATTR_NONRESIDENT* attr_info = reinterpret_cast<const ATTR_NONRESIDENT*>(ntfs_file_rec_buf.data() + attr_off + sizeof(ATTR_HEADER));
+// Decode mapping pairs of non-resident attribute extent.
+// Runs are appended to data_runs (if not NULL), so caller can reuse one array for many attributes/extents.
+// Fragments are counted in run_stats (if not NULL).
+void FileInfo::decode_data_runs(const MftRecView& file_rec, unsigned attr_off, Array<DataRun>* data_runs, RunStats* run_stats) {
+  const ATTR_NONRESIDENT* attr_info = file_rec.attr_info<ATTR_NONRESIDENT>(attr_off);
 
-  const u8* data_runs = ntfs_file_rec_buf.data();
+  const u8* data = file_rec.data();
+  unsigned size = file_rec.size();
   unsigned idx = attr_off + attr_info->mapping_pairs_offset;
-  data_run_list.extend((ntfs_file_rec_buf.size() - idx) / 3);
   u64 lcn = 0;
   while (true) {
-    CHECK_FMT(idx < ntfs_file_rec_buf.size());
-    if (data_runs[idx] == 0) break; // end marker
-    unsigned len_l = data_runs[idx] & 0x0F;
-    unsigned off_l = (data_runs[idx] & 0xF0) >> 4;
+    CHECK_FMT(idx < size);
+    u8 header = data[idx];
+    if (header == 0) break; // end marker
+    unsigned len_l = header & 0x0F;
+    unsigned off_l = header >> 4;
+    // zero-width length field (empty run) is tolerated
+    CHECK_FMT((len_l <= 8) && (off_l <= 8));
     idx++;
-    CHECK_FMT(idx + len_l + off_l <= ntfs_file_rec_buf.size());
-    u64 len = 0;
-    unsigned i;
-    for (i = 0; i < len_l; i++) {
-      len += static_cast<u64>(data_runs[idx++]) << (i * 8);
+    CHECK_FMT(idx + len_l + off_l <= size);
+    u64 len, off;
+    if (idx + 2 * sizeof(u64) <= size) { // wide loads stay inside record
+      len = load_u64(data + idx) & c_field_mask[len_l];
+      off = load_u64(data + idx + len_l) & c_field_mask[off_l];
     }
-    if (off_l == 0) {
-      data_run_list += DataRun(-1, len); // sparse
+    else {
+      len = load_field(data + idx, len_l);
+      off = load_field(data + idx + len_l, off_l);
+    }
+    idx += len_l + off_l;
+    if (off_l == 0) { // sparse
+      if (data_runs) *data_runs += DataRun(-1, len);
       continue;
     }
-    s64 off = 0;
-    for (i = 0; i + 1 < off_l; i++) {
-      off |= static_cast<u64>(data_runs[idx++]) << (i * 8);
+    // offset is signed
+    unsigned shift = 64 - off_l * 8;
+    lcn += static_cast<s64>(off << shift) >> shift;
+    if (data_runs) *data_runs += DataRun(lcn, len);
+    if (run_stats) {
+      if (run_stats->prev_lcn + run_stats->prev_len != lcn) run_stats->fragments++;
+      run_stats->prev_lcn = lcn;
+      run_stats->prev_len = len;
     }
-    off |= static_cast<s64>(static_cast<s8>(data_runs[idx++])) << (i * 8);
-    lcn = lcn + off;
-    data_run_list += DataRun(lcn, len);
   }
-
-  return data_run_list;
 }
 
-void FileInfo::process_attribute(const Array<u8>& ntfs_file_rec_buf, unsigned attr_off) {
-  const MFT_RECORD* mft_rec = reinterpret_cast<const MFT_RECORD*>(ntfs_file_rec_buf.data());
-  const ATTR_HEADER* attr_header = reinterpret_cast<const ATTR_HEADER*>(ntfs_file_rec_buf.data() + attr_off);
-  CHECK_FMT(attr_off + sizeof(ATTR_HEADER) <= ntfs_file_rec_buf.size());
+void FileInfo::process_attribute(const MftRecView& file_rec, unsigned attr_off) {
+  const MFT_RECORD* mft_rec = file_rec.header();
+  const ATTR_HEADER* attr_header = file_rec.attr_header(attr_off);
 
   AttrInfo attr;
   attr.type = attr_header->type;
@@ -168,22 +247,20 @@ void FileInfo::process_attribute(const Array<u8>& ntfs_file_rec_buf, unsigned at
   attr.sparse = (attr_header->flags & ATTR_IS_SPARSE) == ATTR_IS_SPARSE;
   // attribute name
   if (attr_header->name_length != 0) {
-    CHECK_FMT(attr_off + attr_header->name_offset + attr_header->name_length * 2 <= ntfs_file_rec_buf.size());
-    attr.name.copy(reinterpret_cast<const wchar_t*>(ntfs_file_rec_buf.data() + attr_off + attr_header->name_offset), attr_header->name_length);
+    attr.name.copy(file_rec.str(attr_off + attr_header->name_offset, attr_header->name_length), attr_header->name_length);
   }
   // resident attribute
   if (attr.resident) {
-    CHECK_FMT(attr_off + sizeof(ATTR_HEADER) + sizeof(ATTR_RESIDENT) <= ntfs_file_rec_buf.size());
-    const ATTR_RESIDENT* attr_info = reinterpret_cast<const ATTR_RESIDENT*>(ntfs_file_rec_buf.data() + attr_off + sizeof(ATTR_HEADER));
+    const ATTR_RESIDENT* attr_info = file_rec.attr_info<ATTR_RESIDENT>(attr_off);
     attr.data_size = attr_info->value_length;
     attr.disk_size = 0;
     attr.valid_size = attr.data_size;
     attr.fragments = 0;
+    unsigned value_off = attr_off + attr_info->value_offset;
 
     // STANDARD_INFORMATION attribute
     if (attr.type == AT_STANDARD_INFORMATION) {
-      CHECK_FMT(attr_off + attr_info->value_offset + sizeof(STANDARD_INFORMATION_ATTR) <= ntfs_file_rec_buf.size());
-      const STANDARD_INFORMATION_ATTR* attr = reinterpret_cast<const STANDARD_INFORMATION_ATTR*>(ntfs_file_rec_buf.data() + attr_off + attr_info->value_offset);
+      const STANDARD_INFORMATION_ATTR* attr = file_rec.at<STANDARD_INFORMATION_ATTR>(value_off);
       std_info.creation_time = attr->creation_time;
       std_info.last_data_change_time = attr->last_data_change_time;
       std_info.last_mft_change_time = attr->last_mft_change_time;
@@ -193,9 +270,7 @@ void FileInfo::process_attribute(const Array<u8>& ntfs_file_rec_buf, unsigned at
 
     // FILE_NAME attribute
     if (attr.type == AT_FILE_NAME) {
-      CHECK_FMT(attr_off + attr_info->value_offset + sizeof(FILE_NAME_ATTR) <= ntfs_file_rec_buf.size());
-      const FILE_NAME_ATTR* fn_attr = reinterpret_cast<const FILE_NAME_ATTR*>(ntfs_file_rec_buf.data() + attr_off + attr_info->value_offset);
-      CHECK_FMT(attr_off + attr_info->value_offset + sizeof(FILE_NAME_ATTR) + fn_attr->file_name_length <= ntfs_file_rec_buf.size());
+      const FILE_NAME_ATTR* fn_attr = file_rec.at<FILE_NAME_ATTR>(value_off);
       FileNameAttr file_name_attr;
       file_name_attr.parent_directory = FILE_REF(fn_attr->parent_directory);
       file_name_attr.creation_time = fn_attr->creation_time;
@@ -204,34 +279,25 @@ void FileInfo::process_attribute(const Array<u8>& ntfs_file_rec_buf, unsigned at
       file_name_attr.last_access_time = fn_attr->last_access_time;
       file_name_attr.file_attributes = fn_attr->file_attributes;
       file_name_attr.file_name_type = fn_attr->file_name_type;
-      file_name_attr.name.copy(reinterpret_cast<const wchar_t*>(ntfs_file_rec_buf.data() + attr_off + attr_info->value_offset + sizeof(FILE_NAME_ATTR)), fn_attr->file_name_length);
+      file_name_attr.name.copy(file_rec.str(value_off + sizeof(FILE_NAME_ATTR), fn_attr->file_name_length), fn_attr->file_name_length);
       file_name_list += file_name_attr;
     }
 
     // REPARSE_POINT attribute
     if (attr.type == AT_REPARSE_POINT) {
-      unsigned value_off = attr_info->value_offset;
-
-      CHECK_FMT(attr_off + value_off + sizeof(REPARSE_POINT) <= ntfs_file_rec_buf.size());
-      const REPARSE_POINT* reparse_point = reinterpret_cast<const REPARSE_POINT*>(ntfs_file_rec_buf.data() + attr_off + value_off);
+      const REPARSE_POINT* reparse_point = file_rec.at<REPARSE_POINT>(value_off);
 
       if (reparse_point->reparse_tag == IO_REPARSE_TAG_MOUNT_POINT) {
         CHECK_FMT(reparse_point->reparse_data_length >= sizeof(MOUNT_POINT));
-        CHECK_FMT(attr_off + value_off + sizeof(REPARSE_POINT) + sizeof(MOUNT_POINT) <= ntfs_file_rec_buf.size());
-        const MOUNT_POINT* mnt_point = reinterpret_cast<const MOUNT_POINT*>(ntfs_file_rec_buf.data() + attr_off + value_off + sizeof(REPARSE_POINT));
-
-        value_off += sizeof(REPARSE_POINT) + sizeof(MOUNT_POINT) + mnt_point->subst_name_off;
-        CHECK_FMT(attr_off + value_off + mnt_point->subst_name_len <= ntfs_file_rec_buf.size());
-        attr.name.copy(reinterpret_cast<const wchar_t*>(ntfs_file_rec_buf.data() + attr_off + value_off), mnt_point->subst_name_len / 2);
+        const MOUNT_POINT* mnt_point = file_rec.at<MOUNT_POINT>(value_off + sizeof(REPARSE_POINT));
+        unsigned name_off = value_off + sizeof(REPARSE_POINT) + sizeof(MOUNT_POINT) + mnt_point->subst_name_off;
+        attr.name.copy(file_rec.str(name_off, mnt_point->subst_name_len / 2), mnt_point->subst_name_len / 2);
       }
       else if (reparse_point->reparse_tag == IO_REPARSE_TAG_SYMBOLIC_LINK) {
         CHECK_FMT(reparse_point->reparse_data_length >= sizeof(SYMBOLIC_LINK));
-        CHECK_FMT(attr_off + value_off + sizeof(REPARSE_POINT) + sizeof(SYMBOLIC_LINK) <= ntfs_file_rec_buf.size());
-        const SYMBOLIC_LINK* sym_link = reinterpret_cast<const SYMBOLIC_LINK*>(ntfs_file_rec_buf.data() + attr_off + value_off + sizeof(REPARSE_POINT));
-
-        value_off += sizeof(REPARSE_POINT) + sizeof(SYMBOLIC_LINK) + sym_link->subst_name_off;
-        CHECK_FMT(attr_off + value_off + sym_link->subst_name_len <= ntfs_file_rec_buf.size());
-        attr.name.copy(reinterpret_cast<const wchar_t*>(ntfs_file_rec_buf.data() + attr_off + value_off), sym_link->subst_name_len / 2);
+        const SYMBOLIC_LINK* sym_link = file_rec.at<SYMBOLIC_LINK>(value_off + sizeof(REPARSE_POINT));
+        unsigned name_off = value_off + sizeof(REPARSE_POINT) + sizeof(SYMBOLIC_LINK) + sym_link->subst_name_off;
+        attr.name.copy(file_rec.str(name_off, sym_link->subst_name_len / 2), sym_link->subst_name_len / 2);
       }
     }
     attr_list += attr;
@@ -240,34 +306,24 @@ void FileInfo::process_attribute(const Array<u8>& ntfs_file_rec_buf, unsigned at
   else {
     bool extent;
     if (attr.compressed || attr.sparse) {
-      CHECK_FMT(attr_off + sizeof(ATTR_HEADER) + sizeof(ATTR_COMPRESSED) <= ntfs_file_rec_buf.size());
-      const ATTR_COMPRESSED* attr_info = reinterpret_cast<const ATTR_COMPRESSED*>(ntfs_file_rec_buf.data() + attr_off + sizeof(ATTR_HEADER));
+      const ATTR_COMPRESSED* attr_info = file_rec.attr_info<ATTR_COMPRESSED>(attr_off);
       attr.data_size = attr_info->data_size;
       attr.disk_size = attr_info->compressed_size;
       attr.valid_size = attr_info->initialized_size;
       extent = attr_info->lowest_vcn != 0;
     }
     else {
-      CHECK_FMT(attr_off + sizeof(ATTR_HEADER) + sizeof(ATTR_NONRESIDENT) <= ntfs_file_rec_buf.size());
-      const ATTR_NONRESIDENT* attr_info = reinterpret_cast<const ATTR_NONRESIDENT*>(ntfs_file_rec_buf.data() + attr_off + sizeof(ATTR_HEADER));
+      const ATTR_NONRESIDENT* attr_info = file_rec.attr_info<ATTR_NONRESIDENT>(attr_off);
       attr.data_size = attr_info->data_size;
       attr.disk_size = attr_info->allocated_size;
       attr.valid_size = attr_info->initialized_size;
       extent = attr_info->lowest_vcn != 0;
     }
-    // fragments
-    Array<DataRun> data_runs = decode_data_runs(ntfs_file_rec_buf, attr_off);
-    u64 fragments = 0;
-    if (!extent) {
-      prev_lcn = 0;
-      prev_len = 0;
-    }
-    for (unsigned i = 0; i < data_runs.size(); i++) {
-      if (data_runs[i].lcn == -1) continue;
-      if (prev_lcn + prev_len != data_runs[i].lcn) fragments++;
-      prev_lcn = data_runs[i].lcn;
-      prev_len = data_runs[i].len;
-    }
+    // fragments (runs are only counted, not stored)
+    if (!extent) attr_run_stats = RunStats();
+    u64 fragments = attr_run_stats.fragments;
+    decode_data_runs(file_rec, attr_off, NULL, &attr_run_stats);
+    fragments = attr_run_stats.fragments - fragments;
     if (extent) {
       CHECK_FMT(attr_list.size() != 0);
       CHECK_FMT(attr_list.last().type == attr.type);
@@ -280,46 +336,43 @@ void FileInfo::process_attribute(const Array<u8>& ntfs_file_rec_buf, unsigned at
   }
 }
 
-void FileInfo::process_attr_list_entry(const ATTR_LIST_ENTRY* attr_list_entry, Array<u64>& ext_rec_list) {
+void FileInfo::process_attr_list_entry(const ATTR_LIST_ENTRY* attr_list_entry, unordered_set<u64>& ext_rec_set, AttrVisitor& visitor) {
   if (attr_list_entry->mft_reference == base_file_rec_num) {
-    unsigned attr_off = find_attribute(base_file_rec_buf, attr_list_entry->type, attr_list_entry->instance);
+    unsigned attr_off = find_attribute(base_file_rec, attr_list_entry->type, attr_list_entry->instance);
     CHECK_FMT(attr_off != -1);
-    process_attribute(base_file_rec_buf, attr_off);
+    visitor.visit(base_file_rec, attr_off);
   }
   else {
-    if (ext_rec_list.search(attr_list_entry->mft_reference) == -1) {
-      ext_rec_list += attr_list_entry->mft_reference;
-      mft_rec_cnt++;
-    }
+    if (ext_rec_set.insert(attr_list_entry->mft_reference).second) mft_rec_cnt++;
 
-    load_mft_record(attr_list_entry->mft_reference, ext_file_rec_buf);
-    unsigned attr_off = find_attribute(ext_file_rec_buf, attr_list_entry->type, attr_list_entry->instance);
+    const MftRecView* file_rec = ext_rec_cache ? ext_rec_cache->find(attr_list_entry->mft_reference) : NULL;
+    if (file_rec == NULL) {
+      load_mft_record(attr_list_entry->mft_reference, ext_file_rec_buf, ext_file_rec);
+      if (ext_rec_cache) ext_rec_cache->store(attr_list_entry->mft_reference, ext_file_rec_buf, ext_file_rec);
+      file_rec = &ext_file_rec;
+    }
+    unsigned attr_off = find_attribute(*file_rec, attr_list_entry->type, attr_list_entry->instance);
     CHECK_FMT(attr_off != -1);
-    process_attribute(ext_file_rec_buf, attr_off);
+    visitor.visit(*file_rec, attr_off);
   }
 }
 
-void FileInfo::process_base_file_rec() {
-  attr_list.clear();
-  file_name_list.clear();
+// walk over all attributes of a file (base and extension records)
+void FileInfo::enum_attributes(AttrVisitor& visitor) {
   // is attr. list present?
-  unsigned attr_list_off = find_attribute(base_file_rec_buf, AT_ATTRIBUTE_LIST);
+  unsigned attr_list_off = find_attribute(base_file_rec, AT_ATTRIBUTE_LIST);
   // init. mft record counter
   mft_rec_cnt = 1;
-  Array<u64> ext_rec_list;
+  unordered_set<u64> ext_rec_set;
   // no ATTRIBUTE_LIST - one MFT file record
   if (attr_list_off == -1) {
-    const MFT_RECORD* mft_rec = reinterpret_cast<const MFT_RECORD*>(base_file_rec_buf.data());
-
     // walk over list of attributes stored in a base file record
-    unsigned attr_off = mft_rec->attrs_offset;
+    unsigned attr_off = base_file_rec.header()->attrs_offset;
     while (true) {
-      const ATTR_HEADER* attr_header = reinterpret_cast<const ATTR_HEADER*>(base_file_rec_buf.data() + attr_off);
-      CHECK_FMT(attr_off + sizeof(attr_header->type) <= base_file_rec_buf.size());
-      if (attr_header->type == AT_END) break; // end of attribute list
-      CHECK_FMT(attr_off + sizeof(ATTR_HEADER) <= base_file_rec_buf.size());
+      if (base_file_rec.attr_type(attr_off) == AT_END) break; // end of attribute list
+      const ATTR_HEADER* attr_header = base_file_rec.attr_header(attr_off);
 
-      process_attribute(base_file_rec_buf, attr_off);
+      visitor.visit(base_file_rec, attr_off);
 
       CHECK_FMT(attr_header->length != 0); // prevent infinite loop
       attr_off += attr_header->length;
@@ -327,14 +380,15 @@ void FileInfo::process_base_file_rec() {
   }
   // ATTRIBUTE_LIST present
   else {
-    process_attribute(base_file_rec_buf, attr_list_off);
-    const ATTR_HEADER* attr_header = reinterpret_cast<const ATTR_HEADER*>(base_file_rec_buf.data() + attr_list_off);
+    visitor.visit(base_file_rec, attr_list_off);
+    const ATTR_HEADER* attr_header = base_file_rec.attr_header(attr_list_off);
     // non-resident ATTRIBUTE_LIST
     if (attr_header->non_resident) {
-      CHECK_FMT(attr_list_off + sizeof(ATTR_HEADER) + sizeof(ATTR_NONRESIDENT) <= base_file_rec_buf.size());
-      const ATTR_NONRESIDENT* attr_info = reinterpret_cast<const ATTR_NONRESIDENT*>(base_file_rec_buf.data() + attr_list_off + sizeof(ATTR_HEADER));
+      const ATTR_NONRESIDENT* attr_info = base_file_rec.attr_info<ATTR_NONRESIDENT>(attr_list_off);
       CHECK_FMT(attr_info->allocated_size <= MAX_ATTR_LIST_SIZE);
-      Array<DataRun> data_runs = decode_data_runs(base_file_rec_buf, attr_list_off);
+      Array<DataRun>& data_runs = run_arena;
+      data_runs.clear();
+      decode_data_runs(base_file_rec, attr_list_off, &data_runs);
       // calculate disk size using data runs
       u64 attr_disk_size = 0;
       for (unsigned i = 0; i < data_runs.size(); i++) {
@@ -350,16 +404,10 @@ void FileInfo::process_base_file_rec() {
       CLEAN(u8*, attr_data_buf, CHECK_SYS(VirtualFree(attr_data_buf, 0, MEM_RELEASE)));
 
       unsigned buf_pos = 0;
+      volume->flush();
       for (unsigned i = 0; i < data_runs.size(); i++) {
-        LARGE_INTEGER pos;
-        pos.QuadPart = data_runs[i].lcn * volume->cluster_size;
-        CHECK_SYS(SetFilePointerEx(volume->handle, pos, NULL, FILE_BEGIN));
-
         unsigned size = static_cast<unsigned>(data_runs[i].len * volume->cluster_size);
-        DWORD bytes_ret;
-        volume->flush();
-        CHECK_SYS(ReadFile(volume->handle, attr_data_buf + buf_pos, size, &bytes_ret, NULL));
-        CHECK_FMT(size == bytes_ret);
+        volume->read(data_runs[i].lcn * volume->cluster_size, attr_data_buf + buf_pos, size);
         buf_pos += size;
       }
 
@@ -369,7 +417,7 @@ void FileInfo::process_base_file_rec() {
         CHECK_FMT(idx + sizeof(ATTR_LIST_ENTRY) <= attr_info->data_size);
         const ATTR_LIST_ENTRY* attr_list_entry = reinterpret_cast<const ATTR_LIST_ENTRY*>(attr_data_buf + idx);
 
-        process_attr_list_entry(attr_list_entry, ext_rec_list);
+        process_attr_list_entry(attr_list_entry, ext_rec_set, visitor);
 
         CHECK_FMT(attr_list_entry->length != 0);
         idx += attr_list_entry->length;
@@ -377,17 +425,15 @@ void FileInfo::process_base_file_rec() {
     }
     // resident ATTRIBUTE_LIST
     else {
-      CHECK_FMT(attr_list_off + sizeof(ATTR_HEADER) + sizeof(ATTR_RESIDENT) <= base_file_rec_buf.size());
-      const ATTR_RESIDENT* attr_info = reinterpret_cast<const ATTR_RESIDENT*>(base_file_rec_buf.data() + attr_list_off + sizeof(ATTR_HEADER));
+      const ATTR_RESIDENT* attr_info = base_file_rec.attr_info<ATTR_RESIDENT>(attr_list_off);
       unsigned idx = attr_info->value_offset;
 
       // process attribute list entries
       while (idx != attr_info->value_offset + attr_info->value_length) {
         CHECK_FMT(idx < attr_info->value_offset + attr_info->value_length);
-        CHECK_FMT(attr_list_off + idx + sizeof(ATTR_LIST_ENTRY) <= base_file_rec_buf.size());
-        const ATTR_LIST_ENTRY* attr_list_entry = reinterpret_cast<const ATTR_LIST_ENTRY*>(base_file_rec_buf.data() + attr_list_off + idx);
+        const ATTR_LIST_ENTRY* attr_list_entry = base_file_rec.at<ATTR_LIST_ENTRY>(attr_list_off + idx);
 
-        process_attr_list_entry(attr_list_entry, ext_rec_list);
+        process_attr_list_entry(attr_list_entry, ext_rec_set, visitor);
 
         CHECK_FMT(attr_list_entry->length != 0);
         idx += attr_list_entry->length;
@@ -395,3 +441,95 @@ void FileInfo::process_base_file_rec() {
     }
   }
 }
+
+void FileInfo::process_base_file_rec() {
+  attr_list.clear();
+  file_name_list.clear();
+  class AttrProcessor: public AttrVisitor {
+  private:
+    FileInfo& file_info;
+  public:
+    AttrProcessor(FileInfo& file_info): file_info(file_info) {
+    }
+    virtual void visit(const MftRecView& file_rec, unsigned attr_off) {
+      file_info.process_attribute(file_rec, attr_off);
+    }
+  };
+  AttrProcessor processor(*this);
+  enum_attributes(processor);
+}
+
+bool FileInfo::get_resident_data(const UnicodeString& stream_name, Array<u8>& data) {
+  class ResidentDataFinder: public AttrVisitor {
+  private:
+    const UnicodeString& stream_name;
+    Array<u8>& data;
+  public:
+    bool found;
+    bool resident;
+    ResidentDataFinder(const UnicodeString& stream_name, Array<u8>& data): stream_name(stream_name), data(data), found(false), resident(false) {
+    }
+    virtual void visit(const MftRecView& file_rec, unsigned attr_off) {
+      const ATTR_HEADER* attr_header = file_rec.attr_header(attr_off);
+      if ((attr_header->type != AT_DATA) || (attr_header->name_length != stream_name.size())) return;
+      if ((attr_header->name_length != 0) && (wcsncmp(file_rec.str(attr_off + attr_header->name_offset, attr_header->name_length), stream_name.data(), attr_header->name_length) != 0)) return;
+      // extents of non-resident stream are visited several times
+      if (found) return;
+      found = true;
+      // encrypted data is stored as is, only the file system can decrypt it
+      if (attr_header->non_resident || (attr_header->flags & (ATTR_IS_COMPRESSED | ATTR_IS_ENCRYPTED))) return;
+      const ATTR_RESIDENT* attr_info = file_rec.attr_info<ATTR_RESIDENT>(attr_off);
+      data.copy(file_rec.at<u8>(attr_off + attr_info->value_offset, attr_info->value_length), attr_info->value_length);
+      resident = true;
+    }
+  };
+  CHECK_FMT(base_file_rec.header()->flags & MFT_RECORD_IN_USE);
+  data.clear();
+  ResidentDataFinder finder(stream_name, data);
+  enum_attributes(finder);
+  return finder.resident;
+}
+
+void load_upcase_table(NtfsVolume& volume, Array<wchar_t>& upcase_table) {
+  class UpCaseDataCollector: public FileInfo::AttrVisitor {
+  public:
+    Array<FileInfo::DataRun> data_runs;
+    u64 data_size;
+    UpCaseDataCollector(): data_size(0) {
+    }
+    virtual void visit(const MftRecView& file_rec, unsigned attr_off) {
+      const ATTR_HEADER* attr_header = file_rec.attr_header(attr_off);
+      if ((attr_header->type != AT_DATA) || (attr_header->name_length != 0)) return;
+      CHECK_FMT(attr_header->non_resident);
+      const ATTR_NONRESIDENT* attr_info = file_rec.attr_info<ATTR_NONRESIDENT>(attr_off);
+      FileInfo::decode_data_runs(file_rec, attr_off, &data_runs);
+      if (attr_info->lowest_vcn == 0) data_size = attr_info->data_size;
+    }
+  };
+  FileInfo file_info;
+  file_info.volume = &volume;
+  MftReader mft_reader(volume, 0);
+  if (volume.image) file_info.mft_reader = &mft_reader;
+  file_info.load_base_file_rec(c_upcase_file_rec);
+  CHECK_FMT(file_info.base_mft_rec()->flags & MFT_RECORD_IN_USE);
+  UpCaseDataCollector collector;
+  file_info.enum_attributes(collector);
+  CHECK_FMT(collector.data_size == c_upcase_table_size * sizeof(wchar_t));
+
+  u64 disk_size = 0;
+  for (unsigned i = 0; i < collector.data_runs.size(); i++) {
+    CHECK_FMT(collector.data_runs[i].lcn != -1);
+    disk_size += collector.data_runs[i].len * volume.cluster_size;
+  }
+  CHECK_FMT((disk_size >= collector.data_size) && (disk_size <= 2 * collector.data_size + volume.cluster_size));
+  Array<u8> data;
+  u8* buf = data.buf(static_cast<unsigned>(disk_size));
+  unsigned pos = 0;
+  volume.flush();
+  for (unsigned i = 0; i < collector.data_runs.size(); i++) {
+    unsigned size = static_cast<unsigned>(collector.data_runs[i].len * volume.cluster_size);
+    volume.read(collector.data_runs[i].lcn * volume.cluster_size, buf + pos, size);
+    pos += size;
+  }
+  upcase_table.copy(reinterpret_cast<const wchar_t*>(buf), c_upcase_table_size);
+}
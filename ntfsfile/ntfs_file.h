@@ -34,27 +34,124 @@ struct StdInfo {
   u32 file_attributes;
 };
 
-class FileInfo {
+// Non-owning view of MFT record stored in external buffer (I/O buffer, MFT chunk).
+// All accessors verify that requested structure lies inside the record.
+class MftRecView {
 private:
-  u64 base_file_rec_num;
+  const u8* rec_data;
+  unsigned rec_size;
+  static void fmt_error() {
+    FAIL(MsgError(L"NTFS data structure parsing problem"));
+  }
+public:
+  MftRecView(): rec_data(NULL), rec_size(0) {
+  }
+  MftRecView(const u8* rec_data, unsigned rec_size): rec_data(rec_data), rec_size(rec_size) {
+  }
+  MftRecView(const Array<u8>& rec_buf): rec_data(rec_buf.data()), rec_size(rec_buf.size()) {
+  }
+  const u8* data() const {
+    return rec_data;
+  }
+  unsigned size() const {
+    return rec_size;
+  }
+  void check(unsigned off, unsigned size) const {
+    if ((off > rec_size) || (size > rec_size - off)) fmt_error();
+  }
+  template<typename T> const T* at(unsigned off, unsigned size = sizeof(T)) const {
+    check(off, size);
+    return reinterpret_cast<const T*>(rec_data + off);
+  }
+  const MFT_RECORD* header() const {
+    return at<MFT_RECORD>(0);
+  }
+  const ATTR_HEADER* attr_header(unsigned attr_off) const {
+    return at<ATTR_HEADER>(attr_off);
+  }
+  // attribute type is the only field present in the end marker
+  u32 attr_type(unsigned attr_off) const {
+    return *at<u32>(attr_off);
+  }
+  // attribute header continuation (ATTR_RESIDENT, ATTR_NONRESIDENT, ...)
+  template<typename T> const T* attr_info(unsigned attr_off) const {
+    return at<T>(attr_off + sizeof(ATTR_HEADER));
+  }
+  const wchar_t* str(unsigned off, unsigned len) const {
+    return at<wchar_t>(off, len * sizeof(wchar_t));
+  }
+};
+
+// Bounded LRU cache of extension MFT records used by ATTRIBUTE_LIST processing.
+// Keyed by full file reference (including sequence number).
+// Not thread-safe: each scanning thread should own its cache.
+class ExtRecCache: private NonCopyable {
+private:
+  struct Entry {
+    u64 file_ref_num;
+    Array<u8> rec_buf;
+    MftRecView file_rec;
+  };
+  typedef std::list<Entry> EntryList;
+  EntryList lru; // most recently used first
+  unordered_map<u64, EntryList::iterator> index;
+  unsigned max_size;
+public:
+  u64 hit_cnt;
+  u64 miss_cnt;
+  ExtRecCache(unsigned max_size = 64): max_size(max_size), hit_cnt(0), miss_cnt(0) {
+  }
+  // NULL if record is not cached
+  const MftRecView* find(u64 file_ref_num);
+  // file_rec must point into rec_buf (buffer is shared, not copied)
+  void store(u64 file_ref_num, const Array<u8>& rec_buf, const MftRecView& file_rec);
+  void clear() {
+    lru.clear();
+    index.clear();
+  }
+};
+
+class MftReader;
+
+class FileInfo {
+public:
   struct DataRun {
     u64 lcn;
     u64 len;
     DataRun(u64 lcn, u64 len): lcn(lcn), len(len) {
     }
   };
-  u64 prev_lcn;
-  u64 prev_len;
-  Array<u8> base_file_rec_buf;
+  class AttrVisitor {
+  public:
+    virtual void visit(const MftRecView& file_rec, unsigned attr_off) = 0;
+  };
+  static unsigned find_attribute(const MftRecView& file_rec, u32 type, u16 instance = 0);
+  // fragment count; state is carried over to next extent of the same attribute
+  struct RunStats {
+    u64 fragments;
+    u64 prev_lcn;
+    u64 prev_len;
+    RunStats(): fragments(0), prev_lcn(0), prev_len(0) {
+    }
+  };
+  static void decode_data_runs(const MftRecView& file_rec, unsigned attr_off, Array<DataRun>* data_runs, RunStats* run_stats = NULL);
+private:
+  u64 base_file_rec_num;
+  RunStats attr_run_stats;
+  Array<DataRun> run_arena; // reused between records
+  Array<u8> base_file_rec_buf; // I/O buffers (reused between records)
   Array<u8> ext_file_rec_buf;
-  u64 load_mft_record(u64 mft_rec_num, Array<u8>& ntfs_file_rec_buf);
-  unsigned find_attribute(const Array<u8>& ntfs_file_rec_buf, u32 type, u16 instance = 0);
-  Array<DataRun> decode_data_runs(const Array<u8>& ntfs_file_rec_buf, unsigned attr_off);
-  void process_attribute(const Array<u8>& ntfs_file_rec_buf, unsigned attr_off);
-  void process_attr_list_entry(const ATTR_LIST_ENTRY* attr_list_entry, Array<u64>& ext_rec_list);
+  MftRecView base_file_rec;
+  MftRecView ext_file_rec;
+  u64 load_mft_record(u64 mft_rec_num, Array<u8>& io_buf, MftRecView& file_rec);
+  void process_attribute(const MftRecView& file_rec, unsigned attr_off);
+  void process_attr_list_entry(const ATTR_LIST_ENTRY* attr_list_entry, unordered_set<u64>& ext_rec_set, AttrVisitor& visitor);
+  unsigned find_dir_name() const;
 public:
   // filled by external code
   NtfsVolume* volume;
+  MftReader* mft_reader; // read MFT records directly from disk instead of FSCTL_GET_NTFS_FILE_RECORD
+  ExtRecCache* ext_rec_cache; // optional cache of extension records (owned by caller)
   UnicodeString file_name;
   unsigned hard_link_cnt;
   bool directory;
@@ -65,6 +162,8 @@ public:
   ObjectArray<AttrInfo> attr_list;
   ObjectArray<FileNameAttr> file_name_list;
 public:
+  FileInfo(): volume(NULL), mft_reader(NULL), ext_rec_cache(NULL) {
+  }
   bool operator==(const FileInfo& file_info) const {
     return base_file_rec_num == file_info.base_file_rec_num;
   }
@@ -73,18 +172,38 @@ public:
   }
 public:
   u64 load_base_file_rec(u64 file_ref_num) {
-    return base_file_rec_num = load_mft_record(file_ref_num, base_file_rec_buf);
+    return base_file_rec_num = load_mft_record(file_ref_num, base_file_rec_buf, base_file_rec);
+  }
+  // use MFT record already read by caller (bulk MFT scan); record is not copied
+  // and must stay valid until processing is complete
+  void set_base_file_rec(u64 file_ref_num, const u8* file_rec, unsigned file_rec_size) {
+    base_file_rec_num = file_ref_num;
+    base_file_rec = MftRecView(file_rec, file_rec_size);
   }
   u64 file_ref_num() const {
     return base_file_rec_num;
   }
   const MFT_RECORD* base_mft_rec() const {
-    return reinterpret_cast<const MFT_RECORD*>(base_file_rec_buf.data());
+    return base_file_rec.header();
   }
+  // calls visitor for every attribute (in ATTRIBUTE_LIST order if present)
+  void enum_attributes(AttrVisitor& visitor);
   void process_base_file_rec();
+  // Contents of $DATA stream stored in the base record (or one of its extension records);
+  // reading it does not require opening the file.
+  // Returns false if stream is absent, non-resident, compressed or encrypted.
+  bool get_resident_data(const UnicodeString& stream_name, Array<u8>& data);
   void process_file(u64 file_ref_num) {
     load_base_file_rec(file_ref_num);
     process_base_file_rec();
   }
+  void cache_dir_name() const;
   void find_full_paths();
 };
+
+const u64 c_bad_clus_file_rec = 8;
+const u64 c_upcase_file_rec = 10;
+const unsigned c_upcase_table_size = 0x10000;
+
+// $UpCase table (upper case equivalent of every UTF-16 code unit) used by NTFS to collate file names
+void load_upcase_table(NtfsVolume& volume, Array<wchar_t>& upcase_table);
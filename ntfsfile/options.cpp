@@ -168,8 +168,8 @@ FilePanelMode::FilePanelMode():
   delete_usn_journal(true),
   delete_own_usn_journal(true),
   use_cache(false),
+  live_update(false),
   default_mft_mode(true),
-  backward_mft_scan(true),
   flat_mode_auto_off(true),
   cache_dir(L"%TEMP%") {
 }
@@ -213,8 +213,8 @@ void load_plugin_options() {
   g_file_panel_mode.delete_usn_journal = options.get_bool(L"FilePanelDeleteUsnJournal", def_file_panel_mode.delete_usn_journal);
   g_file_panel_mode.delete_own_usn_journal = options.get_bool(L"FilePanelDeleteOwnUsnJournal", def_file_panel_mode.delete_own_usn_journal);
   g_file_panel_mode.use_cache = options.get_bool(L"FilePanelUseCache", def_file_panel_mode.use_cache);
+  g_file_panel_mode.live_update = options.get_bool(L"FilePanelLiveUpdate", def_file_panel_mode.live_update);
   g_file_panel_mode.default_mft_mode = options.get_bool(L"FilePanelDefaultMftMode", def_file_panel_mode.default_mft_mode);
-  g_file_panel_mode.backward_mft_scan = options.get_bool(L"FilePanelBackwardMftScan", def_file_panel_mode.backward_mft_scan);
   g_file_panel_mode.cache_dir = options.get_str(L"FilePanelCacheDir", def_file_panel_mode.cache_dir);
   g_file_panel_mode.flat_mode_auto_off = options.get_bool(L"FilePanelFlatModeAutoOff", def_file_panel_mode.flat_mode_auto_off);
   CompressFilesParams def_compress_files_params;
@@ -255,8 +255,8 @@ void store_plugin_options() {
   options.set_bool(L"FilePanelDeleteUsnJournal", g_file_panel_mode.delete_usn_journal, def_file_panel_mode.delete_usn_journal);
   options.set_bool(L"FilePanelDeleteOwnUsnJournal", g_file_panel_mode.delete_own_usn_journal, def_file_panel_mode.delete_own_usn_journal);
   options.set_bool(L"FilePanelUseCache", g_file_panel_mode.use_cache, def_file_panel_mode.use_cache);
+  options.set_bool(L"FilePanelLiveUpdate", g_file_panel_mode.live_update, def_file_panel_mode.live_update);
   options.set_bool(L"FilePanelDefaultMftMode", g_file_panel_mode.default_mft_mode, def_file_panel_mode.default_mft_mode);
-  options.set_bool(L"FilePanelBackwardMftScan", g_file_panel_mode.backward_mft_scan, def_file_panel_mode.backward_mft_scan);
   options.set_str(L"FilePanelCacheDir", g_file_panel_mode.cache_dir, def_file_panel_mode.cache_dir);
   options.set_bool(L"FilePanelFlatModeAutoOff", g_file_panel_mode.flat_mode_auto_off, def_file_panel_mode.flat_mode_auto_off);
   CompressFilesParams def_compress_files_params;
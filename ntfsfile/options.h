@@ -31,8 +31,8 @@ struct FilePanelMode {
   bool delete_usn_journal;
   bool delete_own_usn_journal;
   bool use_cache;
+  bool live_update; // follow USN journal on background thread
   bool default_mft_mode;
-  bool backward_mft_scan;
   bool flat_mode_auto_off;
   UnicodeString cache_dir;
   FilePanelMode();
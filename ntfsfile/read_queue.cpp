@@ -0,0 +1,113 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include "utils.h"
+#include "read_queue.h"
+
+// memory for all read buffers (stages of content analysis hold buffers too)
+const unsigned c_read_ahead_size = 64 * 1024 * 1024;
+// target number of blocks read per second
+const unsigned c_block_rate = 32;
+
+unsigned ReadQueue::get_max_block_size(unsigned buf_cnt) {
+  unsigned size = c_read_ahead_size / max(buf_cnt, 1u) / c_min_block_size * c_min_block_size;
+  if (size < c_min_block_size) return c_min_block_size;
+  if (size > c_max_block_size) return c_max_block_size;
+  return size;
+}
+
+ReadQueue::ReadQueue(HANDLE h_file, u64 file_size, unsigned depth, unsigned max_block_size, unsigned block_size): h_file(h_file), file_size(file_size), file_ptr(0), eof(false), depth(depth), head(0), cnt(0), max_block_size(max_block_size), block_size(min(block_size, max_block_size)), window_size(0) {
+  assert((depth != 0) && (max_block_size >= c_min_block_size) && (max_block_size % c_min_block_size == 0));
+  assert((block_size >= c_min_block_size) && (block_size % c_min_block_size == 0));
+  requests = request_data.buf(depth);
+  memset(requests, 0, depth * sizeof(Request));
+  request_data.set_size(depth);
+  try {
+    for (unsigned i = 0; i < depth; i++) {
+      HANDLE h_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+      CHECK_SYS(h_event != NULL);
+      h_events += h_event;
+    }
+  }
+  catch (...) {
+    for (unsigned i = 0; i < h_events.size(); i++) CloseHandle(h_events[i]);
+    throw;
+  }
+  LARGE_INTEGER li;
+  CHECK_SYS(QueryPerformanceFrequency(&li));
+  time_freq = li.QuadPart;
+  CHECK_SYS(QueryPerformanceCounter(&li));
+  window_start = li.QuadPart;
+}
+
+ReadQueue::~ReadQueue() {
+  // buffers and OVERLAPPED structures must not be released while I/O is pending
+  if (cnt != 0) {
+    CancelIo(h_file);
+    for (; cnt != 0; cnt--, head = (head + 1) % depth) {
+      DWORD size;
+      if (!requests[head].done) GetOverlappedResult(h_file, &requests[head].ov, &size, TRUE);
+    }
+  }
+  for (unsigned i = 0; i < h_events.size(); i++) {
+    VERIFY(CloseHandle(h_events[i]) != 0);
+  }
+}
+
+void ReadQueue::submit(u8* buffer, unsigned buf_idx) {
+  assert(can_submit());
+  Request& rq = requests[(head + cnt) % depth];
+  memset(&rq.ov, 0, sizeof(rq.ov));
+  rq.ov.Offset = (DWORD) (file_ptr & 0xFFFFFFFF);
+  rq.ov.OffsetHigh = (DWORD) ((file_ptr >> 32) & 0xFFFFFFFF);
+  rq.ov.hEvent = h_events[(head + cnt) % depth];
+  rq.buf_idx = buf_idx;
+  rq.size = block_size;
+  rq.done = false;
+  if (ReadFile(h_file, buffer, rq.size, &rq.done_size, &rq.ov)) {
+    rq.done = true;
+  }
+  else {
+    DWORD last_error = GetLastError();
+    if (last_error == ERROR_HANDLE_EOF) {
+      rq.done = true;
+      rq.done_size = 0;
+    }
+    else CHECK_SYS(last_error == ERROR_IO_PENDING);
+  }
+  file_ptr += rq.size;
+  cnt++;
+}
+
+unsigned ReadQueue::complete(unsigned& size) {
+  assert(cnt != 0);
+  Request& rq = requests[head];
+  DWORD size_read = rq.done_size;
+  if (!rq.done && (GetOverlappedResult(h_file, &rq.ov, &size_read, TRUE) == 0)) {
+    CHECK_SYS(GetLastError() == ERROR_HANDLE_EOF);
+    size_read = 0;
+  }
+  head = (head + 1) % depth;
+  cnt--;
+  // data after short read is not returned (file was truncated)
+  size = eof ? 0 : size_read;
+  if (size_read < rq.size) eof = true;
+  window_size += size;
+  end_measurement();
+  return rq.buf_idx;
+}
+
+// new block size is set after enough data is read to measure throughput
+void ReadQueue::end_measurement() {
+  if (window_size < (u64) depth * block_size) return;
+  LARGE_INTEGER li;
+  CHECK_SYS(QueryPerformanceCounter(&li));
+  u64 end_time = li.QuadPart;
+  if (end_time <= window_start) return;
+  u64 new_size = window_size * (time_freq / c_block_rate) / (end_time - window_start);
+  if (new_size < c_min_block_size) block_size = c_min_block_size;
+  else if (new_size > max_block_size) block_size = max_block_size;
+  else block_size = (unsigned) new_size / c_min_block_size * c_min_block_size;
+  window_start = end_time;
+  window_size = 0;
+}
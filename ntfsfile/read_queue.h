@@ -0,0 +1,63 @@
+#pragma once
+
+// Sequential reader of file opened with FILE_FLAG_OVERLAPPED (and usually FILE_FLAG_NO_BUFFERING).
+// Keeps several reads in flight so that devices which need queue depth above 1 (NVMe, RAID)
+// are kept busy; completed blocks are returned in file order.
+// Block size is tuned from measured throughput (every block holds about 1/32 s of data),
+// it stays a multiple of c_min_block_size, so reads remain sector aligned.
+class ReadQueue: private NonCopyable {
+private:
+  struct Request {
+    OVERLAPPED ov;
+    unsigned buf_idx;
+    unsigned size; // requested size
+    bool done; // completed synchronously
+    DWORD done_size;
+  };
+  HANDLE h_file;
+  u64 file_size;
+  u64 file_ptr; // offset of next read
+  bool eof; // short read was seen, nothing is read after it
+  unsigned depth;
+  Request* requests; // ring of depth requests
+  Array<Request> request_data;
+  Array<HANDLE> h_events; // event of every request
+  unsigned head; // oldest pending request
+  unsigned cnt; // number of pending requests
+  unsigned max_block_size;
+  unsigned block_size;
+  u64 time_freq;
+  u64 window_start; // throughput measurement
+  u64 window_size;
+  void end_measurement();
+public:
+  enum {
+    c_min_block_size = 64 * 1024,
+    c_max_block_size = 8 * 1024 * 1024,
+    c_depth = 4,
+  };
+  // largest block size that fits buf_cnt buffers into read ahead memory budget
+  static unsigned get_max_block_size(unsigned buf_cnt);
+  // Every buffer passed to submit() must hold max_block_size bytes.
+  // Block size tuned while reading previous file may be passed as initial one.
+  ReadQueue(HANDLE h_file, u64 file_size, unsigned depth, unsigned max_block_size, unsigned block_size = c_min_block_size);
+  // pending reads are cancelled
+  ~ReadQueue();
+  // there are pending reads or file is not read to the end
+  bool active() const {
+    return (cnt != 0) || !(eof || (file_ptr >= file_size));
+  }
+  bool can_submit() const {
+    return (cnt < depth) && !(eof || (file_ptr >= file_size));
+  }
+  bool pending() const {
+    return cnt != 0;
+  }
+  // start reading next block into buffer
+  void submit(u8* buffer, unsigned buf_idx);
+  // wait for oldest read and return its buffer index; size is 0 for read past end of file
+  unsigned complete(unsigned& size);
+  unsigned get_block_size() const {
+    return block_size;
+  }
+};
@@ -0,0 +1,76 @@
+#define _ERROR_WINDOWS
+#include "error.h"
+
+#include "utils.h"
+#include "ntfs.h"
+#include "usn_journal.h"
+
+const unsigned c_usn_buffer_size = 0x1000;
+
+void VolumeUsnJournal::read(DWORDLONG journal_id, USN start_usn, Array<u8>& buffer) {
+  READ_USN_JOURNAL_DATA read_usn_data;
+  read_usn_data.StartUsn = start_usn;
+  read_usn_data.ReasonMask = 0xFFFFFFFF;
+  read_usn_data.ReturnOnlyOnClose = FALSE;
+  read_usn_data.Timeout = 0;
+  read_usn_data.BytesToWaitFor = 0;
+  read_usn_data.UsnJournalID = journal_id;
+  DWORD bytes_ret;
+  CHECK_SYS(DeviceIoControl(h_volume, FSCTL_READ_USN_JOURNAL, &read_usn_data, sizeof(read_usn_data), buffer.buf(c_usn_buffer_size), c_usn_buffer_size, &bytes_ret, NULL));
+  buffer.set_size(bytes_ret);
+}
+
+RecordedUsnJournal::RecordedUsnJournal(DWORDLONG journal_id, const Array<u8>& records): journal_id(journal_id), records(records) {
+  unsigned pos = 0;
+  while (pos < records.size()) {
+    const USN_RECORD* usn_rec = reinterpret_cast<const USN_RECORD*>(records.data() + pos);
+    CHECK(records.size() - pos >= sizeof(USN_RECORD));
+    CHECK((usn_rec->RecordLength >= sizeof(USN_RECORD)) && (usn_rec->RecordLength <= records.size() - pos));
+    pos += usn_rec->RecordLength;
+  }
+}
+
+void RecordedUsnJournal::read(DWORDLONG journal_id, USN start_usn, Array<u8>& buffer) {
+  if (journal_id != this->journal_id) FAIL(SystemError(ERROR_JOURNAL_NOT_ACTIVE));
+  unsigned pos = 0;
+  while ((pos < records.size()) && (reinterpret_cast<const USN_RECORD*>(records.data() + pos)->Usn < start_usn)) {
+    pos += reinterpret_cast<const USN_RECORD*>(records.data() + pos)->RecordLength;
+  }
+  // same amount of records as volume journal returns at once
+  unsigned end_pos = pos;
+  unsigned last_pos = pos;
+  while (end_pos < records.size()) {
+    unsigned rec_len = reinterpret_cast<const USN_RECORD*>(records.data() + end_pos)->RecordLength;
+    if ((end_pos != pos) && (sizeof(USN) + end_pos - pos + rec_len > c_usn_buffer_size)) break;
+    last_pos = end_pos;
+    end_pos += rec_len;
+  }
+  // continue from next record, end of stream is end of last record
+  USN next_usn = start_usn;
+  if (end_pos < records.size()) {
+    next_usn = reinterpret_cast<const USN_RECORD*>(records.data() + end_pos)->Usn;
+  }
+  else if (end_pos != pos) {
+    const USN_RECORD* usn_rec = reinterpret_cast<const USN_RECORD*>(records.data() + last_pos);
+    next_usn = usn_rec->Usn + usn_rec->RecordLength;
+  }
+  buffer.clear();
+  buffer.add(reinterpret_cast<const u8*>(&next_usn), sizeof(next_usn));
+  buffer.add(records.data() + pos, end_pos - pos);
+}
+
+void read_usn_changes(UsnJournalSource& source, DWORDLONG journal_id, USN& next_usn, std::set<u64>& file_refs) {
+  Array<u8> usn_buffer;
+  while (true) {
+    source.read(journal_id, next_usn, usn_buffer);
+    if (usn_buffer.size() < sizeof(USN)) break;
+    next_usn = *reinterpret_cast<const USN*>(usn_buffer.data());
+    if (usn_buffer.size() == sizeof(USN)) break;
+    unsigned pos = sizeof(USN);
+    while (pos < usn_buffer.size()) {
+      const USN_RECORD* usn_rec = reinterpret_cast<const USN_RECORD*>(usn_buffer.data() + pos);
+      file_refs.insert(FILE_REF(usn_rec->FileReferenceNumber));
+      pos += usn_rec->RecordLength;
+    }
+  }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+// Source of USN journal records. Output of read() has FSCTL_READ_USN_JOURNAL layout:
+// USN to continue reading from followed by USN_RECORD structures (none if there are no more records).
+class UsnJournalSource {
+public:
+  virtual ~UsnJournalSource() {
+  }
+  virtual void read(DWORDLONG journal_id, USN start_usn, Array<u8>& buffer) = 0;
+};
+
+// journal of live volume
+class VolumeUsnJournal: public UsnJournalSource {
+private:
+  HANDLE h_volume;
+public:
+  VolumeUsnJournal(HANDLE h_volume): h_volume(h_volume) {
+  }
+  virtual void read(DWORDLONG journal_id, USN start_usn, Array<u8>& buffer);
+};
+
+// Previously recorded USN stream (sequence of USN_RECORD structures ordered by USN),
+// allows to drive index updates without a volume journal.
+class RecordedUsnJournal: public UsnJournalSource {
+private:
+  DWORDLONG journal_id;
+  Array<u8> records;
+public:
+  RecordedUsnJournal(DWORDLONG journal_id, const Array<u8>& records);
+  virtual void read(DWORDLONG journal_id, USN start_usn, Array<u8>& buffer);
+};
+
+// Reads all records starting from next_usn, collects changed file references
+// (without sequence numbers) and advances next_usn.
+void read_usn_changes(UsnJournalSource& source, DWORDLONG journal_id, USN& next_usn, std::set<u64>& file_refs);
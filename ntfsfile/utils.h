@@ -157,6 +157,40 @@ public:
   }
 };
 
+// Slim reader/writer lock: readers share it, writer has exclusive access. Not recursive.
+class ReadWriteLock: private NonCopyable, private SRWLOCK {
+public:
+  ReadWriteLock() {
+    InitializeSRWLock(this);
+  }
+  friend class SharedLock;
+  friend class ExclusiveLock;
+};
+
+class SharedLock: private NonCopyable {
+private:
+  ReadWriteLock& rw_lock;
+public:
+  SharedLock(ReadWriteLock& rw_lock): rw_lock(rw_lock) {
+    AcquireSRWLockShared(&rw_lock);
+  }
+  ~SharedLock() {
+    ReleaseSRWLockShared(&rw_lock);
+  }
+};
+
+class ExclusiveLock: private NonCopyable {
+private:
+  ReadWriteLock& rw_lock;
+public:
+  ExclusiveLock(ReadWriteLock& rw_lock): rw_lock(rw_lock) {
+    AcquireSRWLockExclusive(&rw_lock);
+  }
+  ~ExclusiveLock() {
+    ReleaseSRWLockExclusive(&rw_lock);
+  }
+};
+
 class Event: private NonCopyable {
 protected:
   HANDLE h_event;
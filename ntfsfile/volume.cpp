@@ -5,6 +5,7 @@
 #include "ntfs.h"
 #include "options.h"
 #include "volume.h"
+#include "volume_io.h"
 
 extern struct FarStandardFunctions g_fsf;
 
@@ -57,11 +58,55 @@ UnicodeString get_volume_path(const UnicodeString& volume_name) {
   else return L"\\\\.\\" + volume_name;
 }
 
+// names are copied, so no string buffers are shared between threads
+bool DirNameCache::find(unsigned __int64 file_ref_num, UnicodeString& name, unsigned __int64& parent_ref_num) {
+  CriticalSectionLock lock(sync);
+  unordered_map<unsigned __int64, Entry>::const_iterator entry = entries.find(file_ref_num);
+  if (entry == entries.end()) return false;
+  name.copy(entry->second.name.data(), entry->second.name.size());
+  parent_ref_num = entry->second.parent_ref_num;
+  return true;
+}
+
+void DirNameCache::store(unsigned __int64 file_ref_num, const UnicodeString& name, unsigned __int64 parent_ref_num) {
+  CriticalSectionLock lock(sync);
+  Entry& entry = entries[file_ref_num];
+  entry.name.copy(name.data(), name.size());
+  entry.parent_ref_num = parent_ref_num;
+}
+
+void DirNameCache::clear() {
+  CriticalSectionLock lock(sync);
+  entries.clear();
+}
+
+void NtfsVolume::close() {
+  if (cache) {
+    DBG_LOG(UnicodeString::format(L"volume cache: %Lu hits, %Lu misses", cache->hit_cnt, cache->miss_cnt));
+    delete cache;
+    cache = NULL;
+  }
+  if (backend) {
+    delete backend;
+    backend = NULL;
+  }
+  if (handle != INVALID_HANDLE_VALUE) {
+    CHECK_SYS(CloseHandle(handle));
+    handle = INVALID_HANDLE_VALUE;
+  }
+  name.clear();
+  serial = 0;
+  image = false;
+  dir_names.clear();
+}
+
 void NtfsVolume::open(const UnicodeString& volume_name) {
   close();
   try {
     name = volume_name;
     synced = false;
+    flush_journal_id = 0;
+    flush_usn = 0;
 
     CHECK_MSG(!is_unc_path(name), L"Network shares are not supported");
 
@@ -85,6 +130,10 @@ void NtfsVolume::open(const UnicodeString& volume_name) {
     file_rec_size = ntfs_vol_data.BytesPerFileRecordSegment;
     cluster_size = ntfs_vol_data.BytesPerCluster;
     mft_size = ntfs_vol_data.MftValidDataLength.QuadPart;
+    mft_start_lcn = ntfs_vol_data.MftStartLcn.QuadPart;
+
+    backend = new HandleBackend(handle);
+    cache = new BlockCache(*backend);
   }
   catch (...) {
     close();
@@ -92,16 +141,88 @@ void NtfsVolume::open(const UnicodeString& volume_name) {
   }
 }
 
+// volume geometry is taken from boot sector
+// mft_size is unknown until $MFT record is parsed by MftReader
+void NtfsVolume::init_image(const UnicodeString& image_name) {
+  name = image_name;
+  image = true;
+  synced = true;
+  cache = new BlockCache(*backend);
+
+  u8 sector[NTFS_BLOCK_SIZE];
+  read(0, sector, sizeof(sector));
+  const NTFS_BOOT_SECTOR* boot_sector = reinterpret_cast<const NTFS_BOOT_SECTOR*>(sector);
+  CHECK_MSG(boot_sector->oem_id == NTFS_OEM_ID, L"Only NTFS volumes are supported");
+  CHECK_MSG((boot_sector->bytes_per_sector != 0) && (boot_sector->sectors_per_cluster != 0), L"Invalid NTFS boot sector");
+
+  serial = static_cast<DWORD>(boot_sector->volume_serial_number);
+  cluster_size = boot_sector->bytes_per_sector * boot_sector->sectors_per_cluster;
+  if (boot_sector->clusters_per_mft_record > 0) file_rec_size = boot_sector->clusters_per_mft_record * cluster_size;
+  else file_rec_size = 1 << -boot_sector->clusters_per_mft_record;
+  mft_start_lcn = boot_sector->mft_lcn;
+  mft_size = 0;
+}
+
+// open a raw NTFS volume image (dd-style dump)
+void NtfsVolume::open_image(const UnicodeString& file_name) {
+  close();
+  try {
+    handle = CreateFileW(long_path(file_name).data(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+    CHECK_SYS(handle != INVALID_HANDLE_VALUE);
+    backend = new HandleBackend(handle);
+    init_image(file_name);
+  }
+  catch (...) {
+    close();
+    throw;
+  }
+}
+
+void NtfsVolume::open_image(VolumeBackend* image_backend, const UnicodeString& image_name) {
+  close();
+  backend = image_backend;
+  try {
+    init_image(image_name);
+  }
+  catch (...) {
+    close();
+    throw;
+  }
+}
+
+// Live volume may be changed by any process. Every metadata change advances USN journal, so file
+// system buffers are written and cached blocks are dropped only if journal position differs from
+// the one seen by previous flush. Without active journal changes cannot be detected: volume is
+// flushed whenever caller has reset synced.
 void NtfsVolume::flush() {
-  if (!synced) {
-    HANDLE handle = CreateFileW(get_volume_path(name).data(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
-    if (handle != INVALID_HANDLE_VALUE) {
-      FlushFileBuffers(handle);
-      CloseHandle(handle);
-      DBG_LOG(UnicodeString(L"volume flushed"));
-    }
-    synced = true;
+  if (image) return;
+  CriticalSectionLock lock(flush_sync);
+  DWORD bytes_ret;
+  USN_JOURNAL_DATA journal_data;
+  if (DeviceIoControl(handle, FSCTL_QUERY_USN_JOURNAL, NULL, 0, &journal_data, sizeof(journal_data), &bytes_ret, NULL)) {
+    if ((journal_data.UsnJournalID == flush_journal_id) && (journal_data.NextUsn == flush_usn)) return;
+    // changes made after the query are detected by next flush
+    flush_journal_id = journal_data.UsnJournalID;
+    flush_usn = journal_data.NextUsn;
   }
+  else {
+    if (synced) return;
+    flush_journal_id = 0;
+  }
+  HANDLE handle = CreateFileW(get_volume_path(name).data(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+  if (handle != INVALID_HANDLE_VALUE) {
+    FlushFileBuffers(handle);
+    CloseHandle(handle);
+    DBG_LOG(UnicodeString(L"volume flushed"));
+  }
+  synced = true;
+  if (cache) cache->invalidate();
+}
+
+// cached positional read: safe to use from several threads sharing the volume
+void NtfsVolume::read(unsigned __int64 pos, void* buffer, unsigned size) {
+  CHECK_MSG(cache != NULL, L"Volume is not open");
+  CHECK_MSG(cache->read(pos, buffer, size) == size, L"Unexpected end of volume data");
 }
 
 UnicodeString get_volume_guid(const UnicodeString& volume_name) {
@@ -6,29 +6,57 @@ struct VolumeInfo {
   VolumeInfo(const UnicodeString& file_name);
 };
 
+// Directory names by file reference number (without sequence number).
+// Used to resolve full paths without reloading every ancestor directory record.
+// Shared between threads of a single volume.
+class DirNameCache: private NonCopyable {
+private:
+  struct Entry {
+    UnicodeString name;
+    unsigned __int64 parent_ref_num;
+  };
+  unordered_map<unsigned __int64, Entry> entries;
+  CriticalSection sync;
+public:
+  bool find(unsigned __int64 file_ref_num, UnicodeString& name, unsigned __int64& parent_ref_num);
+  void store(unsigned __int64 file_ref_num, const UnicodeString& name, unsigned __int64 parent_ref_num);
+  void clear();
+};
+
+class VolumeBackend;
+class BlockCache;
+
 struct NtfsVolume {
   UnicodeString name;
   DWORD serial;
   unsigned file_rec_size;
   unsigned cluster_size;
   unsigned __int64 mft_size;
+  unsigned __int64 mft_start_lcn;
   HANDLE handle;
-  bool synced;
-  NtfsVolume(): handle(INVALID_HANDLE_VALUE), serial(0) {
+  bool synced; // file system buffers are flushed (change tracking of volumes without USN journal)
+  bool image; // raw NTFS image file instead of a live volume
+  DirNameCache dir_names;
+  VolumeBackend* backend; // raw data source used by read()
+  BlockCache* cache;
+  // USN journal position at last flush: volume is flushed again only if it has moved
+  DWORDLONG flush_journal_id;
+  USN flush_usn;
+  CriticalSection flush_sync;
+  NtfsVolume(): handle(INVALID_HANDLE_VALUE), serial(0), image(false), backend(NULL), cache(NULL), flush_journal_id(0), flush_usn(0) {
   }
   ~NtfsVolume() {
     close();
   }
-  void close() {
-    if (handle != INVALID_HANDLE_VALUE) {
-      CHECK_SYS(CloseHandle(handle));
-      handle = INVALID_HANDLE_VALUE;
-    }
-    name.clear();
-    serial = 0;
-  }
+  void close();
   void open(const UnicodeString& volume_name);
+  void open_image(const UnicodeString& file_name);
+  // volume image from arbitrary data source (takes ownership of image_backend)
+  void open_image(VolumeBackend* image_backend, const UnicodeString& image_name);
+  void init_image(const UnicodeString& image_name);
+  // make raw reads see current volume state (no-op if volume has not changed since last flush)
   void flush();
+  void read(unsigned __int64 pos, void* buffer, unsigned size);
 };
 
 UnicodeString get_real_path(const UnicodeString& fp);
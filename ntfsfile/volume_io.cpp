@@ -0,0 +1,142 @@
+#define _ERROR_WINDOWS
+#ifndef _WIN32
+#define _ERROR_STDIO
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "error.h"
+
+#include "utils.h"
+#include "volume_io.h"
+
+// positional read: safe to use from several threads sharing the handle
+unsigned HandleBackend::read(u64 pos, void* buffer, unsigned size) {
+  OVERLAPPED ov;
+  memzero(ov);
+  ov.Offset = static_cast<DWORD>(pos & 0xFFFFFFFF);
+  ov.OffsetHigh = static_cast<DWORD>(pos >> 32);
+  DWORD bytes_ret;
+  if (!ReadFile(handle, buffer, size, &bytes_ret, &ov)) {
+    CHECK_SYS(GetLastError() == ERROR_HANDLE_EOF);
+    bytes_ret = 0;
+  }
+  return bytes_ret;
+}
+
+#ifndef _WIN32
+PosixFileBackend::PosixFileBackend(const char* file_path) {
+  fd = open(file_path, O_RDONLY);
+  CHECK_STD(fd != -1);
+}
+
+PosixFileBackend::~PosixFileBackend() {
+  close(fd);
+}
+
+unsigned PosixFileBackend::read(u64 pos, void* buffer, unsigned size) {
+  unsigned bytes_read = 0;
+  while (bytes_read < size) {
+    ssize_t res = pread(fd, static_cast<u8*>(buffer) + bytes_read, size - bytes_read, pos + bytes_read);
+    if ((res == -1) && (errno == EINTR)) continue;
+    CHECK_STD(res != -1);
+    if (res == 0) break; // end of file
+    bytes_read += static_cast<unsigned>(res);
+  }
+  return bytes_read;
+}
+#endif
+
+BlockCache::BlockCache(VolumeBackend& backend, unsigned block_size, unsigned max_block_cnt, unsigned read_ahead_cnt): backend(backend), block_size(block_size), max_block_cnt(max_block_cnt), read_ahead_cnt(max(read_ahead_cnt, 1u)), next_seq_block(-1), generation(0), hit_cnt(0), miss_cnt(0) {
+}
+
+bool BlockCache::find_block(u64 block_idx, unsigned offset, u8* buffer, unsigned size) {
+  CriticalSectionLock lock(sync);
+  unordered_map<u64, BlockList::iterator>::const_iterator pos = index.find(block_idx);
+  if (pos == index.end()) return false;
+  const Array<u8>& data = pos->second->data;
+  if (offset + size > data.size()) return false; // partial block at the end of volume
+  memcpy(buffer, data.data() + offset, size);
+  lru.splice(lru.begin(), lru, pos->second);
+  hit_cnt++;
+  return true;
+}
+
+// caller must hold lock
+void BlockCache::store_block(u64 block_idx, const u8* data, unsigned size) {
+  if (max_block_cnt == 0) return;
+  unordered_map<u64, BlockList::iterator>::iterator pos = index.find(block_idx);
+  if (pos != index.end()) {
+    lru.splice(lru.begin(), lru, pos->second);
+  }
+  else {
+    if (lru.size() >= max_block_cnt) {
+      // recycle least recently used block
+      index.erase(lru.back().idx);
+      lru.splice(lru.begin(), lru, --lru.end());
+    }
+    else {
+      lru.push_front(Block());
+    }
+    lru.front().idx = block_idx;
+    index[block_idx] = lru.begin();
+  }
+  lru.front().data.copy(data, size);
+}
+
+// read block (with read-ahead if access is sequential) and copy requested part
+unsigned BlockCache::load_blocks(u64 block_idx, unsigned offset, u8* buffer, unsigned size) {
+  unsigned block_cnt = 1;
+  u64 read_generation;
+  {
+    CriticalSectionLock lock(sync);
+    miss_cnt++;
+    read_generation = generation;
+    if (block_idx == next_seq_block) block_cnt = read_ahead_cnt;
+    next_seq_block = block_idx + block_cnt;
+  }
+  Array<u8> data;
+  unsigned data_size = backend.read(block_idx * block_size, data.buf(block_cnt * block_size), block_cnt * block_size);
+  data.set_size(data_size);
+  {
+    CriticalSectionLock lock(sync);
+    // cache was invalidated while data was read: data may be stale, so it is only returned to caller
+    for (unsigned i = 0; (generation == read_generation) && (i * block_size < data_size); i++) {
+      store_block(block_idx + i, data.data() + i * block_size, min(block_size, data_size - i * block_size));
+    }
+  }
+  if (offset >= data_size) return 0;
+  unsigned copy_size = min(size, data_size - offset);
+  memcpy(buffer, data.data() + offset, copy_size);
+  return copy_size;
+}
+
+unsigned BlockCache::read(u64 pos, void* buffer, unsigned size) {
+  if (size >= read_ahead_cnt * block_size) return backend.read(pos, buffer, size);
+  u8* data = static_cast<u8*>(buffer);
+  unsigned bytes_read = 0;
+  while (size != 0) {
+    u64 block_idx = pos / block_size;
+    unsigned offset = static_cast<unsigned>(pos % block_size);
+    unsigned part_size = min(size, block_size - offset);
+    if (!find_block(block_idx, offset, data, part_size)) {
+      unsigned copy_size = load_blocks(block_idx, offset, data, part_size);
+      bytes_read += copy_size;
+      if (copy_size != part_size) break; // end of data
+    }
+    else {
+      bytes_read += part_size;
+    }
+    pos += part_size;
+    data += part_size;
+    size -= part_size;
+  }
+  return bytes_read;
+}
+
+void BlockCache::invalidate() {
+  CriticalSectionLock lock(sync);
+  lru.clear();
+  index.clear();
+  next_seq_block = -1;
+  generation++;
+}
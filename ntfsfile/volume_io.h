@@ -0,0 +1,66 @@
+#pragma once
+
+// Source of raw volume data.
+// Implementations must support concurrent positional reads.
+class VolumeBackend: private NonCopyable {
+public:
+  virtual ~VolumeBackend() {
+  }
+  // returns number of bytes read (less than size only at the end of data)
+  virtual unsigned read(u64 pos, void* buffer, unsigned size) = 0;
+};
+
+// Win32 file or device handle (live volume or image file); handle is not owned
+class HandleBackend: public VolumeBackend {
+private:
+  HANDLE handle;
+public:
+  HandleBackend(HANDLE handle): handle(handle) {
+  }
+  virtual unsigned read(u64 pos, void* buffer, unsigned size);
+};
+
+#ifndef _WIN32
+// POSIX image file (pread); descriptor is owned
+class PosixFileBackend: public VolumeBackend {
+private:
+  int fd;
+public:
+  PosixFileBackend(const char* file_path);
+  virtual ~PosixFileBackend();
+  virtual unsigned read(u64 pos, void* buffer, unsigned size);
+};
+#endif
+
+// LRU cache of fixed size blocks on top of a backend.
+// Sequential misses trigger read-ahead of several blocks with a single I/O.
+// Large reads bypass the cache (bulk MFT scan does its own buffering).
+// Blocks are read outside of the lock; data read before invalidate() is not stored.
+class BlockCache: private NonCopyable {
+private:
+  struct Block {
+    u64 idx;
+    Array<u8> data;
+  };
+  typedef std::list<Block> BlockList;
+  VolumeBackend& backend;
+  unsigned block_size;
+  unsigned max_block_cnt;
+  unsigned read_ahead_cnt;
+  BlockList lru; // most recently used first
+  unordered_map<u64, BlockList::iterator> index;
+  u64 next_seq_block; // block following the last miss
+  u64 generation; // number of invalidate() calls
+  CriticalSection sync;
+  bool find_block(u64 block_idx, unsigned offset, u8* buffer, unsigned size);
+  void store_block(u64 block_idx, const u8* data, unsigned size);
+  unsigned load_blocks(u64 block_idx, unsigned offset, u8* buffer, unsigned size);
+public:
+  u64 hit_cnt;
+  u64 miss_cnt;
+  BlockCache(VolumeBackend& backend, unsigned block_size = 64 * 1024, unsigned max_block_cnt = 256, unsigned read_ahead_cnt = 8);
+  // returns number of bytes read
+  unsigned read(u64 pos, void* buffer, unsigned size);
+  // drop all cached data (volume contents may have changed)
+  void invalidate();
+};
@@ -6,6 +6,8 @@
 #include "ntfs.h"
 #include "volume.h"
 #include "ntfs_file.h"
+#include "mft_index.h"
+#include "name_search.h"
 #include "file_panel.h"
 
 class VolumeEnum {